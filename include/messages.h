@@ -20,7 +20,9 @@ typedef enum SystemMessageNo {
     SYS_MSG_INVALID_COND,
     SYS_MSG_TABLE_NOT_EXIST,
     SYS_MSG_FIELD_NOT_EXIST,
-    SYS_MSG_NUM_RECORD_FOUND
+    SYS_MSG_NUM_RECORD_FOUND,
+    SYS_MSG_RESET_STATS,
+    SYS_MSG_SUCCESS_COPY
 } SystemMessageNo;
 
 /* システムメッセージ */
@@ -38,7 +40,9 @@ static char *systemMessage[] = {
     "条件式の指定に間違いがあります。",
     "指定したテーブルは存在しません。",
     "指定したフィールドが存在しません。",
-    "件見つかりました。"
+    "件見つかりました。",
+    "統計を0に戻しました。",
+    "件のレコードを読み込みました。"
 };
 
 /* エラーメッセージ番号 */
@@ -51,6 +55,7 @@ typedef enum ErrorMessageNo {
     ERR_MSG_INSERT,
     ERR_MSG_SELECT,
     ERR_MSG_DELETE,
+    ERR_MSG_COPY,
     ERR_MSG_UNKNOWN_TYPE
 } ErrorMessageNo;
 
@@ -64,6 +69,7 @@ static char *errorMessage[] = {
     "Cannot insert record",
     "Cannot select record",
     "Cannot delete record",
+    "Cannot copy records",
     "Unknown data type found."
 };
 
@@ -14,6 +14,7 @@
 #include <assert.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include "messages.h"
 
 #define DB_PATH "/Users/Koji/.microdb/data"
@@ -28,20 +29,110 @@ typedef enum { OK, NG } Result;
  */
 #define PAGE_SIZE 4096
 
+/*
+ * MAX_PAGE_SIZE -- テーブルごとに指定できるページの大きさの上限(バイト数)
+ *
+ * テーブルのページの大きさは、PAGE_SIZEの2のべき乗倍でこの値以下とする。
+ * PAGE_SIZEより大きいページは、ファイル上で連続したPAGE_SIZEのページを
+ * まとめたもの(ブロック)として、latchBlock()などで読み書きする。
+ */
+#define MAX_PAGE_SIZE (16 * PAGE_SIZE)
+
 /*
  * MAX_FILENAME -- オープンするファイルの名前の長さの上限
  */
 #define MAX_FILENAME 256
 
+/*
+ * accessHint -- ファイルのアクセスパターンのヒント
+ */
+typedef enum { ACCESS_NORMAL = 0, ACCESS_SEQUENTIAL = 1 } accessHint;
+
+/*
+ * BufferRing -- 大きなファイルを順に読むときに使う専用のバッファの輪
+ * (内容はファイルアクセスモジュールの中だけで使う)
+ */
+typedef struct BufferRing BufferRing;
+
+/*
+ * FileMap -- ファイルをメモリにマップした領域
+ * (内容はファイルアクセスモジュールの中だけで使う)
+ */
+typedef struct FileMap FileMap;
+
+/*
+ * PageMap -- 圧縮したファイルのページ対応表
+ * (内容はファイルアクセスモジュールの中だけで使う)
+ */
+typedef struct PageMap PageMap;
+
+/*
+ * fileBackend -- データファイルのページを読む方法
+ *	BACKEND_BUFFER: バッファに読み込んで読む
+ *	BACKEND_MMAP: バッファにないページは、メモリにマップした領域から直接読む
+ */
+typedef enum { BACKEND_BUFFER = 0, BACKEND_MMAP = 1 } fileBackend;
+
+/*
+ * BufferStats -- バッファの統計
+ *
+ * ファイルアクセスモジュールが、全体とファイルごとに数える。
+ */
+typedef struct BufferStats BufferStats;
+struct BufferStats {
+    long numHit;                        /* バッファにあったアクセスの数 */
+    long numMiss;                       /* バッファになかったアクセスの数 */
+    long numEvict;                      /* 追い出したバッファの数 */
+    long numWriteBack;                  /* 更新済みのページを書き戻した数 */
+    long numEvictWriteBack;             /* そのうち、追い出すときに書き戻した数 */
+    long numReadCall;                   /* 読み込みのシステムコールの数 */
+    long numWriteCall;                  /* 書き込みのシステムコールの数 */
+    long long readBytes;                /* 読み込んだバイト数 */
+    long long writeBytes;               /* 書き込んだバイト数 */
+    long long ioTime;                   /* 読み書きのシステムコールにかかった時間(ナノ秒) */
+    long long rawBytes;                 /* 圧縮して書いた、または展開して読んだページの元のバイト数 */
+    long long packedBytes;              /* そのページのファイル上のバイト数 */
+    long long codecTime;                /* 圧縮と展開にかかったCPU時間(ナノ秒) */
+};
+
 /*
  * File - オープンしたファイルの情報を保持する構造体
+ *
+ * 同じファイル名のopenFile()には同じFile構造体を返し、closeFile()しても
+ * ファイルは閉じずに残しておく(ファイルアクセスモジュールが管理する)。
  */
 typedef struct File File;
 struct File {
     int desc;                           /* ファイルディスクリプタ */
     char name[MAX_FILENAME];            /* ファイル名 */
+    accessHint hint;                    /* adviseFile()で指定されたアクセスパターン */
+    int lastPageNum;                    /* 最後にアクセスしたページ番号 */
+    int numSequential;                  /* 連続したページ番号で続けてアクセスした回数 */
+    BufferRing *ring;                   /* 順に読むときに使うバッファの輪(使わなければNULL) */
+    FileMap *map;                       /* メモリにマップした領域(マップしていなければNULL) */
+    PageMap *pageMap;                   /* 圧縮したファイルのページ対応表(圧縮していなければNULL) */
+    int nextAheadPage;                  /* 非同期の先読みを次に発行するページ番号 */
+    int numPages;                       /* バッファ上で書き足したページも含めたページ数 */
+    int refCount;                       /* openFile()されている数(閉じている最中なら-1) */
+    File *cachePrev;                    /* オープンしたファイルのリストの前(最近使ったもの) */
+    File *cacheNext;                    /* オープンしたファイルのリストの次 */
+    BufferStats stats;                  /* このファイルのバッファの統計 */
+    pthread_mutex_t mutex;              /* hint, lastPageNum, numSequential, nextAheadPage, numPages, statsを保護する */
+    pthread_mutex_t appendMutex;        /* 末尾に書き足すとき、ページ数を調べてから書き終わるまで取る */
 };
 
+/*
+ * modifyFlag -- 変更フラグ
+ */
+typedef enum { UNMODIFIED = 0, MODIFIED = 1 } modifyFlag;
+
+/*
+ * latchMode -- latchPage()でページに取るラッチの種類
+ *	LATCH_SHARED: 読むだけ(ほかのスレッドも同時に読める)
+ *	LATCH_EXCLUSIVE: 変更する(ほかのスレッドは読むことも変更することもできない)
+ */
+typedef enum { LATCH_SHARED = 0, LATCH_EXCLUSIVE = 1 } latchMode;
+
 /*
  * MAX_FIELD -- 1レコードに含まれるフィールド数の上限
  */
@@ -84,6 +175,8 @@ typedef struct TableInfo TableInfo;
 struct TableInfo {
     int numField;				/* フィールド数 */
     FieldInfo fieldInfo[MAX_FIELD];		/* フィールド情報の配列 */
+    int pageSize;				/* データファイルのページの大きさ(0ならPAGE_SIZE) */
+    int pageFormat;				/* データファイルのページの形式(PAGE_FORMATを参照) */
 };
 
 /*
@@ -126,14 +219,82 @@ struct RecordSet {
 };
 
 /*
- * PageIndex -- ページ内のインデックス
+ * BulkInsert -- レコードをまとめて挿入するセッション
+ * (内容はデータ操作モジュールの中だけで使う)
+ */
+typedef struct BulkInsert BulkInsert;
+
+/*
+ * CopyStats -- copyRecords()で読み込んだ量
+ */
+typedef struct CopyStats CopyStats;
+struct CopyStats {
+    long numRecord;			/* 挿入したレコード数 */
+    long long numByte;			/* 読んだ入力ファイルのバイト数 */
+    int numPage;			/* データファイルに書き足したページ数(テーブルのページの大きさを単位とする) */
+    long lineNum;			/* 失敗したときに読んでいた行の番号 */
+};
+
+/*
+ * PAGE_FORMAT -- データファイルのページの形式の版
+ *
+ * 0はページの先頭にスロット数(int)、続いて9バイトのスロット(char + int×2)が
+ * 並ぶ古い形式。1はPageHeaderに続いてSlotの配列が並ぶ形式で、どちらも
+ * intの境界にそろっているので、ページ上でそのまま読み書きできる。
+ * 古い形式のデータファイルは、upgradeDataFile()でこの形式に書き直す。
+ */
+#define PAGE_FORMAT 1
+
+/*
+ * PageHeader -- データファイルのページの先頭に置くヘッダ
+ *
+ * スロットの並びはヘッダのすぐ後ろから後ろへ、レコードはページの末尾から
+ * 前へ伸びる。スロットの並びの末尾からfreeOffsetまでが、ひと続きの空き。
+ */
+typedef struct PageHeader PageHeader;
+struct PageHeader {
+    int numSlot;				/* スロットの数 */
+    int numLive;				/* レコードが入っているスロットの数 */
+    int freeOffset;				/* 空き領域ポインタ(レコードを詰めた領域の先頭) */
+};
+
+/*
+ * Slot -- ページ内のスロット(レコードまたは空きの位置と大きさ)
+ *
+ * flagがSLOT_USEDならレコード、SLOT_FREEなら削除してできた空き。
+ * 大きさ0の空きスロットは使われていない(使い回せる)スロット。
  */
 typedef struct Slot Slot;
 struct Slot{
-    int num;
-    char flag;
-    int offset;
-    int size;
+    int flag;					/* SLOT_FREEまたはSLOT_USED */
+    int offset;					/* ページの先頭からの位置 */
+    int size;					/* 大きさ(バイト数) */
+};
+
+/*
+ * SLOT_FREE, SLOT_USED -- スロットのflagの値
+ */
+#define SLOT_FREE 0
+#define SLOT_USED 1
+
+/*
+ * PAGE_HEADER, PAGE_SLOT -- ページのヘッダとn番目のスロットを、ページ上で直接指すポインタ
+ *
+ * ページはintの境界にそろった領域に置くこと(バッファやlatchBlock()の領域はそろっている)。
+ */
+#define PAGE_HEADER(page) ((PageHeader *) (page))
+#define PAGE_SLOT(page, n) ((Slot *) ((page) + sizeof(PageHeader)) + (n))
+
+/*
+ * RecordId -- レコードの番地(データファイルのページ番号とスロット番号)
+ *
+ * ページ番号はテーブルのページの大きさを単位とする。ページを詰め直しても
+ * スロット番号は変わらないので、レコードを削除するまで同じ番地で読める。
+ */
+typedef struct RecordId RecordId;
+struct RecordId {
+    int pageNum;				/* ページ番号 */
+    int slotNum;				/* スロット番号 */
 };
 
 /*
@@ -184,14 +345,48 @@ struct FieldList {
  */
 extern Result initializeFileModule();
 extern Result finalizeFileModule();
+extern Result setNumBuffer(int);
+extern int getNumBuffer();
+extern Result setNumShard(int);
+extern int getNumShard();
+extern Result setReplacementPolicy(char *);
+extern char *getReplacementPolicy();
 extern Result createFile(char *);
 extern Result deleteFile(char *);
+extern Result replaceFile(char *, char *);
 extern File *openFile(char *);
 extern Result closeFile(File *);
+extern Result syncFile(File *);
+extern void adviseFile(File *, accessHint);
+extern Result mapFile(File *);
+extern Result prefetchPages(File *, int, int);
+extern Result setFileCompression(char *, int);
+extern int isFileCompressed(char *);
+extern Result setAsyncIO(char *);
+extern char *getAsyncIO();
+extern Result setDirectIO(int);
+extern int getDirectIO();
+extern Result setHugePages(char *);
+extern char *getHugePages();
+extern void setDefaultBackend(fileBackend);
+extern fileBackend getDefaultBackend();
 extern Result readPage(File *, int, char *);
 extern Result writePage(File *, int, char *);
+extern char *pinPage(File *, int);
+extern void unpinPage(char *, modifyFlag);
+extern char *latchPage(File *, int, latchMode);
+extern void unlatchPage(char *, modifyFlag);
+extern char *latchBlock(File *, int, int, latchMode);
+extern Result unlatchBlock(char *, int, modifyFlag);
+extern Result writeBlock(File *, int, int, char *);
+extern int appendBlock(File *, int, char *);
+extern int appendPages(File *, int, int, char *);
 extern int getNumPages(char *);
 extern void printBufferList();
+extern void getBufferStats(BufferStats *);
+extern void getFileStats(File *, BufferStats *);
+extern void resetBufferStats();
+extern void printBufferStats();
 
 /*
  * datadef.cに定義されている関数群
@@ -202,18 +397,31 @@ extern Result createTable(char *, TableInfo *);
 extern Result dropTable(char *);
 extern TableInfo *getTableInfo(char *);
 extern void freeTableInfo(TableInfo *);
+extern Result setTablePageFormat(char *, int);
 
 /*
  * datamanip.cに定義されている関数群
  */
 extern Result initializeDataManipModule();
 extern Result finalizeDataManipModule();
-extern Result insertRecord(char *, RecordData *);
+extern Result insertRecord(char *, RecordData *, RecordId *);
+extern Result insertRecords(char *, RecordData *, int);
+extern BulkInsert *beginBulkInsert(char *);
+extern Result bulkInsertRecord(BulkInsert *, RecordData *);
+extern Result endBulkInsert(BulkInsert *);
+extern Result copyRecords(char *, char *, CopyStats *);
 extern RecordSet *selectRecord(char *, FieldList *, Condition *);
 extern void freeRecordSet(RecordSet *);
 extern Result deleteRecord(char *, Condition *);
+extern RecordData *fetchRecord(char *, RecordId *);
+extern Result deleteRecordByRid(char *, RecordId *);
+extern Result setTableBackend(char *, fileBackend);
+extern fileBackend getTableBackend(char *);
+extern Result setTableCompression(char *, int);
+extern int isTableCompressed(char *);
 extern Result createDataFile(char *);
 extern Result deleteDataFile(char *);
+extern Result upgradeDataFile(char *, TableInfo *);
 
 /*
  * resultprint.cに定義されている関数群
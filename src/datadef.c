@@ -2,102 +2,732 @@
  * datadef.c - データ定義モジュール
  */
 
+#include <dirent.h>
+#include <stddef.h>
+
 #include "../include/microdb.h"
 
+/*
+ * CATALOG_FILE_NAME -- システムカタログのファイル名
+ *
+ * すべてのテーブルのデータ定義情報を、DB_PATHにあるこの1つのファイルに置く。
+ */
+#define CATALOG_FILE_NAME "system.cat"
+
+/*
+ * CATALOG_MAGIC, CATALOG_VERSION -- システムカタログのファイルの印と版
+ */
+#define CATALOG_MAGIC 0x4d444243
+#define CATALOG_VERSION 1
+
 /*
  * DEF_FILE_EXT -- データ定義ファイルの拡張子
+ *
+ * システムカタログを使うようになる前は、テーブルごとにデータ定義ファイル
+ * (テーブル名.def)を作っていた。initializeDataDefModule()でシステムカタログに移す。
  */
 #define DEF_FILE_EXT ".def"
 
 /*
- * initializeDataDefModule -- データ定義モジュールの初期化
+ * PAGE_SIZE_OFFSET -- データ定義ファイルの中で、データファイルのページの大きさを置く位置
+ *
+ * フィールド情報の領域(MAX_FIELD個分)のすぐ後ろに置く。
+ * この領域が0のファイル(ページの大きさを指定できなかったころに作ったもの)は、
+ * PAGE_SIZEとして扱う。
+ */
+#define PAGE_SIZE_OFFSET (sizeof(int) + MAX_FIELD * (MAX_FIELD_NAME + sizeof(int)))
+
+/*
+ * PAGE_FORMAT_OFFSET -- データ定義ファイルの中で、データファイルのページの形式を置く位置
+ *
+ * ページの大きさのすぐ後ろに置く。この領域が0のファイル(ページヘッダを
+ * 使うようになる前に作ったもの)のデータファイルは、古い形式のページでできている。
+ */
+#define PAGE_FORMAT_OFFSET (PAGE_SIZE_OFFSET + sizeof(int))
+
+/*
+ * CatalogKind -- システムカタログの項目の種類
+ *
+ * 索引や統計情報を置くようになったら、ここに種類を加える。
+ */
+typedef enum { CATALOG_FREE = 0, CATALOG_TABLE = 1 } CatalogKind;
+
+/*
+ * CatalogRecord -- システムカタログのファイルに置く1つの項目
+ */
+typedef struct CatalogRecord CatalogRecord;
+struct CatalogRecord {
+    int kind;				/* 項目の種類(CatalogKind) */
+    char name[MAX_FILENAME];		/* テーブル名 */
+    TableInfo tableInfo;		/* データ定義情報 */
+};
+
+/*
+ * CATALOG_RECORD_PER_PAGE -- システムカタログの1ページに置く項目の数
+ *
+ * システムカタログのファイルの構造
+ *   +----------------------+----------------------+----------------------+----
+ *   |ページ0: ヘッダ       |ページ1: 項目0, 1, ...|ページ2: ...          |
+ *   |(印、版、項目の大きさ)|                      |                      |
+ *   +----------------------+----------------------+----------------------+----
+ * 項目はページをまたがないので、1つの項目の更新は1ページの書き込みで済み、
+ * その書き込みで更新が確定する。
+ */
+#define CATALOG_RECORD_PER_PAGE ((int) (PAGE_SIZE / sizeof(CatalogRecord)))
+
+/*
+ * CATALOG_HASH_SIZE -- データ定義情報のハッシュ表のバケット数
+ */
+#define CATALOG_HASH_SIZE 1024
+
+/*
+ * CatalogEntry -- メモリ上に読み込んだテーブルのデータ定義情報
+ */
+typedef struct CatalogEntry CatalogEntry;
+struct CatalogEntry {
+    char tableName[MAX_FILENAME];	/* テーブル名 */
+    TableInfo tableInfo;		/* データ定義情報(getTableInfo()が返す) */
+    int recordNum;			/* システムカタログのファイルの中の項目の番号 */
+    int refCount;			/* getTableInfo()で返して、まだfreeTableInfo()されていない数 */
+    int retired;			/* ハッシュ表から取り除いたら1 */
+    CatalogEntry *next;			/* 同じバケットの次の項目(捨てた項目なら、捨てた項目の次) */
+};
+
+/*
+ * catalogHash -- テーブル名からデータ定義情報を引くハッシュ表
+ *
+ * initializeDataDefModule()でシステムカタログを読んで作る。getTableInfo()は
+ * ここを引くだけで、ファイルは読まない。createTable()、dropTable()などで
+ * システムカタログを書き換えたら、項目を差し替える(項目そのものは書き換えない)。
+ */
+static CatalogEntry *catalogHash[CATALOG_HASH_SIZE];
+
+/*
+ * retiredEntry -- ハッシュ表から取り除いた項目のリスト
+ *
+ * ほかのセッションがまだ使っている(refCountが0でない)項目を、
+ * 使い終わるまでつないでおく。最後のfreeTableInfo()で解放する。
+ */
+static CatalogEntry *retiredEntry = NULL;
+
+/*
+ * catalogLock -- ハッシュ表、retiredEntryのロック
+ *
+ * 項目のrefCountは、読み込み用のロックを取ったまま不可分に増減する。
+ * 項目を解放するのは書き込み用のロックを取ったときだけなので、
+ * 読み込み用のロックを取っている間は、項目が解放されることはない。
+ */
+static pthread_rwlock_t catalogLock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * freeRecord, numFreeRecord -- システムカタログの空いている項目の番号
+ * numRecord -- システムカタログのファイルにある項目の数(空いている項目を含む)
+ */
+static int *freeRecord = NULL;
+static int numFreeRecord = 0;
+static int numRecord = 0;
+
+/*
+ * ddlMutex -- システムカタログを書き換える操作を1つずつ行うためのロック
+ *
+ * freeRecord、numFreeRecord、numRecordもこのロックで守る。
+ */
+static pthread_mutex_t ddlMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * isValidPageSize -- テーブルのページの大きさとして使えるかどうかを調べる
  *
  * 引数:
- *	なし
+ *	pageSize: ページの大きさ(バイト数)
  *
- * 返り値;
+ * 返り値:
+ *	PAGE_SIZEの2のべき乗倍で、MAX_PAGE_SIZE以下なら1、それ以外なら0を返す
+ */
+static int isValidPageSize(int pageSize)
+{
+    int size;
+
+    for (size = PAGE_SIZE; size <= MAX_PAGE_SIZE; size *= 2) {
+        if (size == pageSize) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * hashTableName -- テーブル名のハッシュ値を求める(FNV-1a)
+ *
+ * 引数:
+ *	tableName: テーブル名
+ *
+ * 返り値:
+ *	catalogHashのバケットの番号
+ */
+static unsigned int hashTableName(char *tableName)
+{
+    unsigned int h = 2166136261U;
+
+    while (*tableName != '\0') {
+        h = (h ^ (unsigned char) *tableName++) * 16777619U;
+    }
+    return h % CATALOG_HASH_SIZE;
+}
+
+/*
+ * findEntry -- ハッシュ表からテーブルの項目を探す
+ *
+ * catalogLockを取ってから呼ぶこと。
+ *
+ * 引数:
+ *	tableName: テーブル名
+ *
+ * 返り値:
+ *	見つかった項目。なければNULLを返す
+ */
+static CatalogEntry *findEntry(char *tableName)
+{
+    CatalogEntry *entry;
+
+    for (entry = catalogHash[hashTableName(tableName)]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->tableName, tableName) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * sweepRetiredEntry -- 捨てた項目のうち、どのセッションも使っていないものを解放する
+ *
+ * catalogLockを書き込み用に取ってから呼ぶこと。
+ */
+static void sweepRetiredEntry()
+{
+    CatalogEntry **p, *entry;
+
+    p = &retiredEntry;
+    while ((entry = *p) != NULL) {
+        if (entry->refCount == 0) {
+            *p = entry->next;
+            free(entry);
+        } else {
+            p = &entry->next;
+        }
+    }
+}
+
+/*
+ * replaceEntry -- ハッシュ表のテーブルの項目を差し替える
+ *
+ * 古い項目は、ほかのセッションが使い終わるまで残すため、retiredEntryにつないでおく
+ * (どのセッションも使っていなければ、すぐに解放する)。
+ *
+ * 引数:
+ *	tableName: テーブル名
+ *	entry: 新しい項目(NULLなら、古い項目を取り除くだけ)
+ */
+static void replaceEntry(char *tableName, CatalogEntry *entry)
+{
+    CatalogEntry **p, *old;
+    unsigned int h = hashTableName(tableName);
+
+    pthread_rwlock_wrlock(&catalogLock);
+    for (p = &catalogHash[h]; *p != NULL; p = &(*p)->next) {
+        if (strcmp((*p)->tableName, tableName) == 0) {
+            old = *p;
+            *p = old->next;
+            old->retired = 1;
+            old->next = retiredEntry;
+            retiredEntry = old;
+            break;
+        }
+    }
+    if (entry != NULL) {
+        entry->next = catalogHash[h];
+        catalogHash[h] = entry;
+    }
+    sweepRetiredEntry();
+    pthread_rwlock_unlock(&catalogLock);
+}
+
+/*
+ * newEntry -- メモリ上の項目を作る
+ *
+ * 引数:
+ *	tableName: テーブル名
+ *	tableInfo: データ定義情報
+ *	recordNum: システムカタログのファイルの中の項目の番号
+ *
+ * 返り値:
+ *	作った項目。エラーの場合には、NULLを返す
+ */
+static CatalogEntry *newEntry(char *tableName, TableInfo *tableInfo, int recordNum)
+{
+    CatalogEntry *entry;
+
+    if ((entry = (CatalogEntry *) malloc(sizeof(CatalogEntry))) == NULL) {
+        return NULL;
+    }
+    strncpy(entry->tableName, tableName, MAX_FILENAME - 1);
+    entry->tableName[MAX_FILENAME - 1] = '\0';
+    entry->tableInfo = *tableInfo;
+    entry->recordNum = recordNum;
+    entry->refCount = 0;
+    entry->retired = 0;
+    entry->next = NULL;
+    return entry;
+}
+
+/*
+ * writeCatalogRecord -- システムカタログのファイルの1つの項目を書き換える
+ *
+ * 項目のあるページを読んで項目を書き換え、そのページを書き戻して、
+ * ディスクに書き込まれるまで待つ。
+ *
+ * 引数:
+ *	recordNum: 項目の番号
+ *	kind: 項目の種類
+ *	tableName: テーブル名(kindがCATALOG_FREEなら使わない)
+ *	tableInfo: データ定義情報(kindがCATALOG_FREEなら使わない)
+ *
+ * 返り値:
  *	成功ならOK、失敗ならNGを返す
  */
-Result initializeDataDefModule(){
-    return OK;
+static Result writeCatalogRecord(int recordNum, CatalogKind kind, char *tableName, TableInfo *tableInfo)
+{
+    File *file;
+    CatalogRecord record;
+    char filename[MAX_FILENAME];
+    char page[PAGE_SIZE];
+    int pageNum = 1 + recordNum / CATALOG_RECORD_PER_PAGE;
+
+    memset(&record, 0, sizeof(record));
+    record.kind = kind;
+    if (kind != CATALOG_FREE) {
+        strncpy(record.name, tableName, MAX_FILENAME - 1);
+        record.tableInfo = *tableInfo;
+    }
+
+    sprintf(filename, "%s/%s", DB_PATH, CATALOG_FILE_NAME);
+    if ((file = openFile(filename)) == NULL) {
+        return NG;
+    }
+
+    /* ファイルの末尾の次のページなら、空のページに書き込んで加える */
+    if (pageNum < getNumPages(filename)) {
+        if (readPage(file, pageNum, page) != OK) {
+            closeFile(file);
+            return NG;
+        }
+    } else {
+        memset(page, 0, PAGE_SIZE);
+    }
+    memcpy(page + sizeof(CatalogRecord) * (recordNum % CATALOG_RECORD_PER_PAGE), &record, sizeof(record));
+    if (writePage(file, pageNum, page) != OK || syncFile(file) != OK) {
+        closeFile(file);
+        return NG;
+    }
+
+    return closeFile(file);
 }
 
 /*
- * finalizeDataDefModule -- データ定義モジュールの終了処理
+ * releaseRecord -- 項目の番号を空いている項目に戻す
+ *
+ * ddlMutexを取ってから呼ぶこと。
  *
  * 引数:
- *	なし
+ *	recordNum: 項目の番号
  *
- * 返り値;
+ * 返り値:
  *	成功ならOK、失敗ならNGを返す
  */
-Result finalizeDataDefModule(){
+static Result releaseRecord(int recordNum)
+{
+    int *p;
+
+    /* まだファイルにない項目なら、戻さなくてもよい */
+    if (recordNum >= numRecord) {
+        return OK;
+    }
+    if ((p = (int *) realloc(freeRecord, sizeof(int) * (numFreeRecord + 1))) == NULL) {
+        return NG;
+    }
+    freeRecord = p;
+    freeRecord[numFreeRecord++] = recordNum;
     return OK;
 }
 
 /*
- * createTable -- 表(テーブル)の作成
+ * putTableInfo -- システムカタログにテーブルのデータ定義情報を書き込む
+ *
+ * ddlMutexを取ってから呼ぶこと。システムカタログにすでにあるテーブルなら、
+ * 同じ項目を書き換える。ファイルへの書き込みに成功してから、ハッシュ表の項目を差し替える。
  *
  * 引数:
- *	tableName: 作成する表の名前
+ *	tableName: テーブル名
  *	tableInfo: データ定義情報
  *
  * 返り値:
  *	成功ならOK、失敗ならNGを返す
+ */
+static Result putTableInfo(char *tableName, TableInfo *tableInfo)
+{
+    CatalogEntry *entry, *old;
+    int recordNum;
+
+    pthread_rwlock_rdlock(&catalogLock);
+    old = findEntry(tableName);
+    pthread_rwlock_unlock(&catalogLock);
+
+    /* なければ、空いている項目か、ファイルの末尾の次の項目を使う */
+    if (old != NULL) {
+        recordNum = old->recordNum;
+    } else if (numFreeRecord > 0) {
+        recordNum = freeRecord[--numFreeRecord];
+    } else {
+        recordNum = numRecord;
+    }
+
+    if ((entry = newEntry(tableName, tableInfo, recordNum)) == NULL
+        || writeCatalogRecord(recordNum, CATALOG_TABLE, tableName, tableInfo) != OK) {
+        free(entry);
+        if (old == NULL) {
+            releaseRecord(recordNum);
+        }
+        return NG;
+    }
+    if (recordNum >= numRecord) {
+        numRecord = recordNum + 1;
+    }
+
+    replaceEntry(tableName, entry);
+    return OK;
+}
+
+/*
+ * readDefFile -- データ定義ファイルを読む
+ *
+ * 引数:
+ *	filename: データ定義ファイルのファイル名
+ *	tableInfo: 読んだデータ定義情報を入れる領域
+ *
+ * 返り値:
+ *	成功ならOK、失敗ならNGを返す
  *
- * データ定義ファイルの構造(ファイル名: tableName.def)
+ * データ定義ファイルの構造(ファイル名: テーブル名.def)
  *   +-------------------+----------------------+-------------------+----
  *   |フィールド数       |フィールド名          |データ型           |
  *   |(sizeof(int)バイト)|(MAX_FIELD_NAMEバイト)|(sizeof(int)バイト)|
  *   +-------------------+----------------------+-------------------+----
  * 以降、フィールド名とデータ型が交互に続く。
+ * PAGE_SIZE_OFFSETバイト目に、データファイルのページの大きさ(sizeof(int)バイト)、
+ * PAGE_FORMAT_OFFSETバイト目に、データファイルのページの形式(sizeof(int)バイト)がある。
  */
-Result createTable(char *tableName, TableInfo *tableInfo){
+static Result readDefFile(char *filename, TableInfo *tableInfo){
     File *file;
-    char filename[MAX_FILENAME];
     char page[PAGE_SIZE];
     char *p;
     int i;
 
-    //ファイルを作成
-    sprintf(filename, "%s/%s%s", DB_PATH, tableName, DEF_FILE_EXT);
-    if(createFile(filename) != OK || createDataFile(tableName) != OK){
-        return NG;
-    }
+    memset(tableInfo, 0, sizeof(TableInfo));
 
-
-    //ファイルをオープン
+    //ファイルのオープン
     if((file = openFile(filename)) == NULL){return NG;}
 
-    /* ページの内容をクリアする */
-    memset(page, 0, PAGE_SIZE);
+    //0ページ目を読み込み
+    if(readPage(file, 0, page) == NG){
+        closeFile(file);
+        return NG;
+    }
     p = page;
 
-    /* ページの先頭にフィールド数を保存する */
-    memcpy(p, &(tableInfo->numField), sizeof(tableInfo->numField));
+    //フィールド数を取得
+    memcpy(&(tableInfo->numField), p, sizeof(tableInfo->numField));
     p += sizeof(tableInfo->numField);
+    if(tableInfo->numField < 0 || tableInfo->numField > MAX_FIELD){
+        closeFile(file);
+        return NG;
+    }
 
-    //他の情報(フィールド名、データ型など)を、配列pageにmemcpyでコピーする...
+    //フィールド名とフィールドタイプを個数分読み込み
     for(i=0; i<(tableInfo->numField); ++i){
-        memcpy(p, tableInfo->fieldInfo[i].name, sizeof(tableInfo->fieldInfo[i].name));
+        memcpy(tableInfo->fieldInfo[i].name, p, sizeof(tableInfo->fieldInfo[i].name));
         p += sizeof(tableInfo->fieldInfo[i].name);
 
-        memcpy(p, &(tableInfo->fieldInfo[i].dataType), sizeof(tableInfo->fieldInfo[i].dataType));
+        memcpy(&(tableInfo->fieldInfo[i].dataType), p, sizeof(tableInfo->fieldInfo[i].dataType));
         p += sizeof(tableInfo->fieldInfo[i].dataType);
+    }
 
+    //データファイルのページの大きさを取得(0なら古い形式なのでPAGE_SIZE)
+    memcpy(&(tableInfo->pageSize), page + PAGE_SIZE_OFFSET, sizeof(tableInfo->pageSize));
+    if(tableInfo->pageSize == 0){
+        tableInfo->pageSize = PAGE_SIZE;
     }
 
-    /* ファイルの先頭ページ(ページ番号0)に1ページ分のデータを書き込む */
-    if(writePage(file, 0, page) == NG){return NG;}
+    //データファイルのページの形式を取得(0なら古い形式)
+    memcpy(&(tableInfo->pageFormat), page + PAGE_FORMAT_OFFSET, sizeof(tableInfo->pageFormat));
+
+    //ファイルのクローズ
+    return closeFile(file);
+}
 
-    if(closeFile(file) == NG){return NG;}
+/*
+ * loadCatalog -- システムカタログのファイルを読んで、ハッシュ表を作る
+ *
+ * ファイルがなければ、ヘッダだけのファイルを作る。
+ * ddlMutexを取ってから呼ぶこと。
+ *
+ * 返り値:
+ *	成功ならOK、失敗ならNGを返す
+ */
+static Result loadCatalog()
+{
+    File *file;
+    CatalogEntry *entry;
+    CatalogRecord record;
+    char filename[MAX_FILENAME];
+    char page[PAGE_SIZE];
+    int header[3], numPage, i, j;
+
+    sprintf(filename, "%s/%s", DB_PATH, CATALOG_FILE_NAME);
+
+    /* なければ(ヘッダを書く前に止まっていれば)、ヘッダのページだけを書いて作る */
+    if (access(filename, F_OK) != 0 || getNumPages(filename) == 0) {
+        memset(page, 0, PAGE_SIZE);
+        header[0] = CATALOG_MAGIC;
+        header[1] = CATALOG_VERSION;
+        header[2] = (int) sizeof(CatalogRecord);
+        memcpy(page, header, sizeof(header));
+        if (createFile(filename) != OK || (file = openFile(filename)) == NULL) {
+            return NG;
+        }
+        if (writePage(file, 0, page) != OK || syncFile(file) != OK) {
+            closeFile(file);
+            return NG;
+        }
+        return closeFile(file);
+    }
+
+    if ((numPage = getNumPages(filename)) < 0 || (file = openFile(filename)) == NULL) {
+        return NG;
+    }
+
+    /* ヘッダを確かめる */
+    if (readPage(file, 0, page) != OK) {
+        closeFile(file);
+        return NG;
+    }
+    memcpy(header, page, sizeof(header));
+    if (header[0] != CATALOG_MAGIC || header[1] != CATALOG_VERSION
+        || header[2] != (int) sizeof(CatalogRecord)) {
+        closeFile(file);
+        return NG;
+    }
+
+    /* 項目を順に読む(空いている項目は、空いている項目の番号に加える) */
+    for (i = 1; i < numPage; i++) {
+        if (readPage(file, i, page) != OK) {
+            closeFile(file);
+            return NG;
+        }
+        for (j = 0; j < CATALOG_RECORD_PER_PAGE; j++) {
+            memcpy(&record, page + sizeof(CatalogRecord) * j, sizeof(record));
+            numRecord++;
+            if (record.kind != CATALOG_TABLE) {
+                if (releaseRecord(numRecord - 1) != OK) {
+                    closeFile(file);
+                    return NG;
+                }
+                continue;
+            }
+            record.name[MAX_FILENAME - 1] = '\0';
+            if ((entry = newEntry(record.name, &record.tableInfo, numRecord - 1)) == NULL) {
+                closeFile(file);
+                return NG;
+            }
+            replaceEntry(record.name, entry);
+        }
+    }
+
+    return closeFile(file);
+}
+
+/*
+ * migrateDefFiles -- データ定義ファイルをシステムカタログに移す
+ *
+ * DB_PATHにあるデータ定義ファイルを読んでシステムカタログに書き込み、
+ * 書き込めたものから削除する。途中で止まっても、残ったものは次の
+ * initializeDataDefModule()で移す(システムカタログにすでにあるテーブルなら、
+ * データ定義ファイルを削除するだけ)。ddlMutexを取ってから呼ぶこと。
+ *
+ * 返り値:
+ *	成功ならOK、失敗ならNGを返す
+ */
+static Result migrateDefFiles()
+{
+    DIR *dir;
+    struct dirent *dirEntry;
+    CatalogEntry *entry;
+    TableInfo tableInfo;
+    char filename[MAX_FILENAME];
+    char tableName[MAX_FILENAME];
+    size_t nameLen, extLen = strlen(DEF_FILE_EXT);
+    Result result = OK;
+
+    if ((dir = opendir(DB_PATH)) == NULL) {
+        return OK;
+    }
+
+    while (result == OK && (dirEntry = readdir(dir)) != NULL) {
+        nameLen = strlen(dirEntry->d_name);
+        if (nameLen <= extLen || nameLen - extLen >= MAX_FILENAME
+            || strcmp(dirEntry->d_name + nameLen - extLen, DEF_FILE_EXT) != 0) {
+            continue;
+        }
+        memcpy(tableName, dirEntry->d_name, nameLen - extLen);
+        tableName[nameLen - extLen] = '\0';
+        snprintf(filename, MAX_FILENAME, "%s/%s", DB_PATH, dirEntry->d_name);
+
+        pthread_rwlock_rdlock(&catalogLock);
+        entry = findEntry(tableName);
+        pthread_rwlock_unlock(&catalogLock);
+
+        /* システムカタログに書き込めてから、データ定義ファイルを削除する */
+        if (entry == NULL
+            && (readDefFile(filename, &tableInfo) != OK || putTableInfo(tableName, &tableInfo) != OK)) {
+            result = NG;
+        } else if (deleteFile(filename) != OK) {
+            result = NG;
+        }
+    }
+
+    closedir(dir);
+    return result;
+}
+
+/*
+ * freeCatalog -- メモリ上のデータ定義情報をすべて解放する
+ *
+ * ddlMutexを取ってから呼ぶこと。
+ */
+static void freeCatalog()
+{
+    CatalogEntry *entry;
+    int i;
+
+    pthread_rwlock_wrlock(&catalogLock);
+    for (i = 0; i < CATALOG_HASH_SIZE; i++) {
+        while ((entry = catalogHash[i]) != NULL) {
+            catalogHash[i] = entry->next;
+            free(entry);
+        }
+    }
+    while ((entry = retiredEntry) != NULL) {
+        retiredEntry = entry->next;
+        free(entry);
+    }
+    pthread_rwlock_unlock(&catalogLock);
+
+    free(freeRecord);
+    freeRecord = NULL;
+    numFreeRecord = 0;
+    numRecord = 0;
+}
+
+/*
+ * initializeDataDefModule -- データ定義モジュールの初期化
+ *
+ * システムカタログを読み込み(なければ作り)、残っているデータ定義ファイルを
+ * システムカタログに移す。ファイルモジュールを初期化してから呼ぶこと。
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値;
+ *	成功ならOK、失敗ならNGを返す
+ */
+Result initializeDataDefModule(){
+    Result result;
+
+    pthread_mutex_lock(&ddlMutex);
+    freeCatalog();
+    if((result = loadCatalog()) == OK){
+        result = migrateDefFiles();
+    }
+    pthread_mutex_unlock(&ddlMutex);
+
+    return result;
+}
+
+/*
+ * finalizeDataDefModule -- データ定義モジュールの終了処理
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値;
+ *	成功ならOK、失敗ならNGを返す
+ */
+Result finalizeDataDefModule(){
+    //メモリ上のデータ定義情報を解放する
+    pthread_mutex_lock(&ddlMutex);
+    freeCatalog();
+    pthread_mutex_unlock(&ddlMutex);
 
     return OK;
 }
 
+/*
+ * createTable -- 表(テーブル)の作成
+ *
+ * データファイルを作ってから、システムカタログにデータ定義情報を書き込む。
+ * 書き込めた時点で作成が確定し、書き込めなければデータファイルを削除する。
+ * 同じ名前のテーブルがあれば、そのデータ定義情報を置き換える。
+ *
+ * 引数:
+ *	tableName: 作成する表の名前
+ *	tableInfo: データ定義情報
+ *
+ * 返り値:
+ *	成功ならOK、失敗ならNGを返す
+ *
+ * tableInfo->pageSizeが0ならPAGE_SIZEとする。
+ * 新しく作るデータファイルなので、tableInfo->pageFormatによらずPAGE_FORMATとする。
+ */
+Result createTable(char *tableName, TableInfo *tableInfo){
+    TableInfo info;
+    Result result;
+
+    //テーブル名、フィールド数、ページの大きさを確認
+    if(strlen(tableName) >= MAX_FILENAME || tableInfo->numField < 0 || tableInfo->numField > MAX_FIELD){
+        return NG;
+    }
+    info = *tableInfo;
+    info.pageSize = (tableInfo->pageSize == 0) ? PAGE_SIZE : tableInfo->pageSize;
+    info.pageFormat = PAGE_FORMAT;
+    if(!isValidPageSize(info.pageSize)){
+        return NG;
+    }
+
+    pthread_mutex_lock(&ddlMutex);
+
+    //データファイルを作成してから、システムカタログに書き込む
+    if((result = createDataFile(tableName)) == OK && (result = putTableInfo(tableName, &info)) != OK){
+        deleteDataFile(tableName);
+    }
+
+    pthread_mutex_unlock(&ddlMutex);
+
+    return result;
+}
+
 /*
  * dropTable -- 表(テーブル)の削除
  *
+ * システムカタログから項目を消した時点で削除が確定し、その後でデータファイルを削除する。
+ *
  * 引数:
  *	tableInfo: 削除するテーブル定義情報
  *
@@ -105,83 +735,125 @@ Result createTable(char *tableName, TableInfo *tableInfo){
  *	成功ならOK、失敗ならNGを返す
  */
 Result dropTable(char *tableName){
-    char filename[MAX_FILENAME];
+    CatalogEntry *entry;
+    int recordNum = -1;
 
-    //テーブル定義情報ファイルの削除
-    sprintf(filename, "%s/%s%s", DB_PATH, tableName, DEF_FILE_EXT);
-    if(deleteFile(filename) != OK || deleteDataFile(tableName) != OK){
+    pthread_mutex_lock(&ddlMutex);
+
+    pthread_rwlock_rdlock(&catalogLock);
+    if((entry = findEntry(tableName)) != NULL){
+        recordNum = entry->recordNum;
+    }
+    pthread_rwlock_unlock(&catalogLock);
+
+    //システムカタログから消す
+    if(recordNum < 0 || writeCatalogRecord(recordNum, CATALOG_FREE, NULL, NULL) != OK){
+        pthread_mutex_unlock(&ddlMutex);
         return NG;
     }
+    replaceEntry(tableName, NULL);
+    releaseRecord(recordNum);
 
-    return OK;
+    pthread_mutex_unlock(&ddlMutex);
+
+    //データファイルの削除
+    return deleteDataFile(tableName);
 }
 
 /*
  * getTableInfo -- 表のデータ定義情報を取得する関数
  *
+ * initializeDataDefModule()で読み込んだシステムカタログから返す(ファイルは読まない)。
+ *
  * 引数:
  *	tableName: 情報を表示する表の名前
  *
  * 返り値:
  *	tableNameのデータ定義情報を返す
- *	エラーの場合には、NULLを返す
+ *	テーブルがない場合には、NULLを返す
  *
  * ***注意***
- *	この関数が返すデータ定義情報を収めたメモリ領域は、不要になったら
- *	必ずfreeTableInfoで解放すること。
+ *	返すデータ定義情報はセッションの間で共有しているので、書き換えないこと。
+ *	不要になったらfreeTableInfoを呼ぶこと(呼ぶまで、DDLで差し替えられても解放されない)。
  */
 TableInfo *getTableInfo(char *tableName){
-    TableInfo *tableInfo;
-    File *file;
-    char filename[MAX_FILENAME];
-    char page[PAGE_SIZE];
-    char *p;
-    int i;
-
-
-    //テーブル情報のメモリ確保
-    if((tableInfo = (TableInfo*)malloc(sizeof(TableInfo))) == NULL){return NULL;}
+    CatalogEntry *entry;
 
-    //ファイルのオープン
-    sprintf(filename, "%s/%s%s", DB_PATH, tableName, DEF_FILE_EXT);
-    if((file = openFile(filename)) == NULL){return NULL;}
-
-    //0ページ目を読み込み
-    if(readPage(file, 0, page) == NG){return NULL;}
-    p = page;
-
-    //フィールド数を取得
-    memcpy(&(tableInfo->numField), p, sizeof(tableInfo->numField));
-    p += sizeof(tableInfo->numField);
-
-    //フィールド名とフィールドタイプを個数分読み込み
-    for(i=0; i<(tableInfo->numField); ++i){
-        memcpy(tableInfo->fieldInfo[i].name, p, sizeof(tableInfo->fieldInfo[i].name));
-        p += sizeof(tableInfo->fieldInfo[i].name);
-
-        memcpy(&(tableInfo->fieldInfo[i].dataType), p, sizeof(tableInfo->fieldInfo[i].name));
-        p += sizeof(tableInfo->fieldInfo[i].dataType);
+    pthread_rwlock_rdlock(&catalogLock);
+    if ((entry = findEntry(tableName)) != NULL) {
+        __atomic_add_fetch(&entry->refCount, 1, __ATOMIC_RELAXED);
     }
+    pthread_rwlock_unlock(&catalogLock);
 
-    //ファイルのクローズ
-    if(closeFile(file) == NG){return NULL;}
-
-    return tableInfo;
+    return (entry != NULL) ? &entry->tableInfo : NULL;
 }
 
 /*
- * freeTableInfo -- データ定義情報を収めたメモリ領域の解放
+ * freeTableInfo -- データ定義情報の使用の終わり
  *
  * 引数:
- *	tableInfo: 開放するテーブル定義情報
+ *	tableInfo: 使い終わったテーブル定義情報
  *
  * 返り値:
  *	なし
  *
  * ***注意***
- *	関数getTableInfoが返すデータ定義情報を収めたメモリ領域は、
- *	不要になったら必ずこの関数で解放すること。
+ *	関数getTableInfoが返すデータ定義情報はメモリ上のシステムカタログの項目の中にある。
+ *	項目の参照の数を減らし、ハッシュ表から取り除かれた項目を誰も使わなくなったら解放する。
  */
 void freeTableInfo(TableInfo *tableInfo){
-    free(tableInfo);
+    CatalogEntry *entry;
+    int unused;
+
+    if (tableInfo == NULL) {
+        return;
+    }
+    entry = (CatalogEntry *) ((char *) tableInfo - offsetof(CatalogEntry, tableInfo));
+
+    pthread_rwlock_rdlock(&catalogLock);
+    unused = (__atomic_sub_fetch(&entry->refCount, 1, __ATOMIC_RELAXED) == 0 && entry->retired);
+    pthread_rwlock_unlock(&catalogLock);
+
+    /* 捨てた項目を使い終わったので解放する(ほかのセッションが先に解放していてもよい) */
+    if (unused) {
+        pthread_rwlock_wrlock(&catalogLock);
+        sweepRetiredEntry();
+        pthread_rwlock_unlock(&catalogLock);
+    }
+}
+
+/*
+ * setTablePageFormat -- システムカタログに、データファイルのページの形式を記録する
+ *
+ * データファイルを新しい形式に書き直したときに使う。
+ *
+ * 引数:
+ *	tableName: 表の名前
+ *	pageFormat: データファイルのページの形式
+ *
+ * 返り値:
+ *	成功ならOK、失敗ならNGを返す
+ */
+Result setTablePageFormat(char *tableName, int pageFormat){
+    CatalogEntry *entry;
+    TableInfo info;
+    Result result = NG;
+
+    pthread_mutex_lock(&ddlMutex);
+
+    pthread_rwlock_rdlock(&catalogLock);
+    if((entry = findEntry(tableName)) != NULL){
+        info = entry->tableInfo;
+    }
+    pthread_rwlock_unlock(&catalogLock);
+
+    //ページの形式を書き換えた項目を書き込んで、差し替える
+    if(entry != NULL){
+        info.pageFormat = pageFormat;
+        result = putTableInfo(tableName, &info);
+    }
+
+    pthread_mutex_unlock(&ddlMutex);
+
+    return result;
 }
@@ -2,6 +2,8 @@
 * datamanip.c -- データ操作モジュール
 */
 
+#include <dirent.h>
+
 #include "../include/microdb.h"
 
 /*
@@ -9,9 +11,323 @@
 */
 #define DATA_FILE_EXT ".dat"
 
+/*
+* FSM_FILE_EXT -- 空き領域マップ(free space map)のファイルの拡張子
+*/
+#define FSM_FILE_EXT ".fsm"
+
+/*
+* FsmEntry -- 空き領域マップの1項目
+*
+* データファイルの1ページの中で最大の空きスロットの大きさ(バイト数)を記録する。
+* ページの大きさはMAX_PAGE_SIZE以下なので、2バイトで収まる。
+*/
+typedef unsigned short FsmEntry;
+
+/*
+* FSM_NUM_ENTRY -- 空き領域マップの1ページに入る項目の数
+*/
+#define FSM_NUM_ENTRY ((int) (PAGE_SIZE / sizeof(FsmEntry)))
+
+/*
+* FSM_MAX_LEAF -- 空き領域マップの葉のページ数の上限
+*
+* 空き領域マップのファイルは2段の木で、ページ0(根)のi番目の項目に
+* ページi+1(葉)の中の最大値を置く。葉1ページでFSM_NUM_ENTRY個のページを表す。
+* これを超えるページは記録しない(挿入先には選ばれない)。
+*/
+#define FSM_MAX_LEAF FSM_NUM_ENTRY
+
+/*
+* UPGRADE_FILE_EXT -- 古い形式のデータファイルを書き直すときの一時ファイルの拡張子
+*/
+#define UPGRADE_FILE_EXT ".upg"
+
+/*
+* OLD_SLOT_SIZE -- 古い形式(ページの形式0)のページの、スロット1つの大きさ
+*
+* 古い形式では、ページの先頭のスロット数(int)に続いて、
+* フラグ(char)、位置(int)、大きさ(int)のスロットが詰めて並ぶ。
+*/
+#define OLD_SLOT_SIZE (sizeof(char) + sizeof(int) * 2)
+
+/*
+* COMPACT_FRAGMENT_RATIO -- ページを詰め直す細切れの空きの割合
+*
+* 削除したページで、最大の空きスロット以外の空きがページの
+* 1/COMPACT_FRAGMENT_RATIO以上になったら、その場で詰め直す。
+*/
+#define COMPACT_FRAGMENT_RATIO 8
+
+/*
+* COPY_READ_SIZE -- copyRecords()で入力ファイルを1回に読む大きさ(バイト数)
+*/
+#define COPY_READ_SIZE (1024 * 1024)
+
+/*
+* COPY_RUN_SIZE -- copyRecords()でデータファイルに1回で書き足す大きさ(バイト数)
+*
+* MAX_PAGE_SIZEの倍数とする(どのページの大きさのテーブルでも、ページの境界で区切れる)。
+*/
+#define COPY_RUN_SIZE (16 * MAX_PAGE_SIZE)
+
+/*
+* MAX_BACKEND_TABLE -- ページを読む方法を個別に指定できるテーブル数の上限
+*/
+#define MAX_BACKEND_TABLE 32
+
+/*
+* TableBackend -- テーブルごとに指定したページを読む方法
+*/
+typedef struct TableBackend TableBackend;
+struct TableBackend {
+    char tableName[MAX_FILENAME];   /* テーブル名 */
+    fileBackend backend;            /* ページを読む方法 */
+};
+
+/*
+* tableBackend, numTableBackend -- テーブルごとに指定したページを読む方法の一覧
+*/
+static TableBackend tableBackend[MAX_BACKEND_TABLE];
+static int numTableBackend = 0;
+
+/*
+* BulkInsert -- まとめて挿入するセッション(beginBulkInsert()が作る)
+*
+* 空き領域マップで見つからない分は、メモリ上の新しいページに詰めていき、
+* いっぱいになったら(またはendBulkInsert()で)データファイルの末尾に追加する。
+*/
+struct BulkInsert {
+    TableInfo *tableInfo;                       /* テーブルのデータ定義情報 */
+    File *file;                                 /* データファイル */
+    File *fsm;                                  /* 空き領域マップ */
+    int pageSize;                               /* テーブルのページの大きさ */
+    int hasPage;                                /* 新しいページに詰めている途中なら1 */
+    int newPage[MAX_PAGE_SIZE / sizeof(int)];   /* 詰めている途中の新しいページ(intの境界にそろえる) */
+};
+
+/*
+* CopyLoad -- copyRecords()で、データファイルに書き足すページを詰めている状態
+*/
+typedef struct CopyLoad CopyLoad;
+struct CopyLoad {
+    TableInfo *tableInfo;                       /* テーブルのデータ定義情報 */
+    File *file;                                 /* データファイル */
+    File *fsm;                                  /* 空き領域マップ */
+    int pageSize;                               /* テーブルのページの大きさ */
+    char *run;                                  /* 書き足すページを詰める領域(PAGE_SIZEの境界にそろえる) */
+    int numRunPage;                             /* runに置けるページ数 */
+    int curPage;                                /* 詰めているページ(runの中の番号) */
+    CopyStats *stats;                           /* 読み込んだ量 */
+};
+
+/*
+* fsmMutex -- 空き領域マップのファイルを作り直したり、書き換えたりするときのロック
+*/
+static pthread_mutex_t fsmMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+* upgradeMutex -- 古い形式のデータファイルを書き直すときのロック
+*/
+static pthread_mutex_t upgradeMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+* UpgradingTable -- データファイルの置き換えが済んでいないテーブル
+*
+* 書き直しでは、システムカタログに今の形式を記録する前にリストに加え、
+* データファイルを置き換えてから取り除く。リストにあるテーブルは、今の形式の
+* データ定義情報を得たセッションも、upgradeDataFile()でupgradeMutexを取って
+* 置き換えが済むのを待つ(置き換えられなかったときは、そこでやり直す)。
+*/
+typedef struct UpgradingTable UpgradingTable;
+struct UpgradingTable {
+    char tableName[MAX_FILENAME];               /* テーブル名 */
+    UpgradingTable *next;                       /* リストの次 */
+};
+
+/*
+* upgradingTable -- データファイルの置き換えが済んでいないテーブルのリスト
+* numUpgrading -- upgradingTableにあるテーブルの数(0なら、ロックを取らずに調べ終える)
+* upgradingLock -- upgradingTableのロック(書き換えるのは、upgradeMutexを取ったセッションだけ)
+*/
+static UpgradingTable *upgradingTable = NULL;
+static int numUpgrading = 0;
+static pthread_rwlock_t upgradingLock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+* isUpgrading -- テーブルのデータファイルの置き換えが済んでいないかどうかを調べる
+*
+* 引数:
+*	tableName: テーブル名
+*
+* 返り値:
+*	置き換えが済んでいなければ1、それ以外なら0
+*/
+static int isUpgrading(char *tableName){
+    UpgradingTable *table;
+    int found = 0;
+
+    if(__atomic_load_n(&numUpgrading, __ATOMIC_ACQUIRE) == 0){
+        return 0;
+    }
+
+    pthread_rwlock_rdlock(&upgradingLock);
+    for (table = upgradingTable; table != NULL && !found; table = table->next) {
+        found = (strcmp(table->tableName, tableName) == 0);
+    }
+    pthread_rwlock_unlock(&upgradingLock);
+
+    return found;
+}
+
+/*
+* setUpgrading -- テーブルを、データファイルの置き換えが済んでいないテーブルのリストに加える
+*
+* upgradeMutexを取ってから呼ぶこと。
+*
+* 引数:
+*	tableName: テーブル名
+*
+* 返り値:
+*	成功(すでにあった場合を含む)ならOK、失敗ならNG
+*/
+static Result setUpgrading(char *tableName){
+    UpgradingTable *table;
+
+    if(isUpgrading(tableName)){
+        return OK;
+    }
+    if((table = (UpgradingTable *) malloc(sizeof(UpgradingTable))) == NULL){
+        return NG;
+    }
+    strcpy(table->tableName, tableName);
+
+    pthread_rwlock_wrlock(&upgradingLock);
+    table->next = upgradingTable;
+    upgradingTable = table;
+    __atomic_store_n(&numUpgrading, numUpgrading + 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&upgradingLock);
+
+    return OK;
+}
+
+/*
+* clearUpgrading -- テーブルを、データファイルの置き換えが済んでいないテーブルのリストから取り除く
+*
+* upgradeMutexを取ってから呼ぶこと。
+*
+* 引数:
+*	tableName: テーブル名
+*/
+static void clearUpgrading(char *tableName){
+    UpgradingTable **p, *table;
+
+    pthread_rwlock_wrlock(&upgradingLock);
+    for (p = &upgradingTable; *p != NULL; p = &(*p)->next) {
+        if(strcmp((*p)->tableName, tableName) == 0){
+            table = *p;
+            *p = table->next;
+            free(table);
+            __atomic_store_n(&numUpgrading, numUpgrading - 1, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&upgradingLock);
+}
+
+/*
+* finishUpgrade -- 書き直した一時ファイルで、データファイルを置き換える
+*
+* 空き領域マップを消し(次に使うときに作り直させる)、一時ファイル(テーブル名.upg)を
+* データファイルに改名して、置き換えが済んでいないテーブルのリストから取り除く。
+* 圧縮していたデータファイルは、置き換えた後でまた圧縮する。
+* システムカタログに今の形式を記録してから呼ぶこと(途中で止まっても、
+* 一時ファイルが残っていればrecoverUpgrade()がやり直す)。
+* upgradeMutexを取ってから呼ぶこと。
+*
+* 引数:
+*	tableName: テーブル名
+*
+* 返り値:
+*	成功ならOK、失敗ならNG
+*/
+static Result finishUpgrade(char *tableName){
+    char filename[MAX_FILENAME], tmpName[MAX_FILENAME], fsmName[MAX_FILENAME];
+    int compressed;
+
+    sprintf(filename, "%s/%s%s", DB_PATH, tableName, DATA_FILE_EXT);
+    sprintf(tmpName, "%s/%s%s", DB_PATH, tableName, UPGRADE_FILE_EXT);
+    sprintf(fsmName, "%s/%s%s", DB_PATH, tableName, FSM_FILE_EXT);
+    compressed = isFileCompressed(filename);
+
+    if((access(fsmName, F_OK) == 0 && deleteFile(fsmName) != OK)
+       || replaceFile(filename, tmpName) != OK){
+        return NG;
+    }
+
+    /* 今の形式のデータファイルになったので、ほかのセッションが開いてよい */
+    clearUpgrading(tableName);
+
+    if(compressed && setFileCompression(filename, 1) != OK){
+        return NG;
+    }
+
+    return OK;
+}
+
+/*
+* recoverUpgrade -- 途中で止まった書き直しを終わらせるか取り消す
+*
+* upgradeDataFile()は、一時ファイルに書き出してsyncFile()してから、システムカタログに
+* 今の形式を記録することで書き直しを確定させ、最後にデータファイルを置き換える。
+* したがって、一時ファイルが残っていれば、システムカタログが今の形式なら
+* 確定しているのでデータファイルを置き換え、そうでなければ(テーブルが
+* 削除されていた場合を含む)確定していないので一時ファイルを消す。
+* 一時ファイルが残っていなければ、置き換えは済んでいるので、テーブルを
+* upgradingTableから取り除く。
+* upgradeMutexを取ってから呼ぶこと。
+*
+* 引数:
+*	tableName: テーブル名
+*
+* 返り値:
+*	成功(一時ファイルがなかった場合を含む)ならOK、失敗ならNG
+*/
+static Result recoverUpgrade(char *tableName){
+    char tmpName[MAX_FILENAME];
+    TableInfo *tableInfo;
+    int committed = 0;
+
+    /* 一時ファイルがなければ、置き換えは済んでいる */
+    sprintf(tmpName, "%s/%s%s", DB_PATH, tableName, UPGRADE_FILE_EXT);
+    if(access(tmpName, F_OK) != 0){
+        clearUpgrading(tableName);
+        return OK;
+    }
+
+    if((tableInfo = getTableInfo(tableName)) != NULL){
+        committed = (tableInfo->pageFormat == PAGE_FORMAT);
+        freeTableInfo(tableInfo);
+    }
+    if(!committed){
+        clearUpgrading(tableName);
+        return deleteFile(tmpName);
+    }
+
+    /* 置き換え終わるまで、ほかのセッションに古い形式のデータファイルを開かせない */
+    if(setUpgrading(tableName) != OK){
+        return NG;
+    }
+    return finishUpgrade(tableName);
+}
+
 /*
 * initializeDataManipModule -- データ操作モジュールの初期化
 *
+* 古い形式のデータファイルの書き直しが途中で止まっていれば、
+* recoverUpgrade()で終わらせるか取り消す。
+* データ定義モジュールを初期化してから呼ぶこと。
+*
 * 引数:
 *	なし
 *
@@ -19,7 +335,31 @@
 *	成功ならOK、失敗ならNGを返す
 */
 Result initializeDataManipModule(){
-    return OK;
+    DIR *dir;
+    struct dirent *dirEntry;
+    char tableName[MAX_FILENAME];
+    size_t nameLen, extLen = strlen(UPGRADE_FILE_EXT);
+    Result result = OK;
+
+    if((dir = opendir(DB_PATH)) == NULL){
+        return OK;
+    }
+
+    pthread_mutex_lock(&upgradeMutex);
+    while(result == OK && (dirEntry = readdir(dir)) != NULL){
+        nameLen = strlen(dirEntry->d_name);
+        if(nameLen <= extLen || nameLen - extLen >= MAX_FILENAME
+           || strcmp(dirEntry->d_name + nameLen - extLen, UPGRADE_FILE_EXT) != 0){
+            continue;
+        }
+        memcpy(tableName, dirEntry->d_name, nameLen - extLen);
+        tableName[nameLen - extLen] = '\0';
+        result = recoverUpgrade(tableName);
+    }
+    pthread_mutex_unlock(&upgradeMutex);
+
+    closedir(dir);
+    return result;
 }
 
 /*
@@ -35,6 +375,104 @@ Result finalizeDataManipModule(){
     return OK;
 }
 
+/*
+* setTableBackend -- テーブルのページを読む方法の指定
+*
+* BACKEND_MMAPを指定したテーブルは、検索や表示のときにデータファイルを
+* メモリにマップして読む。指定しないテーブルはgetDefaultBackend()に従う。
+*
+* 引数:
+*	tableName: テーブル名
+*	backend: BACKEND_BUFFERまたはBACKEND_MMAP
+*
+* 返り値;
+*	成功ならOK、失敗(指定できるテーブル数を超えた)ならNGを返す
+*/
+Result setTableBackend(char *tableName, fileBackend backend){
+    int i;
+
+    /* すでに指定されていれば上書きする */
+    for (i = 0; i < numTableBackend; i++) {
+        if (strcmp(tableBackend[i].tableName, tableName) == 0) {
+            tableBackend[i].backend = backend;
+            return OK;
+        }
+    }
+
+    if (numTableBackend >= MAX_BACKEND_TABLE) {
+        return NG;
+    }
+
+    strncpy(tableBackend[numTableBackend].tableName, tableName, MAX_FILENAME - 1);
+    tableBackend[numTableBackend].tableName[MAX_FILENAME - 1] = '\0';
+    tableBackend[numTableBackend].backend = backend;
+    numTableBackend++;
+
+    return OK;
+}
+
+/*
+* getTableBackend -- テーブルのページを読む方法の取得
+*
+* 引数:
+*	tableName: テーブル名
+*
+* 返り値;
+*	setTableBackend()で指定されていればその方法、なければgetDefaultBackend()の値
+*/
+fileBackend getTableBackend(char *tableName){
+    int i;
+
+    for (i = 0; i < numTableBackend; i++) {
+        if (strcmp(tableBackend[i].tableName, tableName) == 0) {
+            return tableBackend[i].backend;
+        }
+    }
+
+    return getDefaultBackend();
+}
+
+/*
+* setTableCompression -- テーブルのデータファイルを圧縮するかどうかの指定
+*
+* 圧縮するように指定したテーブルは、データファイルのページを圧縮して格納する
+* (ファイルアクセスモジュールが書き戻すときに圧縮し、読み込むときに展開するので、
+* 挿入、検索、削除はそのまま使える)。指定はデータファイルに残るので、
+* 次に起動したときも有効。圧縮率と圧縮・展開にかかった時間は、
+* printBufferStats()で確かめられる。
+*
+* 引数:
+*	tableName: テーブル名
+*	on: 0でなければ圧縮する、0なら圧縮しない
+*
+* 返り値;
+*	成功ならOK、失敗(データファイルを使っている最中など)ならNGを返す
+*/
+Result setTableCompression(char *tableName, int on){
+    char filename[MAX_FILENAME];
+
+    sprintf(filename, "%s/%s%s", DB_PATH, tableName, DATA_FILE_EXT);
+
+    return setFileCompression(filename, on);
+}
+
+/*
+* isTableCompressed -- テーブルのデータファイルを圧縮しているかどうか
+*
+* 引数:
+*	tableName: テーブル名
+*
+* 返り値;
+*	圧縮していれば1、していなければ0
+*/
+int isTableCompressed(char *tableName){
+    char filename[MAX_FILENAME];
+
+    sprintf(filename, "%s/%s%s", DB_PATH, tableName, DATA_FILE_EXT);
+
+    return isFileCompressed(filename);
+}
+
 /*
 * getRecordSize -- 1レコード分の保存に必要なバイト数の計算
 *
@@ -67,8 +505,6 @@ static int getRecordSize(RecordData *recordData, TableInfo *tableInfo){
                 break;
             default:
                 /* ここにくることはないはず */
-                freeTableInfo(tableInfo);
-                free(recordData);
                 return -1;
         }
 
@@ -78,28 +514,20 @@ static int getRecordSize(RecordData *recordData, TableInfo *tableInfo){
 }
 
 /*
- * createRecordString -- ページに書き込むレコード文字列の作成
+ * writeRecordString -- ページに書き込むレコード文字列を、指定した領域に作る
  *
  * 引数:
  *	tableInfo: レコードを挿入するテーブルの情報
  *	recordData: 挿入するレコードのデータ
+ *	recordString: レコード文字列を書き込む領域(getRecordSize()バイト以上)
  *
  * 返り値:
- *	挿入に成功したらレコード文字列、失敗したらNULLを返す
+ *	成功したらOK、失敗したらNGを返す
  */
-static char* createRecordString(TableInfo *tableInfo, RecordData *recordData, int recordSize){
-    char *recordString;
+static Result writeRecordString(TableInfo *tableInfo, RecordData *recordData, char *recordString){
     char *p;
     int i;
 
-    /* レコードを治めるために必要なバイト数を計算 */
-    recordSize = getRecordSize(recordData, tableInfo);
-
-    /* レコード文字列のメモリの確保 */
-    if((recordString = (char *)malloc(sizeof(char) * recordSize)) == NULL){
-        return NULL; //エラー処理
-    }
-
     /* recordの先頭アドレスををpに代入 */
     p = recordString;
 
@@ -127,129 +555,767 @@ static char* createRecordString(TableInfo *tableInfo, RecordData *recordData, in
                 break;
             default:
                 /* ここにくることはないはず */
-                freeTableInfo(tableInfo);
-                free(recordString);
-                return NULL;
+                return NG;
         }
     }
 
-    return recordString;
+    return OK;
 }
 
 /*
- * readSlotFromPage -- ページからスロットを1つ読み込み
+ * createRecordString -- ページに書き込むレコード文字列の作成
  *
  * 引数:
- *	page: スロットを読み込むページ
- *	n: 先頭から何番目のスロットを読み込むか
+ *	tableInfo: レコードを挿入するテーブルの情報
+ *	recordData: 挿入するレコードのデータ
+ *	recordSize: レコードを収めるために必要なバイト数(getRecordSize()で求めたもの)
  *
  * 返り値:
- *	読み込んだSlot構造体のポインタ。失敗したらNULL
+ *	挿入に成功したらレコード文字列、失敗したらNULLを返す
  */
-static Slot* readSlotFromPage(char *page, int n){
-    Slot *slot;
-    char *p;
+static char* createRecordString(TableInfo *tableInfo, RecordData *recordData, int recordSize){
+    char *recordString;
 
-    if((slot = (Slot*)malloc(sizeof(Slot))) == NULL){
-        return NULL;
+    /* レコード文字列のメモリの確保 */
+    if((recordString = (char *)malloc(sizeof(char) * recordSize)) == NULL){
+        return NULL; //エラー処理
     }
 
-    slot->num = n;
-
-    /* スロットがある位置までポインタをすすめる */
-    p = page;
-    p += sizeof(int) + (sizeof(char) + sizeof(int) + sizeof(int)) * n;
-
-    /* スロットを構造体にコピー */
-    memcpy(&slot->flag, p, sizeof(char));
-    memcpy(&slot->offset, p+sizeof(char), sizeof(int));
-    memcpy(&slot->size, p+sizeof(char)+sizeof(int), sizeof(int));
+    if(writeRecordString(tableInfo, recordData, recordString) != OK){
+        free(recordString);
+        return NULL;
+    }
 
-    return slot;
+    return recordString;
 }
 
 /*
- * writeSlotToPage -- ページにスロットを1つ書き込む
+ * readRecordString -- ページ上のレコード文字列を読んで、レコードのデータにする
  *
  * 引数:
- *	page: スロットを書き込むpage
- *	slot: 書き込むスロットのデータ
+ *	tableInfo: レコードがあるテーブルの情報
+ *	recordString: ページ上のレコード文字列
+ *	recordData: 読んだデータを入れる領域
  *
  * 返り値:
- *	書き込みに成功したらOK、失敗したらNGを返す
+ *	成功したらOK、失敗したらNGを返す
  */
-static Result writeSlotToPage(char *page, Slot *slot){
-    char *p;
-
-    p = page;
-    p += sizeof(int) + (sizeof(char) + sizeof(int) + sizeof(int)) * slot->num;
+static Result readRecordString(TableInfo *tableInfo, char *recordString, RecordData *recordData){
+    char *q = recordString;
+    int stringLen, i;
 
-    memcpy(p, &slot->flag, sizeof(char));
-    memcpy(p+sizeof(char), &slot->offset, sizeof(int));
-    memcpy(p+sizeof(char)+sizeof(int), &slot->size, sizeof(int));
-
-    /*スロットの解放*/
-    free(slot);
+    recordData->numField = tableInfo->numField;
+    recordData->next = NULL;
+    for (i = 0; i < tableInfo->numField; i++) {
+        strcpy(recordData->fieldData[i].name, tableInfo->fieldInfo[i].name);
+        recordData->fieldData[i].dataType = tableInfo->fieldInfo[i].dataType;
+        switch (tableInfo->fieldInfo[i].dataType) {
+            case TYPE_INT:
+                /* 整数の時、そのままコピーしてポインタを進める */
+                memcpy(&recordData->fieldData[i].val.intVal, q, sizeof(int));
+                q += sizeof(int);
+                break;
+            case TYPE_DOUBLE:
+                /* 小数の時、そのままコピーしてポインタを進める */
+                memcpy(&recordData->fieldData[i].val.doubleVal, q, sizeof(double));
+                q += sizeof(double);
+                break;
+            case TYPE_VARCHAR:
+                /* 文字列の時、先頭の文字列の長さを読んでから文字列をコピー */
+                memcpy(&stringLen, q, sizeof(int));
+                q += sizeof(int);
+                strcpy(recordData->fieldData[i].val.stringVal, q);
+                q += stringLen+1; // '\0'の分も進む
+                break;
+            default:
+                /* ここにくることはないはず */
+                return NG;
+        }
+    }
 
     return OK;
 }
 
 /*
- * changeNumSlot -- ページのスロット数記録を変更する
+ * initializePage -- ページの初期化
  *
  * 引数:
- *	page: スロットを書き込むpage
- *	delta: スロット個数の差分
+ *	page: 初期化を行うpage
+ *	pageSize: ページの大きさ(バイト数)
  *
  * 返り値:
- *	書き込みに成功したら変更後の総数、失敗したらNULL
+ *	初期化に成功したらOK, 失敗したらNG
  */
-static int changeNumSlot(char *page, int delta){
-    int num;
+static Result initializePage(char *page, int pageSize){
+    PageHeader *header = PAGE_HEADER(page);
 
-    memcpy(&num, page, sizeof(int));
-    num += delta;
-    memcpy(page, &num, sizeof(int));
+    /* 0埋め */
+    memset(page, 0, pageSize);
 
-    return num;
+    /* スロットはまだなく、ヘッダの後ろからページの末尾までがひと続きの空き */
+    header->numSlot = 0;
+    header->numLive = 0;
+    header->freeOffset = pageSize;
 
+    return OK;
 }
 
+/*
+ * getContiguousFree -- スロットの並びの末尾から空き領域ポインタまでの、ひと続きの空きの大きさ
+ *
+ * 引数:
+ *	page: 調べるページ
+ *
+ * 返り値:
+ *	ひと続きの空きの大きさ(バイト数)
+ */
+static int getContiguousFree(char *page){
+    PageHeader *header = PAGE_HEADER(page);
+
+    return header->freeOffset - (int) (sizeof(PageHeader) + sizeof(Slot) * header->numSlot);
+}
 
 /*
- * initializePage -- ページの初期化
+ * findUnusedSlot -- 使われていないスロット(大きさ0の空きスロット)を探す
+ *
+ * 隣の空きと統合されたスロットは、大きさ0の空きスロットとして残る。
+ * スロットが必要になったときは、スロットの並びを伸ばす前にこれを使い回す。
  *
  * 引数:
- *	page: 初期化を行うpage
+ *	page: 探すページ
+ *	except: 除くスロットの番号
  *
  * 返り値:
- *	初期化に成功したらOK, 失敗したらNG
+ *	見つかったスロットの番号。なければ-1
  */
-static Result initializePage(char *page){
-    int numSlot = 1;
+static int findUnusedSlot(char *page, int except){
     Slot *slot;
+    int j;
 
-    /* メモリの確保 */
-    if((slot = (Slot*)malloc(sizeof(Slot))) == NULL){
+    for (j = 0; j < PAGE_HEADER(page)->numSlot; j++) {
+        slot = PAGE_SLOT(page, j);
+        if(j != except && slot->flag == SLOT_FREE && slot->size == 0){
+            return j;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * getMaxFreeSize -- ページに書き込めるレコードの大きさの上限を調べる
+ *
+ * 削除してできた最大の空きスロットと、ひと続きの空き(使い回せるスロットが
+ * なければ、スロットを1つ足す分を除く)の大きい方。putRecord()は、
+ * これ以下の大きさのレコードなら必ず書き込める。
+ *
+ * 引数:
+ *	page: 調べるページ
+ *
+ * 返り値:
+ *	書き込めるレコードの大きさの上限
+ */
+static int getMaxFreeSize(char *page){
+    Slot *slot;
+    int maxSize, j;
+
+    maxSize = getContiguousFree(page);
+    if(findUnusedSlot(page, -1) < 0){
+        maxSize -= (int) sizeof(Slot);
+    }
+    if(maxSize < 0){
+        maxSize = 0;
+    }
+
+    for (j = 0; j < PAGE_HEADER(page)->numSlot; j++) {
+        slot = PAGE_SLOT(page, j);
+        if(slot->flag == SLOT_FREE && slot->size > maxSize){
+            maxSize = slot->size;
+        }
+    }
+
+    return maxSize;
+}
+
+/*
+ * rebuildFreeSpaceMap -- データファイルを読んで空き領域マップのファイルを作る
+ *
+ * 空き領域マップがない(空き領域マップを作るようになる前に作った)テーブルで使う。
+ * fsmMutexを取ってから呼ぶこと。
+ *
+ * 引数:
+ *	fsmName: 空き領域マップのファイル名
+ *	file: データファイル
+ *	pageSize: ページの大きさ
+ *	numPage: データファイルのページ数(pageSizeを単位とする)
+ *
+ * 返り値:
+ *	成功ならOK、失敗ならNG
+ */
+static Result rebuildFreeSpaceMap(char *fsmName, File *file, int pageSize, int numPage){
+    File *fsm;
+    FsmEntry *entry;
+    FsmEntry root[FSM_NUM_ENTRY];
+    char *page;
+    int numLeaf, i, j;
+    Result result = OK;
+
+    /* 空き領域マップで表せるページの分だけ、各ページの空きを調べる */
+    if(numPage > FSM_MAX_LEAF * FSM_NUM_ENTRY){
+        numPage = FSM_MAX_LEAF * FSM_NUM_ENTRY;
+    }
+    numLeaf = (numPage + FSM_NUM_ENTRY - 1) / FSM_NUM_ENTRY;
+    if((entry = (FsmEntry*)calloc((size_t) numLeaf * FSM_NUM_ENTRY + 1, sizeof(FsmEntry))) == NULL){
         return NG;
     }
+    for (i = 0; i < numPage; i++) {
+        if((page = latchBlock(file, i, pageSize, LATCH_SHARED)) == NULL){
+            free(entry);
+            return NG;
+        }
+        entry[i] = (FsmEntry) getMaxFreeSize(page);
+        unlatchBlock(page, pageSize, UNMODIFIED);
+    }
 
-    /* 0埋め */
-    memset(page, 0, PAGE_SIZE);
+    if(createFile(fsmName) != OK || (fsm = openFile(fsmName)) == NULL){
+        free(entry);
+        return NG;
+    }
 
-    /* 先頭にスロット数を書き込み */
-    memcpy(page, &numSlot, sizeof(int));
+    /* 根: 葉ごとの最大値 */
+    memset(root, 0, PAGE_SIZE);
+    for (i = 0; i < numLeaf; i++) {
+        for (j = 0; j < FSM_NUM_ENTRY; j++) {
+            if(root[i] < entry[i * FSM_NUM_ENTRY + j]){
+                root[i] = entry[i * FSM_NUM_ENTRY + j];
+            }
+        }
+    }
+    result = writePage(fsm, 0, (char*) root);
 
-    /* 一個目のスロットの構造体を用意 */
-    slot->num = 0;
-    slot->flag = 0;
-    slot->offset = sizeof(int) + (sizeof(char) + sizeof(int) * 2);
-    slot->size = PAGE_SIZE - slot->offset;
-    /* スロットの書き込み */
-    if(writeSlotToPage(page, slot) != OK){
+    /* 葉 */
+    for (i = 0; i < numLeaf && result == OK; i++) {
+        result = writePage(fsm, i + 1, (char*) (entry + (size_t) i * FSM_NUM_ENTRY));
+    }
+
+    free(entry);
+    if(closeFile(fsm) != OK){
         return NG;
     }
 
+    return result;
+}
+
+/*
+ * openFreeSpaceMap -- テーブルの空き領域マップのファイルを開く
+ *
+ * 空き領域マップのファイル(テーブル名.fsm)がなければ、データファイルを読んで作る。
+ *
+ * 引数:
+ *	tableName: テーブル名
+ *	file: テーブルのデータファイル
+ *	pageSize: ページの大きさ
+ *	numPage: データファイルのページ数(pageSizeを単位とする)
+ *
+ * 返り値:
+ *	空き領域マップのファイルのFile構造体。失敗したらNULL
+ *
+ * ***注意***
+ *	使い終わったら、closeFileで閉じること。
+ */
+static File *openFreeSpaceMap(char *tableName, File *file, int pageSize, int numPage){
+    char fsmName[MAX_FILENAME];
+    File *fsm;
+
+    sprintf(fsmName, "%s/%s%s", DB_PATH, tableName, FSM_FILE_EXT);
+    if((fsm = openFile(fsmName)) != NULL){
+        return fsm;
+    }
+
+    pthread_mutex_lock(&fsmMutex);
+    if(access(fsmName, F_OK) != 0 && rebuildFreeSpaceMap(fsmName, file, pageSize, numPage) != OK){
+        pthread_mutex_unlock(&fsmMutex);
+        return NULL;
+    }
+    pthread_mutex_unlock(&fsmMutex);
+
+    return openFile(fsmName);
+}
+
+/*
+ * setFreeSpace -- 空き領域マップにページの空きを記録する
+ *
+ * 葉の項目を書き換え、根にある葉の最大値も合わせて直す。
+ * 葉のページがまだなければ、0で埋めたページを足す。
+ * 葉と根のラッチは同時には取らず(バッファが少なくても動くように)、
+ * 代わりにfsmMutexで更新どうしを順に並べる。
+ *
+ * 引数:
+ *	fsm: 空き領域マップのファイル
+ *	pageNum: データファイルのページ番号(テーブルのページの大きさを単位とする)
+ *	freeSize: ページの中で最大の空きスロットの大きさ
+ *
+ * 返り値:
+ *	成功ならOK、失敗ならNG
+ */
+static Result setFreeSpace(File *fsm, int pageNum, int freeSize){
+    char zeroPage[PAGE_SIZE];
+    FsmEntry *leaf, *root;
+    int leafNum, numMapPage, maxSize, oldSize, j;
+
+    /* 空き領域マップで表せないページは記録しない */
+    leafNum = pageNum / FSM_NUM_ENTRY + 1;
+    if(pageNum < 0 || leafNum > FSM_MAX_LEAF){
+        return OK;
+    }
+    if(freeSize < 0){
+        freeSize = 0;
+    }
+
+    pthread_mutex_lock(&fsmMutex);
+
+    /* 葉のページがなければ足す */
+    memset(zeroPage, 0, PAGE_SIZE);
+    for (numMapPage = getNumPages(fsm->name); numMapPage <= leafNum; numMapPage++) {
+        if(writePage(fsm, numMapPage, zeroPage) != OK){
+            pthread_mutex_unlock(&fsmMutex);
+            return NG;
+        }
+    }
+
+    /* 葉を書き換え、葉の中の最大値を求める */
+    if((leaf = (FsmEntry*) latchPage(fsm, leafNum, LATCH_EXCLUSIVE)) == NULL){
+        pthread_mutex_unlock(&fsmMutex);
+        return NG;
+    }
+    oldSize = leaf[pageNum % FSM_NUM_ENTRY];
+    if(oldSize == freeSize){
+        unlatchPage((char*) leaf, UNMODIFIED);
+        pthread_mutex_unlock(&fsmMutex);
+        return OK;
+    }
+    leaf[pageNum % FSM_NUM_ENTRY] = (FsmEntry) freeSize;
+    maxSize = 0;
+    for (j = 0; j < FSM_NUM_ENTRY; j++) {
+        if(leaf[j] > maxSize){
+            maxSize = leaf[j];
+        }
+    }
+    unlatchPage((char*) leaf, MODIFIED);
+
+    /* 根にある葉の最大値を直す */
+    if((root = (FsmEntry*) latchPage(fsm, 0, LATCH_EXCLUSIVE)) == NULL){
+        pthread_mutex_unlock(&fsmMutex);
+        return NG;
+    }
+    root[leafNum - 1] = (FsmEntry) maxSize;
+    unlatchPage((char*) root, MODIFIED);
+
+    pthread_mutex_unlock(&fsmMutex);
+
+    return OK;
+}
+
+/*
+ * searchFreeSpace -- 空き領域マップから、必要な空きがあるページを探す
+ *
+ * 根で空きがある葉を探し、その葉の中でページを探す(ふつうは2ページ読むだけで済む)。
+ *
+ * 引数:
+ *	fsm: 空き領域マップのファイル
+ *	size: 必要な空きの大きさ
+ *
+ * 返り値:
+ *	見つかったページのページ番号(テーブルのページの大きさを単位とする)。
+ *	なければ-1
+ */
+static int searchFreeSpace(File *fsm, int size){
+    FsmEntry *root, *leaf;
+    int numLeaf, leafNum, pageNum, j;
+
+    if((numLeaf = getNumPages(fsm->name) - 1) > FSM_MAX_LEAF){
+        numLeaf = FSM_MAX_LEAF;
+    }
+
+    for (leafNum = 1; leafNum <= numLeaf; leafNum++) {
+        /* 根で、空きがある葉を探す */
+        if((root = (FsmEntry*) latchPage(fsm, 0, LATCH_SHARED)) == NULL){
+            return -1;
+        }
+        while (leafNum <= numLeaf && root[leafNum - 1] < size) {
+            leafNum++;
+        }
+        unlatchPage((char*) root, UNMODIFIED);
+        if(leafNum > numLeaf){
+            break;
+        }
+
+        /* 葉の中で、空きがあるページを探す */
+        if((leaf = (FsmEntry*) latchPage(fsm, leafNum, LATCH_SHARED)) == NULL){
+            return -1;
+        }
+        pageNum = -1;
+        for (j = 0; j < FSM_NUM_ENTRY; j++) {
+            if(leaf[j] >= size){
+                pageNum = (leafNum - 1) * FSM_NUM_ENTRY + j;
+                break;
+            }
+        }
+        unlatchPage((char*) leaf, UNMODIFIED);
+        if(pageNum >= 0){
+            return pageNum;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * putRecord -- ページにレコードを書き込む
+ *
+ * 削除してできた空きスロットのうち、最初に収まるものがあれば、その領域の後ろに
+ * 詰めて書き込み、残った空きは使われていないスロット(なければスロットの並びの
+ * 末尾に足したスロット)で表す。スロットを足す余裕がなければ、残りはページを
+ * 詰め直すまで使わない。収まる空きスロットがなければ、ひと続きの空きの末尾に
+ * 書き込んで、空き領域ポインタを前に進める。
+ *
+ * 引数:
+ *	page: レコードを書き込むページ
+ *	recordString: 書き込むレコード
+ *	recordSize: レコードの大きさ
+ *
+ * 返り値:
+ *	書き込んだスロットの番号。収まらなければ-1
+ */
+static int putRecord(char *page, char *recordString, int recordSize){
+    PageHeader *header = PAGE_HEADER(page);
+    Slot *slot, *rest;
+    int numFree, restSize, n, j;
+
+    numFree = getContiguousFree(page);
+
+    /* 削除してできた空きスロットに、後ろから詰めて書き込む */
+    for (j = 0; j < header->numSlot; j++) {
+        slot = PAGE_SLOT(page, j);
+        if(slot->flag != SLOT_FREE || slot->size == 0 || slot->size < recordSize){
+            continue;
+        }
+
+        restSize = slot->size - recordSize;
+        memcpy(page + slot->offset + restSize, recordString, recordSize);
+
+        /* 残った空きを表すスロットを用意する */
+        if(restSize > 0){
+            if((n = findUnusedSlot(page, j)) < 0 && numFree >= (int) sizeof(Slot)){
+                n = header->numSlot++;
+            }
+            if(n >= 0){
+                rest = PAGE_SLOT(page, n);
+                rest->flag = SLOT_FREE;
+                rest->offset = slot->offset;
+                rest->size = restSize;
+            }
+        }
+
+        slot->flag = SLOT_USED;
+        slot->offset += restSize;
+        slot->size = recordSize;
+        header->numLive++;
+        return j;
+    }
+
+    /* ひと続きの空きの末尾に書き込む(スロットを足すなら、その分の空きも要る) */
+    if((n = findUnusedSlot(page, -1)) < 0){
+        n = header->numSlot;
+        numFree -= (int) sizeof(Slot);
+    }
+    if(numFree < recordSize){
+        return -1;
+    }
+    if(n == header->numSlot){
+        header->numSlot++;
+    }
+
+    header->freeOffset -= recordSize;
+    memcpy(page + header->freeOffset, recordString, recordSize);
+
+    slot = PAGE_SLOT(page, n);
+    slot->flag = SLOT_USED;
+    slot->offset = header->freeOffset;
+    slot->size = recordSize;
+    header->numLive++;
+
+    return n;
+}
+
+/*
+ * freeSlot -- スロットのレコードを消し、隣り合う空きとまとめる
+ *
+ * 領域が前の空きスロットに続いていればそちらに含め、後ろの空きスロットが
+ * 続いていればそれを含める。含められた方のスロットは使われていないスロット
+ * (大きさ0の空きスロット)になり、findUnusedSlotで使い回される。
+ * まとめた空きが空き領域ポインタの位置にあれば、ひと続きの空きに含める。
+ * 最後に、スロットの並びの末尾にある使われていないスロットを回収する
+ * (レコードが入っているスロットの番号は変えない)。
+ *
+ * 引数:
+ *	page: スロットがあるページ
+ *	n: レコードを消すスロットの番号
+ *
+ * 返り値:
+ *	なし
+ */
+static void freeSlot(char *page, int n){
+    PageHeader *header = PAGE_HEADER(page);
+    Slot *freed, *other;
+    int j;
+
+    /* 0埋めして、空きスロットにする */
+    freed = PAGE_SLOT(page, n);
+    memset(page + freed->offset, 0, freed->size);
+    freed->flag = SLOT_FREE;
+    header->numLive--;
+
+    /* 隣り合う空きスロットとまとめる */
+    for (j = 0; j < header->numSlot; j++) {
+        other = PAGE_SLOT(page, j);
+        if(other == freed || other->flag != SLOT_FREE || other->size == 0){
+            continue;
+        }
+
+        if(other->offset + other->size == freed->offset){
+            /* 前の空きに続いているので、前の空きに含める */
+            other->size += freed->size;
+            freed->offset = 0;
+            freed->size = 0;
+            freed = other;
+        }else if(freed->offset + freed->size == other->offset){
+            /* 後ろの空きを含める */
+            freed->size += other->size;
+            other->offset = 0;
+            other->size = 0;
+        }
+    }
+
+    /* ひと続きの空きに接していれば、空き領域ポインタを戻してそちらに含める */
+    if(freed->offset == header->freeOffset){
+        header->freeOffset += freed->size;
+        freed->offset = 0;
+        freed->size = 0;
+    }
+
+    /* 末尾の使われていないスロットを回収する */
+    while (header->numSlot > 0) {
+        other = PAGE_SLOT(page, header->numSlot - 1);
+        if(other->flag != SLOT_FREE || other->size != 0){
+            break;
+        }
+        memset(other, 0, sizeof(Slot));
+        header->numSlot--;
+    }
+}
+
+/*
+ * compactPage -- ページを詰め直す
+ *
+ * 使われているレコードをページの末尾に詰めて空きを1か所にまとめ、
+ * 最後に使われているスロットより後ろのスロットを回収する。
+ * 使われているスロットの番号は変えない。
+ * 使われているレコードが1つもなければ、ページを初期化する。
+ *
+ * 引数:
+ *	page: 詰め直すページ
+ *	pageSize: ページの大きさ
+ *
+ * 返り値:
+ *	成功したらOK、失敗したらNG
+ */
+static Result compactPage(char *page, int pageSize){
+    int work[MAX_PAGE_SIZE / sizeof(int)]; //intの境界にそろえる
+    char *copy = (char *) work;
+    PageHeader *header = PAGE_HEADER(page);
+    Slot *from, *to;
+    int numSlot, end, j;
+
+    /* 最後に使われているスロットを探す */
+    numSlot = 0;
+    for (j = 0; j < header->numSlot; j++) {
+        if(PAGE_SLOT(page, j)->flag == SLOT_USED){
+            numSlot = j + 1;
+        }
+    }
+    if(numSlot == 0){
+        return initializePage(page, pageSize);
+    }
+
+    /* 作業用の領域に写してから、使われているレコードを後ろから詰めて書き戻す */
+    memcpy(copy, page, pageSize);
+    memset(page, 0, pageSize);
+    end = pageSize;
+    for (j = 0; j < numSlot; j++) {
+        from = PAGE_SLOT(copy, j);
+        to = PAGE_SLOT(page, j);
+        if(from->flag == SLOT_USED){
+            end -= from->size;
+            memcpy(page + end, copy + from->offset, from->size);
+            to->flag = SLOT_USED;
+            to->offset = end;
+            to->size = from->size;
+        }
+    }
+
+    header->numSlot = numSlot;
+    header->numLive = PAGE_HEADER(copy)->numLive;
+    header->freeOffset = end;
+
+    return OK;
+}
+
+/*
+ * needsCompaction -- ページを詰め直すべきかどうかを調べる
+ *
+ * 最大の空き以外の空き(細切れの空きと、使われていないスロット)が
+ * ページの1/COMPACT_FRAGMENT_RATIO以上になったか、レコードが1つもなくなったら
+ * 詰め直す。
+ *
+ * 引数:
+ *	page: 調べるページ
+ *	pageSize: ページの大きさ
+ *
+ * 返り値:
+ *	詰め直すべきなら1、そうでなければ0
+ */
+static int needsCompaction(char *page, int pageSize){
+    Slot *slot;
+    int totalFree, maxFree, j;
+
+    if(PAGE_HEADER(page)->numLive == 0){
+        return 1;
+    }
+
+    totalFree = maxFree = getContiguousFree(page);
+    for (j = 0; j < PAGE_HEADER(page)->numSlot; j++) {
+        slot = PAGE_SLOT(page, j);
+        if(slot->flag != SLOT_FREE){
+            continue;
+        }
+        if(slot->size == 0){
+            /* 使われていないスロットも、細切れの空きとして数える */
+            totalFree += sizeof(Slot);
+        }else{
+            totalFree += slot->size;
+            if(slot->size > maxFree){
+                maxFree = slot->size;
+            }
+        }
+    }
+
+    return (totalFree - maxFree) * COMPACT_FRAGMENT_RATIO >= pageSize;
+}
+
+/*
+ * putRecordInFreeSpace -- 空き領域マップで空きがあるページを探して、レコードを書き込む
+ *
+ * 引数:
+ *	file: データファイル
+ *	fsm: 空き領域マップ
+ *	pageSize: テーブルのページの大きさ
+ *	recordString: 書き込むレコード
+ *	recordSize: レコードの大きさ
+ *	inserted: 書き込めたら1、空きがあるページがなければ0を入れる
+ *	recordId: 書き込めたら、書き込んだ番地を入れる(NULLなら入れない)
+ *
+ * 返り値:
+ *	成功ならOK(空きがあるページがなかった場合を含む)、失敗ならNGを返す
+ */
+static Result putRecordInFreeSpace(File *file, File *fsm, int pageSize, char *recordString, int recordSize,
+                                   int *inserted, RecordId *recordId){
+    int numPage, maxSize, slotNum, i;
+    char *p; //バッファ上のページのポインタ
+
+    *inserted = 0;
+
+    /* データファイルのページ数(テーブルのページの大きさを単位とする)を調べる */
+    if((numPage = getNumPages(file->name)) < 0){
+        return NG;
+    }
+    numPage /= pageSize / PAGE_SIZE;
+
+    while ((i = searchFreeSpace(fsm, recordSize)) >= 0) {
+
+        /*
+         * データファイルにないページが記録されていたら、空きなしに直す
+         * (探している間にほかのセッションが書き足したページかもしれないので、ページ数を調べ直す)
+         */
+        if (i >= numPage) {
+            if((numPage = getNumPages(file->name)) < 0){
+                return NG;
+            }
+            numPage /= pageSize / PAGE_SIZE;
+        }
+        if (i >= numPage) {
+            if (setFreeSpace(fsm, i, 0) != OK) {
+                break;
+            }
+            continue;
+        }
+
+        /* 1ページ分のデータを書き込み用のラッチを取って参照する(PAGE_SIZEならバッファを直接参照する) */
+        if ((p = latchBlock(file, i, pageSize, LATCH_EXCLUSIVE)) == NULL) {
+            return NG;
+        }
+
+        /* 十分な空きがあったら後ろから詰めてrecordを書き込み */
+        slotNum = putRecord(p, recordString, recordSize);
+        *inserted = (slotNum >= 0);
+
+        /* ページに残った空きを空き領域マップに記録する(記録より空きが少なかった場合も直す) */
+        maxSize = getMaxFreeSize(p);
+        if(unlatchBlock(p, pageSize, *inserted ? MODIFIED : UNMODIFIED) != OK){
+            *inserted = 0;
+            return NG;
+        }
+        if(setFreeSpace(fsm, i, maxSize) != OK && !*inserted){
+            break;
+        }
+
+        if(*inserted){
+            if(recordId != NULL){
+                recordId->pageNum = i;
+                recordId->slotNum = slotNum;
+            }
+            return OK;
+        }
+    }/* ページ繰り返し */
+
+    return OK;
+}
+
+/*
+ * appendPage -- 新しいページをデータファイルの末尾に追加し、空き領域マップに記録する
+ *
+ * 引数:
+ *	file: データファイル
+ *	fsm: 空き領域マップ
+ *	pageSize: テーブルのページの大きさ
+ *	page: 追加するページ
+ *	pageNum: 追加したページの番号を入れる(NULLなら入れない)
+ *
+ * 返り値:
+ *	成功ならOK、失敗ならNGを返す
+ */
+static Result appendPage(File *file, File *fsm, int pageSize, char *page, int *pageNum){
+    int blockNum;
+
+    /* ページ番号はappendBlock()が決める(同時に書き足すセッションとは重ならない) */
+    if((blockNum = appendBlock(file, pageSize, page)) < 0
+       || setFreeSpace(fsm, blockNum, getMaxFreeSize(page)) != OK){
+        return NG;
+    }
+    if(pageNum != NULL){
+        *pageNum = blockNum;
+    }
+
     return OK;
 }
 
@@ -259,177 +1325,634 @@ static Result initializePage(char *page){
 * 引数:
 *	tableName: レコードを挿入するテーブルの名前
 *	recordData: 挿入するレコードのデータ
+*	recordId: 挿入したレコードの番地を入れる領域(NULLなら入れない)
 *
 * 返り値:
 *	挿入に成功したらOK、失敗したらNGを返す
 */
-Result insertRecord(char *tableName, RecordData *recordData){
+Result insertRecord(char *tableName, RecordData *recordData, RecordId *recordId){
     assert(strcmp(tableName, "") != 0);
     assert(recordData != NULL);
 
     TableInfo *tableInfo;
     char *recordString;
     char filename[MAX_FILENAME];
-    File *file;
-    int numPage;
-    char page[PAGE_SIZE];
-    int recordSize;
-    int numSlot;
-    Slot *slot;
-    int i,j;
-    char *q; //pageのポインタ
+    File *file, *fsm;
+    int numPage, pageSize;
+    int newPage[MAX_PAGE_SIZE / sizeof(int)]; //intの境界にそろえる
+    char *page = (char *) newPage;
+    int recordSize, inserted, slotNum;
 
     /*テーブル情報の取得*/
     if((tableInfo = getTableInfo(tableName)) == NULL){
         return NG; //エラー処理
     }
 
+    /* 古い形式のデータファイルなら、今の形式に書き直す */
+    if(upgradeDataFile(tableName, tableInfo) != OK){
+        freeTableInfo(tableInfo);
+        return NG;
+    }
+
     if((recordSize = getRecordSize(recordData, tableInfo)) < 0){
+        freeTableInfo(tableInfo);
+        return NG;
+    }
+
+    /* 空のページに収まらない大きさのレコードは挿入できない */
+    if(recordSize > tableInfo->pageSize - (int)(sizeof(PageHeader) + sizeof(Slot))){
+        freeTableInfo(tableInfo);
         return NG;
     }
 
     if((recordString = createRecordString(tableInfo, recordData, recordSize)) == NULL){
+        freeTableInfo(tableInfo);
         return NG;
     }
 
     /* ファイルオープン */
     sprintf(filename, "%s/%s%s", DB_PATH, tableName, DATA_FILE_EXT);
     if((file = openFile(filename)) == NULL){
-        free(tableInfo);
+        freeTableInfo(tableInfo);
         free(recordString); //エラー処理
         return NG;
     }
 
-    /* データファイルのページ数を調べる */
+    /* データファイルのページ数(テーブルのページの大きさを単位とする)を調べる */
+    pageSize = tableInfo->pageSize;
     if((numPage = getNumPages(filename)) < 0){
-        free(tableInfo);
+        freeTableInfo(tableInfo);
         free(recordString); //エラー処理
         closeFile(file);
         return NG;
     }
+    numPage /= pageSize / PAGE_SIZE;
 
-    /* ページごとにデータを挿入できる空きを探す */
-    for (i = 0; i < numPage; i++) {
+    /* 空き領域マップを開く */
+    if((fsm = openFreeSpaceMap(tableName, file, pageSize, numPage)) == NULL){
+        freeTableInfo(tableInfo);
+        free(recordString); //エラー処理
+        closeFile(file);
+        return NG;
+    }
 
-        /* 1ページ分のデータを読み込む */
-        if (readPage(file, i, page) != OK) {
-            free(tableInfo);
-            free(recordString); //エラー処理
-            closeFile(file);
+    /* 空きがあるページを探して書き込み、なかったら新規ページを作成して末尾に追加 */
+    if(putRecordInFreeSpace(file, fsm, pageSize, recordString, recordSize, &inserted, recordId) != OK
+       || (!inserted && (initializePage(page, pageSize) != OK
+                         || (slotNum = putRecord(page, recordString, recordSize)) < 0
+                         || appendPage(file, fsm, pageSize, page,
+                                       recordId != NULL ? &recordId->pageNum : NULL) != OK))){
+        freeTableInfo(tableInfo);
+        free(recordString);
+        closeFile(fsm);
+        closeFile(file);
+        return NG;
+    }
+
+    if(!inserted && recordId != NULL){
+        recordId->slotNum = slotNum;
+    }
+
+    freeTableInfo(tableInfo);
+    free(recordString);
+    if(closeFile(fsm) != OK || closeFile(file) != OK){
+        return NG;
+    }
+
+    return OK;
+}
+
+/*
+* insertRecords -- レコードをまとめて挿入する
+*
+* beginBulkInsert()、bulkInsertRecord()、endBulkInsert()で挿入する。
+* データ定義情報の取得とファイルのオープンは1回で済み、新しいページには
+* 1ページ分のレコードを詰めてから書き込む。
+*
+* 引数:
+*	tableName: レコードを挿入するテーブルの名前
+*	recordData: 挿入するレコードのリストの先頭(nextでつないだもの)
+*	numRecord: 挿入するレコードの数(リストがそれより短ければ、リストの末尾まで)
+*
+* 返り値:
+*	すべて挿入できたらOK、失敗したらNGを返す
+*	(失敗したときも、それまでのレコードは挿入したままにする)
+*/
+Result insertRecords(char *tableName, RecordData *recordData, int numRecord){
+    BulkInsert *bulk;
+    Result result = OK;
+    int i;
+
+    if((bulk = beginBulkInsert(tableName)) == NULL){
+        return NG;
+    }
+
+    for (i = 0; i < numRecord && recordData != NULL; i++, recordData = recordData->next) {
+        if(bulkInsertRecord(bulk, recordData) != OK){
+            result = NG;
+            break;
+        }
+    }
+
+    if(endBulkInsert(bulk) != OK){
+        result = NG;
+    }
+
+    return result;
+}
+
+/*
+* beginBulkInsert -- まとめて挿入するセッションを始める
+*
+* データ定義情報を取得してデータファイルと空き領域マップを開き、
+* endBulkInsert()まで開いたままにする。
+*
+* 引数:
+*	tableName: レコードを挿入するテーブルの名前
+*
+* 返り値:
+*	セッション。失敗したらNULLを返す
+*/
+BulkInsert *beginBulkInsert(char *tableName){
+    BulkInsert *bulk;
+    char filename[MAX_FILENAME];
+    int numPage;
+
+    if((bulk = (BulkInsert *) malloc(sizeof(BulkInsert))) == NULL){
+        return NULL;
+    }
+    bulk->hasPage = 0;
+
+    /*テーブル情報の取得と、古い形式のデータファイルの書き直し*/
+    if((bulk->tableInfo = getTableInfo(tableName)) == NULL){
+        free(bulk);
+        return NULL;
+    }
+    if(upgradeDataFile(tableName, bulk->tableInfo) != OK){
+        freeTableInfo(bulk->tableInfo);
+        free(bulk);
+        return NULL;
+    }
+    bulk->pageSize = bulk->tableInfo->pageSize;
+
+    /* データファイルと空き領域マップを開く */
+    sprintf(filename, "%s/%s%s", DB_PATH, tableName, DATA_FILE_EXT);
+    if((bulk->file = openFile(filename)) == NULL){
+        freeTableInfo(bulk->tableInfo);
+        free(bulk);
+        return NULL;
+    }
+    if((numPage = getNumPages(filename)) < 0
+       || (bulk->fsm = openFreeSpaceMap(tableName, bulk->file, bulk->pageSize,
+                                        numPage / (bulk->pageSize / PAGE_SIZE))) == NULL){
+        closeFile(bulk->file);
+        freeTableInfo(bulk->tableInfo);
+        free(bulk);
+        return NULL;
+    }
+
+    return bulk;
+}
+
+/*
+* bulkInsertRecord -- まとめて挿入するセッションで、レコードを1つ挿入する
+*
+* 詰めている途中の新しいページに入ればそこに書き込む。入らなければ空き領域マップで
+* 空きがあるページを探し、それもなければ詰めていたページをデータファイルの
+* 末尾に追加して、次の新しいページに詰め始める。
+*
+* 引数:
+*	bulk: beginBulkInsert()が返したセッション
+*	recordData: 挿入するレコードのデータ
+*
+* 返り値:
+*	挿入に成功したらOK、失敗したらNGを返す
+*
+* ***注意***
+*	詰めている途中のページのレコードは、データファイルに追加するまで検索できない。
+*/
+Result bulkInsertRecord(BulkInsert *bulk, RecordData *recordData){
+    assert(bulk != NULL);
+    assert(recordData != NULL);
+
+    char *page = (char *) bulk->newPage;
+    char *recordString;
+    int recordSize, inserted;
+
+    /* 空のページに収まらない大きさのレコードは挿入できない */
+    if((recordSize = getRecordSize(recordData, bulk->tableInfo)) < 0
+       || recordSize > bulk->pageSize - (int)(sizeof(PageHeader) + sizeof(Slot))){
+        return NG;
+    }
+
+    if((recordString = createRecordString(bulk->tableInfo, recordData, recordSize)) == NULL){
+        return NG;
+    }
+
+    /* 詰めている途中のページに入れる */
+    if(bulk->hasPage && putRecord(page, recordString, recordSize) >= 0){
+        free(recordString);
+        return OK;
+    }
+
+    /* 空き領域マップで空きがあるページを探して書き込む */
+    if(putRecordInFreeSpace(bulk->file, bulk->fsm, bulk->pageSize, recordString, recordSize, &inserted, NULL) != OK){
+        free(recordString);
+        return NG;
+    }
+
+    /* なければ、詰めていたページを追加して、新しいページに詰め始める */
+    if(!inserted){
+        if((bulk->hasPage && appendPage(bulk->file, bulk->fsm, bulk->pageSize, page, NULL) != OK)
+           || initializePage(page, bulk->pageSize) != OK){
+            bulk->hasPage = 0;
+            free(recordString);
             return NG;
         }
+        bulk->hasPage = 1;
+        putRecord(page, recordString, recordSize);
+    }
 
-        /* スロット個数を読み込む */
-        memcpy(&numSlot, page, sizeof(int));
-        q = page + sizeof(int);
+    free(recordString);
+    return OK;
+}
 
-        /* スロットを見て空きを探す */
-        for (j=0; j<numSlot; ++j) {
+/*
+* endBulkInsert -- まとめて挿入するセッションを終える
+*
+* 詰めている途中のページをデータファイルの末尾に追加し、ファイルを閉じて
+* セッションを解放する。
+*
+* 引数:
+*	bulk: beginBulkInsert()が返したセッション
+*
+* 返り値:
+*	成功したらOK、失敗したらNGを返す
+*/
+Result endBulkInsert(BulkInsert *bulk){
+    Result result = OK;
+
+    if(bulk->hasPage && appendPage(bulk->file, bulk->fsm, bulk->pageSize, (char *) bulk->newPage, NULL) != OK){
+        result = NG;
+    }
+
+    if(closeFile(bulk->fsm) != OK){
+        result = NG;
+    }
+    if(closeFile(bulk->file) != OK){
+        result = NG;
+    }
+    freeTableInfo(bulk->tableInfo);
+    free(bulk);
+
+    return result;
+}
+
+/*
+ * flushCopyRun -- copyRecords()で詰めたページを、データファイルの末尾にまとめて書き足す
+ *
+ * 詰めている途中のページも、レコードがあれば書き足す。書き足したページの空きは
+ * 空き領域マップに記録する。
+ *
+ * 引数:
+ *	load: ページを詰めている状態
+ *
+ * 返り値:
+ *	成功したらOK、失敗したらNGを返す
+ */
+static Result flushCopyRun(CopyLoad *load){
+    int ratio = load->pageSize / PAGE_SIZE;
+    int numPage, pageNum, i;
 
-            if((slot = readSlotFromPage(page, j)) == NULL){
-                free(tableInfo);
-                free(recordString); //エラー処理
-                closeFile(file);
+    numPage = load->curPage;
+    if(PAGE_HEADER(load->run + (size_t) load->curPage * load->pageSize)->numLive > 0){
+        numPage++;
+    }
+    if(numPage == 0){
+        return OK;
+    }
+
+    /* データファイルの末尾に1回で書き足す(書き足す位置はappendPages()が決める) */
+    if((pageNum = appendPages(load->file, numPage * ratio, ratio, load->run)) < 0){
+        return NG;
+    }
+    for (i = 0; i < numPage; i++) {
+        if(setFreeSpace(load->fsm, pageNum / ratio + i,
+                        getMaxFreeSize(load->run + (size_t) i * load->pageSize)) != OK){
+            return NG;
+        }
+    }
+    load->stats->numPage += numPage;
+
+    load->curPage = 0;
+    return initializePage(load->run, load->pageSize);
+}
+
+/*
+ * copyRecord -- copyRecords()で読んだ1行を、詰めているページに書き込む
+ *
+ * 数値のフィールドは、読んだ文字列を数値に変換する。ページがいっぱいなら次のページに
+ * 詰め始め、書き足す領域がいっぱいならflushCopyRun()で書き足す。
+ *
+ * 引数:
+ *	load: ページを詰めている状態
+ *	record: 読んだ行(どのフィールドも文字列としてstringValに入っている)
+ *
+ * 返り値:
+ *	成功したらOK、失敗したら(値が不正な場合を含む)NGを返す
+ */
+static Result copyRecord(CopyLoad *load, RecordData *record){
+    int work[MAX_PAGE_SIZE / sizeof(int)]; //intの境界にそろえる
+    char *recordString = (char *) work;
+    FieldData *field;
+    char *endp;
+    long intNum;
+    double doubleNum;
+    int recordSize, i;
+
+    /* 数値のフィールドを変換する */
+    for (i = 0; i < record->numField; i++) {
+        field = &record->fieldData[i];
+        if(field->dataType == TYPE_INT){
+            intNum = strtol(field->val.stringVal, &endp, 10);
+            if(field->val.stringVal[0] == '\0' || *endp != '\0' || intNum < INT_MIN || intNum > INT_MAX){
+                return NG;
+            }
+            field->val.intVal = (int) intNum;
+        }else if(field->dataType == TYPE_DOUBLE){
+            doubleNum = strtod(field->val.stringVal, &endp);
+            if(field->val.stringVal[0] == '\0' || *endp != '\0' || doubleNum == -HUGE_VAL || doubleNum == HUGE_VAL){
                 return NG;
             }
+            field->val.doubleVal = doubleNum;
+        }
+    }
 
-            /* 十分な空きがあったら後ろから詰めてrecordを書き込み */
-            if(slot->flag == 0 && slot->size >= recordSize){
-                memcpy(page + slot->offset + slot->size - recordSize, recordString, recordSize);
+    /* insertRecord()と同じ形式のレコード文字列にする */
+    if((recordSize = getRecordSize(record, load->tableInfo)) < 0
+       || recordSize > load->pageSize - (int)(sizeof(PageHeader) + sizeof(Slot))
+       || writeRecordString(load->tableInfo, record, recordString) != OK){
+        return NG;
+    }
+
+    /* 詰めているページに入らなければ、次のページに詰め始める */
+    if(putRecord(load->run + (size_t) load->curPage * load->pageSize, recordString, recordSize) < 0){
+        if(load->curPage + 1 == load->numRunPage){
+            if(flushCopyRun(load) != OK){
+                return NG;
+            }
+        }else{
+            load->curPage++;
+            initializePage(load->run + (size_t) load->curPage * load->pageSize, load->pageSize);
+        }
+        putRecord(load->run + (size_t) load->curPage * load->pageSize, recordString, recordSize);
+    }
 
-                /* 新しいスロット */
-                Slot *newSlot = (Slot*)malloc(sizeof(Slot));
-                newSlot->num = numSlot;
-                newSlot->flag = 0;
-                newSlot->offset = slot->offset;
-                newSlot->size = slot->size - recordSize;
+    load->stats->numRecord++;
+    return OK;
+}
 
+/*
+ * isHeaderRow -- copyRecords()で読んだ行が、フィールド名の並び(見出し)かどうかを調べる
+ *
+ * 引数:
+ *	tableInfo: テーブルのデータ定義情報
+ *	record: 読んだ行
+ *
+ * 返り値:
+ *	見出しなら1、そうでなければ0
+ */
+static int isHeaderRow(TableInfo *tableInfo, RecordData *record){
+    int i;
 
-                /* 元のスロットの更新 */
-                slot->flag = 1;
-                slot->offset = slot->offset + slot->size -  recordSize;
-                slot->size = recordSize;
+    for (i = 0; i < tableInfo->numField; i++) {
+        if(strcmp(record->fieldData[i].val.stringVal, tableInfo->fieldInfo[i].name) != 0){
+            return 0;
+        }
+    }
+    return 1;
+}
 
+/*
+ * copyRecords -- CSVまたはTSVのファイルから、レコードをまとめて読み込む
+ *
+ * 入力ファイルをCOPY_READ_SIZEずつ読みながら1行ずつ解析し、insertRecord()と
+ * 同じ形式のレコードにする。空き領域マップで空きを探さずに新しいページに順に詰め、
+ * COPY_RUN_SIZE分たまったらappendPages()でデータファイルの末尾にまとめて書き足す。
+ *
+ * 1行目にタブがあればTSV、なければCSVとして読む。CSVでは"で囲んだフィールドに
+ * 区切り文字や改行を含めてよく、""は"1文字を表す。1行目がフィールド名の並びなら
+ * 見出しとして読み飛ばす。空行は読み飛ばす。
+ *
+ * 引数:
+ *	tableName: レコードを挿入するテーブルの名前
+ *	filename: 入力ファイルのファイル名
+ *	stats: 読み込んだ量を入れる領域
+ *
+ * 返り値:
+ *	すべて読み込めたらOK、失敗したらNGを返す
+ *	(失敗したときは、その行より前の行は挿入したままにし、stats->lineNumにその行の番号を入れる)
+ */
+Result copyRecords(char *tableName, char *filename, CopyStats *stats){
+    CopyLoad load;
+    RecordData record;
+    FILE *fp;
+    char *input, *value = NULL;
+    char dataFilename[MAX_FILENAME];
+    char delimiter = ',';
+    size_t numRead, i;
+    int numPage, numField = 0, length = 0;
+    int rowStarted = 0, inQuote = 0, quoteSeen = 0, firstRow = 1;
+    char c;
+    Result result = OK;
+
+    memset(stats, 0, sizeof(CopyStats));
+    stats->lineNum = 1;
+
+    /*テーブル情報の取得と、古い形式のデータファイルの書き直し*/
+    if((load.tableInfo = getTableInfo(tableName)) == NULL){
+        return NG;
+    }
+    if(upgradeDataFile(tableName, load.tableInfo) != OK){
+        freeTableInfo(load.tableInfo);
+        return NG;
+    }
+    load.pageSize = load.tableInfo->pageSize;
+    load.numRunPage = COPY_RUN_SIZE / load.pageSize;
+    load.curPage = 0;
+    load.stats = stats;
+
+    /* 入力ファイルと作業用の領域 */
+    if((fp = fopen(filename, "r")) == NULL){
+        freeTableInfo(load.tableInfo);
+        return NG;
+    }
+    if((input = (char *) malloc(COPY_READ_SIZE)) == NULL){
+        fclose(fp);
+        freeTableInfo(load.tableInfo);
+        return NG;
+    }
+    if(posix_memalign((void **) &load.run, PAGE_SIZE, COPY_RUN_SIZE) != 0){
+        free(input);
+        fclose(fp);
+        freeTableInfo(load.tableInfo);
+        return NG;
+    }
+    initializePage(load.run, load.pageSize);
+
+    /* データファイルと空き領域マップを開く */
+    sprintf(dataFilename, "%s/%s%s", DB_PATH, tableName, DATA_FILE_EXT);
+    if((load.file = openFile(dataFilename)) == NULL){
+        free(load.run);
+        free(input);
+        fclose(fp);
+        freeTableInfo(load.tableInfo);
+        return NG;
+    }
+    if((numPage = getNumPages(dataFilename)) < 0
+       || (load.fsm = openFreeSpaceMap(tableName, load.file, load.pageSize,
+                                      numPage / (load.pageSize / PAGE_SIZE))) == NULL){
+        closeFile(load.file);
+        free(load.run);
+        free(input);
+        fclose(fp);
+        freeTableInfo(load.tableInfo);
+        return NG;
+    }
 
-                if(writeSlotToPage(page, slot) != OK){
-                    free(tableInfo);
-                    free(recordString);
-                    free(slot);
-                    closeFile(file);
-                    return NG;
+    /* 読んだ行は、どのフィールドもいったん文字列としてrecordに入れる */
+    record.numField = load.tableInfo->numField;
+    for (i = 0; i < (size_t) record.numField; i++) {
+        strcpy(record.fieldData[i].name, load.tableInfo->fieldInfo[i].name);
+        record.fieldData[i].dataType = load.tableInfo->fieldInfo[i].dataType;
+    }
+    record.next = NULL;
+
+    while (result == OK && (numRead = fread(input, 1, COPY_READ_SIZE, fp)) > 0) {
+        /* 1行目にタブがあればTSVとする */
+        if(stats->numByte == 0){
+            for (i = 0; i < numRead && input[i] != '\n'; i++) {
+                if(input[i] == '\t'){
+                    delimiter = '\t';
+                    break;
                 }
-
-                /* 空きが残っていたらスロットを追加 */
-                if(newSlot->size > 0){
-                    if(writeSlotToPage(page, newSlot) != OK
-                       || changeNumSlot(page, 1) < 0){
-                        free(tableInfo);
-                        free(recordString);
-                        free(slot);
-                        closeFile(file);
-                        return NG;
+            }
+        }
+        stats->numByte += numRead;
+
+        for (i = 0; i < numRead && result == OK; i++) {
+            c = input[i];
+
+            /* "で囲んだフィールドの中 */
+            if(inQuote){
+                if(c == '"'){
+                    /* ""なら"1文字、そうでなければ閉じる"(次の文字で決まる) */
+                    if(quoteSeen){
+                        c = '"';
+                        quoteSeen = 0;
+                    }else{
+                        quoteSeen = 1;
+                        continue;
                     }
+                }else if(quoteSeen){
+                    inQuote = 0;
+                    quoteSeen = 0;
                 }
-
-                if(writePage(file, i, page) != OK
-                   || closeFile(file) != OK){
-                    free(tableInfo);
-                    free(recordString);
-                    free(slot);
-                    closeFile(file);
-                    return NG;
+                if(inQuote){
+                    if(c == '\n'){
+                        stats->lineNum++;
+                    }
+                    if(length >= MAX_STRING - 1){
+                        result = NG;
+                        break;
+                    }
+                    value[length++] = c;
+                    continue;
                 }
+            }
 
-                return OK;
-
+            if(c == '\r'){
+                continue;
             }
 
-            /* 次のスロットを見る */
-            q += sizeof(char) + sizeof(int) * 2;
-        }/* スロット繰り返し */
+            /* 行の終わり */
+            if(c == '\n'){
+                if(rowStarted){
+                    value[length] = '\0';
+                    if(numField + 1 != record.numField){
+                        result = NG;
+                        break;
+                    }
+                    if(!(firstRow && isHeaderRow(load.tableInfo, &record))
+                       && copyRecord(&load, &record) != OK){
+                        result = NG;
+                        break;
+                    }
+                    firstRow = 0;
+                }
+                stats->lineNum++;
+                rowStarted = 0;
+                numField = 0;
+                length = 0;
+                continue;
+            }
 
-    }/* ページ繰り返し */
+            /* フィールドの始まり */
+            if(!rowStarted){
+                rowStarted = 1;
+                value = record.fieldData[0].val.stringVal;
+            }
 
-    /* 空きがなかったら新規ページ作成 */
-    if(initializePage(page) != OK){
-        free(tableInfo);
-        free(recordString);
-        closeFile(file);
-        return NG;
+            if(c == delimiter){
+                value[length] = '\0';
+                if(++numField >= record.numField){
+                    result = NG;
+                    break;
+                }
+                value = record.fieldData[numField].val.stringVal;
+                length = 0;
+            }else if(c == '"' && delimiter == ',' && length == 0){
+                inQuote = 1;
+            }else if(length >= MAX_STRING - 1){
+                result = NG;
+                break;
+            }else{
+                value[length++] = c;
+            }
+        }
     }
-
-    /*先頭のスロットを読み込み*/
-    if((slot = readSlotFromPage(page, 0)) == NULL){
-        free(tableInfo);
-        free(recordString);
-        closeFile(file);
-        return NG;
+    if(ferror(fp)){
+        result = NG;
     }
-    /*ページにレコードを書き込み*/
-    memcpy(page + slot->offset + slot->size - recordSize, recordString, recordSize);
 
-    /* レコードが増えたので空き領域を表す新しいスロットを作成 */
-    Slot *newSlot = (Slot*)malloc(sizeof(Slot));
-    newSlot->num = 1;
-    newSlot->flag = 0;
-    newSlot->offset = slot->offset;
-    newSlot->size = slot->size - recordSize;
+    /* 改行で終わっていない最後の行 */
+    if(result == OK && (inQuote && !quoteSeen)){
+        result = NG;
+    }else if(result == OK && rowStarted){
+        value[length] = '\0';
+        if(numField + 1 != record.numField
+           || (!(firstRow && isHeaderRow(load.tableInfo, &record)) && copyRecord(&load, &record) != OK)){
+            result = NG;
+        }
+    }
 
-    /*元のスロットを更新*/
-    slot->flag = 1;
-    slot->offset = PAGE_SIZE - recordSize;
-    slot->size = recordSize;
+    /* 詰めた分を書き足す(失敗した行より前の行も書き足す) */
+    if(flushCopyRun(&load) != OK){
+        result = NG;
+    }
 
-    /*スロットを書き込み*/
-    if(writeSlotToPage(page, slot) != OK
-       || writeSlotToPage(page, newSlot) != OK
-       || changeNumSlot(page, 1) < 0
-       || writePage(file, numPage, page) != OK
-       || closeFile(file) != OK){
-        return NG;
+    if(closeFile(load.fsm) != OK){
+        result = NG;
+    }
+    if(closeFile(load.file) != OK){
+        result = NG;
     }
+    free(load.run);
+    free(input);
+    fclose(fp);
+    freeTableInfo(load.tableInfo);
 
-    return OK;
+    return result;
 }
 
 /*
@@ -585,15 +2108,26 @@ RecordSet *selectRecord(char *tableName, FieldList *fieldList, Condition *condit
     RecordSet *recordSet;
     char filename[MAX_FILENAME];
     File *file;
-    int numPage;
+    int numPage, pageSize;
     TableInfo *tableInfo;
     int i, j, k, l, m, n;
-    char page[PAGE_SIZE];
+    char *page; //バッファ上のページのポインタ
     int numSlot;
     char *q;
     Slot *slot;
     int isIncluded = 0;
 
+    /*テーブル情報の取得*/
+    if((tableInfo = getTableInfo(tableName)) == NULL){
+        return NULL;
+    }
+
+    /* 古い形式のデータファイルなら、今の形式に書き直す */
+    if(upgradeDataFile(tableName, tableInfo) != OK){
+        freeTableInfo(tableInfo);
+        return NULL;
+    }
+
     /* recordSetを初期化 */
     recordSet = (RecordSet*)malloc(sizeof(RecordSet));
     recordSet->numRecord = 0;
@@ -602,45 +2136,48 @@ RecordSet *selectRecord(char *tableName, FieldList *fieldList, Condition *condit
     /*ファイルをオープン*/
     sprintf(filename, "%s/%s%s", DB_PATH, tableName, DATA_FILE_EXT);
     if((file = openFile(filename)) == NULL){
+        freeTableInfo(tableInfo);
         return NULL;
     }
 
-    if((numPage = getNumPages(filename)) < 0){
-        closeFile(file);
-        return NULL;
+    /* 全ページを順に読むので、先読みするよう指定する */
+    adviseFile(file, ACCESS_SEQUENTIAL);
+
+    /* 指定されていれば、メモリにマップして読む(失敗したらバッファで読む) */
+    if(getTableBackend(tableName) == BACKEND_MMAP){
+        mapFile(file);
     }
 
-    /*テーブル情報の取得*/
-    if((tableInfo = getTableInfo(tableName)) == NULL){
+    if((numPage = getNumPages(filename)) < 0){
         closeFile(file);
+        freeTableInfo(tableInfo);
         return NULL;
     }
 
+    /* テーブルのページの大きさを単位としたページ数にする */
+    pageSize = tableInfo->pageSize;
+    numPage /= pageSize / PAGE_SIZE;
+
     /* ページ数分だけ繰り返す */
     for (i=0; i<numPage; ++i) {
-        if(readPage(file, i, page) != OK){
+        /* 読み込み用のラッチを取ってページを読む(PAGE_SIZEならバッファ上のページをコピーせずに直接読む) */
+        if((page = latchBlock(file, i, pageSize, LATCH_SHARED)) == NULL){
             closeFile(file);
             freeTableInfo(tableInfo);
             return NULL;
         }
 
         /*スロットの数を取得*/
-        memcpy(&numSlot, page, sizeof(int));
+        numSlot = PAGE_HEADER(page)->numSlot;
 
-        /* スロットを見ていく */
+        /* スロットを見ていく(スロットはページ上で直接読む) */
         for (j=0; j<numSlot; ++j) {
-
-            /* ページからスロットを読み込み */
-            if((slot = readSlotFromPage(page, j)) == NULL){
-                closeFile(file);
-                freeTableInfo(tableInfo);
-                return NULL;
-            }
+            slot = PAGE_SLOT(page, j);
 
             q = page + slot->offset;
 
             /* レコードがあったら読み込み */
-            if(slot->flag == 1){
+            if(slot->flag == SLOT_USED){
                 RecordData *recordData1 = (RecordData*)malloc(sizeof(RecordData));
                 recordData1->numField = 1;
                 recordData1->next = NULL;
@@ -676,9 +2213,9 @@ RecordSet *selectRecord(char *tableName, FieldList *fieldList, Condition *condit
                                 break;
                             default:
                                 /* ここにくることはないはず */
+                                unlatchBlock(page, pageSize, UNMODIFIED);
                                 closeFile(file);
                                 freeTableInfo(tableInfo);
-                                free(slot);
                                 free(recordData1);
                                 free(recordData2);
                                 return NULL;
@@ -731,9 +2268,9 @@ RecordSet *selectRecord(char *tableName, FieldList *fieldList, Condition *condit
                             break;
                         default:
                             /* ここにくることはないはず */
+                            unlatchBlock(page, pageSize, UNMODIFIED);
                             closeFile(file);
                             freeTableInfo(tableInfo);
-                            free(slot);
                             free(recordData1);
                             free(recordData2);
                             return NULL;
@@ -763,11 +2300,12 @@ RecordSet *selectRecord(char *tableName, FieldList *fieldList, Condition *condit
                     free(recordData2);
                 }
                 free(recordData1);
-                free(slot);
             }/* レコード読み込みおわり */
 
         }/* スロット繰り返し */
 
+        unlatchBlock(page, pageSize, UNMODIFIED);
+
     }/*ページ繰り返し*/
 
     freeTableInfo(tableInfo);
@@ -824,55 +2362,84 @@ Result deleteRecord(char *tableName, Condition *condition){
     assert(condition != NULL);
 
     char filename[MAX_FILENAME];
-    File *file;
-    int numPage;
+    File *file, *fsm;
+    int numPage, pageSize;
     TableInfo *tableInfo;
     int i, j, k;
-    char page[PAGE_SIZE];
+    char *page; //バッファ上のページのポインタ
     int numSlot;
     char *q;
     Slot *slot;
+    modifyFlag modified;
+    int *freeSize;
+
+
+    /*テーブル情報の取得*/
+    if((tableInfo = getTableInfo(tableName)) == NULL){
+        return NG;
+    }
 
+    /* 古い形式のデータファイルなら、今の形式に書き直す */
+    if(upgradeDataFile(tableName, tableInfo) != OK){
+        freeTableInfo(tableInfo);
+        return NG;
+    }
 
     sprintf(filename, "%s/%s%s", DB_PATH, tableName, DATA_FILE_EXT);
     if((file = openFile(filename)) == NULL){
+        freeTableInfo(tableInfo);
         return NG;
     }
 
     if((numPage = getNumPages(filename)) < 0){
         closeFile(file);
+        freeTableInfo(tableInfo);
         return NG;
     }
 
-    /*テーブル情報の取得*/
-    if((tableInfo = getTableInfo(tableName)) == NULL){
+    /* テーブルのページの大きさを単位としたページ数にする */
+    pageSize = tableInfo->pageSize;
+    numPage /= pageSize / PAGE_SIZE;
+
+    /* 空き領域マップを開き、削除したページの空きを集めておく領域を用意する */
+    if((fsm = openFreeSpaceMap(tableName, file, pageSize, numPage)) == NULL){
         closeFile(file);
+        freeTableInfo(tableInfo);
         return NG;
     }
+    if((freeSize = (int*)malloc(sizeof(int) * (numPage + 1))) == NULL){
+        closeFile(fsm);
+        closeFile(file);
+        freeTableInfo(tableInfo);
+        return NG;
+    }
+
+    /* 全ページを順に読むので、先読みするよう指定する(空き領域マップを作り直す場合は、その後で) */
+    adviseFile(file, ACCESS_SEQUENTIAL);
 
     /* ページ数分だけ繰り返す */
     for (i=0; i<numPage; ++i) {
-        if(readPage(file, i, page) != OK){
+        /* 書き込み用のラッチを取ってページを読み、その上で削除する(PAGE_SIZEならバッファ上で直接削除する) */
+        if((page = latchBlock(file, i, pageSize, LATCH_EXCLUSIVE)) == NULL){
+            free(freeSize);
+            closeFile(fsm);
             closeFile(file);
             freeTableInfo(tableInfo);
             return NG;
         }
+        modified = UNMODIFIED;
 
-        /*スロットの数*/
-        memcpy(&numSlot, page, sizeof(int));
+        /*スロットの数(削除で末尾のスロットが回収されても、その先は空きスロットなので見てよい)*/
+        numSlot = PAGE_HEADER(page)->numSlot;
 
-        /* スロットを見ていく */
+        /* スロットを見ていく(スロットはページ上で直接読み書きする) */
         for (j=0; j<numSlot; ++j) {
-            if((slot = readSlotFromPage(page, j)) == NULL){
-                closeFile(file);
-                freeTableInfo(tableInfo);
-                return NG;
-            }
+            slot = PAGE_SLOT(page, j);
 
             q = page + slot->offset;
 
             /* レコードがあったら読み込み */
-            if(slot->flag == 1){
+            if(slot->flag == SLOT_USED){
                 RecordData *recordData = (RecordData*)malloc(sizeof(RecordData));
                 recordData->numField = tableInfo->numField;
                 int stringLen;
@@ -900,6 +2467,10 @@ Result deleteRecord(char *tableName, Condition *condition){
                             break;
                         default:
                             /* ここにくることはないはず */
+                            unlatchBlock(page, pageSize, modified);
+                            free(freeSize);
+                            closeFile(fsm);
+                            closeFile(file);
                             freeTableInfo(tableInfo);
                             free(recordData);
                             return NG;
@@ -908,23 +2479,34 @@ Result deleteRecord(char *tableName, Condition *condition){
 
                 /*条件を満足するかを確認して満たしていたら削除 */
                 if(strcmp(condition->name, "") == 0 || checkCondition(recordData, condition) == OK){
-                    /* 0埋め */
-                    memset(page+slot->offset, 0, slot->size);
-                    /* スロットの更新*/
-                    slot->flag = 0;
-                    if(writeSlotToPage(page, slot) != OK){
-                        closeFile(file);
-                        freeTableInfo(tableInfo);
-                        free(slot);
-                        return NG;
-                    }
-                }/* TODO 隣のスロットと統合 */
+                    /* 0埋めして空きスロットにし、隣の空きと統合する */
+                    freeSlot(page, j);
+                    modified = MODIFIED;
+                }
                 free(recordData);
             }
 
         }/* スロット繰り返し */
 
-        if(writePage(file, i, page)  != OK){
+        /* 細切れの空きが増えたページや空になったページは、その場で詰め直す */
+        if(modified == MODIFIED && needsCompaction(page, pageSize) && compactPage(page, pageSize) != OK){
+            unlatchBlock(page, pageSize, modified);
+            free(freeSize);
+            closeFile(fsm);
+            closeFile(file);
+            freeTableInfo(tableInfo);
+            return NG;
+        }
+
+        /*
+         * 削除したレコードがあったページだけ、空きを調べて変更ありとしてラッチを解除する
+         * (空になったページはページ全体が空きとして記録され、次に新しいページが
+         * 必要になったときにファイルを伸ばす前に使われる)
+         */
+        freeSize[i] = (modified == MODIFIED) ? getMaxFreeSize(page) : -1;
+        if(unlatchBlock(page, pageSize, modified) != OK){
+            free(freeSize);
+            closeFile(fsm);
             closeFile(file);
             freeTableInfo(tableInfo);
             return NG;
@@ -932,9 +2514,24 @@ Result deleteRecord(char *tableName, Condition *condition){
 
     }/*ページ繰り返し*/
 
+    /*
+     * 削除したページの空きを空き領域マップに記録する。走査の間はバッファの輪や
+     * 先読みがバッファを占めていることがあるので、走査を終えてふつうのアクセスに
+     * 戻してから、まとめて記録する。
+     * 空き領域マップは挿入先を探す目安なので、記録に失敗しても削除は続ける
+     */
+    adviseFile(file, ACCESS_NORMAL);
+    for (i=0; i<numPage; ++i) {
+        if(freeSize[i] >= 0){
+            setFreeSpace(fsm, i, freeSize[i]);
+        }
+    }
+    free(freeSize);
+
     freeTableInfo(tableInfo);
 
 
+    closeFile(fsm);
     if(closeFile(file) != OK){
         closeFile(file);
         return NG;
@@ -943,6 +2540,185 @@ Result deleteRecord(char *tableName, Condition *condition){
     return OK;
 }
 
+/*
+* fetchRecord -- 番地を指定してレコードを読む
+*
+* insertRecord()が返した番地のページだけを読む。
+*
+* 引数:
+*	tableName: レコードを読むテーブルの名前
+*	recordId: 読むレコードの番地
+*
+* 返り値:
+*	読んだレコード(使い終わったらfree()で解放する)。
+*	その番地にレコードがないか、失敗したらNULLを返す
+*/
+RecordData *fetchRecord(char *tableName, RecordId *recordId){
+    assert(strcmp(tableName, "") != 0);
+    assert(recordId != NULL);
+
+    TableInfo *tableInfo;
+    RecordData *recordData;
+    char filename[MAX_FILENAME];
+    File *file;
+    int numPage, pageSize;
+    char *page; //バッファ上のページのポインタ
+    Slot *slot;
+
+    /*テーブル情報の取得と、古い形式のデータファイルの書き直し*/
+    if((tableInfo = getTableInfo(tableName)) == NULL){
+        return NULL;
+    }
+    if(upgradeDataFile(tableName, tableInfo) != OK){
+        freeTableInfo(tableInfo);
+        return NULL;
+    }
+
+    if((recordData = (RecordData *) malloc(sizeof(RecordData))) == NULL){
+        freeTableInfo(tableInfo);
+        return NULL;
+    }
+
+    sprintf(filename, "%s/%s%s", DB_PATH, tableName, DATA_FILE_EXT);
+    if((file = openFile(filename)) == NULL){
+        free(recordData);
+        freeTableInfo(tableInfo);
+        return NULL;
+    }
+
+    /* 指定されていれば、メモリにマップして読む(失敗したらバッファで読む) */
+    if(getTableBackend(tableName) == BACKEND_MMAP){
+        mapFile(file);
+    }
+
+    /* データファイルにないページなら、レコードはない */
+    pageSize = tableInfo->pageSize;
+    if((numPage = getNumPages(filename)) < 0
+       || recordId->pageNum < 0 || recordId->pageNum >= numPage / (pageSize / PAGE_SIZE)){
+        closeFile(file);
+        free(recordData);
+        freeTableInfo(tableInfo);
+        return NULL;
+    }
+
+    /* 読み込み用のラッチを取って、そのページだけを読む */
+    if((page = latchBlock(file, recordId->pageNum, pageSize, LATCH_SHARED)) == NULL){
+        closeFile(file);
+        free(recordData);
+        freeTableInfo(tableInfo);
+        return NULL;
+    }
+    if(recordId->slotNum < 0 || recordId->slotNum >= PAGE_HEADER(page)->numSlot
+       || (slot = PAGE_SLOT(page, recordId->slotNum))->flag != SLOT_USED
+       || readRecordString(tableInfo, page + slot->offset, recordData) != OK){
+        unlatchBlock(page, pageSize, UNMODIFIED);
+        closeFile(file);
+        free(recordData);
+        freeTableInfo(tableInfo);
+        return NULL;
+    }
+    unlatchBlock(page, pageSize, UNMODIFIED);
+
+    closeFile(file);
+    freeTableInfo(tableInfo);
+
+    return recordData;
+}
+
+/*
+* deleteRecordByRid -- 番地を指定してレコードを削除する
+*
+* insertRecord()が返した番地のページだけを書き換え、deleteRecord()と同じく
+* 必要ならページを詰め直して、空きを空き領域マップに記録する。
+*
+* 引数:
+*	tableName: レコードを削除するテーブルの名前
+*	recordId: 削除するレコードの番地
+*
+* 返り値:
+*	削除に成功したらOK、その番地にレコードがないか、失敗したらNGを返す
+*/
+Result deleteRecordByRid(char *tableName, RecordId *recordId){
+    assert(strcmp(tableName, "") != 0);
+    assert(recordId != NULL);
+
+    TableInfo *tableInfo;
+    char filename[MAX_FILENAME];
+    File *file, *fsm;
+    int numPage, pageSize, freeSize;
+    char *page; //バッファ上のページのポインタ
+    Result result = OK;
+
+    /*テーブル情報の取得と、古い形式のデータファイルの書き直し*/
+    if((tableInfo = getTableInfo(tableName)) == NULL){
+        return NG;
+    }
+    if(upgradeDataFile(tableName, tableInfo) != OK){
+        freeTableInfo(tableInfo);
+        return NG;
+    }
+
+    sprintf(filename, "%s/%s%s", DB_PATH, tableName, DATA_FILE_EXT);
+    if((file = openFile(filename)) == NULL){
+        freeTableInfo(tableInfo);
+        return NG;
+    }
+
+    /* データファイルにないページなら、レコードはない */
+    pageSize = tableInfo->pageSize;
+    if((numPage = getNumPages(filename)) < 0){
+        closeFile(file);
+        freeTableInfo(tableInfo);
+        return NG;
+    }
+    numPage /= pageSize / PAGE_SIZE;
+    if(recordId->pageNum < 0 || recordId->pageNum >= numPage){
+        closeFile(file);
+        freeTableInfo(tableInfo);
+        return NG;
+    }
+
+    /* 書き込み用のラッチを取って、そのページだけを書き換える */
+    if((page = latchBlock(file, recordId->pageNum, pageSize, LATCH_EXCLUSIVE)) == NULL){
+        closeFile(file);
+        freeTableInfo(tableInfo);
+        return NG;
+    }
+    if(recordId->slotNum < 0 || recordId->slotNum >= PAGE_HEADER(page)->numSlot
+       || PAGE_SLOT(page, recordId->slotNum)->flag != SLOT_USED){
+        unlatchBlock(page, pageSize, UNMODIFIED);
+        closeFile(file);
+        freeTableInfo(tableInfo);
+        return NG;
+    }
+
+    /* 0埋めして空きスロットにし、細切れの空きが増えたり空になったりしたら詰め直す */
+    freeSlot(page, recordId->slotNum);
+    if(needsCompaction(page, pageSize) && compactPage(page, pageSize) != OK){
+        result = NG;
+    }
+    freeSize = getMaxFreeSize(page);
+    if(unlatchBlock(page, pageSize, MODIFIED) != OK){
+        result = NG;
+    }
+
+    /*
+     * ラッチを解除してから、空きを空き領域マップに記録する
+     * (空き領域マップは挿入先を探す目安なので、記録に失敗しても削除は済んでいる)
+     */
+    if((fsm = openFreeSpaceMap(tableName, file, pageSize, numPage)) != NULL){
+        setFreeSpace(fsm, recordId->pageNum, freeSize);
+        closeFile(fsm);
+    }
+
+    freeTableInfo(tableInfo);
+    if(closeFile(file) != OK){
+        return NG;
+    }
+
+    return result;
+}
+
 /*
 * createDataFile -- データファイルの作成
 *
@@ -954,6 +2730,8 @@ Result deleteRecord(char *tableName, Condition *condition){
 */
 Result createDataFile(char *tableName){
     char filename[MAX_FILENAME];
+    char map[PAGE_SIZE];
+    File *fsm;
 
     sprintf(filename, "%s/%s%s", DB_PATH, tableName, DATA_FILE_EXT);
 
@@ -961,6 +2739,20 @@ Result createDataFile(char *tableName){
         return NG;
     }
 
+    /* 空き領域マップのファイルを作り、空の根を書き込む */
+    sprintf(filename, "%s/%s%s", DB_PATH, tableName, FSM_FILE_EXT);
+    memset(map, 0, PAGE_SIZE);
+    if(createFile(filename) != OK || (fsm = openFile(filename)) == NULL){
+        return NG;
+    }
+    if(writePage(fsm, 0, map) != OK){
+        closeFile(fsm);
+        return NG;
+    }
+    if(closeFile(fsm) != OK){
+        return NG;
+    }
+
     return OK;
 }
 
@@ -982,5 +2774,190 @@ Result deleteDataFile(char *tableName){
         return NG;
     }
 
+    /* 空き領域マップのファイルも削除する(古いテーブルにはないこともある) */
+    sprintf(filename, "%s/%s%s", DB_PATH, tableName, FSM_FILE_EXT);
+    if(access(filename, F_OK) == 0 && deleteFile(filename) != OK){
+        return NG;
+    }
+
+    return OK;
+}
+
+/*
+ * convertOldPages -- 古い形式のデータファイルのレコードを、今の形式のページに詰めて書き出す
+ *
+ * 引数:
+ *	file: 古い形式のデータファイル
+ *	dst: 書き出すファイル
+ *	pageSize: ページの大きさ
+ *	numPage: 古い形式のデータファイルのページ数(pageSizeを単位とする)
+ *
+ * 返り値:
+ *	書き出したページ数(pageSizeを単位とする)。失敗したら-1
+ */
+static int convertOldPages(File *file, File *dst, int pageSize, int numPage){
+    int newPage[MAX_PAGE_SIZE / sizeof(int)]; //intの境界にそろえる
+    char *page = (char *) newPage;
+    char oldPage[MAX_PAGE_SIZE];
+    char *latched, *p;
+    char flag;
+    int numSlot, offset, size, numNewPage = 0, i, j;
+    Result result = OK;
+
+    initializePage(page, pageSize);
+
+    for (i = 0; i < numPage && result == OK; i++) {
+        /* 書き出すときにバッファが要るので、写してからラッチを解除する */
+        if((latched = latchBlock(file, i, pageSize, LATCH_SHARED)) == NULL){
+            return -1;
+        }
+        memcpy(oldPage, latched, pageSize);
+        unlatchBlock(latched, pageSize, UNMODIFIED);
+
+        /* 古い形式のスロットを順に読み、レコードがあれば今の形式のページに詰める */
+        memcpy(&numSlot, oldPage, sizeof(int));
+        for (j = 0; j < numSlot && result == OK; j++) {
+            p = oldPage + sizeof(int) + OLD_SLOT_SIZE * j;
+            memcpy(&flag, p, sizeof(char));
+            memcpy(&offset, p + sizeof(char), sizeof(int));
+            memcpy(&size, p + sizeof(char) + sizeof(int), sizeof(int));
+            if(flag != 1){
+                continue;
+            }
+
+            /* 壊れたスロットがあれば、書き直しをやめる */
+            if(offset < (int) sizeof(int) || size <= 0 || offset + size > pageSize){
+                result = NG;
+                break;
+            }
+
+            /* ページに収まらなければ書き出して、次のページに詰める */
+            if(putRecord(page, oldPage + offset, size) < 0){
+                if(writeBlock(dst, numNewPage++, pageSize, page) != OK){
+                    result = NG;
+                    break;
+                }
+                initializePage(page, pageSize);
+                if(putRecord(page, oldPage + offset, size) < 0){
+                    result = NG;
+                }
+            }
+        }
+    }
+
+    /* 最後のページを書き出す */
+    if(result == OK && PAGE_HEADER(page)->numLive > 0
+       && writeBlock(dst, numNewPage++, pageSize, page) != OK){
+        result = NG;
+    }
+
+    return (result == OK) ? numNewPage : -1;
+}
+
+/*
+ * upgradeDataFile -- 古い形式のデータファイルを、今の形式(PAGE_FORMAT)に書き直す
+ *
+ * 古い形式のページからレコードを順に読み出し、今の形式のページに詰めて
+ * 一時ファイル(テーブル名.upg)に書き出す。一時ファイルをsyncFile()してから
+ * システムカタログに今の形式を記録し、finishUpgrade()でデータファイルを
+ * 置き換える。スロットが大きくなるので、ページ数が増えることがある(レコードの
+ * 位置も変わる)。どこで止まっても、前の形式か今の形式のどちらかのデータファイルが
+ * 残り、残った一時ファイルはinitializeDataManipModule()か次の書き直しで片付ける。
+ * 今の形式を記録してから置き換え終わるまでは、テーブルをupgradingTableに入れておき、
+ * 今の形式のデータ定義情報を得たほかのセッションにも、置き換えを待たせる
+ * (置き換えられなかったときは、入れたままにして次の呼び出しでやり直す)。
+ * 挿入、検索、削除は、データファイルを開く前にこれを呼ぶ
+ * (すでに今の形式なら、何もせずに返る)。
+ *
+ * 引数:
+ *	tableName: テーブル名
+ *	tableInfo: テーブル情報
+ *
+ * 返り値:
+ *	成功(すでに今の形式だった場合を含む)ならOK、失敗ならNG
+ */
+Result upgradeDataFile(char *tableName, TableInfo *tableInfo){
+    char filename[MAX_FILENAME], tmpName[MAX_FILENAME];
+    File *file, *tmp;
+    TableInfo *current;
+    int numPage, numNewPage, pageSize, upgraded;
+
+    if(tableInfo->pageFormat == PAGE_FORMAT && !isUpgrading(tableName)){
+        return OK;
+    }
+
+    pthread_mutex_lock(&upgradeMutex);
+
+    /* 前の書き直しが途中で止まっていれば、先に片付ける */
+    if(recoverUpgrade(tableName) != OK){
+        pthread_mutex_unlock(&upgradeMutex);
+        return NG;
+    }
+
+    /* ほかのセッションが書き直し終えていれば、何もしない(書き直すと、データ定義情報は読み直される) */
+    if((current = getTableInfo(tableName)) == NULL){
+        pthread_mutex_unlock(&upgradeMutex);
+        return NG;
+    }
+    upgraded = (current->pageFormat == PAGE_FORMAT);
+    freeTableInfo(current);
+    if(upgraded){
+        pthread_mutex_unlock(&upgradeMutex);
+        return OK;
+    }
+
+    sprintf(filename, "%s/%s%s", DB_PATH, tableName, DATA_FILE_EXT);
+    sprintf(tmpName, "%s/%s%s", DB_PATH, tableName, UPGRADE_FILE_EXT);
+    pageSize = tableInfo->pageSize;
+
+    if((numPage = getNumPages(filename)) < 0 || (file = openFile(filename)) == NULL){
+        pthread_mutex_unlock(&upgradeMutex);
+        return NG;
+    }
+    numPage /= pageSize / PAGE_SIZE;
+    if(createFile(tmpName) != OK || (tmp = openFile(tmpName)) == NULL){
+        closeFile(file);
+        pthread_mutex_unlock(&upgradeMutex);
+        return NG;
+    }
+
+    /*
+     * 今の形式のページに詰めて、一時ファイルに書き出してディスクに書き込む
+     * (読みながら書くので、先読みやバッファの輪でバッファを占めないよう、順に読む指定はしない)
+     */
+    numNewPage = convertOldPages(file, tmp, pageSize, numPage);
+    if(closeFile(file) != OK || numNewPage < 0 || syncFile(tmp) != OK){
+        closeFile(tmp);
+        deleteFile(tmpName);
+        pthread_mutex_unlock(&upgradeMutex);
+        return NG;
+    }
+    if(closeFile(tmp) != OK){
+        deleteFile(tmpName);
+        pthread_mutex_unlock(&upgradeMutex);
+        return NG;
+    }
+
+    /*
+     * 今の形式になったことを記録して書き直しを確定させ、データファイルを置き換える
+     * (記録する前にupgradingTableに入れ、置き換え終わるまでほかのセッションに開かせない)
+     */
+    if(setUpgrading(tableName) != OK){
+        deleteFile(tmpName);
+        pthread_mutex_unlock(&upgradeMutex);
+        return NG;
+    }
+    if(setTablePageFormat(tableName, PAGE_FORMAT) != OK){
+        clearUpgrading(tableName);
+        pthread_mutex_unlock(&upgradeMutex);
+        return NG;
+    }
+    if(finishUpgrade(tableName) != OK){
+        pthread_mutex_unlock(&upgradeMutex);
+        return NG;
+    }
+
+    pthread_mutex_unlock(&upgradeMutex);
+
     return OK;
 }
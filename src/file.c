@@ -2,465 +2,6822 @@
  * file.c -- ファイルアクセスモジュール
  */
 
+/* LinuxでO_DIRECTを使うため */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+/*
+ * HAVE_IO_URING -- io_uringを使えるかどうか(Linuxでヘッダがある場合)
+ */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING
+#endif
+#endif
 #include "../include/microdb.h"
 
 /*
- * NUM_BUFFER -- ファイルアクセスモジュールが管理するバッファの大きさ(ページ数)
+ * DEFAULT_NUM_BUFFER -- バッファの大きさ(ページ数)の既定値
  */
-#define NUM_BUFFER 4
+#define DEFAULT_NUM_BUFFER 4
+
+/*
+ * ENV_NUM_BUFFER -- バッファの大きさ(ページ数)を指定する環境変数
+ */
+#define ENV_NUM_BUFFER "MICRODB_NUM_BUFFER"
+
+/*
+ * ENV_BUFFER_SIZE -- バッファの大きさ(バイト数)を指定する環境変数
+ *
+ * 値の末尾にK, M, Gを付けるとそれぞれキロ、メガ、ギガバイト単位になる。
+ * ENV_NUM_BUFFERと両方指定された場合はENV_NUM_BUFFERを優先する。
+ */
+#define ENV_BUFFER_SIZE "MICRODB_BUFFER_SIZE"
+
+/*
+ * ENV_REPLACEMENT_POLICY -- バッファの置換方式を指定する環境変数
+ *
+ * "lru", "clock", "2q", "lru-k" のいずれかを指定する。既定値は"lru"。
+ */
+#define ENV_REPLACEMENT_POLICY "MICRODB_REPLACEMENT_POLICY"
+
+/*
+ * ENV_BACKEND -- データファイルのページを読む方法を指定する環境変数
+ *
+ * "mmap"を指定すると、すべてのテーブルをメモリにマップして読む。既定値は"buffer"。
+ */
+#define ENV_BACKEND "MICRODB_BACKEND"
+
+/*
+ * MIN_MAP_SIZE -- ファイルをマップする領域の大きさの最小値(バイト数)
+ */
+#define MIN_MAP_SIZE (64 * PAGE_SIZE)
+
+/*
+ * LRU_K -- LRU-K方式で記録するアクセス履歴の数(K)
+ */
+#define LRU_K 2
+
+/*
+ * READAHEAD_PAGES -- 先読みで一度に読み込むページ数の上限
+ *
+ * 実際にはバッファの大きさの1/4までに抑える。
+ */
+#define READAHEAD_PAGES 32
+
+/*
+ * RING_PAGES -- 大きなファイルを順に読むときに使うバッファの輪の大きさ(ページ数)
+ *
+ * 実際にはバッファの大きさの1/8までに抑える。
+ */
+#define RING_PAGES 16
+
+/*
+ * SEQUENTIAL_THRESHOLD -- 順番に読んでいると判断するまでの連続アクセス回数
+ */
+#define SEQUENTIAL_THRESHOLD 2
+
+/*
+ * ENV_ASYNC_IO -- 非同期I/Oの方式を指定する環境変数
+ *
+ * "io_uring", "threads", "none" のいずれかを指定する。既定値は"none"
+ * (非同期I/Oを使わない)。"io_uring"が使えない環境では"threads"になる。
+ */
+#define ENV_ASYNC_IO "MICRODB_ASYNC_IO"
+
+/*
+ * ENV_DIRECT_IO -- ダイレクトI/Oを使うかどうかを指定する環境変数
+ *
+ * "1"を指定すると、カーネルのページキャッシュを通さずに読み書きする。
+ */
+#define ENV_DIRECT_IO "MICRODB_DIRECT_IO"
+
+/*
+ * AIO_DEPTH -- 同時に発行しておける非同期I/Oの数
+ */
+#define AIO_DEPTH 64
+
+/*
+ * AIO_THREADS -- スレッドプール方式の非同期I/Oで使うスレッド数
+ */
+#define AIO_THREADS 4
+
+/*
+ * IO_NONE, IO_READ, IO_WRITE -- バッファに対して発行中の非同期I/O
+ */
+#define IO_NONE 0
+#define IO_READ 1
+#define IO_WRITE 2
+
+/*
+ * FLUSH_INTERVAL -- 書き戻しスレッドが起きる間隔(ミリ秒)
+ */
+#define FLUSH_INTERVAL 100
+
+/*
+ * FLUSH_DIRTY_RATIO -- 書き戻しスレッドをすぐに起こす更新済みバッファの割合(%)
+ *
+ * 更新済みのバッファがこの割合を超えたら、間隔を待たずに書き戻しを始める。
+ */
+#define FLUSH_DIRTY_RATIO 50
+
+/*
+ * FLUSH_EVICT_DIRTY_RATIO -- 追い出しが起きているときに書き戻しスレッドを起こす割合(%)
+ *
+ * 空きバッファがなくなって追い出しが始まったら、更新済みのバッファがこの割合を
+ * 超えた時点で書き戻しを始め、追い出せる更新されていないバッファを多めに残しておく。
+ */
+#define FLUSH_EVICT_DIRTY_RATIO 10
+
+/*
+ * MAX_OPEN_FILES -- 閉じずに残しておくファイルの数の上限
+ *
+ * これを超えたら、どこからもopenFile()されていないファイルのうち
+ * 最も長く使われていないものを閉じる。
+ */
+#define MAX_OPEN_FILES 64
+
+/*
+ * WRITE_RUN_PAGES -- 連続したページを1回のpwritevで書き戻すページ数の上限
+ */
+#define WRITE_RUN_PAGES 64
+
+/*
+ * FLUSH_BATCH -- 書き戻しスレッドが一度に集めて書き戻すバッファ数の上限
+ */
+#define FLUSH_BATCH 256
+
+/*
+ * ENV_NUM_SHARD -- バッファを分けるシャードの数を指定する環境変数
+ */
+#define ENV_NUM_SHARD "MICRODB_BUFFER_SHARDS"
+
+/*
+ * MAX_SHARDS -- シャードの数の上限
+ */
+#define MAX_SHARDS 64
+
+/*
+ * MIN_SHARD_BUFFERS -- シャードの数を自動で決めるときの、1シャードあたりのバッファ数の下限
+ *
+ * 置換方式はシャードごとに働くので、小さく分けすぎると追い出すページの選び方が悪くなる。
+ */
+#define MIN_SHARD_BUFFERS 1024
+
+/*
+ * SHARD_EXTENT_PAGES -- 同じシャードに入れる連続したページの数
+ *
+ * 先読みや書き戻しでまとめて読み書きするページが同じシャードに入るよう、
+ * ページ番号をこの数で割った値からシャードを決める。
+ */
+#define SHARD_EXTENT_PAGES WRITE_RUN_PAGES
+
+/*
+ * ENV_HUGE_PAGES -- バッファの領域をヒュージページで確保するかどうかを指定する環境変数
+ *
+ * "hugetlb"ならMAP_HUGETLBで予約済みのヒュージページから、"thp"なら
+ * Transparent Huge Pagesで確保し、"none"ならふつうのページで確保する。
+ * 指定がなければ、領域がHUGE_PAGE_SIZE以上のときに"hugetlb"、"thp"の順に試す。
+ * 確保できなければ、次の方法で確保する。
+ */
+#define ENV_HUGE_PAGES "MICRODB_HUGE_PAGES"
+
+/*
+ * HUGE_PAGE_SIZE -- ヒュージページの大きさ
+ */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/*
+ * ARENA_HEAP, ARENA_THP, ARENA_HUGETLB -- バッファの領域の確保のしかた
+ */
+#define ARENA_HEAP 0
+#define ARENA_THP 1
+#define ARENA_HUGETLB 2
+
+/*
+ * PAGE_MAP_EXT -- 圧縮したファイルのページ対応表のファイルの拡張子
+ *
+ * データファイルと同じ名前にこの拡張子を付けたファイルがあれば、
+ * そのデータファイルのページは圧縮して格納されている。
+ */
+#define PAGE_MAP_EXT ".pmap"
+
+/*
+ * PACK_TMP_EXT, UNPACK_TMP_EXT, MAP_TMP_EXT -- 形式を書き直すときの一時ファイルの拡張子
+ *
+ * 圧縮した形式に書き直すデータファイルはPACK_TMP_EXTを、圧縮しない形式に
+ * 書き直すデータファイルはUNPACK_TMP_EXTを付けた名前に書く。
+ * 新しいページ対応表は、ページ対応表のファイル名にMAP_TMP_EXTを付けた名前に書く。
+ * 書き直しの途中で止まったときは、残った一時ファイルの種類とページ対応表の
+ * 有無から、書き直しを終わらせるか取り消すかを決める(recoverConversion()参照)。
+ */
+#define PACK_TMP_EXT ".pack"
+#define UNPACK_TMP_EXT ".unpack"
+#define MAP_TMP_EXT ".tmp"
+
+/*
+ * MAX_CONVERT_TMP_NAME -- 形式を書き直すときの一時ファイルのファイル名の長さの上限
+ */
+#define MAX_CONVERT_TMP_NAME (MAX_FILENAME + sizeof(PAGE_MAP_EXT) + sizeof(UNPACK_TMP_EXT))
+
+/*
+ * EXTENT_ALIGN -- 圧縮したページを格納するファイル上の領域の大きさの単位(バイト数)
+ *
+ * 書き直したページが少し大きくなっても、同じ領域に収まれば移さずに済むよう、
+ * 領域はこの単位に切り上げて確保する。
+ */
+#define EXTENT_ALIGN 64
+
+/*
+ * NUM_BLOCK_LATCH -- ブロックのラッチの数
+ *
+ * ブロックのラッチは(ファイル, 最初のページ番号)のハッシュ値で選ぶので、
+ * 違うブロックが同じラッチを使うことがある(待つことがあるだけで、正しさは変わらない)。
+ */
+#define NUM_BLOCK_LATCH 256
+
+/*
+ * BLOCK_PIN_RATIO -- ブロックをバッファに置いたまま固定するときの、シャードの大きさの下限
+ *
+ * シャードのバッファ数がブロックのページ数のこの倍以上あるときだけ、ブロックの
+ * ページを連続したバッファに集めて固定する(小さなバッファを固定で埋めないため)。
+ */
+#define BLOCK_PIN_RATIO 8
+
+/*
+ * LZ_MIN_MATCH, LZ_MAX_MATCH -- 圧縮で前に出てきた並びを参照する長さの下限と上限
+ */
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_MATCH (127 + LZ_MIN_MATCH)
+
+/*
+ * LZ_MAX_LITERAL -- 圧縮で1つの印の後にそのまま続けるバイト数の上限
+ */
+#define LZ_MAX_LITERAL 128
 
-/*------バッファ-------*/
 /*
- * modifyFlag -- 変更フラグ
+ * LZ_HASH_BITS -- 圧縮で前に出てきた並びを探すハッシュ表の大きさ(ビット数)
  */
-typedef enum { UNMODIFIED = 0, MODIFIED = 1 } modifyFlag;
+#define LZ_HASH_BITS 12
+
+/*------バッファ-------*/
+typedef struct Shard Shard;
 
 /*
  * Buffer -- 1ページ分のバッファを記憶する構造体
+ *
+ * prev, next, referenced, queue, history, heapIndexは置換方式ごとの管理情報で、
+ * 使用している置換方式のものだけが意味を持つ。
+ * ringがNULLでないバッファはバッファの輪に属していて、置換方式には登録しない。
+ * 置換方式が調べるメンバを先頭に集め、ページの内容とラッチは別の領域に置いて、
+ * Buffer構造体の配列を詰めておく(追い出すバッファを探すときに、ページの内容の
+ * キャッシュラインやTLBのエントリを使わないようにするため)。
+ * latch以外のメンバは、shardのmutexを取ってから読み書きする。pageの内容は、
+ * バッファを固定してlatchを取ってから読み書きする(固定されていないバッファは
+ * ラッチを取っている者がいないので、shardのmutexを取っていれば読み書きしてよい)。
  */
 typedef struct Buffer Buffer;
 struct Buffer {
     File *file;				/* バッファの内容が格納されたファイル */
     /* file == NULLならこのバッファは未使用 */
     int pageNum;			/* ページ番号 */
-    char page[PAGE_SIZE];		/* ページの内容を格納する配列 */
-    struct Buffer *prev;		/* 一つ前のバッファへのポインタ */
-    struct Buffer *next;		/* 一つ後ろのバッファへのポインタ */
     modifyFlag modified;		/* ページの内容が更新されたかどうかを示すフラグ */
+    int pinCount;			/* pinPage()で固定されている数(0より大きければ追い出さない) */
+    int ioState;			/* 発行中のI/O(IO_NONE, IO_READ, IO_WRITE) */
+    int referenced;			/* CLOCK: 参照ビット */
+    int queue;				/* 2Q: 入っているキュー(QUEUE_A1IN, QUEUE_AM) */
+    struct Buffer *prev;		/* 一つ前のバッファへのポインタ */
+    struct Buffer *next;		/* 一つ後ろのバッファへのポインタ(未使用なら空きリストの次) */
+    struct Buffer *hashNext;		/* 同じハッシュバケットの次のバッファへのポインタ */
+    BufferRing *ring;			/* 属しているバッファの輪(なければNULL) */
+    unsigned long history[LRU_K];	/* LRU-K: 最近K回のアクセス時刻(history[0]が最新) */
+    int heapIndex;			/* LRU-K: ヒープ内の位置 */
+    int aheadMark;			/* 読まれたら次の非同期の先読みを発行する印 */
+    Shard *shard;			/* バッファが属するシャード */
+    char *page;				/* ページの内容を格納する領域(pageArenaの中) */
+    pthread_rwlock_t *latch;		/* ページの内容を読み書きするときに取るラッチ(latchArenaの中) */
+    struct Buffer *ioNext;		/* 非同期I/Oのキューの次のバッファ */
+    struct iovec iov;			/* io_uringに渡す読み書きの領域 */
+};
+
+/*
+ * BufferRing -- 大きなファイルを順に読むときに使う専用のバッファの輪
+ *
+ * 全ページを順に読むと、読んだページがすべて置換方式のリストを通り抜け、
+ * ほかの処理がよく使うページ(テーブル定義のページなど)を追い出してしまう。
+ * そこで、バッファの大きさの1/4より大きいファイルをACCESS_SEQUENTIALで
+ * 読むときは、小さな輪に入ったバッファだけを順に使い回す。
+ * 輪のバッファは置換方式には登録しないので、ほかのバッファは追い出されない。
+ * 輪はシャードごとに分かれていて、各シャードの分はそのシャードのmutexで保護する。
+ */
+struct BufferRing {
+    int size;				/* シャードごとの輪の大きさ(バッファ数) */
+    int *current;			/* シャードごとの次に使う位置 */
+    Buffer **slot;			/* 輪に入っているバッファ(シャードiの分はslot[i * size]から。まだなければNULL) */
+};
+
+/*
+ * BufferList -- バッファの両方向リスト
+ */
+typedef struct BufferList BufferList;
+struct BufferList {
+    Buffer *head;			/* 先頭(最も新しい)のバッファ */
+    Buffer *tail;			/* 末尾(最も古い)のバッファ */
+    int length;				/* リストに入っているバッファの数 */
+};
+
+/*
+ * Ghost -- 2QのA1outに記録する、追い出したページの番号
+ */
+typedef struct Ghost Ghost;
+
+/*
+ * Shard -- バッファを分けた区画(シャード)
+ *
+ * バッファをnumShard個のシャードに分け、それぞれが自分のバッファ、空きリスト、
+ * ハッシュ表、置換方式の状態を持つ。ページがどのシャードに入るかは
+ * (ファイル, ページ番号 / SHARD_EXTENT_PAGES)のハッシュ値で決まるので、
+ * 違うシャードのページを読み書きするスレッドは互いに待たない。
+ * mutex以外のメンバは、mutexを取ってから読み書きする。
+ */
+struct Shard {
+    int index;				/* シャードの番号 */
+    pthread_mutex_t mutex;		/* シャードの管理情報を保護するミューテックス */
+    pthread_cond_t ioDoneCond;		/* シャードのバッファの読み書きが終わったことを知らせる条件変数 */
+    Buffer *frames;			/* シャードのバッファ(bufferArenaの一部) */
+    int numFrame;			/* シャードのバッファ数 */
+    Buffer *freeBufferList;		/* 空きバッファのリスト(nextでつなぐ) */
+    Buffer **hashTable;			/* (ファイル, ページ番号)からバッファを引くハッシュ表 */
+    int numHashBucket;			/* ハッシュ表のバケット数(バッファ数の2倍) */
+    int numDirty;			/* 更新済み(まだ書き戻していない)バッファの数 */
+    int numInFlight;			/* 発行中のI/Oの数 */
+    int numPendingIO;			/* I/Oの印(ioState)が付いたバッファの数 */
+    int numPendingWrite;		/* 書き戻しスレッドが非同期I/Oで発行中の書き込みの数 */
+    int flushCursor;			/* 書き戻しスレッドが次に調べるバッファの番号 */
+    int blockCursor;			/* ブロックを集める連続したバッファを次に探す位置(ブロック単位) */
+    long numHit;			/* ヒットした数 */
+    long numMiss;			/* ミスした数 */
+    long numEvict;			/* 追い出した数 */
+    BufferList lruList;			/* LRU: LRUリスト */
+    int clockHand;			/* CLOCK: 次に調べるバッファの番号 */
+    BufferList a1inList;		/* 2Q: A1inのリスト */
+    BufferList amList;			/* 2Q: Amのリスト */
+    int a1inMax;			/* 2Q: A1inに入れるバッファ数の上限 */
+    Ghost *ghostRing;			/* 2Q: A1outを記録する環状バッファ */
+    int ghostMax;			/* 2Q: A1outに記録する数の上限 */
+    int ghostNext;			/* 2Q: 次に記録する位置 */
+    int numGhost;			/* 2Q: A1outに記録している数 */
+    Ghost **ghostHashTable;		/* 2Q: A1outを引くためのハッシュ表 */
+    int numGhostBucket;			/* 2Q: A1outのハッシュ表のバケット数 */
+    unsigned long accessClock;		/* LRU-K: アクセス時刻(アクセスのたびに1増える) */
+    Buffer **lrukHeap;			/* LRU-K: 追い出す順序で並べたバッファのヒープ */
+    int lrukHeapSize;			/* LRU-K: ヒープに入っているバッファの数 */
+};
+
+/*
+ * AsyncIO -- 非同期I/Oの方式
+ *
+ * submitは、バッファのシャードのmutexとioMutexを取ったまま呼ばれる。
+ * 各バッファのI/Oが終わったら、方式のスレッドがfinishIO()を呼ぶ。
+ */
+typedef struct AsyncIO AsyncIO;
+struct AsyncIO {
+    char *name;				/* 方式の名前 */
+    Result (*initialize)();		/* 初期化 */
+    void (*finalize)();			/* 終了処理(発行したI/Oはすべて終わっている) */
+    Result (*submit)(Buffer **, int);	/* バッファの読み書きをまとめて発行する(失敗ならNG) */
+};
+
+/*
+ * ReplacementPolicy -- バッファの置換方式
+ *
+ * 置換方式は、シャードごとに使用中のバッファだけを管理する。空きバッファは
+ * 置換方式とは別の空きリストで管理し、空きがなくなったときだけvictimで
+ * 追い出すバッファを選ぶ。どの関数も、シャードのmutexを取ってから呼び出す。
+ */
+typedef struct ReplacementPolicy ReplacementPolicy;
+struct ReplacementPolicy {
+    char *name;				/* 置換方式の名前 */
+    Result (*initialize)(Shard *);	/* バッファを確保した後の初期化 */
+    void (*finalize)(Shard *);		/* バッファを解放する前の終了処理 */
+    void (*insert)(Shard *, Buffer *);	/* ページを読み込んだバッファを登録する */
+    void (*access)(Shard *, Buffer *);	/* バッファ上のページがアクセスされた(ヒット) */
+    void (*remove)(Shard *, Buffer *, int);	/* バッファを空にする(第3引数は追い出しかどうか) */
+    Buffer *(*victim)(Shard *, int);	/* 追い出すバッファを選ぶ(固定されたものは選ばない。第2引数が1なら更新済みのものも選ばない) */
+    void (*print)(Shard *);		/* 内部状態を出力する */
+};
+
+/*
+ * numBuffer -- ファイルアクセスモジュールが管理するバッファの大きさ(ページ数)
+ */
+static int numBuffer = 0;
+
+/*
+ * requestedNumBuffer -- setNumBuffer()で指定されたバッファの大きさ(ページ数)
+ *
+ * 0の場合は、initializeFileModule()で環境変数か既定値から決める。
+ */
+static int requestedNumBuffer = 0;
+
+/*
+ * numShard -- バッファを分けたシャードの数
+ */
+static int numShard = 0;
+
+/*
+ * requestedNumShard -- setNumShard()で指定されたシャードの数
+ *
+ * 0の場合は、initializeFileModule()で環境変数かCPUの数とバッファの大きさから決める。
+ */
+static int requestedNumShard = 0;
+
+/*
+ * shards -- numShard個分のシャード
+ */
+static Shard *shards = NULL;
+
+/*
+ * bufferArena -- numBuffer個分のBuffer構造体をまとめて確保した領域
+ *
+ * シャードiは、bufferArenaのうち連続した一部(shards[i].frames)を持つ。
+ */
+static Buffer *bufferArena = NULL;
+
+/*
+ * pageArena -- numBuffer個分のページの内容をまとめて確保した領域
+ *
+ * ダイレクトI/Oでは読み書きする領域をページの境界にそろえる必要があるので、
+ * Buffer構造体とは別に、PAGE_SIZEの境界にそろえて確保する。
+ * bufferArena[i]のページはpageArenaのi番目のPAGE_SIZEバイト。
+ */
+static char *pageArena = NULL;
+
+/*
+ * latchArena -- numBuffer個分のラッチをまとめて確保した領域
+ *
+ * bufferArena[i]のラッチはlatchArena[i]。
+ */
+static pthread_rwlock_t *latchArena = NULL;
+
+/*
+ * bufferArenaKind, pageArenaKind -- bufferArenaとpageArenaの確保のしかた(ARENA_HEAPなど)
+ * bufferArenaSize, pageArenaSize -- bufferArenaとpageArenaとして確保した大きさ(バイト数)
+ */
+static int bufferArenaKind = ARENA_HEAP;
+static int pageArenaKind = ARENA_HEAP;
+static size_t bufferArenaSize = 0;
+static size_t pageArenaSize = 0;
+
+/*
+ * requestedHugePages -- setHugePages()で指定されたヒュージページの使い方(NULLなら環境変数から)
+ */
+static char *requestedHugePages = NULL;
+
+/*
+ * directIO -- ダイレクトI/Oを使うかどうか
+ *
+ * 使うときは、ファイルをO_DIRECT(macOSではF_NOCACHE)で開き、カーネルの
+ * ページキャッシュを通さずに読み書きする。ページはバッファにだけ
+ * キャッシュされるので、同じページを二重に持たずに済む。
+ */
+static int directIO = 0;
+
+/*
+ * requestedDirectIO -- setDirectIO()で指定されたダイレクトI/Oを使うかどうか
+ *
+ * -1の場合は、initializeFileModule()で環境変数から決める。
+ */
+static int requestedDirectIO = -1;
+
+/*
+ * policy -- 使用中の置換方式
+ */
+static ReplacementPolicy *policy = NULL;
+
+/*
+ * requestedPolicy -- setReplacementPolicy()で指定された置換方式
+ *
+ * NULLの場合は、initializeFileModule()で環境変数か既定値から決める。
+ */
+static ReplacementPolicy *requestedPolicy = NULL;
+
+/*
+ * FileMap -- ファイルをメモリにマップした領域
+ *
+ * ファイルの大きさより広めにマップしておき、ファイルが伸びてもその範囲なら
+ * マップし直さずに読めるようにする。範囲を超えたら2倍以上の大きさで
+ * マップし直すが、古い領域を指すポインタをpinPage()で返しているかもしれないので、
+ * 古い領域はretiredにつないでおき、closeFile()まで解放しない。
+ * マップし直すときは、mutexを取ってからaddr, size, fileSizeを読み書きする。
+ */
+struct FileMap {
+    char *addr;				/* マップした領域の先頭 */
+    size_t size;			/* マップした領域の大きさ(バイト数) */
+    off_t fileSize;			/* 最後に調べたファイルの大きさ(バイト数) */
+    int sequential;			/* 順に読むとカーネルに伝えているかどうか */
+    FileMap *retired;			/* マップし直す前の古い領域 */
+    pthread_mutex_t mutex;		/* マップし直すときに取るミューテックス */
+};
+
+/*
+ * Block -- latchBlock()で読み書きする、連続したページをまとめたもの
+ *
+ * ファイル上で連続したnumPage個のページの内容を、dataにつなげてコピーする。
+ * latchBlock()はdataを返し、unlatchBlock()はその番地からBlock構造体を求める。
+ */
+typedef struct Block Block;
+struct Block {
+    File *file;				/* ブロックを読んだファイル */
+    int pageNum;			/* ブロックの最初のページ番号 */
+    int numPage;			/* ブロックのページ数 */
+    pthread_rwlock_t *latch;		/* 取っているブロックのラッチ(blockLatchの中) */
+    char data[];			/* ページの内容(numPage * PAGE_SIZEバイト) */
+};
+
+/*
+ * Extent -- 圧縮したページを格納するファイル上の領域(ページ対応表の1項目)
+ *
+ * ページ対応表のファイルには、ページ番号の順にこの構造体をそのまま並べる。
+ * lengthが0のページはまだ書かれていない(内容はすべて0)。
+ * lengthがPAGE_SIZEのページは、圧縮しても小さくならなかったのでそのまま格納している。
+ */
+typedef struct Extent Extent;
+struct Extent {
+    int64_t offset;			/* データファイル上の位置(バイト数) */
+    int32_t length;			/* 格納しているバイト数 */
+    int32_t capacity;			/* 確保した領域の大きさ(EXTENT_ALIGNの倍数) */
+};
+
+/*
+ * PageMap -- 圧縮したファイルのページ対応表
+ *
+ * 圧縮したページは大きさがまちまちなので、ページ番号からデータファイル上の
+ * 位置を引けるよう、ページごとの領域をページ対応表のファイルに記録する。
+ * 書き直したページが元の領域に収まらなければ、データファイルの末尾に
+ * 新しい領域を確保する(元の領域は使わなくなる。setFileCompression()で
+ * 圧縮をやめてからやり直すと詰められる)。
+ * mutex以外のメンバは、mutexを取ってから読み書きする。
+ */
+struct PageMap {
+    int desc;				/* ページ対応表のファイルのディスクリプタ */
+    Extent *extents;			/* ページごとの領域(ページ番号の順) */
+    int numExtent;			/* 記録しているページ数 */
+    int maxExtent;			/* extentsに確保した項目数 */
+    int64_t endOffset;			/* 次に領域を確保するデータファイル上の位置 */
+    pthread_mutex_t mutex;		/* ページ対応表を保護するミューテックス */
 };
 
 /*
- * bufferListHead -- LRUリストの先頭へのポインタ
+ * defaultBackend -- テーブルごとに指定がないときのページを読む方法
+ */
+static fileBackend defaultBackend = BACKEND_BUFFER;
+
+/*
+ * defaultBackendDecided -- defaultBackendを環境変数から決めたかどうか
+ */
+static int defaultBackendDecided = 0;
+
+/*
+ * blockLatch -- ブロックを読み書きするときに取るラッチ
+ *
+ * ブロックは複数のバッファにまたがるので、ページごとのラッチではなく、
+ * ブロックごとにこのラッチを取ってから各ページを読み書きする。
+ */
+static pthread_rwlock_t blockLatch[NUM_BLOCK_LATCH];
+
+/*
+ * totalStats -- ファイル全体のバッファの統計(ファイルごとの統計はFile構造体のstats)
+ *
+ * ヒット、ミス、追い出しの数はシャードごとに数え、getBufferStats()で合計する。
+ */
+static BufferStats totalStats;
+
+/*
+ * numReadAhead, numReadAheadPage -- 先読みした回数、先読みで読み込んだページ数
+ */
+static long numReadAhead = 0;
+static long numReadAheadPage = 0;
+
+/*
+ * numMappedRead -- メモリにマップした領域から直接読んだページ数
+ */
+static long numMappedRead = 0;
+
+/*
+ * numFlush -- 書き戻しスレッドが書き戻した数
+ *
+ * 追い出し時に書き戻した数は、統計(BufferStatsのnumEvictWriteBack)で数える。
+ */
+static long numFlush = 0;
+
+/*
+ * writeBackList -- ファイルを閉じるときなどに書き戻すバッファを集める領域
+ *
+ * numBuffer個分。openFileMutexを取ってから使うこと。
+ */
+static Buffer **writeBackList = NULL;
+
+/*
+ * ロックの順序
+ *
+ * 複数のロックを取るときは、openFileMutex、シャードのmutex(番号の小さい順)の
+ * 順に取る。File構造体とFileMapのmutex、statsMutex、ioMutex、flusherMutexは、
+ * 取ったままほかのロックを取らない(シャードのmutexを取ったまま取るのはよい)。
+ * シャードのmutexを取ったまま、バッファのラッチを待ってはならない。
+ */
+
+/*
+ * openFileMutex -- オープンしたファイルのリストと設定の変更を保護するミューテックス
+ *
+ * File構造体のringとmapは、これとすべてのシャードのmutexを取ってから変更する
+ * (どれか1つのシャードのmutexを取っていれば読んでよい)。
+ */
+static pthread_mutex_t openFileMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * statsMutex -- 全体の統計と回数を保護するミューテックス
+ */
+static pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * flusherMutex, flusherCond -- 書き戻しスレッドを止めるためのミューテックスと、
+ * 書き戻しスレッドを起こすための条件変数
+ */
+static pthread_mutex_t flusherMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusherCond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * ioMutex, ioSlotCond -- 非同期I/Oのキューと発行数を保護するミューテックスと、
+ * 発行中のI/Oが減ったことを知らせる条件変数
+ */
+static pthread_mutex_t ioMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ioSlotCond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * asyncIO -- 使用中の非同期I/Oの方式(使わなければNULL)
+ */
+static AsyncIO *asyncIO = NULL;
+
+/*
+ * requestedAsyncIO -- setAsyncIO()で指定された非同期I/Oの方式の名前
+ */
+static char *requestedAsyncIO = NULL;
+
+/*
+ * numAsyncInFlight -- 全シャードで発行中の非同期I/Oの数(ioMutexで保護する)
+ */
+static int numAsyncInFlight = 0;
+
+/*
+ * numAsyncRead, numAsyncWrite, numWriteError -- 非同期に読んだ数、書いた数、
+ * 書き込みに失敗した数
+ */
+static long numAsyncRead = 0;
+static long numAsyncWrite = 0;
+static long numWriteError = 0;
+
+/*
+ * ioQueueHead, ioQueueTail, ioQueueCond, ioThread, ioThreadStop --
+ * スレッドプール方式の非同期I/Oのキューとスレッド(ioMutexで保護する)
+ */
+static Buffer *ioQueueHead = NULL;
+static Buffer *ioQueueTail = NULL;
+static pthread_cond_t ioQueueCond = PTHREAD_COND_INITIALIZER;
+static pthread_t ioThread[AIO_THREADS];
+static int ioThreadStop = 0;
+
+/*
+ * flusherThread, flusherRunning, flusherStop -- 書き戻しスレッドとその状態
+ */
+static pthread_t flusherThread;
+static int flusherRunning = 0;
+static int flusherStop = 0;
+
+/*
+ * openFileHead, openFileTail -- オープンしたファイルのリスト
+ *
+ * 先頭が最も最近openFile()したもの。closeFile()されてもファイルは閉じずに
+ * このリストに残し、次のopenFile()でそのまま(バッファ上のページとともに)使う。
+ */
+static File *openFileHead = NULL;
+static File *openFileTail = NULL;
+
+/*
+ * numOpenFile -- オープンしたファイルのリストに入っているファイルの数
+ */
+static int numOpenFile = 0;
+
+/*
+ * numFileOpened, numFileReused -- 実際にファイルを開いた数、
+ * 開いたままのファイルをopenFile()で使い回した数
+ */
+static long numFileOpened = 0;
+static long numFileReused = 0;
+
+/*
+ * numDirectOpened -- ダイレクトI/Oで開けたファイルの数
+ */
+static long numDirectOpened = 0;
+
+/*
+ * parseBufferSize -- バイト数を表す文字列の解析
+ *
+ * 引数:
+ *	str: "65536", "512K", "256M", "1G" のような文字列
+ *
+ * 返り値:
+ *	バイト数。解析できなければ-1を返す。
+ */
+static long long parseBufferSize(char *str)
+{
+    char *endp;
+    long long size;
+    
+    size = strtoll(str, &endp, 10);
+    if (endp == str || size < 0) {
+        return -1;
+    }
+    
+    switch (*endp) {
+        case '\0':
+            break;
+        case 'k': case 'K':
+            size *= 1024;
+            endp++;
+            break;
+        case 'm': case 'M':
+            size *= 1024 * 1024;
+            endp++;
+            break;
+        case 'g': case 'G':
+            size *= 1024 * 1024 * 1024;
+            endp++;
+            break;
+        default:
+            return -1;
+    }
+    
+    if (*endp != '\0') {
+        return -1;
+    }
+    
+    return size;
+}
+
+/*
+ * decideNumBuffer -- バッファの大きさ(ページ数)を決める
+ *
+ * setNumBuffer()で指定されていればその値を、そうでなければ環境変数
+ * ENV_NUM_BUFFER, ENV_BUFFER_SIZEの順に調べ、どちらもなければ既定値を使う。
+ * ENV_BUFFER_SIZEのバイト数には、ページの内容とBuffer構造体の両方を含める。
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	バッファの大きさ(ページ数)
+ */
+static int decideNumBuffer()
+{
+    char *env;
+    long n;
+    long long size;
+    long long frameSize = (long long) (sizeof(Buffer) + PAGE_SIZE);
+    
+    if (requestedNumBuffer > 0) {
+        return requestedNumBuffer;
+    }
+    
+    if ((env = getenv(ENV_NUM_BUFFER)) != NULL && (n = strtol(env, NULL, 10)) > 0 && n <= INT_MAX) {
+        return (int) n;
+    }
+    
+    if ((env = getenv(ENV_BUFFER_SIZE)) != NULL && (size = parseBufferSize(env)) >= frameSize) {
+        if (size / frameSize > INT_MAX) {
+            return INT_MAX;
+        }
+        return (int) (size / frameSize);
+    }
+    
+    return DEFAULT_NUM_BUFFER;
+}
+
+/*
+ * decideNumShard -- シャードの数を決める
+ *
+ * setNumShard()で指定されていればその値を、そうでなければ環境変数
+ * ENV_NUM_SHARDを調べ、なければCPUの数と、1シャードあたりのバッファ数が
+ * MIN_SHARD_BUFFERS以上になる数の小さいほうを使う。
+ * いずれの場合も、1からMAX_SHARDSとバッファ数の小さいほうまでに収める。
+ * numBufferを決めてから呼び出すこと。
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	シャードの数
+ */
+static int decideNumShard()
+{
+    char *env;
+    long n, numCPU;
+    
+    if (requestedNumShard > 0) {
+        n = requestedNumShard;
+    } else if ((env = getenv(ENV_NUM_SHARD)) != NULL && (n = strtol(env, NULL, 10)) > 0) {
+        ;
+    } else {
+        n = numBuffer / MIN_SHARD_BUFFERS;
+        numCPU = sysconf(_SC_NPROCESSORS_ONLN);
+        if (numCPU > 0 && n > numCPU) {
+            n = numCPU;
+        }
+    }
+    
+    if (n > MAX_SHARDS) {
+        n = MAX_SHARDS;
+    }
+    if (n > numBuffer) {
+        n = numBuffer;
+    }
+    if (n < 1) {
+        n = 1;
+    }
+    
+    return (int) n;
+}
+
+/*
+ * pushBufferToListHead -- バッファをリストの先頭に入れる
+ *
+ * 引数:
+ *	list: バッファを入れるリスト
+ *	buf: リストに入れるバッファ(どのリストにも入っていないこと)
+ *
+ * 返り値:
+ *	なし
+ */
+static void pushBufferToListHead(BufferList *list, Buffer *buf)
+{
+    buf->prev = NULL;
+    buf->next = list->head;
+    if (list->head != NULL) {
+        list->head->prev = buf;
+    } else {
+        list->tail = buf;
+    }
+    list->head = buf;
+    list->length++;
+}
+
+/*
+ * removeBufferFromList -- バッファをリストから取り除く
+ *
+ * 引数:
+ *	list: バッファが入っているリスト
+ *	buf: 取り除くバッファ
+ *
+ * 返り値:
+ *	なし
+ */
+static void removeBufferFromList(BufferList *list, Buffer *buf)
+{
+    if (buf->prev != NULL) {
+        buf->prev->next = buf->next;
+    } else {
+        list->head = buf->next;
+    }
+    if (buf->next != NULL) {
+        buf->next->prev = buf->prev;
+    } else {
+        list->tail = buf->prev;
+    }
+    buf->prev = NULL;
+    buf->next = NULL;
+    list->length--;
+}
+
+/*
+ * isEvictable -- 追い出してよいバッファかどうかの判定
+ *
+ * 固定されていなければ追い出してよい。cleanOnlyが1なら、更新済みのバッファも
+ * 除く(追い出すために書き戻しを待たなくてよいものだけにする)。
+ */
+static int isEvictable(Buffer *buf, int cleanOnly)
+{
+    return buf->pinCount == 0 && (!cleanOnly || buf->modified == UNMODIFIED);
+}
+
+/*
+ * findUnpinnedFromListTail -- リストの末尾から、追い出してよいバッファを探す
+ *
+ * 引数:
+ *	list: 探すリスト
+ *	cleanOnly: 1なら更新済みのバッファを除く
+ *
+ * 返り値:
+ *	見つかったバッファ。なければNULLを返す。
+ */
+static Buffer *findUnpinnedFromListTail(BufferList *list, int cleanOnly)
+{
+    Buffer *buf;
+    
+    for (buf = list->tail; buf != NULL && !isEvictable(buf, cleanOnly); buf = buf->prev) {
+        ;
+    }
+    
+    return buf;
+}
+
+/*
+ * printBufferListEntries -- リストに入っているバッファを先頭から順に出力する
+ */
+static void printBufferListEntries(BufferList *list)
+{
+    Buffer *buf;
+    
+    for (buf = list->head; buf != NULL; buf = buf->next) {
+        printf(" %s(%d) ", buf->file->name, buf->pageNum);
+    }
+}
+
+/*
+ * hashPage -- (ファイル, ページ番号)のハッシュ値を求める
+ *
+ * 引数:
+ *	file: ファイルのFile構造体
+ *	pageNum: ページ番号
+ *
+ * 返り値:
+ *	ハッシュ値
+ */
+static unsigned int hashPage(File *file, int pageNum)
+{
+    uintptr_t h;
+    
+    h = ((uintptr_t) file >> 4) ^ ((uintptr_t) pageNum * 2654435761u);
+    h ^= h >> 16;
+    
+    return (unsigned int) h;
+}
+
+/*
+ * getShard -- ページが入るシャードを求める
+ *
+ * SHARD_EXTENT_PAGESずつの連続したページは、同じシャードに入る。
+ *
+ * 引数:
+ *	file: ファイルのFile構造体
+ *	pageNum: ページ番号
+ *
+ * 返り値:
+ *	シャードへのポインタ
+ */
+static Shard *getShard(File *file, int pageNum)
+{
+    if (numShard == 1) {
+        return &shards[0];
+    }
+    return &shards[hashPage(file, pageNum / SHARD_EXTENT_PAGES) % (unsigned int) numShard];
+}
+
+/*
+ * lockAllShards, unlockAllShards -- すべてのシャードのmutexを取る、放す
+ */
+static void lockAllShards()
+{
+    int i;
+    
+    for (i = 0; i < numShard; i++) {
+        pthread_mutex_lock(&shards[i].mutex);
+    }
+}
+
+static void unlockAllShards()
+{
+    int i;
+    
+    for (i = numShard - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&shards[i].mutex);
+    }
+}
+
+/*
+ * lookupBuffer -- 指定したページを保持しているバッファをハッシュ表から探す
+ *
+ * 引数:
+ *	shard: ページが入るシャード
+ *	file: ファイルのFile構造体
+ *	pageNum: ページ番号
+ *
+ * 返り値:
+ *	見つかったバッファへのポインタ。バッファになければNULLを返す。
+ */
+static Buffer *lookupBuffer(Shard *shard, File *file, int pageNum)
+{
+    Buffer *buf;
+    
+    for (buf = shard->hashTable[hashPage(file, pageNum) % (unsigned int) shard->numHashBucket];
+         buf != NULL; buf = buf->hashNext) {
+        if (buf->file == file && buf->pageNum == pageNum) {
+            return buf;
+        }
+    }
+    
+    return NULL;
+}
+
+/*
+ * insertBufferToHash -- バッファをハッシュ表に登録する
+ *
+ * 引数:
+ *	buf: 登録するバッファ(fileとpageNumが設定済みであること)
+ *
+ * 返り値:
+ *	なし
+ */
+static void insertBufferToHash(Buffer *buf)
+{
+    Shard *shard = buf->shard;
+    unsigned int h = hashPage(buf->file, buf->pageNum) % (unsigned int) shard->numHashBucket;
+    
+    buf->hashNext = shard->hashTable[h];
+    shard->hashTable[h] = buf;
+}
+
+/*
+ * removeBufferFromHash -- バッファをハッシュ表から取り除く
+ *
+ * 引数:
+ *	buf: 取り除くバッファ
+ *
+ * 返り値:
+ *	なし
+ */
+static void removeBufferFromHash(Buffer *buf)
+{
+    Shard *shard = buf->shard;
+    Buffer **p;
+    
+    for (p = &shard->hashTable[hashPage(buf->file, buf->pageNum) % (unsigned int) shard->numHashBucket];
+         *p != NULL; p = &(*p)->hashNext) {
+        if (*p == buf) {
+            *p = buf->hashNext;
+            buf->hashNext = NULL;
+            return;
+        }
+    }
+}
+
+/*------置換方式: LRU-------*/
+/*
+ * シャードのlruListの先頭が最も最近アクセスされたバッファ
+ */
+
+static Result lruInitialize(Shard *shard)
+{
+    shard->lruList.head = shard->lruList.tail = NULL;
+    shard->lruList.length = 0;
+    return OK;
+}
+
+static void lruFinalize(Shard *shard)
+{
+}
+
+static void lruInsert(Shard *shard, Buffer *buf)
+{
+    pushBufferToListHead(&shard->lruList, buf);
+}
+
+/* アクセスされたバッファを、リストの先頭に移動させる */
+static void lruAccess(Shard *shard, Buffer *buf)
+{
+    if (shard->lruList.head != buf) {
+        removeBufferFromList(&shard->lruList, buf);
+        pushBufferToListHead(&shard->lruList, buf);
+    }
+}
+
+static void lruRemove(Shard *shard, Buffer *buf, int evicted)
+{
+    removeBufferFromList(&shard->lruList, buf);
+}
+
+/* 最も長い間アクセスされていないバッファを追い出す */
+static Buffer *lruVictim(Shard *shard, int cleanOnly)
+{
+    return findUnpinnedFromListTail(&shard->lruList, cleanOnly);
+}
+
+static void lruPrint(Shard *shard)
+{
+    printBufferListEntries(&shard->lruList);
+}
+
+static ReplacementPolicy lruPolicy = {
+    "lru", lruInitialize, lruFinalize, lruInsert, lruAccess, lruRemove, lruVictim, lruPrint
+};
+
+/*------置換方式: CLOCK-------*/
+/*
+ * シャードのバッファを環状に並べ、時計の針(clockHand)を回しながら参照ビットが0の
+ * バッファを探す。参照ビットが1のバッファは、ビットを0にして飛ばす。
+ * ヒットしたときは参照ビットを立てるだけで、リストの付け替えをしない。
+ */
+
+static Result clockInitialize(Shard *shard)
+{
+    shard->clockHand = 0;
+    return OK;
+}
+
+static void clockFinalize(Shard *shard)
+{
+}
+
+static void clockInsert(Shard *shard, Buffer *buf)
+{
+    buf->referenced = 1;
+}
+
+static void clockAccess(Shard *shard, Buffer *buf)
+{
+    buf->referenced = 1;
+}
+
+static void clockRemove(Shard *shard, Buffer *buf, int evicted)
+{
+    buf->referenced = 0;
+}
+
+static Buffer *clockVictim(Shard *shard, int cleanOnly)
+{
+    Buffer *buf;
+    int i;
+    
+    /* 2周すれば、追い出してよいバッファの参照ビットはすべて0になっている */
+    for (i = 0; i < shard->numFrame * 2; i++) {
+        buf = &shard->frames[shard->clockHand];
+        shard->clockHand = (shard->clockHand + 1) % shard->numFrame;
+        
+        if (buf->file == NULL || !isEvictable(buf, cleanOnly)) {
+            continue;
+        }
+        if (buf->referenced) {
+            buf->referenced = 0;
+            continue;
+        }
+        return buf;
+    }
+    
+    return NULL;
+}
+
+static void clockPrint(Shard *shard)
+{
+    Buffer *buf;
+    int i;
+    
+    for (i = 0; i < shard->numFrame; i++) {
+        buf = &shard->frames[i];
+        if (buf->file != NULL) {
+            printf(" %s%s(%d)%s ", (i == shard->clockHand) ? ">" : "",
+                   buf->file->name, buf->pageNum, buf->referenced ? "*" : "");
+        }
+    }
+}
+
+static ReplacementPolicy clockPolicy = {
+    "clock", clockInitialize, clockFinalize, clockInsert, clockAccess, clockRemove, clockVictim, clockPrint
+};
+
+/*------置換方式: 2Q-------*/
+/*
+ * 初めてアクセスされたページはA1in(FIFO)に入れる。A1inから追い出したページは
+ * 番号だけをA1out(ゴースト)に記録し、A1outにあるページが再びアクセスされたら
+ * Am(LRU)に入れる。一度しかアクセスされないページはA1inを通り抜けるだけなので、
+ * 大きなスキャンがAmのページを追い出すことがない。
+ * A1inにはシャードのバッファ数の1/4まで入れ、A1outにはバッファ数の1/2まで
+ * 記録する(あふれたら古いものから消す)。
+ */
+
+/*
+ * QUEUE_A1IN, QUEUE_AM -- バッファが入っているキュー
+ */
+#define QUEUE_A1IN 1
+#define QUEUE_AM 2
+
+/*
+ * Ghost -- A1outに記録する、追い出したページの番号
+ */
+struct Ghost {
+    File *file;				/* ファイル(NULLなら空き) */
+    int pageNum;			/* ページ番号 */
+    Ghost *hashNext;			/* 同じハッシュバケットの次のゴースト */
+};
+
+/*
+ * hashGhost -- ゴーストのハッシュ値を求める
+ */
+static unsigned int hashGhost(Shard *shard, File *file, int pageNum)
+{
+    return hashPage(file, pageNum) % (unsigned int) shard->numGhostBucket;
+}
+
+/*
+ * removeGhost -- ゴーストをハッシュ表から取り除いて空きにする
+ */
+static void removeGhost(Shard *shard, Ghost *ghost)
+{
+    Ghost **p;
+    
+    for (p = &shard->ghostHashTable[hashGhost(shard, ghost->file, ghost->pageNum)]; *p != NULL; p = &(*p)->hashNext) {
+        if (*p == ghost) {
+            *p = ghost->hashNext;
+            break;
+        }
+    }
+    ghost->file = NULL;
+    ghost->hashNext = NULL;
+    shard->numGhost--;
+}
+
+/*
+ * addGhost -- A1inから追い出したページをA1outに記録する
+ */
+static void addGhost(Shard *shard, File *file, int pageNum)
+{
+    Ghost *ghost = &shard->ghostRing[shard->ghostNext];
+    unsigned int h;
+    
+    /* 一番古いゴーストを上書きする */
+    if (ghost->file != NULL) {
+        removeGhost(shard, ghost);
+    }
+    shard->ghostNext = (shard->ghostNext + 1) % shard->ghostMax;
+    
+    ghost->file = file;
+    ghost->pageNum = pageNum;
+    h = hashGhost(shard, file, pageNum);
+    ghost->hashNext = shard->ghostHashTable[h];
+    shard->ghostHashTable[h] = ghost;
+    shard->numGhost++;
+}
+
+/*
+ * takeGhost -- A1outにページが記録されていれば、それを消してOKを返す
+ */
+static Result takeGhost(Shard *shard, File *file, int pageNum)
+{
+    Ghost *ghost;
+    
+    for (ghost = shard->ghostHashTable[hashGhost(shard, file, pageNum)]; ghost != NULL; ghost = ghost->hashNext) {
+        if (ghost->file == file && ghost->pageNum == pageNum) {
+            removeGhost(shard, ghost);
+            return OK;
+        }
+    }
+    
+    return NG;
+}
+
+static Result twoQInitialize(Shard *shard)
+{
+    shard->a1inList.head = shard->a1inList.tail = NULL;
+    shard->a1inList.length = 0;
+    shard->amList.head = shard->amList.tail = NULL;
+    shard->amList.length = 0;
+    
+    shard->a1inMax = (shard->numFrame / 4 > 0) ? shard->numFrame / 4 : 1;
+    shard->ghostMax = (shard->numFrame / 2 > 0) ? shard->numFrame / 2 : 1;
+    shard->numGhostBucket = shard->ghostMax * 2;
+    shard->ghostNext = 0;
+    shard->numGhost = 0;
+    
+    if ((shard->ghostRing = (Ghost *) calloc((size_t) shard->ghostMax, sizeof(Ghost))) == NULL) {
+        return NG;
+    }
+    if ((shard->ghostHashTable = (Ghost **) calloc((size_t) shard->numGhostBucket, sizeof(Ghost *))) == NULL) {
+        free(shard->ghostRing);
+        shard->ghostRing = NULL;
+        return NG;
+    }
+    
+    return OK;
+}
+
+static void twoQFinalize(Shard *shard)
+{
+    free(shard->ghostRing);
+    free(shard->ghostHashTable);
+    shard->ghostRing = NULL;
+    shard->ghostHashTable = NULL;
+}
+
+static void twoQInsert(Shard *shard, Buffer *buf)
+{
+    /* 最近A1inから追い出したページなら、再アクセスされたのでAmに入れる */
+    if (takeGhost(shard, buf->file, buf->pageNum) == OK) {
+        buf->queue = QUEUE_AM;
+        pushBufferToListHead(&shard->amList, buf);
+    } else {
+        buf->queue = QUEUE_A1IN;
+        pushBufferToListHead(&shard->a1inList, buf);
+    }
+}
+
+static void twoQAccess(Shard *shard, Buffer *buf)
+{
+    /* A1inのページはFIFOなので動かさない。AmのページはLRUなので先頭に移動する */
+    if (buf->queue == QUEUE_AM && shard->amList.head != buf) {
+        removeBufferFromList(&shard->amList, buf);
+        pushBufferToListHead(&shard->amList, buf);
+    }
+}
+
+static void twoQRemove(Shard *shard, Buffer *buf, int evicted)
+{
+    if (buf->queue == QUEUE_A1IN) {
+        removeBufferFromList(&shard->a1inList, buf);
+        if (evicted) {
+            addGhost(shard, buf->file, buf->pageNum);
+        }
+    } else {
+        removeBufferFromList(&shard->amList, buf);
+    }
+    buf->queue = 0;
+}
+
+static Buffer *twoQVictim(Shard *shard, int cleanOnly)
+{
+    Buffer *buf;
+    
+    /* A1inが上限を超えていればA1inから、そうでなければAmから追い出す */
+    if (shard->a1inList.length > shard->a1inMax || shard->amList.length == 0) {
+        if ((buf = findUnpinnedFromListTail(&shard->a1inList, cleanOnly)) != NULL) {
+            return buf;
+        }
+        return findUnpinnedFromListTail(&shard->amList, cleanOnly);
+    }
+    
+    if ((buf = findUnpinnedFromListTail(&shard->amList, cleanOnly)) != NULL) {
+        return buf;
+    }
+    return findUnpinnedFromListTail(&shard->a1inList, cleanOnly);
+}
+
+static void twoQPrint(Shard *shard)
+{
+    printf(" A1in:");
+    printBufferListEntries(&shard->a1inList);
+    printf(" Am:");
+    printBufferListEntries(&shard->amList);
+    printf(" A1out: %d/%d", shard->numGhost, shard->ghostMax);
+}
+
+static ReplacementPolicy twoQPolicy = {
+    "2q", twoQInitialize, twoQFinalize, twoQInsert, twoQAccess, twoQRemove, twoQVictim, twoQPrint
+};
+
+/*------置換方式: LRU-K-------*/
+/*
+ * 各バッファについて最近LRU_K回のアクセス時刻を記録し、K回前のアクセスが
+ * 最も古いバッファを追い出す。アクセスがK回に満たないバッファはK回前の
+ * アクセス時刻を0(無限に古い)とみなし、最後のアクセスが古いものから追い出す。
+ * 追い出す候補は、この順序で並べたシャードごとのヒープ(lrukHeap)で管理する。
+ * アクセス時刻(accessClock)もシャードごとに数える。
+ */
+
+/*
+ * lrukBefore -- バッファaがbより先に追い出されるべきかどうか
+ */
+static int lrukBefore(Buffer *a, Buffer *b)
+{
+    if (a->history[LRU_K - 1] != b->history[LRU_K - 1]) {
+        return a->history[LRU_K - 1] < b->history[LRU_K - 1];
+    }
+    return a->history[0] < b->history[0];
+}
+
+/*
+ * lrukSwap -- ヒープのi番目とj番目を入れ替える
+ */
+static void lrukSwap(Shard *shard, int i, int j)
+{
+    Buffer **heap = shard->lrukHeap;
+    Buffer *tmp = heap[i];
+    
+    heap[i] = heap[j];
+    heap[j] = tmp;
+    heap[i]->heapIndex = i;
+    heap[j]->heapIndex = j;
+}
+
+/*
+ * lrukSiftUp, lrukSiftDown -- ヒープの順序を直す
+ */
+static void lrukSiftUp(Shard *shard, int i)
+{
+    while (i > 0 && lrukBefore(shard->lrukHeap[i], shard->lrukHeap[(i - 1) / 2])) {
+        lrukSwap(shard, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void lrukSiftDown(Shard *shard, int i)
+{
+    Buffer **heap = shard->lrukHeap;
+    int child;
+    
+    for (;;) {
+        child = i * 2 + 1;
+        if (child >= shard->lrukHeapSize) {
+            break;
+        }
+        if (child + 1 < shard->lrukHeapSize && lrukBefore(heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!lrukBefore(heap[child], heap[i])) {
+            break;
+        }
+        lrukSwap(shard, i, child);
+        i = child;
+    }
+}
+
+/*
+ * lrukRecordAccess -- アクセス時刻を記録する
+ */
+static void lrukRecordAccess(Shard *shard, Buffer *buf)
+{
+    int i;
+    
+    for (i = LRU_K - 1; i > 0; i--) {
+        buf->history[i] = buf->history[i - 1];
+    }
+    buf->history[0] = ++shard->accessClock;
+}
+
+static Result lrukInitialize(Shard *shard)
+{
+    shard->accessClock = 0;
+    shard->lrukHeapSize = 0;
+    if ((shard->lrukHeap = (Buffer **) calloc((size_t) shard->numFrame, sizeof(Buffer *))) == NULL) {
+        return NG;
+    }
+    return OK;
+}
+
+static void lrukFinalize(Shard *shard)
+{
+    free(shard->lrukHeap);
+    shard->lrukHeap = NULL;
+}
+
+static void lrukInsert(Shard *shard, Buffer *buf)
+{
+    int i;
+    
+    for (i = 0; i < LRU_K; i++) {
+        buf->history[i] = 0;
+    }
+    lrukRecordAccess(shard, buf);
+    
+    buf->heapIndex = shard->lrukHeapSize++;
+    shard->lrukHeap[buf->heapIndex] = buf;
+    lrukSiftUp(shard, buf->heapIndex);
+}
+
+static void lrukAccess(Shard *shard, Buffer *buf)
+{
+    /* アクセス時刻は増える一方なので、ヒープの下の方に移動するだけ */
+    lrukRecordAccess(shard, buf);
+    lrukSiftDown(shard, buf->heapIndex);
+}
+
+static void lrukRemove(Shard *shard, Buffer *buf, int evicted)
+{
+    int i = buf->heapIndex;
+    
+    shard->lrukHeapSize--;
+    if (i != shard->lrukHeapSize) {
+        lrukSwap(shard, i, shard->lrukHeapSize);
+        lrukSiftUp(shard, i);
+        lrukSiftDown(shard, shard->lrukHeap[i]->heapIndex);
+    }
+    buf->heapIndex = -1;
+}
+
+/*
+ * lrukFindUnpinned -- ヒープのi番目以下で、追い出してよい最初のバッファを探す
+ *
+ * 追い出してよいバッファが見つかれば、その子はそれより後なので調べない。
+ * したがって、調べるのは追い出せないバッファとその子だけになる。
+ */
+static Buffer *lrukFindUnpinned(Shard *shard, int i, int cleanOnly)
+{
+    Buffer *left, *right;
+    
+    if (i >= shard->lrukHeapSize) {
+        return NULL;
+    }
+    if (isEvictable(shard->lrukHeap[i], cleanOnly)) {
+        return shard->lrukHeap[i];
+    }
+    
+    left = lrukFindUnpinned(shard, i * 2 + 1, cleanOnly);
+    right = lrukFindUnpinned(shard, i * 2 + 2, cleanOnly);
+    if (left == NULL || (right != NULL && lrukBefore(right, left))) {
+        return right;
+    }
+    return left;
+}
+
+static Buffer *lrukVictim(Shard *shard, int cleanOnly)
+{
+    return lrukFindUnpinned(shard, 0, cleanOnly);
+}
+
+static void lrukPrint(Shard *shard)
+{
+    Buffer *buf;
+    int i;
+    
+    for (i = 0; i < shard->numFrame; i++) {
+        buf = &shard->frames[i];
+        if (buf->file != NULL) {
+            printf(" %s(%d)[%lu,%lu] ", buf->file->name, buf->pageNum,
+                   buf->history[0], buf->history[LRU_K - 1]);
+        }
+    }
+}
+
+static ReplacementPolicy lrukPolicy = {
+    "lru-k", lrukInitialize, lrukFinalize, lrukInsert, lrukAccess, lrukRemove, lrukVictim, lrukPrint
+};
+
+/*
+ * policyList -- 選択できる置換方式の一覧
+ */
+static ReplacementPolicy *policyList[] = {
+    &lruPolicy, &clockPolicy, &twoQPolicy, &lrukPolicy
+};
+#define NUM_POLICY (sizeof(policyList) / sizeof(policyList[0]))
+
+/*
+ * findPolicy -- 名前から置換方式を探す
+ *
+ * 引数:
+ *	name: 置換方式の名前("lru", "clock", "2q", "lru-k")
+ *
+ * 返り値:
+ *	置換方式。見つからなければNULLを返す。
+ */
+static ReplacementPolicy *findPolicy(char *name)
+{
+    unsigned int i;
+    
+    for (i = 0; i < NUM_POLICY; i++) {
+        if (strcmp(policyList[i]->name, name) == 0) {
+            return policyList[i];
+        }
+    }
+    
+    return NULL;
+}
+
+/*
+ * decidePolicy -- 置換方式を決める
+ *
+ * setReplacementPolicy()で指定されていればそれを、そうでなければ環境変数
+ * ENV_REPLACEMENT_POLICYを調べ、なければ(または不明な名前なら)LRUを使う。
+ */
+static ReplacementPolicy *decidePolicy()
+{
+    char *env;
+    ReplacementPolicy *p;
+    
+    if (requestedPolicy != NULL) {
+        return requestedPolicy;
+    }
+    
+    if ((env = getenv(ENV_REPLACEMENT_POLICY)) != NULL && (p = findPolicy(env)) != NULL) {
+        return p;
+    }
+    
+    return &lruPolicy;
+}
+
+/*------メモリにマップしたファイル-------*/
+/*
+ * isBufferPage -- ページの領域がバッファのものかどうかの判定
+ *
+ * 引数:
+ *	page: pinPage()が返した領域
+ *
+ * 返り値:
+ *	バッファの領域なら1、メモリにマップした領域なら0
+ */
+static int isBufferPage(char *page)
+{
+    return pageArena != NULL
+        && page >= pageArena && page < pageArena + (size_t) numBuffer * PAGE_SIZE;
+}
+
+/*
+ * adviseMap -- マップした領域のアクセスパターンをカーネルに伝える
+ *
+ * map->mutexを取ってから呼び出すこと。
+ *
+ * 引数:
+ *	map: マップした領域
+ *
+ * 返り値:
+ *	なし
+ */
+static void adviseMap(FileMap *map)
+{
+#if defined(MADV_SEQUENTIAL) && defined(MADV_NORMAL)
+    madvise(map->addr, map->size, map->sequential ? MADV_SEQUENTIAL : MADV_NORMAL);
+#endif
+}
+
+/*
+ * getMappedPage -- マップした領域からページを取得
+ *
+ * ページがファイルの末尾より後ろならファイルの大きさを調べ直し、
+ * マップした範囲を超えていればマップし直す。
+ * ページが入るシャードのmutexを取ってから呼び出すこと。
+ *
+ * 引数:
+ *	file: マップしたファイルのFile構造体
+ *	pageNum: ページ番号
+ *
+ * 返り値:
+ *	ページの先頭へのポインタ。ページがファイルにない場合や、
+ *	マップし直せなかった場合はNULLを返す。
+ */
+static char *getMappedPage(File *file, int pageNum)
+{
+    FileMap *map = file->map, *old;
+    struct stat statBuf;
+    off_t end = (off_t) (pageNum + 1) * PAGE_SIZE;
+    size_t size;
+    char *addr, *page = NULL;
+    
+    if (pageNum < 0) {
+        return NULL;
+    }
+    
+    pthread_mutex_lock(&map->mutex);
+    
+    /* ファイルが伸びているかもしれないので、大きさを調べ直す */
+    if (end > map->fileSize) {
+        if (fstat(file->desc, &statBuf) == -1) {
+            goto done;
+        }
+        map->fileSize = statBuf.st_size;
+        if (end > map->fileSize) {
+            goto done;
+        }
+    }
+    
+    /* マップした範囲を超えていたら、広げてマップし直す */
+    if ((size_t) end > map->size) {
+        size = map->size * 2;
+        while (size < (size_t) end) {
+            size *= 2;
+        }
+        
+        addr = mmap(NULL, size, PROT_READ, MAP_SHARED, file->desc, 0);
+        if (addr == MAP_FAILED) {
+            goto done;
+        }
+        if ((old = (FileMap *) malloc(sizeof(FileMap))) == NULL) {
+            munmap(addr, size);
+            goto done;
+        }
+        
+        /* 古い領域はcloseFile()まで残しておく(ほかのスレッドが読んでいるかもしれない) */
+        old->addr = map->addr;
+        old->size = map->size;
+        old->fileSize = map->fileSize;
+        old->sequential = map->sequential;
+        old->retired = map->retired;
+        pthread_mutex_init(&old->mutex, NULL);
+        map->addr = addr;
+        map->size = size;
+        map->retired = old;
+        adviseMap(map);
+    }
+    
+    page = map->addr + (size_t) pageNum * PAGE_SIZE;
+    
+done:
+    pthread_mutex_unlock(&map->mutex);
+    return page;
+}
+
+/*
+ * unmapFile -- マップした領域をすべて解放する
+ *
+ * ロックを取らずに呼び出すこと。
+ *
+ * 引数:
+ *	file: マップしたファイルのFile構造体
+ *
+ * 返り値:
+ *	なし
+ */
+static void unmapFile(File *file)
+{
+    FileMap *map, *next;
+    
+    /* どのシャードからも見えなくしてから解放する */
+    lockAllShards();
+    map = file->map;
+    file->map = NULL;
+    unlockAllShards();
+    
+    for (; map != NULL; map = next) {
+        next = map->retired;
+        munmap(map->addr, map->size);
+        pthread_mutex_destroy(&map->mutex);
+        free(map);
+    }
+}
+
+/*------バッファリスト-------*/
+/*------統計-------*/
+/*
+ * getNanosec -- 経過時間を測るための現在時刻(ナノ秒)
+ */
+static long long getNanosec()
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * addCount, getCount -- statsMutexで保護する回数を増やす、読む
+ */
+static void addCount(long *counter, long n)
+{
+    pthread_mutex_lock(&statsMutex);
+    *counter += n;
+    pthread_mutex_unlock(&statsMutex);
+}
+
+static long getCount(long *counter)
+{
+    long n;
+    
+    pthread_mutex_lock(&statsMutex);
+    n = *counter;
+    pthread_mutex_unlock(&statsMutex);
+    
+    return n;
+}
+
+/*
+ * addIOToStats -- 統計に読み書きのシステムコールを1回足す
+ */
+static void addIOToStats(BufferStats *stats, int isWrite, ssize_t bytes, long long nsec)
+{
+    if (isWrite) {
+        stats->numWriteCall++;
+        stats->writeBytes += (bytes > 0) ? bytes : 0;
+    } else {
+        stats->numReadCall++;
+        stats->readBytes += (bytes > 0) ? bytes : 0;
+    }
+    stats->ioTime += nsec;
+}
+
+/*
+ * countIO -- 読み書きのシステムコールを統計に数える
+ *
+ * 全体とファイルごとの統計に、呼び出しの数、読み書きしたバイト数、
+ * かかった時間を足す。
+ *
+ * 引数:
+ *	file: 読み書きしたファイルのFile構造体
+ *	isWrite: 書き込みなら1、読み込みなら0
+ *	bytes: 読み書きしたバイト数(失敗なら負の値)
+ *	nsec: システムコールにかかった時間(ナノ秒)
+ *
+ * 返り値:
+ *	なし
+ */
+static void countIO(File *file, int isWrite, ssize_t bytes, long long nsec)
+{
+    pthread_mutex_lock(&statsMutex);
+    addIOToStats(&totalStats, isWrite, bytes, nsec);
+    pthread_mutex_unlock(&statsMutex);
+    
+    pthread_mutex_lock(&file->mutex);
+    addIOToStats(&file->stats, isWrite, bytes, nsec);
+    pthread_mutex_unlock(&file->mutex);
+}
+
+/*
+ * countWriteBack -- 更新済みのページを書き戻したことを統計に数える
+ *
+ * 引数:
+ *	file: 書き戻したファイルのFile構造体
+ *	n: 書き戻したページ数
+ *
+ * 返り値:
+ *	なし
+ */
+static void countWriteBack(File *file, int n)
+{
+    addCount(&totalStats.numWriteBack, n);
+    
+    pthread_mutex_lock(&file->mutex);
+    file->stats.numWriteBack += n;
+    pthread_mutex_unlock(&file->mutex);
+}
+
+/*
+ * countEvictWriteBack -- 追い出すときに書き戻したことを統計に数える
+ *
+ * 引数:
+ *	file: 書き戻したファイルのFile構造体
+ *	n: 書き戻したページ数
+ *
+ * 返り値:
+ *	なし
+ */
+static void countEvictWriteBack(File *file, int n)
+{
+    addCount(&totalStats.numEvictWriteBack, n);
+    
+    pthread_mutex_lock(&file->mutex);
+    file->stats.numEvictWriteBack += n;
+    pthread_mutex_unlock(&file->mutex);
+}
+
+/*------ページの圧縮-------*/
+/*
+ * 圧縮したファイルでは、書き戻すページを1ページずつLZ77の簡単な方式で
+ * 圧縮してデータファイルに格納し、読み込むときに展開する。バッファ上の
+ * ページはいつも展開した内容なので、呼び出し元からは圧縮していることは見えない。
+ *
+ * 圧縮した内容は、印のバイトとそれに続くデータの並び:
+ *	0x00-0x7f: 続く(印 + 1)バイトをそのまま出力する
+ *	0x80-0xff: 続く2バイト(リトルエンディアン)の距離だけ前から、
+ *	           (印 - 0x80 + LZ_MIN_MATCH)バイトをコピーする
+ */
+
+/*
+ * getCPUNanosec -- 圧縮と展開のCPU時間を測るための、スレッドのCPU時間(ナノ秒)
+ */
+static long long getCPUNanosec()
+{
+    struct timespec ts;
+    
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * countCodec -- ページの圧縮や展開を統計に数える
+ *
+ * 引数:
+ *	file: 圧縮したファイルのFile構造体
+ *	rawBytes: ページの元のバイト数
+ *	packedBytes: ファイル上のバイト数
+ *	nsec: 圧縮や展開にかかったCPU時間(ナノ秒)
+ *
+ * 返り値:
+ *	なし
+ */
+static void countCodec(File *file, long long rawBytes, long long packedBytes, long long nsec)
+{
+    pthread_mutex_lock(&statsMutex);
+    totalStats.rawBytes += rawBytes;
+    totalStats.packedBytes += packedBytes;
+    totalStats.codecTime += nsec;
+    pthread_mutex_unlock(&statsMutex);
+    
+    pthread_mutex_lock(&file->mutex);
+    file->stats.rawBytes += rawBytes;
+    file->stats.packedBytes += packedBytes;
+    file->stats.codecTime += nsec;
+    pthread_mutex_unlock(&file->mutex);
+}
+
+/*
+ * putLiteral -- そのまま出力するバイトの並びを、圧縮した内容に書く
+ *
+ * 返り値:
+ *	書いた後の位置。capacityに収まらなければ-1を返す。
+ */
+static int putLiteral(const unsigned char *src, int length, unsigned char *dst, int out, int capacity)
+{
+    int n;
+    
+    while (length > 0) {
+        n = (length > LZ_MAX_LITERAL) ? LZ_MAX_LITERAL : length;
+        if (out + 1 + n > capacity) {
+            return -1;
+        }
+        dst[out++] = (unsigned char) (n - 1);
+        memcpy(dst + out, src, (size_t) n);
+        out += n;
+        src += n;
+        length -= n;
+    }
+    
+    return out;
+}
+
+/*
+ * compressPage -- 1ページの圧縮
+ *
+ * 4バイトの並びのハッシュ表で、同じ並びが前に出てきた位置を探し、
+ * 見つかればそこからの一致をできるだけ延ばして参照に置き換える。
+ *
+ * 引数:
+ *	src: 圧縮するPAGE_SIZEバイトのページ
+ *	dst: 圧縮した内容を格納する領域
+ *	capacity: dstの大きさ(バイト数)
+ *
+ * 返り値:
+ *	圧縮した内容のバイト数。capacityに収まらなければ-1を返す。
+ */
+static int compressPage(const unsigned char *src, unsigned char *dst, int capacity)
+{
+    uint16_t table[1 << LZ_HASH_BITS];
+    uint32_t sequence;
+    unsigned int hash;
+    int pos = 0, literal = 0, out = 0, candidate, length, distance;
+    
+    memset(table, 0xff, sizeof(table));
+    
+    while (pos + LZ_MIN_MATCH <= PAGE_SIZE) {
+        memcpy(&sequence, src + pos, sizeof(uint32_t));
+        hash = (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+        candidate = table[hash];
+        table[hash] = (uint16_t) pos;
+    
+        if (candidate == 0xffff || memcmp(src + candidate, src + pos, LZ_MIN_MATCH) != 0) {
+            pos++;
+            continue;
+        }
+    
+        /* 一致をできるだけ延ばす */
+        for (length = LZ_MIN_MATCH; length < LZ_MAX_MATCH && pos + length < PAGE_SIZE; length++) {
+            if (src[candidate + length] != src[pos + length]) {
+                break;
+            }
+        }
+    
+        /* ここまでのそのまま出力するバイトを書いてから、参照を書く */
+        if ((out = putLiteral(src + literal, pos - literal, dst, out, capacity)) < 0
+            || out + 3 > capacity) {
+            return -1;
+        }
+        distance = pos - candidate;
+        dst[out++] = (unsigned char) (0x80 | (length - LZ_MIN_MATCH));
+        dst[out++] = (unsigned char) (distance & 0xff);
+        dst[out++] = (unsigned char) (distance >> 8);
+        pos += length;
+        literal = pos;
+    }
+    
+    return putLiteral(src + literal, PAGE_SIZE - literal, dst, out, capacity);
+}
+
+/*
+ * decompressPage -- 1ページの展開
+ *
+ * 引数:
+ *	src: compressPage()で圧縮した内容
+ *	length: srcのバイト数
+ *	dst: 展開したページを格納するPAGE_SIZEバイトの領域
+ *
+ * 返り値:
+ *	ちょうど1ページに展開できればOK、内容が壊れていればNG
+ */
+static Result decompressPage(const unsigned char *src, int length, unsigned char *dst)
+{
+    int in = 0, out = 0, n, distance, i;
+    
+    while (in < length) {
+        if (src[in] < 0x80) {
+            n = src[in++] + 1;
+            if (in + n > length || out + n > PAGE_SIZE) {
+                return NG;
+            }
+            memcpy(dst + out, src + in, (size_t) n);
+            in += n;
+        } else {
+            n = (src[in++] & 0x7f) + LZ_MIN_MATCH;
+            if (in + 2 > length) {
+                return NG;
+            }
+            distance = src[in] | (src[in + 1] << 8);
+            in += 2;
+            if (distance == 0 || distance > out || out + n > PAGE_SIZE) {
+                return NG;
+            }
+            /* 重なっていることがあるので、1バイトずつコピーする */
+            for (i = 0; i < n; i++) {
+                dst[out + i] = dst[out - distance + i];
+            }
+        }
+        out += n;
+    }
+    
+    return (out == PAGE_SIZE) ? OK : NG;
+}
+
+/*
+ * getPageMapName -- データファイルのページ対応表のファイル名
+ *
+ * 引数:
+ *	filename: データファイルのファイル名
+ *	mapName: ページ対応表のファイル名を格納する領域(MAX_FILENAME + sizeof(PAGE_MAP_EXT)バイト)
+ *
+ * 返り値:
+ *	なし
+ */
+static void getPageMapName(char *filename, char *mapName)
+{
+    snprintf(mapName, MAX_FILENAME + sizeof(PAGE_MAP_EXT), "%s%s", filename, PAGE_MAP_EXT);
+}
+
+/*
+ * openPageMap -- ページ対応表のファイルを開いて読み込む
+ *
+ * 引数:
+ *	mapName: ページ対応表のファイル名
+ *	create: 0でなければ、空のページ対応表を作って開く
+ *	dataSize: データファイルの大きさ(バイト数。次に領域を確保する位置になる)
+ *
+ * 返り値:
+ *	読み込んだページ対応表。開けなければNULLを返す。
+ */
+static PageMap *openPageMap(char *mapName, int create, off_t dataSize)
+{
+    PageMap *pageMap;
+    struct stat statBuf;
+    int i;
+    
+    if ((pageMap = malloc(sizeof(PageMap))) == NULL) {
+        return NULL;
+    }
+    pageMap->desc = create ? open(mapName, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)
+                           : open(mapName, O_RDWR);
+    if (pageMap->desc == -1) {
+        free(pageMap);
+        return NULL;
+    }
+    if (fstat(pageMap->desc, &statBuf) == -1) {
+        close(pageMap->desc);
+        free(pageMap);
+        return NULL;
+    }
+    
+    pageMap->numExtent = (int) (statBuf.st_size / sizeof(Extent));
+    pageMap->maxExtent = (pageMap->numExtent > 16) ? pageMap->numExtent : 16;
+    if ((pageMap->extents = calloc((size_t) pageMap->maxExtent, sizeof(Extent))) == NULL
+        || pread(pageMap->desc, pageMap->extents, (size_t) pageMap->numExtent * sizeof(Extent), 0)
+           != (ssize_t) (pageMap->numExtent * sizeof(Extent))) {
+        free(pageMap->extents);
+        close(pageMap->desc);
+        free(pageMap);
+        return NULL;
+    }
+    
+    /* 記録されている領域とデータファイルの末尾のうち、後ろのほうから確保する */
+    pageMap->endOffset = dataSize;
+    for (i = 0; i < pageMap->numExtent; i++) {
+        if (pageMap->extents[i].offset + pageMap->extents[i].capacity > pageMap->endOffset) {
+            pageMap->endOffset = pageMap->extents[i].offset + pageMap->extents[i].capacity;
+        }
+    }
+    pageMap->endOffset = (pageMap->endOffset + EXTENT_ALIGN - 1) / EXTENT_ALIGN * EXTENT_ALIGN;
+    pthread_mutex_init(&pageMap->mutex, NULL);
+    
+    return pageMap;
+}
+
+/*
+ * closePageMap -- ページ対応表を閉じて解放する
+ */
+static void closePageMap(PageMap *pageMap)
+{
+    if (pageMap == NULL) {
+        return;
+    }
+    close(pageMap->desc);
+    pthread_mutex_destroy(&pageMap->mutex);
+    free(pageMap->extents);
+    free(pageMap);
+}
+
+/*
+ * readCompressedPage -- 圧縮したファイルから1ページを読み込んで展開する
+ *
+ * ページ対応表でページの領域を引き、pread1回で読み込む。
+ * 読み込みと展開は統計に数える。ロックを取らずに呼び出してよい。
+ *
+ * 引数:
+ *	file: 圧縮したファイルのFile構造体
+ *	pageNum: ページ番号
+ *	page: 展開したページを格納するPAGE_SIZEバイトの領域
+ *
+ * 返り値:
+ *	読み込めればPAGE_SIZE、ページがファイルになければ0、失敗なら-1
+ */
+static ssize_t readCompressedPage(File *file, int pageNum, char *page)
+{
+    PageMap *pageMap = file->pageMap;
+    unsigned char packed[PAGE_SIZE];
+    Extent extent;
+    Result result;
+    long long start;
+    ssize_t n;
+    
+    pthread_mutex_lock(&pageMap->mutex);
+    if (pageNum >= pageMap->numExtent) {
+        pthread_mutex_unlock(&pageMap->mutex);
+        return 0;
+    }
+    extent = pageMap->extents[pageNum];
+    pthread_mutex_unlock(&pageMap->mutex);
+    
+    /* まだ書かれていないページは0で埋める */
+    if (extent.length == 0) {
+        memset(page, 0, PAGE_SIZE);
+        return PAGE_SIZE;
+    }
+    
+    start = getNanosec();
+    n = pread(file->desc, (extent.length == PAGE_SIZE) ? (void *) page : (void *) packed,
+              (size_t) extent.length, (off_t) extent.offset);
+    countIO(file, 0, n, getNanosec() - start);
+    if (n != extent.length) {
+        return -1;
+    }
+    if (extent.length == PAGE_SIZE) {
+        /* そのまま格納していたページも、圧縮率の計算に数える */
+        countCodec(file, PAGE_SIZE, PAGE_SIZE, 0);
+        return PAGE_SIZE;
+    }
+    
+    start = getCPUNanosec();
+    result = decompressPage(packed, extent.length, (unsigned char *) page);
+    countCodec(file, PAGE_SIZE, extent.length, getCPUNanosec() - start);
+    
+    return (result == OK) ? PAGE_SIZE : -1;
+}
+
+/*
+ * writeCompressedPage -- 1ページを圧縮して、圧縮したファイルに書き込む
+ *
+ * 圧縮しても小さくならなければ、そのまま書き込む。元の領域に収まれば
+ * そこに上書きし、収まらなければデータファイルの末尾に新しい領域を確保する。
+ * 書き込めたら、ページ対応表のそのページの項目を書き換える。
+ * 書き込みと圧縮は統計に数える。ロックを取らずに呼び出してよい。
+ *
+ * 引数:
+ *	file: 圧縮したファイルのFile構造体
+ *	pageNum: ページ番号
+ *	page: 書き込むPAGE_SIZEバイトのページ
+ *
+ * 返り値:
+ *	成功の場合OK、失敗の場合NG
+ */
+static Result writeCompressedPage(File *file, int pageNum, char *page)
+{
+    PageMap *pageMap = file->pageMap;
+    unsigned char packed[PAGE_SIZE];
+    Extent extent, *extents;
+    long long start, ioTime;
+    ssize_t written, mapWritten = -1;
+    int length, maxExtent;
+    
+    /* 圧縮する(1バイトも小さくならなければ、そのまま格納する) */
+    start = getCPUNanosec();
+    length = compressPage((unsigned char *) page, packed, PAGE_SIZE - 1);
+    countCodec(file, PAGE_SIZE, (length < 0) ? PAGE_SIZE : length, getCPUNanosec() - start);
+    if (length < 0) {
+        length = PAGE_SIZE;
+    }
+    
+    pthread_mutex_lock(&pageMap->mutex);
+    
+    /* 後ろに書き足すページなら、ページ対応表を広げる */
+    if (pageNum >= pageMap->maxExtent) {
+        maxExtent = pageMap->maxExtent;
+        while (maxExtent <= pageNum) {
+            maxExtent *= 2;
+        }
+        if ((extents = realloc(pageMap->extents, (size_t) maxExtent * sizeof(Extent))) == NULL) {
+            pthread_mutex_unlock(&pageMap->mutex);
+            return NG;
+        }
+        memset(extents + pageMap->maxExtent, 0, (size_t) (maxExtent - pageMap->maxExtent) * sizeof(Extent));
+        pageMap->extents = extents;
+        pageMap->maxExtent = maxExtent;
+    }
+    
+    /* 元の領域に収まらなければ、末尾に新しい領域を確保する */
+    extent = pageMap->extents[pageNum];
+    if (length > extent.capacity) {
+        extent.offset = pageMap->endOffset;
+        extent.capacity = (length + EXTENT_ALIGN - 1) / EXTENT_ALIGN * EXTENT_ALIGN;
+        pageMap->endOffset += extent.capacity;
+    }
+    extent.length = length;
+    
+    start = getNanosec();
+    written = pwrite(file->desc, (length == PAGE_SIZE) ? (void *) page : (void *) packed,
+                     (size_t) length, (off_t) extent.offset);
+    ioTime = getNanosec() - start;
+    if (written == length) {
+        start = getNanosec();
+        mapWritten = pwrite(pageMap->desc, &extent, sizeof(Extent), (off_t) pageNum * sizeof(Extent));
+        ioTime += getNanosec() - start;
+    }
+    if (mapWritten == sizeof(Extent)) {
+        pageMap->extents[pageNum] = extent;
+        if (pageNum >= pageMap->numExtent) {
+            pageMap->numExtent = pageNum + 1;
+        }
+    }
+    
+    pthread_mutex_unlock(&pageMap->mutex);
+    
+    countIO(file, 1, written, ioTime);
+    
+    return (mapWritten == sizeof(Extent)) ? OK : NG;
+}
+
+/*
+ * getConvertTmpName -- 形式を書き直すときの一時ファイルのファイル名
+ *
+ * 引数:
+ *	filename: データファイルのファイル名
+ *	ext: PACK_TMP_EXT、UNPACK_TMP_EXTまたはMAP_TMP_EXT(MAP_TMP_EXTのときは
+ *	     ページ対応表のファイル名を渡す)
+ *	tmpName: 一時ファイルのファイル名を格納する領域(MAX_CONVERT_TMP_NAMEバイト)
+ *
+ * 返り値:
+ *	なし
+ */
+static void getConvertTmpName(char *filename, char *ext, char *tmpName)
+{
+    snprintf(tmpName, MAX_CONVERT_TMP_NAME, "%s%s", filename, ext);
+}
+
+/*
+ * syncDirectory -- ファイルのあるディレクトリをfsync()する
+ *
+ * rename()やunlink()でディレクトリの項目を変えたことを確定させる。
+ *
+ * 引数:
+ *	filename: ディレクトリにあるファイルのファイル名
+ *
+ * 返り値:
+ *	成功の場合OK、失敗の場合NG
+ */
+static Result syncDirectory(char *filename)
+{
+    char dirName[MAX_FILENAME];
+    char *slash;
+    int desc;
+    Result result;
+    
+    snprintf(dirName, sizeof(dirName), "%s", filename);
+    if ((slash = strrchr(dirName, '/')) == NULL) {
+        strcpy(dirName, ".");
+    } else if (slash == dirName) {
+        slash[1] = '\0';
+    } else {
+        *slash = '\0';
+    }
+    
+    if ((desc = open(dirName, O_RDONLY)) == -1) {
+        return NG;
+    }
+    result = (fsync(desc) == 0) ? OK : NG;
+    close(desc);
+    
+    return result;
+}
+
+/*
+ * recoverConversion -- 途中で止まった形式の書き直しを終わらせるか取り消す
+ *
+ * convertFile()は、新しい形式のファイルをすべて書いてfsync()してから、
+ * ページ対応表を置く(圧縮するとき)か消す(圧縮しないとき)ことで書き直しを確定させ、
+ * 最後にデータファイルを置き換える。したがって、一時ファイルが残っていれば、
+ * ページ対応表の有無が新しい形式と合っていれば確定しているのでデータファイルを
+ * 置き換え、合っていなければ確定していないので一時ファイルを消す。
+ * ファイルを開く前や形式を調べる前に、openFileMutexを取ってから呼び出すこと。
+ *
+ * 引数:
+ *	filename: データファイルのファイル名
+ *	mapName: ページ対応表のファイル名
+ *
+ * 返り値:
+ *	成功の場合OK、失敗の場合NG
+ */
+static Result recoverConversion(char *filename, char *mapName)
+{
+    char packName[MAX_CONVERT_TMP_NAME], unpackName[MAX_CONVERT_TMP_NAME];
+    char tmpMapName[MAX_CONVERT_TMP_NAME];
+    int mapExists;
+    
+    getConvertTmpName(filename, PACK_TMP_EXT, packName);
+    getConvertTmpName(filename, UNPACK_TMP_EXT, unpackName);
+    getConvertTmpName(mapName, MAP_TMP_EXT, tmpMapName);
+    
+    /* 確定する前の新しいページ対応表は要らない */
+    if (unlink(tmpMapName) == -1 && errno != ENOENT) {
+        return NG;
+    }
+    
+    mapExists = (access(mapName, F_OK) == 0);
+    if (access(packName, F_OK) == 0) {
+        /* 圧縮する書き直しは、ページ対応表を置いていれば確定している */
+        if (mapExists ? rename(packName, filename) == -1 : unlink(packName) == -1) {
+            return NG;
+        }
+        return syncDirectory(filename);
+    }
+    if (access(unpackName, F_OK) == 0) {
+        /* 圧縮しない書き直しは、ページ対応表を消していれば確定している */
+        if (mapExists ? unlink(unpackName) == -1 : rename(unpackName, filename) == -1) {
+            return NG;
+        }
+        return syncDirectory(filename);
+    }
+    
+    return OK;
+}
+
+/*
+ * removeConversion -- 形式を書き直すときの一時ファイルを消す
+ *
+ * ファイルを作り直すときや消すときに、前の書き直しの一時ファイルが
+ * 後から新しいファイルに戻されないように消す。
+ *
+ * 引数:
+ *	filename: データファイルのファイル名
+ *	mapName: ページ対応表のファイル名
+ *
+ * 返り値:
+ *	成功の場合OK、失敗の場合NG
+ */
+static Result removeConversion(char *filename, char *mapName)
+{
+    char tmpName[MAX_CONVERT_TMP_NAME];
+    
+    getConvertTmpName(filename, PACK_TMP_EXT, tmpName);
+    if (unlink(tmpName) == -1 && errno != ENOENT) {
+        return NG;
+    }
+    getConvertTmpName(filename, UNPACK_TMP_EXT, tmpName);
+    if (unlink(tmpName) == -1 && errno != ENOENT) {
+        return NG;
+    }
+    getConvertTmpName(mapName, MAP_TMP_EXT, tmpName);
+    if (unlink(tmpName) == -1 && errno != ENOENT) {
+        return NG;
+    }
+    
+    return OK;
+}
+
+/*
+ * convertFile -- データファイルを圧縮した形式に、または圧縮しない形式に書き直す
+ *
+ * 一時ファイルに全ページを書き直してfsync()してから、次の順で置き換える。
+ * 圧縮するときは新しいページ対応表を置き、圧縮しないときはページ対応表を消す。
+ * ここで書き直しが確定し、最後にデータファイルを一時ファイルで置き換える。
+ * 途中で止まっても、次に開くときにrecoverConversion()がどちらかにそろえる。
+ * ファイルを開いていない状態で、openFileMutexを取ってから呼び出すこと。
+ *
+ * 引数:
+ *	filename: データファイルのファイル名
+ *	mapName: ページ対応表のファイル名
+ *	compress: 0でなければ圧縮した形式に、0なら圧縮しない形式に書き直す
+ *
+ * 返り値:
+ *	成功の場合OK、失敗の場合NG
+ */
+static Result convertFile(char *filename, char *mapName, int compress)
+{
+    File src, dst;
+    char tmpName[MAX_CONVERT_TMP_NAME], tmpMapName[MAX_CONVERT_TMP_NAME];
+    char page[PAGE_SIZE];
+    struct stat statBuf;
+    Result result = OK;
+    int numPage = 0, i;
+    ssize_t n;
+    
+    getConvertTmpName(filename, compress ? PACK_TMP_EXT : UNPACK_TMP_EXT, tmpName);
+    getConvertTmpName(mapName, MAP_TMP_EXT, tmpMapName);
+    
+    /* 統計を数えるので、読み書きするファイルのFile構造体を用意する */
+    memset(&src, 0, sizeof(File));
+    memset(&dst, 0, sizeof(File));
+    pthread_mutex_init(&src.mutex, NULL);
+    pthread_mutex_init(&dst.mutex, NULL);
+    src.desc = open(filename, O_RDONLY);
+    dst.desc = open(tmpName, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (src.desc == -1 || dst.desc == -1 || fstat(src.desc, &statBuf) == -1) {
+        result = NG;
+    } else if (compress) {
+        numPage = (int) ((statBuf.st_size + PAGE_SIZE - 1) / PAGE_SIZE);
+        if ((dst.pageMap = openPageMap(tmpMapName, 1, 0)) == NULL) {
+            result = NG;
+        }
+    } else {
+        if ((src.pageMap = openPageMap(mapName, 0, statBuf.st_size)) == NULL) {
+            result = NG;
+        } else {
+            numPage = src.pageMap->numExtent;
+        }
+    }
+    
+    /* 1ページずつ読んで書き直す(ファイルの末尾の半端なページは0で埋める) */
+    for (i = 0; result == OK && i < numPage; i++) {
+        if (compress) {
+            memset(page, 0, PAGE_SIZE);
+            n = pread(src.desc, page, PAGE_SIZE, (off_t) i * PAGE_SIZE);
+            countIO(&src, 0, n, 0);
+            if (n <= 0 || writeCompressedPage(&dst, i, page) != OK) {
+                result = NG;
+            }
+        } else {
+            if (readCompressedPage(&src, i, page) != PAGE_SIZE
+                || pwrite(dst.desc, page, PAGE_SIZE, (off_t) i * PAGE_SIZE) != PAGE_SIZE) {
+                result = NG;
+            }
+        }
+    }
+    
+    /* 置き換える前に、書き直した内容を確定させる */
+    if (result == OK && (fsync(dst.desc) == -1
+                         || (dst.pageMap != NULL && fsync(dst.pageMap->desc) == -1))) {
+        result = NG;
+    }
+    
+    closePageMap(src.pageMap);
+    closePageMap(dst.pageMap);
+    if (src.desc != -1) {
+        close(src.desc);
+    }
+    if (dst.desc != -1 && close(dst.desc) == -1) {
+        result = NG;
+    }
+    pthread_mutex_destroy(&src.mutex);
+    pthread_mutex_destroy(&dst.mutex);
+    
+    /* 書き直せなければ一時ファイルを消す */
+    if (result != OK) {
+        unlink(tmpName);
+        unlink(tmpMapName);
+        return NG;
+    }
+    
+    /* ページ対応表を置くか消して確定させる(失敗すれば、まだ元のファイルのまま) */
+    if (compress ? rename(tmpMapName, mapName) == -1 : unlink(mapName) == -1) {
+        unlink(tmpName);
+        unlink(tmpMapName);
+        return NG;
+    }
+    if (syncDirectory(filename) != OK) {
+        return NG;
+    }
+    
+    /* データファイルを置き換える(失敗しても、次に開くときに置き換える) */
+    if (rename(tmpName, filename) == -1) {
+        return NG;
+    }
+    
+    return syncDirectory(filename);
+}
+
+/*------書き戻し-------*/
+/*
+ * 更新済みのバッファをバッファの番号順や置換方式の順に1ページずつ書くと、
+ * ファイルのばらばらな位置に小さな書き込みが並ぶ。そこで、書き戻すバッファを
+ * (ファイル, ページ番号)の順に並べ、連続したページは1回のpwritevでまとめて
+ * 書き込む。
+ */
+
+/*
+ * compareBuffer -- バッファを(ファイル, ページ番号)の順に並べるための比較関数
+ */
+static int compareBuffer(const void *a, const void *b)
+{
+    Buffer *x = *(Buffer **) a, *y = *(Buffer **) b;
+    
+    if (x->file->desc != y->file->desc) {
+        return (x->file->desc < y->file->desc) ? -1 : 1;
+    }
+    return x->pageNum - y->pageNum;
+}
+
+/*
+ * writeRun -- 連続したページのバッファを1回の書き込みで書き戻す
+ *
+ * 1回のpwritevで書き込む(pwritevがない環境では作業領域にまとめてから
+ * 1回のpwriteで書き込む)。位置を指定して書き込むので、ほかのスレッドが
+ * 同じファイルを同時に読み書きしていてもよい。圧縮したファイルは、
+ * writeCompressedPage()で1ページずつ圧縮して書き込む。バッファの状態は
+ * 変えずに、統計だけを数える。
+ *
+ * 引数:
+ *	bufs: 同じファイルの連続したページのバッファ(ページ番号の順)
+ *	n: バッファの数(WRITE_RUN_PAGES以下)
+ *
+ * 返り値:
+ *	すべて書き込めればOK、そうでなければNG
+ */
+static Result writeRun(Buffer **bufs, int n)
+{
+    off_t offset = (off_t) bufs[0]->pageNum * PAGE_SIZE;
+    ssize_t written;
+    long long start;
+    int i;
+#ifdef __linux__
+    struct iovec iov[WRITE_RUN_PAGES];
+#else
+    char *area;
+#endif
+    
+    if (bufs[0]->file->pageMap != NULL) {
+        for (i = 0; i < n; i++) {
+            if (writeCompressedPage(bufs[i]->file, bufs[i]->pageNum, bufs[i]->page) != OK) {
+                return NG;
+            }
+        }
+        countWriteBack(bufs[0]->file, n);
+        return OK;
+    }
+    
+#ifdef __linux__
+    for (i = 0; i < n; i++) {
+        iov[i].iov_base = bufs[i]->page;
+        iov[i].iov_len = PAGE_SIZE;
+    }
+    start = getNanosec();
+    written = pwritev(bufs[0]->file->desc, iov, n, offset);
+#else
+    start = getNanosec();
+    if (n == 1) {
+        written = pwrite(bufs[0]->file->desc, bufs[0]->page, PAGE_SIZE, offset);
+    } else if ((area = malloc((size_t) n * PAGE_SIZE)) == NULL) {
+        written = -1;
+    } else {
+        for (i = 0; i < n; i++) {
+            memcpy(area + (size_t) i * PAGE_SIZE, bufs[i]->page, PAGE_SIZE);
+        }
+        written = pwrite(bufs[0]->file->desc, area, (size_t) n * PAGE_SIZE, offset);
+        free(area);
+    }
+#endif
+    
+    countIO(bufs[0]->file, 1, written, getNanosec() - start);
+    if (written == (ssize_t) n * PAGE_SIZE) {
+        countWriteBack(bufs[0]->file, n);
+    }
+    
+    return (written == (ssize_t) n * PAGE_SIZE) ? OK : NG;
+}
+
+/*
+ * writeBackBuffers -- バッファをまとめて書き戻す
+ *
+ * bufsを(ファイル, ページ番号)の順に並べ替え、連続したページごとに
+ * writeRun()で書き込む。バッファの状態は変えない。
+ *
+ * 引数:
+ *	bufs: 書き戻すバッファ(並べ替える)
+ *	n: バッファの数
+ *	results: NULLでなければ、並べ替えた後のbufsの各バッファを書き込めたかを入れる
+ *
+ * 返り値:
+ *	すべて書き込めればOK、そうでなければNG
+ */
+static Result writeBackBuffers(Buffer **bufs, int n, Result *results)
+{
+    Result result = OK, runResult;
+    int start, end, i;
+    
+    qsort(bufs, (size_t) n, sizeof(Buffer *), compareBuffer);
+    
+    for (start = 0; start < n; start = end) {
+        /* 同じファイルで連続しているところまでを1回で書く */
+        for (end = start + 1; end < n && end - start < WRITE_RUN_PAGES; end++) {
+            if (bufs[end]->file != bufs[start]->file
+                || bufs[end]->pageNum != bufs[end - 1]->pageNum + 1) {
+                break;
+            }
+        }
+        if ((runResult = writeRun(bufs + start, end - start)) != OK) {
+            result = NG;
+        }
+        if (results != NULL) {
+            for (i = start; i < end; i++) {
+                results[i] = runResult;
+            }
+        }
+    }
+    
+    return result;
+}
+
+/*
+ * isWritableDirty -- 追い出しのついでに書き戻してよいバッファかどうかの判定
+ */
+static int isWritableDirty(Buffer *buf)
+{
+    return buf != NULL && buf->modified == MODIFIED && buf->pinCount == 0 && buf->ioState == IO_NONE;
+}
+
+/*
+ * takeDirtyBuffer -- 書き戻すバッファを固定し、更新済みの印を外して書き込み中の印を付ける
+ *
+ * 読み込み用のラッチも取るので、書き込みの間にページを変更しようとした
+ * スレッドは、書き終わるまで待つことになる。固定されていなかったバッファなので
+ * ふつうはラッチを持っている者はいないが、シャードのmutexを取ったままラッチを
+ * 待たないよう、取れなければあきらめる。
+ * シャードのmutexを取ってから呼び出すこと。
+ *
+ * 返り値:
+ *	取れた場合1、取れなかった場合0
+ */
+static int takeDirtyBuffer(Buffer *buf)
+{
+    if (pthread_rwlock_tryrdlock(buf->latch) != 0) {
+        return 0;
+    }
+    buf->pinCount++;
+    buf->modified = UNMODIFIED;
+    buf->shard->numDirty--;
+    buf->ioState = IO_WRITE;
+    buf->shard->numPendingIO++;
+    return 1;
+}
+
+/*
+ * writeBackAround -- 更新済みのバッファを、前後の更新済みのページとまとめて書き戻す
+ *
+ * 同じファイルの前後のページが同じシャードのバッファにあって更新済みで
+ * 固定されていなければ、合わせてWRITE_RUN_PAGESまでを1回で書き込む。
+ * 書き戻しスレッドと同じく、書き込むバッファは固定して更新済みの印を外し、
+ * 書き込みの間はシャードのmutexを放す(ほかのスレッドはそのシャードを使い続けられる)。
+ * 戻ったときにはバッファの状態が変わっていることがあるので、呼び出し側で調べ直すこと。
+ * シャードのmutexを取ってから呼び出すこと。
+ *
+ * 引数:
+ *	shard: バッファが属するシャード
+ *	buf: 書き戻すバッファ(更新済みで固定されていないこと)
+ *
+ * 返り値:
+ *	成功の場合OK、失敗の場合NG(書き戻せなかったバッファは更新済みに戻す)
+ */
+static Result writeBackAround(Shard *shard, Buffer *buf)
+{
+    Buffer *run[WRITE_RUN_PAGES];
+    Result result;
+    int first, n, i;
+    
+    /* 前に続く更新済みのページを探す */
+    first = buf->pageNum;
+    while (first > 0 && buf->pageNum - first < WRITE_RUN_PAGES - 1
+           && isWritableDirty(lookupBuffer(shard, buf->file, first - 1))) {
+        first--;
+    }
+    
+    /* そこから後ろに続く更新済みのページを集めて固定する(固定できないところで切る) */
+    for (n = 0; n < WRITE_RUN_PAGES; n++) {
+        if (first + n == buf->pageNum) {
+            run[n] = buf;
+        } else if (!isWritableDirty(run[n] = lookupBuffer(shard, buf->file, first + n))) {
+            break;
+        }
+        if (!takeDirtyBuffer(run[n])) {
+            break;
+        }
+        shard->numInFlight++;
+    }
+    
+    /* ほかのスレッドが先に触っていれば何もしない(呼び出し側が選び直す) */
+    if (n == 0) {
+        return OK;
+    }
+    
+    /* 書き込みの間はシャードのmutexを放す */
+    pthread_mutex_unlock(&shard->mutex);
+    result = writeRun(run, n);
+    if (result == OK) {
+        countEvictWriteBack(run[0]->file, n);
+    }
+    for (i = 0; i < n; i++) {
+        pthread_rwlock_unlock(run[i]->latch);
+    }
+    pthread_mutex_lock(&shard->mutex);
+    
+    for (i = 0; i < n; i++) {
+        run[i]->ioState = IO_NONE;
+        run[i]->pinCount--;
+        shard->numPendingIO--;
+        shard->numInFlight--;
+        if (result != OK && run[i]->modified == UNMODIFIED) {
+            /* 書き戻せなかったので、更新済みに戻す */
+            run[i]->modified = MODIFIED;
+            shard->numDirty++;
+        }
+    }
+    pthread_cond_broadcast(&shard->ioDoneCond);
+    
+    return result;
+}
+
+/*
+ * decideHugePages -- バッファの領域をヒュージページで確保するかどうかを決める
+ *
+ * setHugePages()で指定されていればそれを、そうでなければ環境変数ENV_HUGE_PAGESを
+ * 調べる。どちらもなければ、領域がHUGE_PAGE_SIZE以上のときだけ使う。
+ *
+ * 引数:
+ *	size: 確保する領域の大きさ(バイト数)
+ *
+ * 返り値:
+ *	最初に試す確保のしかた(ARENA_HUGETLB, ARENA_THP, ARENA_HEAP)
+ */
+static int decideHugePages(size_t size)
+{
+    char *name = requestedHugePages;
+    
+    if (name == NULL) {
+        name = getenv(ENV_HUGE_PAGES);
+    }
+    if (name == NULL) {
+        return (size >= HUGE_PAGE_SIZE) ? ARENA_HUGETLB : ARENA_HEAP;
+    }
+    if (strcmp(name, "hugetlb") == 0) {
+        return ARENA_HUGETLB;
+    }
+    if (strcmp(name, "thp") == 0) {
+        return ARENA_THP;
+    }
+    return ARENA_HEAP;
+}
+
+/*
+ * allocateArena -- バッファの領域を確保する
+ *
+ * decideHugePages()が決めたしかたから順に、MAP_HUGETLBで予約済みの
+ * ヒュージページから、HUGE_PAGE_SIZEの境界にそろえてmadvise(MADV_HUGEPAGE)で
+ * Transparent Huge Pagesから、posix_memalign()でふつうのページから確保する。
+ * ヒュージページで確保するときは、大きさをHUGE_PAGE_SIZEの倍数に切り上げる。
+ * どの場合も、PAGE_SIZEの境界にそろい、0で初期化された領域を返す。
+ *
+ * 引数:
+ *	size: 確保する領域の大きさ(バイト数)
+ *	kind: 確保のしかたを入れる場所
+ *	allocated: 確保した大きさを入れる場所
+ *
+ * 返り値:
+ *	確保した領域。確保できなければNULLを返す。
+ */
+static void *allocateArena(size_t size, int *kind, size_t *allocated)
+{
+    void *addr;
+#if defined(MAP_ANONYMOUS) && (defined(MAP_HUGETLB) || defined(MADV_HUGEPAGE))
+    size_t hugeSize = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+#endif
+#if defined(MAP_ANONYMOUS) && defined(MADV_HUGEPAGE)
+    char *area, *aligned;
+#endif
+    int first = decideHugePages(size);
+    
+#if defined(MAP_ANONYMOUS) && defined(MAP_HUGETLB)
+    /* 予約済みのヒュージページから確保する(予約がなければ失敗する) */
+    if (first >= ARENA_HUGETLB) {
+        addr = mmap(NULL, hugeSize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (addr != MAP_FAILED) {
+            *kind = ARENA_HUGETLB;
+            *allocated = hugeSize;
+            return addr;
+        }
+    }
+#endif
+    
+#if defined(MAP_ANONYMOUS) && defined(MADV_HUGEPAGE)
+    /*
+     * 境界にそろえるため、HUGE_PAGE_SIZEだけ大きく確保して前後を返し、
+     * カーネルにヒュージページを使うよう頼む(THPが無効なら失敗する)
+     */
+    if (first >= ARENA_THP) {
+        area = mmap(NULL, hugeSize + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (area != MAP_FAILED) {
+            aligned = (char *) (((uintptr_t) area + HUGE_PAGE_SIZE - 1) & ~((uintptr_t) HUGE_PAGE_SIZE - 1));
+            if (aligned > area) {
+                munmap(area, (size_t) (aligned - area));
+            }
+            if (area + HUGE_PAGE_SIZE > aligned) {
+                munmap(aligned + hugeSize, (size_t) (area + HUGE_PAGE_SIZE - aligned));
+            }
+            if (madvise(aligned, hugeSize, MADV_HUGEPAGE) == 0) {
+                *kind = ARENA_THP;
+                *allocated = hugeSize;
+                return aligned;
+            }
+            munmap(aligned, hugeSize);
+        }
+    }
+#endif
+    
+    /* ふつうのページから、PAGE_SIZEの境界にそろえて確保する */
+    if (posix_memalign(&addr, PAGE_SIZE, size) != 0) {
+        return NULL;
+    }
+    memset(addr, 0, size);
+    *kind = ARENA_HEAP;
+    *allocated = size;
+    return addr;
+}
+
+/*
+ * freeArena -- allocateArena()で確保した領域を解放する
+ *
+ * 引数:
+ *	addr: 領域(NULLなら何もしない)
+ *	kind: 確保のしかた
+ *	size: 確保した大きさ
+ *
+ * 返り値:
+ *	なし
+ */
+static void freeArena(void *addr, int kind, size_t size)
+{
+    if (addr == NULL) {
+        return;
+    }
+    if (kind == ARENA_HEAP) {
+        free(addr);
+    } else {
+        munmap(addr, size);
+    }
+}
+
+/*
+ * freeBufferArena -- バッファとシャードの領域を解放する
+ *
+ * 引数:
+ *	numInitialized: 置換方式を初期化したシャードの数
+ *
+ * 返り値:
+ *	なし
+ */
+static void freeBufferArena(int numInitialized)
+{
+    int i;
+    
+    if (shards != NULL) {
+        for (i = 0; i < numShard; i++) {
+            if (i < numInitialized) {
+                policy->finalize(&shards[i]);
+            }
+            free(shards[i].hashTable);
+            pthread_mutex_destroy(&shards[i].mutex);
+            pthread_cond_destroy(&shards[i].ioDoneCond);
+        }
+    }
+    if (latchArena != NULL) {
+        for (i = 0; i < numBuffer; i++) {
+            pthread_rwlock_destroy(&latchArena[i]);
+        }
+    }
+    
+    free(shards);
+    freeArena(bufferArena, bufferArenaKind, bufferArenaSize);
+    freeArena(pageArena, pageArenaKind, pageArenaSize);
+    free(latchArena);
+    free(writeBackList);
+    shards = NULL;
+    bufferArena = NULL;
+    pageArena = NULL;
+    latchArena = NULL;
+    writeBackList = NULL;
+}
+
+/*
+ * initializeBufferList -- バッファリストの初期化
+ *
+ * バッファをnumShard個のシャードに分け、シャードごとに空きリスト、
+ * ハッシュ表、置換方式を初期化する。
+ *
+ * **注意**
+ *	この関数は、ファイルアクセスモジュールを使用する前に必ず一度だけ呼び出すこと。
+ *	(initializeFileModule()から呼び出すこと。)
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	初期化に成功すればOK、失敗すればNGを返す。
+ */
+static Result initializeBufferList()
+{
+    Buffer *buf;
+    Shard *shard;
+    int i, s;
+    
+    numBuffer = decideNumBuffer();
+    numShard = decideNumShard();
+    policy = decidePolicy();
+    memset(&totalStats, 0, sizeof(BufferStats));
+    numFlush = 0;
+    numReadAhead = numReadAheadPage = 0;
+    numMappedRead = 0;
+    numAsyncRead = numAsyncWrite = numWriteError = 0;
+    
+    /*
+     * numBuffer個分のBuffer構造体と、ページの内容の領域をそれぞれまとめて確保する
+     * (大きければヒュージページで確保し、TLBのミスを減らす。どちらも0で初期化されている)
+     */
+    bufferArena = (Buffer *) allocateArena((size_t) numBuffer * sizeof(Buffer),
+                                           &bufferArenaKind, &bufferArenaSize);
+    if (bufferArena == NULL) {
+        /* メモリ不足なのでエラーを返す */
+        return NG;
+    }
+    pageArena = (char *) allocateArena((size_t) numBuffer * PAGE_SIZE, &pageArenaKind, &pageArenaSize);
+    if (pageArena == NULL) {
+        freeBufferArena(0);
+        return NG;
+    }
+    
+    /* ラッチは大きいので、Buffer構造体を詰めておくため別の領域にまとめて置く */
+    if ((latchArena = (pthread_rwlock_t *) malloc((size_t) numBuffer * sizeof(pthread_rwlock_t))) == NULL) {
+        freeBufferArena(0);
+        return NG;
+    }
+    for (i = 0; i < numBuffer; i++) {
+        pthread_rwlock_init(&latchArena[i], NULL);
+    }
+    
+    /* シャードと、書き戻すバッファを集める領域の確保 */
+    if ((shards = (Shard *) calloc((size_t) numShard, sizeof(Shard))) == NULL
+        || (writeBackList = (Buffer **) calloc((size_t) numBuffer, sizeof(Buffer *))) == NULL) {
+        free(shards);
+        shards = NULL;
+        freeBufferArena(0);
+        return NG;
+    }
+    
+    for (s = 0; s < numShard; s++) {
+        shard = &shards[s];
+        
+        /* シャードsは、bufferArenaのs * numBuffer / numShard番目からのバッファを持つ */
+        shard->index = s;
+        pthread_mutex_init(&shard->mutex, NULL);
+        pthread_cond_init(&shard->ioDoneCond, NULL);
+        shard->frames = &bufferArena[(long) s * numBuffer / numShard];
+        shard->numFrame = (int) ((long) (s + 1) * numBuffer / numShard - (long) s * numBuffer / numShard);
+        shard->numHashBucket = shard->numFrame * 2;
+        if ((shard->hashTable = (Buffer **) calloc((size_t) shard->numHashBucket, sizeof(Buffer *))) == NULL) {
+            freeBufferArena(s);
+            return NG;
+        }
+        
+        /* シャードのバッファを初期化し、すべて空きリストに入れる */
+        shard->freeBufferList = NULL;
+        for (i = shard->numFrame - 1; i >= 0; i--) {
+            buf = &shard->frames[i];
+            
+            /* Buffer構造体の初期化 */
+            buf->page = pageArena + (size_t) (buf - bufferArena) * PAGE_SIZE;
+            buf->latch = &latchArena[buf - bufferArena];
+            buf->shard = shard;
+            buf->file = NULL;
+            buf->pageNum = -1;
+            buf->modified = UNMODIFIED;
+            buf->pinCount = 0;
+            buf->hashNext = NULL;
+            buf->prev = NULL;
+            buf->heapIndex = -1;
+            buf->ring = NULL;
+            buf->ioState = IO_NONE;
+            buf->ioNext = NULL;
+            buf->aheadMark = 0;
+            
+            /* 空きリストにつなぐ */
+            buf->next = shard->freeBufferList;
+            shard->freeBufferList = buf;
+        }
+        
+        /* 置換方式の初期化 */
+        if (policy->initialize(shard) != OK) {
+            freeBufferArena(s);
+            return NG;
+        }
+    }
+    
+    return OK;
+}
+
+/*
+ * finalizeBufferList -- バッファリストの終了処理
+ *
+ * **注意**
+ *	この関数は、ファイルアクセスモジュールの使用後に必ず一度だけ呼び出すこと。
+ *	(finalizeFileModule()から呼び出すこと。ほかのスレッドはバッファを使っていないこと。)
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	終了処理に成功すればOK、失敗すればNGを返す。
+ */
+static Result finalizeBufferList()
+{
+    Buffer *buf;
+    Result result;
+    int i, n;
+    
+    if (bufferArena == NULL) {
+        return OK;
+    }
+    
+    /* まだ書き戻していないバッファがあれば、ファイルとページの順にまとめて書き戻す */
+    n = 0;
+    for (i = 0; i < numBuffer; i++) {
+        buf = &bufferArena[i];
+        if (buf->file != NULL && buf->modified == MODIFIED) {
+            writeBackList[n++] = buf;
+        }
+    }
+    result = writeBackBuffers(writeBackList, n, NULL);
+    
+    /* オープンしたままのファイルのバッファの輪を空にする */
+    for (i = 0; i < numBuffer; i++) {
+        buf = &bufferArena[i];
+        if (buf->ring != NULL) {
+            memset(buf->ring->slot, 0, sizeof(Buffer *) * buf->ring->size * numShard);
+        }
+    }
+    
+    /* 置換方式の終了処理をして、バッファとシャードの領域を解放する */
+    freeBufferArena(numShard);
+    numBuffer = 0;
+    numShard = 0;
+    
+    return result;
+}
+
+/*
+ * clearBuffer -- バッファを空にする
+ *
+ * シャードのmutexを取ってから呼び出すこと。
+ *
+ * 引数:
+ *	buf: 空にするバッファ(ハッシュ表と置換方式からは取り除いておくこと)
+ *
+ * 返り値:
+ *	なし
+ */
+static void clearBuffer(Buffer *buf)
+{
+    if (buf->modified == MODIFIED) {
+        buf->shard->numDirty--;
+    }
+    buf->ring = NULL;
+    buf->aheadMark = 0;
+    buf->file = NULL;
+    buf->pageNum = -1;
+    buf->modified = UNMODIFIED;
+    buf->pinCount = 0;
+    memset(buf->page, 0, PAGE_SIZE);
+}
+
+/*
+ * releaseBuffer -- バッファを空にして空きリストに戻す
+ *
+ * シャードのmutexを取ってから呼び出すこと。
+ *
+ * 引数:
+ *	buf: 空にするバッファ(ハッシュ表と置換方式からは取り除いておくこと)
+ *
+ * 返り値:
+ *	なし
+ */
+static void releaseBuffer(Buffer *buf)
+{
+    Shard *shard = buf->shard;
+    
+    clearBuffer(buf);
+    buf->prev = NULL;
+    buf->next = shard->freeBufferList;
+    shard->freeBufferList = buf;
+}
+
+/*
+ * getEmptyBuffer -- 空きバッファの取得
+ *
+ * シャードの空きリストにバッファがあればそれを返す。なければ置換方式が選んだ
+ * バッファを空にして返す。置換方式には、まず更新されていないバッファだけから
+ * 選ばせるので、ふつうは追い出しのために書き込みを待つことはない(更新済みの
+ * バッファは書き戻しスレッドが書き戻す)。追い出しが起きている間は、更新済みの
+ * バッファがFLUSH_EVICT_DIRTY_RATIOを超えたら書き戻しスレッドを起こし、
+ * 更新されていないバッファを残しておく。
+ * 更新されていないバッファが1つもないときだけ、更新済みのバッファを
+ * (シャードのmutexを放して)書き戻してから選び直す。
+ * 返したバッファは空きリストから外れている。
+ * シャードのmutexを取ってから呼び出すこと(I/Oを待つ間や書き戻しの間は放す)。
+ *
+ * 引数:
+ *	shard: バッファを取るシャード
+ *
+ * 返り値:
+ *	空きバッファへのポインタ。すべてのバッファが固定されている場合や
+ *	書き戻しに失敗した場合はNULLを返す。
+ */
+static Buffer *getEmptyBuffer(Shard *shard)
+{
+    Buffer *buf;
+    
+    /*
+     * 空きリストにあればそれを使い、なければ追い出すバッファを置換方式に
+     * 選ばせる(固定されているバッファは選ばれない)。読み書きの最中のために
+     * 固定されているだけなら、終わるのを待って選び直す
+     */
+    for (;;) {
+        if (shard->freeBufferList != NULL) {
+            buf = shard->freeBufferList;
+            shard->freeBufferList = buf->next;
+            buf->next = NULL;
+            return buf;
+        }
+        if ((buf = policy->victim(shard, 1)) != NULL) {
+            break;
+        }
+        
+        /*
+         * 更新されていないバッファがなければ、書き戻しスレッドが追いついていない。
+         * 起こしてから、更新済みのバッファを自分で書き戻して選び直す
+         */
+        if ((buf = policy->victim(shard, 0)) != NULL) {
+            pthread_cond_signal(&flusherCond);
+            if (writeBackAround(shard, buf) != OK) {
+                return NULL;
+            }
+            continue;
+        }
+        
+        /* 発行前のI/Oのために固定しているだけなら、待っても空かない */
+        if (shard->numInFlight == 0) {
+            return NULL;
+        }
+        pthread_cond_wait(&shard->ioDoneCond, &shard->mutex);
+    }
+    
+    /* 追い出しが起きている間は、更新されていないバッファを多めに残しておく */
+    if (shard->numDirty * 100 > shard->numFrame * FLUSH_EVICT_DIRTY_RATIO) {
+        pthread_cond_signal(&flusherCond);
+    }
+    
+    /* バッファを初期化する */
+    policy->remove(shard, buf, 1);
+    removeBufferFromHash(buf);
+    shard->numEvict++;
+    pthread_mutex_lock(&buf->file->mutex);
+    buf->file->stats.numEvict++;
+    pthread_mutex_unlock(&buf->file->mutex);
+    clearBuffer(buf);
+    
+    return buf;
+}
+
+/*
+ * getRingBuffer -- バッファの輪から空きバッファを取得
+ *
+ * シャードの輪の次の位置のバッファがまだ輪に属していて固定されていなければ、
+ * その内容を(更新されていれば書き戻して)捨てて使い回す。
+ * 使い回せなければ、getEmptyBuffer()で取得したバッファを輪に入れる。
+ * シャードのmutexを取ってから呼び出すこと。
+ *
+ * 引数:
+ *	shard: バッファを取るシャード
+ *	ring: バッファの輪
+ *
+ * 返り値:
+ *	空きバッファへのポインタ。取得できなければNULLを返す。
+ */
+static Buffer *getRingBuffer(Shard *shard, BufferRing *ring)
+{
+    Buffer **slot = ring->slot + (size_t) shard->index * ring->size;
+    int *current = &ring->current[shard->index];
+    Buffer *buf;
+    
+    buf = slot[*current];
+    
+    /*
+     * 更新されていれば、前後の更新済みのページとまとめて書き戻す
+     * (書き戻す間はシャードのmutexを放すので、その後で調べ直す)
+     */
+    if (buf != NULL && buf->ring == ring && buf->pinCount == 0 && buf->modified == MODIFIED
+        && writeBackAround(shard, buf) != OK) {
+        return NULL;
+    }
+    
+    if (buf != NULL && buf->ring == ring && buf->pinCount == 0 && buf->modified == UNMODIFIED) {
+        removeBufferFromHash(buf);
+        clearBuffer(buf);
+    } else if ((buf = getEmptyBuffer(shard)) == NULL) {
+        return NULL;
+    }
+    
+    buf->ring = ring;
+    slot[*current] = buf;
+    *current = (*current + 1) % ring->size;
+    
+    return buf;
+}
+
+/*
+ * allocateBuffer -- ファイルのページを読み込むための空きバッファの取得
+ *
+ * ファイルにバッファの輪があればそこから、なければgetEmptyBuffer()で取得する。
+ * シャードのmutexを取ってから呼び出すこと。
+ *
+ * 引数:
+ *	shard: ページが入るシャード
+ *	file: ページを読み込むファイルのFile構造体
+ *
+ * 返り値:
+ *	空きバッファへのポインタ。取得できなければNULLを返す。
+ */
+static Buffer *allocateBuffer(Shard *shard, File *file)
+{
+    if (file->ring != NULL) {
+        return getRingBuffer(shard, file->ring);
+    }
+    return getEmptyBuffer(shard);
+}
+
+/*
+ * registerBuffer -- ページを読み込んだバッファの登録
+ *
+ * ハッシュ表に登録し、輪に属していなければ置換方式にも登録する。
+ * シャードのmutexを取ってから呼び出すこと。
+ *
+ * 引数:
+ *	buf: 登録するバッファ(file, pageNumを設定しておくこと)
+ *
+ * 返り値:
+ *	なし
+ */
+static void registerBuffer(Buffer *buf)
+{
+    insertBufferToHash(buf);
+    if (buf->ring == NULL) {
+        policy->insert(buf->shard, buf);
+    }
+}
+
+/*------非同期I/O-------*/
+/*
+ * 非同期I/Oでは、バッファごとに1つまでの読み込みか書き込みを発行し、
+ * ioStateを立てて固定しておく。終わったら(発行した順とは限らない)
+ * finishIO()で固定を外し、シャードのioDoneCondで待っているスレッドを起こす。
+ * 読み込み中のバッファはハッシュ表に登録しておき、同じページを読もうとした
+ * スレッドは読み込みが終わるのを待つ。
+ */
+
+/*
+ * completeIO -- 非同期I/Oが終わったバッファの後始末
+ *
+ * バッファのシャードのmutexを取ってから呼び出すこと。
+ *
+ * 引数:
+ *	buf: I/Oが終わったバッファ
+ *	result: 読み書きしたバイト数(失敗なら負の値)
+ *	nsec: 読み書きにかかった時間(ナノ秒、測っていなければ0、統計に数え済みなら負の値)
+ *
+ * 返り値:
+ *	なし
+ */
+static void completeIO(Buffer *buf, ssize_t result, long long nsec)
+{
+    Shard *shard = buf->shard;
+    
+    shard->numInFlight--;
+    shard->numPendingIO--;
+    buf->pinCount--;
+    if (nsec >= 0) {
+        countIO(buf->file, buf->ioState == IO_WRITE, result, nsec);
+    }
+    
+    if (buf->ioState == IO_READ) {
+        buf->ioState = IO_NONE;
+        if (result == PAGE_SIZE) {
+            addCount(&numAsyncRead, 1);
+        } else {
+            /* 読み込めなかったので、バッファを空にする */
+            if (buf->ring == NULL) {
+                policy->remove(shard, buf, 0);
+            }
+            removeBufferFromHash(buf);
+            releaseBuffer(buf);
+        }
+    } else {
+        buf->ioState = IO_NONE;
+        shard->numPendingWrite--;
+        if (result == PAGE_SIZE) {
+            addCount(&numAsyncWrite, 1);
+            addCount(&numFlush, 1);
+            countWriteBack(buf->file, 1);
+        } else if (buf->modified == UNMODIFIED) {
+            /* 書き戻せなかったので、更新済みに戻す */
+            buf->modified = MODIFIED;
+            shard->numDirty++;
+            addCount(&numWriteError, 1);
+        }
+    }
+    
+    pthread_cond_broadcast(&shard->ioDoneCond);
+}
+
+/*
+ * finishIO -- 非同期I/Oの完了の受け取り
+ *
+ * 発行中のI/Oの数を減らしてから、バッファのシャードのmutexを取って
+ * completeIO()を呼ぶ。方式のスレッドが、ロックを取らずに呼び出す。
+ *
+ * 引数:
+ *	buf: I/Oが終わったバッファ
+ *	result: 読み書きしたバイト数(失敗なら負の値)
+ *	nsec: 読み書きにかかった時間(ナノ秒、測っていなければ0)
+ *
+ * 返り値:
+ *	なし
+ */
+static void finishIO(Buffer *buf, ssize_t result, long long nsec)
+{
+    Shard *shard = buf->shard;
+    
+    pthread_mutex_lock(&ioMutex);
+    numAsyncInFlight--;
+    pthread_cond_broadcast(&ioSlotCond);
+    pthread_mutex_unlock(&ioMutex);
+    
+    pthread_mutex_lock(&shard->mutex);
+    completeIO(buf, result, nsec);
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+/*
+ * threadIOMain -- スレッドプール方式の非同期I/Oのスレッドの本体
+ *
+ * キューからバッファを取り出し、preadかpwriteで読み書きする。
+ *
+ * 引数:
+ *	arg: 使わない
+ *
+ * 返り値:
+ *	NULL
+ */
+static void *threadIOMain(void *arg)
+{
+    Buffer *buf;
+    ssize_t n;
+    long long start;
+    
+    pthread_mutex_lock(&ioMutex);
+    
+    while (!ioThreadStop) {
+        if ((buf = ioQueueHead) == NULL) {
+            pthread_cond_wait(&ioQueueCond, &ioMutex);
+            continue;
+        }
+        if ((ioQueueHead = buf->ioNext) == NULL) {
+            ioQueueTail = NULL;
+        }
+        buf->ioNext = NULL;
+        pthread_mutex_unlock(&ioMutex);
+        
+        /* バッファは固定されているので、ロックを取らずに読み書きしてよい */
+        start = getNanosec();
+        if (buf->ioState == IO_READ) {
+            n = pread(buf->file->desc, buf->page, PAGE_SIZE, (off_t) buf->pageNum * PAGE_SIZE);
+        } else {
+            n = pwrite(buf->file->desc, buf->page, PAGE_SIZE, (off_t) buf->pageNum * PAGE_SIZE);
+        }
+        finishIO(buf, n, getNanosec() - start);
+        
+        pthread_mutex_lock(&ioMutex);
+    }
+    
+    pthread_mutex_unlock(&ioMutex);
+    
+    return NULL;
+}
+
+static Result threadIOInitialize()
+{
+    int i;
+    
+    ioQueueHead = ioQueueTail = NULL;
+    ioThreadStop = 0;
+    for (i = 0; i < AIO_THREADS; i++) {
+        if (pthread_create(&ioThread[i], NULL, threadIOMain, NULL) != 0) {
+            /* 作ったスレッドを止める */
+            pthread_mutex_lock(&ioMutex);
+            ioThreadStop = 1;
+            pthread_cond_broadcast(&ioQueueCond);
+            pthread_mutex_unlock(&ioMutex);
+            while (--i >= 0) {
+                pthread_join(ioThread[i], NULL);
+            }
+            return NG;
+        }
+    }
+    
+    return OK;
+}
+
+static void threadIOFinalize()
+{
+    int i;
+    
+    pthread_mutex_lock(&ioMutex);
+    ioThreadStop = 1;
+    pthread_cond_broadcast(&ioQueueCond);
+    pthread_mutex_unlock(&ioMutex);
+    
+    for (i = 0; i < AIO_THREADS; i++) {
+        pthread_join(ioThread[i], NULL);
+    }
+}
+
+static Result threadIOSubmit(Buffer **bufs, int n)
+{
+    int i;
+    
+    /* キューの末尾につなぐ */
+    for (i = 0; i < n; i++) {
+        bufs[i]->ioNext = NULL;
+        if (ioQueueHead == NULL) {
+            ioQueueHead = bufs[i];
+        } else {
+            ioQueueTail->ioNext = bufs[i];
+        }
+        ioQueueTail = bufs[i];
+    }
+    
+    pthread_cond_broadcast(&ioQueueCond);
+    
+    return OK;
+}
+
+static AsyncIO threadIO = {
+    "threads", threadIOInitialize, threadIOFinalize, threadIOSubmit
+};
+
+#ifdef HAVE_IO_URING
+/*
+ * io_uringを使う非同期I/O
+ *
+ * liburingは使わず、システムコールで直接リングを作る。
+ * 投入はioMutexを取ったスレッドが行い、完了はuringThreadが
+ * io_uring_enterで待って受け取る。
+ */
+
+/*
+ * uringFd -- io_uringのファイルディスクリプタ
+ */
+static int uringFd = -1;
+
+/*
+ * sqRing, cqRing, sqeArea -- マップした投入キュー、完了キュー、投入エントリの領域
+ */
+static char *sqRing = NULL, *cqRing = NULL;
+static struct io_uring_sqe *sqeArea = NULL;
+static size_t sqRingSize, cqRingSize, sqeAreaSize;
+
+/*
+ * io_uring_paramsから求めた、キューの各要素へのポインタ
+ */
+static unsigned *sqTail, *sqMask, *sqArray;
+static unsigned *cqHead, *cqTail, *cqMask;
+static struct io_uring_cqe *cqeArray;
+
+/*
+ * uringThread -- 完了を受け取るスレッド
+ */
+static pthread_t uringThread;
+
+/*
+ * uringEnter -- io_uring_enterシステムコール
+ */
+static int uringEnter(unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, uringFd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+/*
+ * uringQueue -- 投入キューに1つエントリを積む(まだ投入はしない)
+ */
+static void uringQueue(int opcode, int fd, void *addr, off_t offset, Buffer *buf)
+{
+    unsigned tail = *sqTail;
+    unsigned index = tail & *sqMask;
+    struct io_uring_sqe *sqe = &sqeArea[index];
+    
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (unsigned char) opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long) (uintptr_t) addr;
+    sqe->len = (addr != NULL) ? 1 : 0;
+    sqe->off = (unsigned long long) offset;
+    sqe->user_data = (unsigned long long) (uintptr_t) buf;
+    sqArray[index] = index;
+    
+    /* エントリを書き終えてから末尾を進める */
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * uringMain -- io_uringの完了を受け取るスレッドの本体
+ *
+ * 完了キューはこのスレッドだけが読むので、ロックを取らずに読む。
+ * user_dataが0の完了(uringFinalizeが投入したNOP)を受け取ったら終わる。
+ */
+static void *uringMain(void *arg)
+{
+    struct io_uring_cqe *cqe;
+    Buffer *buf;
+    unsigned head;
+    int res;
+    int stop = 0;
+    
+    while (!stop) {
+        if (uringEnter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            break;
+        }
+        
+        head = *cqHead;
+        while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+            cqe = &cqeArray[head & *cqMask];
+            buf = (Buffer *) (uintptr_t) cqe->user_data;
+            res = cqe->res;
+            
+            /* エントリを読み終えたので、完了キューを空ける */
+            head++;
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+            
+            if (buf == NULL) {
+                stop = 1;
+            } else {
+                finishIO(buf, res, 0);
+            }
+        }
+    }
+    
+    return NULL;
+}
+
+static Result uringInitialize()
+{
+    struct io_uring_params params;
+    
+    memset(&params, 0, sizeof(params));
+    if ((uringFd = (int) syscall(__NR_io_uring_setup, AIO_DEPTH, &params)) < 0) {
+        return NG;
+    }
+    
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    sqeAreaSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    
+    sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  uringFd, IORING_OFF_SQ_RING);
+    cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  uringFd, IORING_OFF_CQ_RING);
+    sqeArea = mmap(NULL, sqeAreaSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   uringFd, IORING_OFF_SQES);
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqeArea == MAP_FAILED) {
+        goto error;
+    }
+    
+    sqTail = (unsigned *) (sqRing + params.sq_off.tail);
+    sqMask = (unsigned *) (sqRing + params.sq_off.ring_mask);
+    sqArray = (unsigned *) (sqRing + params.sq_off.array);
+    cqHead = (unsigned *) (cqRing + params.cq_off.head);
+    cqTail = (unsigned *) (cqRing + params.cq_off.tail);
+    cqMask = (unsigned *) (cqRing + params.cq_off.ring_mask);
+    cqeArray = (struct io_uring_cqe *) (cqRing + params.cq_off.cqes);
+    
+    if (pthread_create(&uringThread, NULL, uringMain, NULL) != 0) {
+        goto error;
+    }
+    
+    return OK;
+    
+error:
+    if (sqRing != MAP_FAILED && sqRing != NULL) munmap(sqRing, sqRingSize);
+    if (cqRing != MAP_FAILED && cqRing != NULL) munmap(cqRing, cqRingSize);
+    if (sqeArea != MAP_FAILED && sqeArea != NULL) munmap(sqeArea, sqeAreaSize);
+    sqRing = cqRing = NULL;
+    sqeArea = NULL;
+    close(uringFd);
+    uringFd = -1;
+    return NG;
+}
+
+static void uringFinalize()
+{
+    /* 完了を受け取るスレッドを止めるため、user_dataが0のNOPを投入する */
+    pthread_mutex_lock(&ioMutex);
+    uringQueue(IORING_OP_NOP, -1, NULL, 0, NULL);
+    uringEnter(1, 0, 0);
+    pthread_mutex_unlock(&ioMutex);
+    
+    pthread_join(uringThread, NULL);
+    
+    munmap(sqRing, sqRingSize);
+    munmap(cqRing, cqRingSize);
+    munmap(sqeArea, sqeAreaSize);
+    sqRing = cqRing = NULL;
+    sqeArea = NULL;
+    close(uringFd);
+    uringFd = -1;
+}
+
+static Result uringSubmit(Buffer **bufs, int n)
+{
+    int i;
+    
+    for (i = 0; i < n; i++) {
+        bufs[i]->iov.iov_base = bufs[i]->page;
+        bufs[i]->iov.iov_len = PAGE_SIZE;
+        uringQueue((bufs[i]->ioState == IO_READ) ? IORING_OP_READV : IORING_OP_WRITEV,
+                   bufs[i]->file->desc, &bufs[i]->iov, (off_t) bufs[i]->pageNum * PAGE_SIZE, bufs[i]);
+    }
+    
+    /* 投入できなければ、呼び出し元で失敗として後始末する */
+    return (uringEnter((unsigned) n, 0, 0) < 0) ? NG : OK;
+}
+
+static AsyncIO uringIO = {
+    "io_uring", uringInitialize, uringFinalize, uringSubmit
+};
+#endif
+
+/*
+ * initializeAsyncIO -- 非同期I/Oの初期化
+ *
+ * setAsyncIO()で指定されていればそれを、そうでなければ環境変数ENV_ASYNC_IOを
+ * 調べる。"io_uring"が使えなければ"threads"を使う。どちらも指定されて
+ * いなければ(または"none"なら)非同期I/Oは使わない。
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	成功の場合OK、失敗の場合NG
+ */
+static Result initializeAsyncIO()
+{
+    char *name = requestedAsyncIO;
+    
+    numAsyncInFlight = 0;
+    asyncIO = NULL;
+    
+    if (name == NULL) {
+        name = getenv(ENV_ASYNC_IO);
+    }
+    if (name == NULL || strcmp(name, "none") == 0) {
+        return OK;
+    }
+    
+#ifdef HAVE_IO_URING
+    if (strcmp(name, "io_uring") == 0 && uringIO.initialize() == OK) {
+        asyncIO = &uringIO;
+        return OK;
+    }
+#endif
+    
+    if (strcmp(name, "io_uring") == 0 || strcmp(name, "threads") == 0) {
+        if (threadIO.initialize() != OK) {
+            return NG;
+        }
+        asyncIO = &threadIO;
+    }
+    
+    return OK;
+}
+
+/*
+ * finalizeAsyncIO -- 非同期I/Oの終了処理
+ *
+ * 発行したI/Oがすべて終わるのを待ってから止める。ロックを取らずに呼び出すこと。
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	なし
+ */
+static void finalizeAsyncIO()
+{
+    Shard *shard;
+    int i;
+    
+    if (asyncIO == NULL) {
+        return;
+    }
+    
+    for (i = 0; i < numShard; i++) {
+        shard = &shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        while (shard->numPendingIO > 0) {
+            pthread_cond_wait(&shard->ioDoneCond, &shard->mutex);
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    
+    asyncIO->finalize();
+    asyncIO = NULL;
+}
+
+/*
+ * submitIO -- 非同期I/Oの発行
+ *
+ * bufsのバッファには、ioStateを設定して固定し、シャードのnumPendingIOに
+ * 数えておくこと。全シャードで発行中のI/OがAIO_DEPTHを超える場合は、
+ * シャードのmutexを放して空くまで待つ(I/Oを終えたスレッドがシャードの
+ * mutexを取れるようにするため)。
+ * 圧縮したファイルのバッファは、非同期I/Oの方式には渡さず、展開や圧縮を
+ * しながらその場で読み書きして後始末まで済ませる。
+ * シャードのmutexを取ってから呼び出すこと。
+ *
+ * 引数:
+ *	shard: バッファが属するシャード
+ *	bufs: 読み書きするバッファの配列(すべてshardのもの)
+ *	n: バッファの数(AIO_DEPTH以下)
+ *
+ * 返り値:
+ *	なし
+ */
+static void submitIO(Shard *shard, Buffer **bufs, int n)
+{
+    Buffer *asyncBufs[AIO_DEPTH];
+    Result result;
+    ssize_t done;
+    int i, numAsync = 0;
+    
+    shard->numInFlight += n;
+    
+    for (i = 0; i < n; i++) {
+        if (bufs[i]->file->pageMap == NULL) {
+            asyncBufs[numAsync++] = bufs[i];
+        } else if (bufs[i]->ioState == IO_READ) {
+            done = readCompressedPage(bufs[i]->file, bufs[i]->pageNum, bufs[i]->page);
+            completeIO(bufs[i], done, -1);
+        } else {
+            done = (writeCompressedPage(bufs[i]->file, bufs[i]->pageNum, bufs[i]->page) == OK) ? PAGE_SIZE : -1;
+            completeIO(bufs[i], done, -1);
+        }
+    }
+    if (numAsync == 0) {
+        return;
+    }
+    bufs = asyncBufs;
+    n = numAsync;
+    
+    pthread_mutex_lock(&ioMutex);
+    while (numAsyncInFlight + n > AIO_DEPTH) {
+        pthread_mutex_unlock(&ioMutex);
+        pthread_mutex_unlock(&shard->mutex);
+        
+        pthread_mutex_lock(&ioMutex);
+        while (numAsyncInFlight + n > AIO_DEPTH) {
+            pthread_cond_wait(&ioSlotCond, &ioMutex);
+        }
+        pthread_mutex_unlock(&ioMutex);
+        
+        pthread_mutex_lock(&shard->mutex);
+        pthread_mutex_lock(&ioMutex);
+    }
+    numAsyncInFlight += n;
+    result = asyncIO->submit(bufs, n);
+    if (result != OK) {
+        numAsyncInFlight -= n;
+    }
+    pthread_mutex_unlock(&ioMutex);
+    
+    /* 発行できなかったものは、失敗として後始末する */
+    if (result != OK) {
+        for (i = 0; i < n; i++) {
+            completeIO(bufs[i], -1, 0);
+        }
+    }
+}
+
+/*
+ * hasPendingIO -- ファイルのバッファに終わっていないI/Oがあるかどうか
+ *
+ * シャードのmutexを取ってから呼び出すこと。
+ *
+ * 引数:
+ *	shard: 調べるシャード
+ *	file: 調べるファイルのFile構造体
+ *
+ * 返り値:
+ *	あれば1、なければ0
+ */
+static int hasPendingIO(Shard *shard, File *file)
+{
+    int i;
+    
+    if (shard->numPendingIO == 0) {
+        return 0;
+    }
+    for (i = 0; i < shard->numFrame; i++) {
+        if (shard->frames[i].file == file && shard->frames[i].ioState != IO_NONE) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * getStoredPages -- ファイルに格納されているページ数
+ *
+ * 圧縮したファイルはページ対応表に記録されているページ数、そうでなければ
+ * ファイルの大きさから求める(バッファ上で書き足しただけのページは数えない)。
+ *
+ * 引数:
+ *	file: 調べるファイルのFile構造体
+ *
+ * 返り値:
+ *	ページ数。調べられなければ-1を返す。
+ */
+static int getStoredPages(File *file)
+{
+    struct stat statBuf;
+    int numPage;
+    
+    if (file->pageMap != NULL) {
+        pthread_mutex_lock(&file->pageMap->mutex);
+        numPage = file->pageMap->numExtent;
+        pthread_mutex_unlock(&file->pageMap->mutex);
+        return numPage;
+    }
+    if (fstat(file->desc, &statBuf) == -1) {
+        return -1;
+    }
+    return (int) (statBuf.st_size / PAGE_SIZE);
+}
+
+/*
+ * submitReadAhead -- 続くページの非同期の先読み
+ *
+ * pageNumから最大maxPageページ分の空きバッファを用意し、読み込みを一度に
+ * 発行する。先読みするのは、pageNumと同じシャードに入るページまでとする。
+ * 読み込み中のバッファもハッシュ表と置換方式に登録するので、
+ * そのページを読もうとすると、読み込みが終わるまで待つことになる。
+ * markが0でなければ先頭のバッファに印を付け、そのページが読まれたときに
+ * 次の先読みを発行するようにする。
+ * シャードのmutexを取ってから呼び出すこと。
+ *
+ * 引数:
+ *	shard: pageNumのページが入るシャード
+ *	file: アクセスするファイルのFile構造体
+ *	pageNum: 先読みする最初のページ番号
+ *	maxPage: 先読みするページ数の上限(READAHEAD_PAGES以下)
+ *	mark: 先頭のバッファに印を付けるかどうか
+ *
+ * 返り値:
+ *	先読みを発行したページ数
+ */
+static int submitReadAhead(Shard *shard, File *file, int pageNum, int maxPage, int mark)
+{
+    Buffer *aheadBuf[READAHEAD_PAGES];
+    int numPage, numStored;
+    
+    if ((numStored = getStoredPages(file)) == -1) {
+        return 0;
+    }
+    if (maxPage > numStored - pageNum) {
+        maxPage = numStored - pageNum;
+    }
+    
+    for (numPage = 0; numPage < maxPage; numPage++) {
+        if (getShard(file, pageNum + numPage) != shard
+            || lookupBuffer(shard, file, pageNum + numPage) != NULL) {
+            break;
+        }
+        if ((aheadBuf[numPage] = allocateBuffer(shard, file)) == NULL) {
+            break;
+        }
+        if (lookupBuffer(shard, file, pageNum + numPage) != NULL) {
+            releaseBuffer(aheadBuf[numPage]);
+            break;
+        }
+        
+        /* 読み込み中の印を付けて固定し、登録する */
+        aheadBuf[numPage]->file = file;
+        aheadBuf[numPage]->pageNum = pageNum + numPage;
+        aheadBuf[numPage]->modified = UNMODIFIED;
+        aheadBuf[numPage]->ioState = IO_READ;
+        aheadBuf[numPage]->pinCount++;
+        shard->numPendingIO++;
+        registerBuffer(aheadBuf[numPage]);
+    }
+    
+    if (numPage == 0) {
+        return 0;
+    }
+    
+    if (mark) {
+        aheadBuf[0]->aheadMark = 1;
+    }
+    pthread_mutex_lock(&file->mutex);
+    file->nextAheadPage = pageNum + numPage;
+    pthread_mutex_unlock(&file->mutex);
+    addCount(&numReadAhead, 1);
+    addCount(&numReadAheadPage, numPage);
+    
+    submitIO(shard, aheadBuf, numPage);
+    
+    return numPage;
+}
+
+/*
+ * recordAccess -- ページへのアクセスを統計に数え、順番に読んでいるかどうかを判定する
+ *
+ * アクセスしたページ番号を記録し、adviseFile()でACCESS_SEQUENTIALが
+ * 指定されているか、直前のSEQUENTIAL_THRESHOLD回以上のアクセスのページ番号が
+ * 連続していれば、順番に読んでいると判断する。
+ * シャードのmutexを取ってから呼び出すこと。
+ *
+ * 引数:
+ *	shard: ページが入るシャード
+ *	file: アクセスするファイルのFile構造体
+ *	pageNum: アクセスするページ番号
+ *	hit: ヒットなら1、ミスなら0
+ *
+ * 返り値:
+ *	順番に読んでいれば1、そうでなければ0
+ */
+static int recordAccess(Shard *shard, File *file, int pageNum, int hit)
+{
+    int sequential;
+    
+    if (hit) {
+        shard->numHit++;
+    } else {
+        shard->numMiss++;
+    }
+    
+    pthread_mutex_lock(&file->mutex);
+    
+    if (hit) {
+        file->stats.numHit++;
+    } else {
+        file->stats.numMiss++;
+    }
+    
+    if (pageNum == file->lastPageNum + 1) {
+        file->numSequential++;
+    } else if (pageNum != file->lastPageNum) {
+        file->numSequential = 0;
+    }
+    file->lastPageNum = pageNum;
+    sequential = (file->hint == ACCESS_SEQUENTIAL || file->numSequential >= SEQUENTIAL_THRESHOLD);
+    
+    pthread_mutex_unlock(&file->mutex);
+    
+    return sequential;
+}
+
+/*
+ * getReadAheadSize -- 一度に先読みするページ数の上限
+ *
+ * READAHEAD_PAGESと1シャードあたりのバッファ数の1/4の小さいほう。
+ * バッファの輪を使っているときは、輪の大きさの1/2までに抑える。
+ * どれかのシャードのmutexを取ってから呼び出すこと。
+ *
+ * 引数:
+ *	file: アクセスするファイルのFile構造体
+ *
+ * 返り値:
+ *	ページ数
+ */
+static int getReadAheadSize(File *file)
+{
+    int maxPage;
+    
+    maxPage = numBuffer / numShard / 4;
+    if (maxPage > READAHEAD_PAGES) {
+        maxPage = READAHEAD_PAGES;
+    }
+    if (file->ring != NULL && maxPage > file->ring->size / 2) {
+        maxPage = file->ring->size / 2;
+    }
+    
+    return maxPage;
+}
+
+/*
+ * startReadAhead -- 非同期の先読みの発行
+ *
+ * pageNumのページが入るシャードのmutexを取って、submitReadAhead()で
+ * 先読みを発行する。シャードのmutexを取らずに呼び出すこと。
+ *
+ * 引数:
+ *	file: アクセスするファイルのFile構造体
+ *	pageNum: 先読みする最初のページ番号
+ *
+ * 返り値:
+ *	なし
+ */
+static void startReadAhead(File *file, int pageNum)
+{
+    Shard *shard = getShard(file, pageNum);
+    
+    pthread_mutex_lock(&shard->mutex);
+    submitReadAhead(shard, file, pageNum, getReadAheadSize(file), 1);
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+/*
+ * prepareReadBuffer -- ページを読み込む空きバッファに、読み込み中の印を付けて登録する
+ *
+ * 固定してハッシュ表に登録するので、ほかのスレッドがそのページを読もうとすると、
+ * 読み込みが終わるまで待つことになる。置換方式には、読み終わってから登録する。
+ */
+static void prepareReadBuffer(Buffer *buf, File *file, int pageNum)
+{
+    buf->file = file;
+    buf->pageNum = pageNum;
+    buf->modified = UNMODIFIED;
+    buf->ioState = IO_READ;
+    buf->pinCount++;
+    insertBufferToHash(buf);
+}
+
+/*
+ * readPages -- 要求されたページと、それに続くページの読み込み
+ *
+ * pageNumのページをbufに読み込み、maxPageが1より大きければ続くページも
+ * 空きバッファにまとめて読み込む。続くページは、ファイルの末尾、
+ * すでにバッファにあるページ、違うシャードに入るページ、maxPageのうち、
+ * 最初に達したところまでとする。
+ * 読み込みは1回のpreadv(preadvがない環境では1回のpreadで作業領域に
+ * 読み込んでから各バッファにコピーする。圧縮したファイルは1ページずつ読み込んで
+ * 展開する)で行い、その間はシャードのmutexを放す。
+ * 読み込み中のバッファには印を付けて固定し、ハッシュ表に登録しておくので、
+ * ほかのスレッドが同じページを読もうとすると、読み込みが終わるまで待つ。
+ * 読み込んだバッファは、先読みしたものから順に置換方式に登録し、
+ * 要求されたページのバッファは最後に登録して、固定したまま返す。
+ * シャードのmutexを取ってから呼び出すこと。
+ *
+ * 引数:
+ *	shard: pageNumのページが入るシャード
+ *	file: アクセスするファイルのFile構造体
+ *	pageNum: 要求されたページの番号
+ *	buf: 要求されたページを読み込む空きバッファ
+ *	maxPage: 読み込むページ数の上限(READAHEAD_PAGES以下)
+ *	next: 続けて非同期の先読みをするべきなら、その最初のページ番号を入れる
+ *	      (しなくてよければ-1を入れる)
+ *
+ * 返り値:
+ *	読み込んだページ数。要求されたページが読み込めなければ0を返す
+ *	(bufは空きリストに戻す)。
+ */
+static int readPages(Shard *shard, File *file, int pageNum, Buffer *buf, int maxPage, int *next)
+{
+    Buffer *aheadBuf[READAHEAD_PAGES];
+    int numPage, numRead, numStored, i;
+    long long start;
+    ssize_t n;
+#ifdef __linux__
+    struct iovec iov[READAHEAD_PAGES];
+#else
+    char *area;
+#endif
+    
+    *next = -1;
+    
+    /* 先読みするページ数の上限を決める */
+    if (maxPage > 1) {
+        if ((numStored = getStoredPages(file)) == -1) {
+            releaseBuffer(buf);
+            return 0;
+        }
+        if (maxPage > numStored - pageNum) {
+            maxPage = numStored - pageNum;
+        }
+    }
+    
+    /* 先読みするページのための空きバッファを集め、読み込み中の印を付ける */
+    aheadBuf[0] = buf;
+    prepareReadBuffer(buf, file, pageNum);
+    for (numPage = 1; numPage < maxPage; numPage++) {
+        if (getShard(file, pageNum + numPage) != shard
+            || lookupBuffer(shard, file, pageNum + numPage) != NULL) {
+            break;
+        }
+        if ((aheadBuf[numPage] = allocateBuffer(shard, file)) == NULL) {
+            break;
+        }
+        /* 空きを待つ間にほかのスレッドが読み込んでいたら、そこでやめる */
+        if (lookupBuffer(shard, file, pageNum + numPage) != NULL) {
+            releaseBuffer(aheadBuf[numPage]);
+            break;
+        }
+        prepareReadBuffer(aheadBuf[numPage], file, pageNum + numPage);
+    }
+    shard->numPendingIO += numPage;
+    shard->numInFlight += numPage;
+    
+    /* まとめて読み込む(バッファは固定されているので、シャードのmutexを放してよい) */
+    pthread_mutex_unlock(&shard->mutex);
+    if (file->pageMap != NULL) {
+        /* 圧縮したファイルは、1ページずつ読み込んで展開する */
+        for (i = 0; i < numPage; i++) {
+            if (readCompressedPage(file, pageNum + i, aheadBuf[i]->page) != PAGE_SIZE) {
+                break;
+            }
+        }
+        n = (ssize_t) i * PAGE_SIZE;
+    } else {
+#ifdef __linux__
+        for (i = 0; i < numPage; i++) {
+            iov[i].iov_base = aheadBuf[i]->page;
+            iov[i].iov_len = PAGE_SIZE;
+        }
+        start = getNanosec();
+        n = preadv(file->desc, iov, numPage, (off_t) pageNum * PAGE_SIZE);
+        countIO(file, 0, n, getNanosec() - start);
+#else
+        if (numPage == 1) {
+            start = getNanosec();
+            n = pread(file->desc, buf->page, PAGE_SIZE, (off_t) pageNum * PAGE_SIZE);
+            countIO(file, 0, n, getNanosec() - start);
+        } else if ((area = malloc((size_t) numPage * PAGE_SIZE)) == NULL) {
+            n = -1;
+        } else {
+            start = getNanosec();
+            n = pread(file->desc, area, (size_t) numPage * PAGE_SIZE, (off_t) pageNum * PAGE_SIZE);
+            for (i = 0; i < n / PAGE_SIZE; i++) {
+                memcpy(aheadBuf[i]->page, area + (size_t) i * PAGE_SIZE, PAGE_SIZE);
+            }
+            free(area);
+            countIO(file, 0, n, getNanosec() - start);
+        }
+#endif
+    }
+    pthread_mutex_lock(&shard->mutex);
+    numRead = (n < 0) ? 0 : (int) (n / PAGE_SIZE);
+    
+    for (i = 0; i < numPage; i++) {
+        aheadBuf[i]->ioState = IO_NONE;
+    }
+    shard->numPendingIO -= numPage;
+    shard->numInFlight -= numPage;
+    
+    /* 読み込めなかった分のバッファは空きリストに戻す */
+    for (i = numRead; i < numPage; i++) {
+        removeBufferFromHash(aheadBuf[i]);
+        releaseBuffer(aheadBuf[i]);
+    }
+    
+    /* 先読みしたバッファを置換方式に登録して固定を外し、最後に要求されたページを登録する */
+    for (i = 1; i < numRead; i++) {
+        if (aheadBuf[i]->ring == NULL) {
+            policy->insert(shard, aheadBuf[i]);
+        }
+        aheadBuf[i]->pinCount--;
+    }
+    if (numRead > 0 && buf->ring == NULL) {
+        policy->insert(shard, buf);
+    }
+    pthread_cond_broadcast(&shard->ioDoneCond);
+    
+    if (numRead > 1) {
+        addCount(&numReadAhead, 1);
+        addCount(&numReadAheadPage, numRead - 1);
+    }
+    
+    /* 非同期I/Oを使っていれば、次のページからの読み込みを発行するよう知らせる */
+    if (asyncIO != NULL && numRead == numPage && numPage > 1) {
+        *next = pageNum + numRead;
+    }
+    
+    return numRead;
+}
+
+/*
+ * fetchBuffer -- 指定したページを保持するバッファの取得
+ *
+ * ページがバッファになければ空きバッファを用意し、readFromFileが0でなければ
+ * ファイルから内容を読み込む。ファイルを順番に読んでいるときは、続くページも
+ * まとめて先読みする。readFromFileが0なら、読み込み中の印を付けたまま返すので、
+ * 呼び出し元で内容を書いてから印を外すこと(completeFill())。
+ * mappedがNULLでなく、ファイルをメモリにマップしていて、ページがバッファに
+ * なければ、バッファには読み込まずにマップした領域を*mappedに入れてNULLを返す。
+ * さらにcopyがNULLでなければ、ページの内容をシャードのmutexを取ったままcopyに
+ * コピーし、固定せずに*mappedにcopyを入れてNULLを返す(ほかのスレッドが
+ * 書き込み用のラッチを持っていてコピーできなければ、固定したバッファを返す)。
+ * ロックを取らずに呼び出すこと。返したバッファは固定されている。
+ *
+ * 引数:
+ *	file: アクセスするファイルのFile構造体
+ *	pageNum: ページ番号
+ *	readFromFile: バッファにないときにファイルから読み込むかどうか
+ *	             (ページ全体を上書きする場合は0にする)
+ *	mapped: 固定せずに内容を返してよければ、その領域を入れる場所(よくなければNULL)
+ *	copy: 内容をコピーする領域(コピーしなければNULL。mappedがNULLならNULLにする)
+ *
+ * 返り値:
+ *	ページを保持するバッファへのポインタ。失敗した場合や、固定せずに内容を
+ *	返す場合はNULLを返す。
+ */
+static Buffer *fetchBuffer(File *file, int pageNum, int readFromFile, char **mapped, char *copy)
+{
+    Shard *shard = getShard(file, pageNum);
+    Buffer *buf;
+    char *p;
+    int sequential = 0, counted = 0, aheadPage = -1, numRead;
+    
+    pthread_mutex_lock(&shard->mutex);
+    
+retry:
+    /*
+     * 要求されたページがバッファに保存されているかどうか、ハッシュ表で探す
+     * 読み込んでいる最中なら、終わるのを待つ(失敗していたら見つからなくなる)
+     */
+    while ((buf = lookupBuffer(shard, file, pageNum)) != NULL && buf->ioState == IO_READ) {
+        pthread_cond_wait(&shard->ioDoneCond, &shard->mutex);
+    }
+    
+    /* マップしていて、バッファにないページなら、マップした領域を返す */
+    if (buf == NULL && mapped != NULL && file->map != NULL
+        && (p = getMappedPage(file, pageNum)) != NULL) {
+        pthread_mutex_unlock(&shard->mutex);
+        addCount(&numMappedRead, 1);
+        *mapped = p;
+        return NULL;
+    }
+    
+    /* 統計に数え、順番に読んでいるかどうかを判定するため、アクセスしたページ番号を記録する */
+    if (!counted) {
+        sequential = recordAccess(shard, file, pageNum, buf != NULL);
+        counted = 1;
+    }
+    
+    if (buf != NULL) {
+        /* アクセスされたことを置換方式に知らせる(輪のバッファは置換方式の外) */
+        if (buf->ring == NULL) {
+            policy->access(shard, buf);
+        }
+        
+        /* 先読みした範囲に入ったので、次の先読みを発行する */
+        if (buf->aheadMark) {
+            buf->aheadMark = 0;
+            if (asyncIO != NULL && sequential) {
+                pthread_mutex_lock(&file->mutex);
+                aheadPage = file->nextAheadPage;
+                pthread_mutex_unlock(&file->mutex);
+            }
+        }
+        
+        /* 変更しているスレッドがいなければ、固定せずにコピーして済ませる */
+        if (copy != NULL && pthread_rwlock_tryrdlock(buf->latch) == 0) {
+            memcpy(copy, buf->page, PAGE_SIZE);
+            pthread_rwlock_unlock(buf->latch);
+            *mapped = copy;
+            buf = NULL;
+        } else {
+            buf->pinCount++;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+        
+        if (aheadPage >= 0) {
+            startReadAhead(file, aheadPage);
+        }
+        return buf;
+    }
+    
+    /*
+     * 空きバッファを取得する(輪を使っていれば輪から、そうでなければ
+     * 空きリストから取り、空きがなければ置換方式が選んだバッファを追い出す)
+     */
+    if ((buf = allocateBuffer(shard, file)) == NULL) {
+        pthread_mutex_unlock(&shard->mutex);
+        return NULL;
+    }
+    
+    /* 空きを待つ間にほかのスレッドが読み込んでいたら、そちらを使う */
+    if (lookupBuffer(shard, file, pageNum) != NULL) {
+        releaseBuffer(buf);
+        goto retry;
+    }
+    
+    if (!readFromFile) {
+        /* 読み込まずに登録する(呼び出し元が内容を書くまで、ほかのスレッドは待つ) */
+        prepareReadBuffer(buf, file, pageNum);
+        shard->numPendingIO++;
+        if (buf->ring == NULL) {
+            policy->insert(shard, buf);
+        }
+        pthread_mutex_unlock(&shard->mutex);
+        return buf;
+    }
+    
+    /* 順番に読んでいれば、続くページもまとめて読み込む */
+    numRead = readPages(shard, file, pageNum, buf, sequential ? getReadAheadSize(file) : 1, &aheadPage);
+    
+    /*
+     * 読み込んでからシャードのmutexを放していないので、ほかのスレッドは
+     * まだこのバッファを見つけていない。ラッチを取らずにコピーしてよい
+     */
+    if (numRead > 0 && copy != NULL) {
+        memcpy(copy, buf->page, PAGE_SIZE);
+        buf->pinCount--;
+        *mapped = copy;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    
+    if (numRead == 0) {
+        return NULL;
+    }
+    
+    /* 非同期I/Oを使っていれば、次のページからの読み込みを発行しておく */
+    if (aheadPage >= 0) {
+        startReadAhead(file, aheadPage);
+    }
+    
+    return buf;
+}
+
+/*
+ * markBufferModified -- バッファに更新済みの印を付ける
+ *
+ * シャードの更新済みのバッファが多くなったら、書き戻しスレッドを起こす。
+ * シャードのmutexを取ってから呼び出すこと。
+ *
+ * 引数:
+ *	buf: 更新したバッファ
+ *
+ * 返り値:
+ *	なし
+ */
+static void markBufferModified(Buffer *buf)
+{
+    Shard *shard = buf->shard;
+    
+    if (buf->modified == MODIFIED) {
+        return;
+    }
+    
+    buf->modified = MODIFIED;
+    shard->numDirty++;
+    
+    if (shard->numDirty * 100 > shard->numFrame * FLUSH_DIRTY_RATIO) {
+        pthread_cond_signal(&flusherCond);
+    }
+}
+
+/*
+ * completeFill -- fetchBuffer()で読み込まずに取得したバッファの読み込み中の印を外す
+ *
+ * シャードのmutexを取ってから呼び出すこと。
+ *
+ * 引数:
+ *	buf: 内容を書いたバッファ
+ *
+ * 返り値:
+ *	なし
+ */
+static void completeFill(Buffer *buf)
+{
+    if (buf->ioState == IO_READ) {
+        buf->ioState = IO_NONE;
+        buf->shard->numPendingIO--;
+        pthread_cond_broadcast(&buf->shard->ioDoneCond);
+    }
+}
+
+/*
+ * releasePin -- バッファの固定を外す
+ *
+ * 引数:
+ *	buf: fetchBuffer()で取得したバッファ
+ *	modified: 内容を変更した場合はMODIFIED、していない場合はUNMODIFIED
+ *
+ * 返り値:
+ *	なし
+ */
+static void releasePin(Buffer *buf, modifyFlag modified)
+{
+    Shard *shard = buf->shard;
+    
+    pthread_mutex_lock(&shard->mutex);
+    
+    assert(buf->pinCount > 0);
+    buf->pinCount--;
+    
+    if (modified == MODIFIED) {
+        markBufferModified(buf);
+    }
+    
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+/*
+ * findDirtyBuffer -- 書き戻すバッファを探す
+ *
+ * シャードのflushCursorの位置から順に、固定されていない更新済みのバッファを探す。
+ * シャードのmutexを取ってから呼び出すこと。
+ *
+ * 引数:
+ *	shard: 探すシャード
+ *
+ * 返り値:
+ *	書き戻すバッファ。なければNULLを返す。
+ */
+static Buffer *findDirtyBuffer(Shard *shard)
+{
+    Buffer *buf;
+    int i;
+    
+    for (i = 0; i < shard->numFrame; i++) {
+        buf = &shard->frames[(shard->flushCursor + i) % shard->numFrame];
+        if (buf->file != NULL && buf->modified == MODIFIED && buf->pinCount == 0) {
+            shard->flushCursor = (shard->flushCursor + i + 1) % shard->numFrame;
+            return buf;
+        }
+    }
+    
+    return NULL;
+}
+
+/*
+ * isFlusherStopped -- 書き戻しスレッドを止めるよう指示されたかどうか
+ */
+static int isFlusherStopped()
+{
+    int stop;
+    
+    pthread_mutex_lock(&flusherMutex);
+    stop = flusherStop;
+    pthread_mutex_unlock(&flusherMutex);
+    
+    return stop;
+}
+
+/*
+ * waitFlushInterval -- 書き戻しスレッドがFLUSH_INTERVALだけ待つ
+ *
+ * その間に起こされたら、すぐに戻る。ロックを取らずに呼び出すこと。
+ */
+static void waitFlushInterval()
+{
+    struct timeval now;
+    struct timespec timeout;
+    
+    gettimeofday(&now, NULL);
+    timeout.tv_sec = now.tv_sec + (now.tv_usec / 1000 + FLUSH_INTERVAL) / 1000;
+    timeout.tv_nsec = ((now.tv_usec / 1000 + FLUSH_INTERVAL) % 1000) * 1000000L;
+    
+    pthread_mutex_lock(&flusherMutex);
+    if (!flusherStop) {
+        pthread_cond_timedwait(&flusherCond, &flusherMutex, &timeout);
+    }
+    pthread_mutex_unlock(&flusherMutex);
+}
+
+/*
+ * flushAsync -- シャードの更新済みのバッファを非同期I/Oでまとめて書き戻す
+ *
+ * 固定されていない更新済みのバッファを最大AIO_DEPTH個集めて書き込みを
+ * 一度に発行し、すべて終わるまで待つ。
+ * ロックを取らずに呼び出すこと。
+ *
+ * 引数:
+ *	shard: 書き戻すシャード
+ *	failed: 失敗したものがあれば1を入れる
+ *
+ * 返り値:
+ *	書き戻そうとしたバッファの数
+ */
+static int flushAsync(Shard *shard, int *failed)
+{
+    Buffer *bufs[AIO_DEPTH];
+    long numError = getCount(&numWriteError);
+    int n, i;
+    
+    pthread_mutex_lock(&shard->mutex);
+    
+    for (n = 0; n < AIO_DEPTH && (bufs[n] = findDirtyBuffer(shard)) != NULL
+             && takeDirtyBuffer(bufs[n]); n++) {
+        shard->numPendingWrite++;
+    }
+    
+    if (n > 0) {
+        /* ファイルの中の順に発行する */
+        qsort(bufs, (size_t) n, sizeof(Buffer *), compareBuffer);
+        submitIO(shard, bufs, n);
+        while (shard->numPendingWrite > 0) {
+            pthread_cond_wait(&shard->ioDoneCond, &shard->mutex);
+        }
+    }
+    
+    pthread_mutex_unlock(&shard->mutex);
+    
+    for (i = 0; i < n; i++) {
+        pthread_rwlock_unlock(bufs[i]->latch);
+    }
+    if (getCount(&numWriteError) != numError) {
+        *failed = 1;
+    }
+    
+    return n;
+}
+
+/*
+ * flushSync -- シャードの更新済みのバッファをまとめて書き戻す
+ *
+ * 固定されていない更新済みのバッファを最大FLUSH_BATCH個集め、
+ * writeBackBuffers()で(ファイル, ページ番号)の順に、連続したページは
+ * まとめて書き込む。書き込みの間はシャードのmutexを放す。
+ * ロックを取らずに呼び出すこと。
+ *
+ * 引数:
+ *	shard: 書き戻すシャード
+ *	failed: 失敗したものがあれば1を入れる
+ *
+ * 返り値:
+ *	書き戻そうとしたバッファの数
+ */
+static int flushSync(Shard *shard, int *failed)
+{
+    Buffer *bufs[FLUSH_BATCH];
+    Result results[FLUSH_BATCH];
+    int n, i, numWritten = 0;
+    
+    pthread_mutex_lock(&shard->mutex);
+    
+    for (n = 0; n < FLUSH_BATCH && (bufs[n] = findDirtyBuffer(shard)) != NULL
+             && takeDirtyBuffer(bufs[n]); n++) {
+        shard->numInFlight++;
+    }
+    
+    if (n == 0) {
+        pthread_mutex_unlock(&shard->mutex);
+        return 0;
+    }
+    
+    pthread_mutex_unlock(&shard->mutex);
+    if (writeBackBuffers(bufs, n, results) != OK) {
+        *failed = 1;
+    }
+    for (i = 0; i < n; i++) {
+        pthread_rwlock_unlock(bufs[i]->latch);
+    }
+    pthread_mutex_lock(&shard->mutex);
+    
+    for (i = 0; i < n; i++) {
+        bufs[i]->ioState = IO_NONE;
+        bufs[i]->pinCount--;
+        shard->numPendingIO--;
+        shard->numInFlight--;
+        if (results[i] == OK) {
+            numWritten++;
+        } else {
+            /* 書き戻せなかったので、追い出すときに書き戻してもらう */
+            markBufferModified(bufs[i]);
+        }
+    }
+    pthread_cond_broadcast(&shard->ioDoneCond);
+    
+    pthread_mutex_unlock(&shard->mutex);
+    
+    addCount(&numFlush, numWritten);
+    
+    return n;
+}
+
+/*
+ * flusherMain -- 書き戻しスレッドの本体
+ *
+ * FLUSH_INTERVALごとに、または更新済みのバッファが多くなって起こされたときに、
+ * 更新済みのバッファをシャードごとにすべてファイルに書き戻す。こうしておくと、
+ * 追い出すバッファはふつう更新されていないので、readPage()などが追い出しのために
+ * 書き込みを待つことがなくなる。
+ *
+ * ふだんはflushSync()で連続したページをまとめて書き、非同期I/Oを
+ * 使っているときは、flushAsync()でまとめて発行する。
+ * 書き込みの間はシャードのmutexを放すので、ほかのスレッドはバッファを使える。
+ * 書き戻すバッファは固定しておくので、その間に追い出されることはない。
+ * 書き込みの間にページが更新されたら更新済みの印が付き直すので、次の回に
+ * もう一度書き戻す。書き戻すものがなかったときや、失敗したものがあったときは、
+ * FLUSH_INTERVALだけ待つ。
+ *
+ * 引数:
+ *	arg: 使わない
+ *
+ * 返り値:
+ *	NULL
+ */
+static void *flusherMain(void *arg)
+{
+    int i, n, failed;
+    
+    while (!isFlusherStopped()) {
+        n = 0;
+        failed = 0;
+        for (i = 0; i < numShard; i++) {
+            if (asyncIO != NULL) {
+                n += flushAsync(&shards[i], &failed);
+            } else {
+                n += flushSync(&shards[i], &failed);
+            }
+        }
+        
+        /* 失敗を繰り返さないように、しばらく待つ */
+        if (n == 0 || failed) {
+            waitFlushInterval();
+        }
+    }
+    
+    return NULL;
+}
+
+/*
+ * startFlusher -- 書き戻しスレッドの開始
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	成功の場合OK、失敗の場合NG
+ */
+static Result startFlusher()
+{
+    flusherStop = 0;
+    if (pthread_create(&flusherThread, NULL, flusherMain, NULL) != 0) {
+        return NG;
+    }
+    flusherRunning = 1;
+    return OK;
+}
+
+/*
+ * stopFlusher -- 書き戻しスレッドの停止
+ *
+ * 書き戻しスレッドが終わるまで待つ。ロックを取らずに呼び出すこと。
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	なし
+ */
+static void stopFlusher()
+{
+    if (!flusherRunning) {
+        return;
+    }
+    
+    pthread_mutex_lock(&flusherMutex);
+    flusherStop = 1;
+    pthread_cond_signal(&flusherCond);
+    pthread_mutex_unlock(&flusherMutex);
+    
+    pthread_join(flusherThread, NULL);
+    flusherRunning = 0;
+}
+
+/*------オープンしたファイルのリスト-------*/
+/*
+ * 文を実行するたびにファイルを開いて閉じると、closeFile()でそのファイルの
+ * バッファがすべて空になり、次の文はまたファイルから読み直すことになる。
+ * そこで、closeFile()では参照の数を減らすだけにして、ファイルもバッファも
+ * 残しておく。実際に閉じるのは、deleteFile()やcreateFile()でファイルが
+ * 消えるとき、開いているファイルが多すぎるとき、finalizeFileModule()のとき
+ * だけにする。
+ */
+
+/*
+ * findOpenFile -- オープンしたファイルのリストからファイル名で探す
+ *
+ * 引数:
+ *	filename: ファイル名
+ *
+ * 返り値:
+ *	見つかったFile構造体。なければNULLを返す。
+ */
+static File *findOpenFile(char *filename)
+{
+    File *file;
+    
+    for (file = openFileHead; file != NULL; file = file->cacheNext) {
+        if (strcmp(file->name, filename) == 0) {
+            return file;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * removeOpenFile -- オープンしたファイルのリストから取り除く
+ *
+ * 引数:
+ *	file: 取り除くFile構造体
+ *
+ * 返り値:
+ *	なし
+ */
+static void removeOpenFile(File *file)
+{
+    if (file->cachePrev != NULL) {
+        file->cachePrev->cacheNext = file->cacheNext;
+    } else {
+        openFileHead = file->cacheNext;
+    }
+    if (file->cacheNext != NULL) {
+        file->cacheNext->cachePrev = file->cachePrev;
+    } else {
+        openFileTail = file->cachePrev;
+    }
+    file->cachePrev = NULL;
+    file->cacheNext = NULL;
+    numOpenFile--;
+}
+
+/*
+ * pushOpenFile -- オープンしたファイルのリストの先頭に入れる
+ *
+ * 引数:
+ *	file: 入れるFile構造体
+ *
+ * 返り値:
+ *	なし
+ */
+static void pushOpenFile(File *file)
+{
+    file->cachePrev = NULL;
+    file->cacheNext = openFileHead;
+    if (openFileHead != NULL) {
+        openFileHead->cachePrev = file;
+    } else {
+        openFileTail = file;
+    }
+    openFileHead = file;
+    numOpenFile++;
+}
+
+/*
+ * findUnusedFile -- 閉じてよいファイルを探す
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	どこからもopenFile()されていないファイルのうち、最も長く使われていない
+ *	もののFile構造体。なければNULLを返す。
+ */
+static File *findUnusedFile()
+{
+    File *file;
+    
+    for (file = openFileTail; file != NULL; file = file->cachePrev) {
+        if (file->refCount == 0) {
+            return file;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * releaseRing -- バッファの輪をやめる
+ *
+ * 輪に入っていたバッファのうち、変更していないものは空きリストに戻す
+ * (順に読んだページなので、置換方式に引き渡してもほかのページを追い出すだけ)。
+ * 変更したものや読み込み中のものは置換方式に引き渡す。
+ * ロックを取らずに呼び出すこと。
+ *
+ * 引数:
+ *	file: 輪を使っているファイルのFile構造体
+ *
+ * 返り値:
+ *	なし
+ */
+static void releaseRing(File *file)
+{
+    BufferRing *ring = file->ring;
+    Buffer *buf;
+    int i;
+    
+    if (ring == NULL) {
+        return;
+    }
+    
+    lockAllShards();
+    for (i = 0; i < ring->size * numShard; i++) {
+        buf = ring->slot[i];
+        if (buf == NULL || buf->ring != ring) {
+            continue;
+        }
+        if (buf->modified == UNMODIFIED && buf->pinCount == 0 && buf->ioState == IO_NONE) {
+            removeBufferFromHash(buf);
+            releaseBuffer(buf);
+        } else {
+            buf->ring = NULL;
+            policy->insert(buf->shard, buf);
+        }
+    }
+    file->ring = NULL;
+    unlockAllShards();
+    
+    free(ring->current);
+    free(ring->slot);
+    free(ring);
+}
+
+/*
+ * dropFile -- ファイルを閉じて、オープンしたファイルのリストから取り除く
+ *
+ * そのファイルのバッファをすべて空にする。writeBackが0でなければ、
+ * 変更されたバッファをファイルに書き戻してから空にする(ファイルを消す
+ * ときは書き戻さない)。書き戻しスレッドや非同期I/Oがこのファイルを
+ * 読み書きしている最中なら、終わるまで待つ。
+ * openFileMutexを取ってから呼び出すこと(その間にopenFile()されることはない)。
+ *
+ * 引数:
+ *	file: 閉じるファイルのFile構造体(どこからもopenFile()されていないこと)
+ *	writeBack: 変更されたバッファを書き戻すかどうか
+ *
+ * 返り値:
+ *	成功の場合OK、失敗の場合NG
+ */
+static Result dropFile(File *file, int writeBack)
+{
+    Result result = OK;
+    Shard *shard;
+    Buffer *buf;
+    int s, i, n;
+    
+    for (s = 0; s < numShard; s++) {
+        shard = &shards[s];
+        pthread_mutex_lock(&shard->mutex);
+        
+        while (hasPendingIO(shard, file)) {
+            pthread_cond_wait(&shard->ioDoneCond, &shard->mutex);
+        }
+        
+        /* 変更フラグが立っているバッファを、ページの順にまとめて書き戻す */
+        if (writeBack) {
+            n = 0;
+            for (i = 0; i < shard->numFrame; i++) {
+                buf = &shard->frames[i];
+                if (buf->file == file && buf->modified == MODIFIED) {
+                    writeBackList[n++] = buf;
+                }
+            }
+            if (writeBackBuffers(writeBackList, n, NULL) != OK) {
+                result = NG;
+            }
+        }
+        
+        for (i = 0; i < shard->numFrame; i++) {
+            buf = &shard->frames[i];
+            if (buf->file != file) {
+                continue;
+            }
+            
+            /* バッファを空にして空きリストに戻す */
+            if (buf->ring == NULL) {
+                policy->remove(shard, buf, 0);
+            }
+            removeBufferFromHash(buf);
+            releaseBuffer(buf);
+        }
+        
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    
+    /* バッファの輪とマップした領域、ページ対応表を解放する */
+    if (file->ring != NULL) {
+        free(file->ring->current);
+        free(file->ring->slot);
+        free(file->ring);
+        file->ring = NULL;
+    }
+    unmapFile(file);
+    closePageMap(file->pageMap);
+    
+    if (close(file->desc) == -1) {
+        result = NG;
+    }
+    removeOpenFile(file);
+    pthread_mutex_destroy(&file->mutex);
+    pthread_mutex_destroy(&file->appendMutex);
+    free(file);
+    
+    return result;
+}
+
+/*
+ * discardFile -- 消すファイルを開いたままにしていれば、書き戻さずに閉じる
+ *
+ * 引数:
+ *	filename: ファイル名
+ *
+ * 返り値:
+ *	成功の場合OK、失敗(openFile()されている最中)の場合NG
+ */
+static Result discardFile(char *filename)
+{
+    File *file;
+    Result result = OK;
+    
+    pthread_mutex_lock(&openFileMutex);
+    
+    if ((file = findOpenFile(filename)) != NULL) {
+        if (file->refCount > 0) {
+            result = NG;
+        } else {
+            dropFile(file, 0);
+        }
+    }
+    
+    pthread_mutex_unlock(&openFileMutex);
+    
+    return result;
+}
+
+/*
+ * closeAllFiles -- 開いたままのファイルをすべて閉じる
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	成功の場合OK、失敗の場合NG
+ */
+static Result closeAllFiles()
+{
+    Result result = OK;
+    
+    pthread_mutex_lock(&openFileMutex);
+    while (openFileHead != NULL) {
+        if (dropFile(openFileHead, 1) != OK) {
+            result = NG;
+        }
+    }
+    pthread_mutex_unlock(&openFileMutex);
+    
+    return result;
+}
+
+/*
+ * openDesc -- ファイルを読み書き用に開く
+ *
+ * directが0でなければ、O_DIRECT(macOSではF_NOCACHE)を指定する。
+ * ファイルシステムがO_DIRECTに対応していなければ、指定せずに開く。
+ *
+ * 引数:
+ *	filename: ファイル名
+ *	direct: ダイレクトI/Oを使うかどうか
+ *
+ * 返り値:
+ *	ファイルディスクリプタ。開けなければ-1を返す(errnoが設定される)。
+ */
+static int openDesc(char *filename, int direct)
+{
+    int desc;
+    
+#if defined(O_DIRECT)
+    if (direct) {
+        if ((desc = open(filename, O_RDWR | O_DIRECT)) != -1) {
+            numDirectOpened++;
+            return desc;
+        }
+        if (errno != EINVAL) {
+            return -1;
+        }
+    }
+    desc = open(filename, O_RDWR);
+#else
+    desc = open(filename, O_RDWR);
+#if defined(F_NOCACHE)
+    if (direct && desc != -1 && fcntl(desc, F_NOCACHE, 1) != -1) {
+        numDirectOpened++;
+    }
+#endif
+#endif
+    
+    return desc;
+}
+
+/*-------ファイルモジュール本体--------*/
+
+
+/*
+ * initializeFileModule -- ファイルアクセスモジュールの初期化処理
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	成功の場合OK、失敗の場合NG
+ */
+Result initializeFileModule(){
+    char *env;
+    
+    int i;
+    
+    numFileOpened = numFileReused = 0;
+    numDirectOpened = 0;
+    for (i = 0; i < NUM_BLOCK_LATCH; i++) {
+        pthread_rwlock_init(&blockLatch[i], NULL);
+    }
+    if (requestedDirectIO >= 0) {
+        directIO = requestedDirectIO;
+    } else {
+        directIO = ((env = getenv(ENV_DIRECT_IO)) != NULL && strcmp(env, "1") == 0);
+    }
+    if (initializeBufferList() != OK) {
+        return NG;
+    }
+    if (initializeAsyncIO() != OK) {
+        finalizeBufferList();
+        return NG;
+    }
+    if (startFlusher() != OK) {
+        finalizeAsyncIO();
+        finalizeBufferList();
+        return NG;
+    }
+    return OK;
+}
+
+/*
+ * finalizeFileModule -- ファイルアクセスモジュールの終了処理
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	成功の場合OK、失敗の場合NG
+ */
+Result finalizeFileModule(){
+    Result result;
+    int i;
+    
+    stopFlusher();
+    finalizeAsyncIO();
+    result = closeAllFiles();
+    if (finalizeBufferList() != OK) {
+        result = NG;
+    }
+    for (i = 0; i < NUM_BLOCK_LATCH; i++) {
+        pthread_rwlock_destroy(&blockLatch[i]);
+    }
+    return result;
+}
+
+/*
+ * setNumBuffer -- バッファの大きさ(ページ数)の設定
+ *
+ * initializeFileModule()より前に呼び出すと、環境変数より優先してこの値が使われる。
+ * 0を指定すると、環境変数か既定値から決める動作に戻る。
+ *
+ * 引数:
+ *	n: バッファの大きさ(ページ数)
+ *
+ * 返り値:
+ *	成功の場合OK、失敗(モジュールの使用中または不正な値)の場合NG
+ */
+Result setNumBuffer(int n){
+    if (bufferArena != NULL || n < 0) {
+        return NG;
+    }
+    requestedNumBuffer = n;
+    return OK;
+}
+
+/*
+ * setReplacementPolicy -- バッファの置換方式の設定
+ *
+ * initializeFileModule()より前に呼び出すと、環境変数より優先してこの置換方式が
+ * 使われる。NULLを指定すると、環境変数か既定値から決める動作に戻る。
+ *
+ * 引数:
+ *	name: 置換方式の名前("lru", "clock", "2q", "lru-k")
+ *
+ * 返り値:
+ *	成功の場合OK、失敗(モジュールの使用中または不明な名前)の場合NG
+ */
+Result setReplacementPolicy(char *name){
+    ReplacementPolicy *p = NULL;
+    
+    if (bufferArena != NULL) {
+        return NG;
+    }
+    if (name != NULL && (p = findPolicy(name)) == NULL) {
+        return NG;
+    }
+    requestedPolicy = p;
+    return OK;
+}
+
+/*
+ * getReplacementPolicy -- バッファの置換方式の名前の取得
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	使用中の置換方式の名前。初期化前ならNULLを返す。
+ */
+char *getReplacementPolicy(){
+    if (bufferArena == NULL) {
+        return NULL;
+    }
+    return policy->name;
+}
+
+/*
+ * setAsyncIO -- 非同期I/Oの方式の設定
+ *
+ * initializeFileModule()より前に呼び出すと、環境変数より優先してこの方式が
+ * 使われる。NULLを指定すると、環境変数から決める動作に戻る。
+ *
+ * 引数:
+ *	name: 方式の名前("io_uring", "threads", "none")
+ *
+ * 返り値:
+ *	成功の場合OK、失敗(モジュールの使用中または不明な名前)の場合NG
+ */
+Result setAsyncIO(char *name){
+    static char *names[] = { "io_uring", "threads", "none" };
+    unsigned int i;
+    
+    if (bufferArena != NULL) {
+        return NG;
+    }
+    if (name == NULL) {
+        requestedAsyncIO = NULL;
+        return OK;
+    }
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(names[i], name) == 0) {
+            requestedAsyncIO = names[i];
+            return OK;
+        }
+    }
+    return NG;
+}
+
+/*
+ * getAsyncIO -- 使用中の非同期I/Oの方式の名前の取得
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	方式の名前。非同期I/Oを使っていなければ"none"を返す。
+ */
+char *getAsyncIO(){
+    return (asyncIO != NULL) ? asyncIO->name : "none";
+}
+
+/*
+ * setDirectIO -- ダイレクトI/Oを使うかどうかの設定
+ *
+ * initializeFileModule()より前に呼び出すと、環境変数より優先してこの値が使われる。
+ * -1を指定すると、環境変数から決める動作に戻る。ダイレクトI/Oを使うと、
+ * ページはバッファにだけキャッシュされるので、バッファの大きさを十分に取ること。
+ *
+ * 引数:
+ *	on: 使うなら1、使わないなら0
+ *
+ * 返り値:
+ *	成功の場合OK、失敗(モジュールの使用中または不正な値)の場合NG
+ */
+Result setDirectIO(int on){
+    if (bufferArena != NULL || on < -1 || on > 1) {
+        return NG;
+    }
+    requestedDirectIO = on;
+    return OK;
+}
+
+/*
+ * getDirectIO -- ダイレクトI/Oを使っているかどうかの取得
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	使っていれば1、使っていなければ0
+ */
+int getDirectIO(){
+    return directIO;
+}
+
+/*
+ * setHugePages -- バッファの領域をヒュージページで確保するかどうかの設定
+ *
+ * initializeFileModule()より前に呼び出すと、環境変数より優先してこの方法が
+ * 使われる。NULLを指定すると、環境変数か既定値(領域が大きければ使う)から
+ * 決める動作に戻る。ヒュージページが使えなければ、ふつうのページで確保する。
+ *
+ * 引数:
+ *	name: 方法の名前("hugetlb", "thp", "none")
+ *
+ * 返り値:
+ *	成功の場合OK、失敗(モジュールの使用中または不明な名前)の場合NG
+ */
+Result setHugePages(char *name){
+    static char *names[] = { "hugetlb", "thp", "none" };
+    unsigned int i;
+    
+    if (bufferArena != NULL) {
+        return NG;
+    }
+    if (name == NULL) {
+        requestedHugePages = NULL;
+        return OK;
+    }
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(names[i], name) == 0) {
+            requestedHugePages = names[i];
+            return OK;
+        }
+    }
+    return NG;
+}
+
+/*
+ * getHugePages -- ページの内容の領域を確保した方法の名前の取得
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	方法の名前。ヒュージページを使っていない場合や初期化前なら"none"を返す。
+ */
+char *getHugePages(){
+    if (pageArena == NULL) {
+        return "none";
+    }
+    switch (pageArenaKind) {
+        case ARENA_HUGETLB:
+            return "hugetlb";
+        case ARENA_THP:
+            return "thp";
+        default:
+            return "none";
+    }
+}
+
+/*
+ * getNumBuffer -- バッファの大きさ(ページ数)の取得
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	現在のバッファの大きさ(ページ数)。初期化前なら0を返す。
+ */
+int getNumBuffer(){
+    return numBuffer;
+}
+
+/*
+ * setNumShard -- バッファを分けるシャードの数の設定
+ *
+ * initializeFileModule()より前に呼び出すと、環境変数より優先してこの値が使われる。
+ * 0を指定すると、環境変数か既定値(バッファの大きさとCPUの数から決める)から
+ * 決める動作に戻る。バッファのページ数より多くは分けない。
+ *
+ * 引数:
+ *	n: シャードの数(MAX_SHARDS以下)
+ *
+ * 返り値:
+ *	成功の場合OK、失敗(モジュールの使用中または不正な値)の場合NG
+ */
+Result setNumShard(int n){
+    if (bufferArena != NULL || n < 0 || n > MAX_SHARDS) {
+        return NG;
+    }
+    requestedNumShard = n;
+    return OK;
+}
+
+/*
+ * getNumShard -- バッファを分けたシャードの数の取得
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	現在のシャードの数。初期化前なら0を返す。
+ */
+int getNumShard(){
+    return numShard;
+}
+
+/*
+ * createFile -- ファイルの作成
+ *
+ * 同じ名前のファイルを開いたままにしていれば、その内容は捨てて閉じる。
+ * 作成したファイルは圧縮しない形式になる(前のファイルのページ対応表は消す)。
+ *
+ * 引数:
+ *	filename: 作成するファイルのファイル名
+ *
+ * 返り値:
+ *	成功の場合OK、失敗の場合NG
+ */
+Result createFile(char *filename){
+    char mapName[MAX_FILENAME + sizeof(PAGE_MAP_EXT)];
+    int fd;
+    if (discardFile(filename) != OK) {
+        return NG;
+    }
+    getPageMapName(filename, mapName);
+    if ((unlink(mapName) == -1 && errno != ENOENT) || removeConversion(filename, mapName) != OK) {
+        return NG;
+    }
+    if((fd = creat(filename, S_IRUSR|S_IWUSR)) == -1){
+        return NG;
+    }
+    close(fd);
+    return OK;
+}
+
+/*
+ * deleteFile -- ファイルの削除
+ *
+ * ファイルを開いたままにしていれば、バッファ上のページを書き戻さずに閉じる。
+ * 圧縮したファイルなら、ページ対応表も削除する。
+ *
+ * 引数:
+ *	filename: 削除するファイルのファイル名
+ *
+ * 返り値:
+ *	成功の場合OK、失敗(openFile()されている最中の場合を含む)の場合NG
+ */
+Result deleteFile(char *filename){
+    char mapName[MAX_FILENAME + sizeof(PAGE_MAP_EXT)];
+    if (discardFile(filename) != OK) {
+        return NG;
+    }
+    getPageMapName(filename, mapName);
+    if ((unlink(mapName) == -1 && errno != ENOENT) || removeConversion(filename, mapName) != OK) {
+        return NG;
+    }
+    if(unlink(filename)  == -1){
+        return NG;
+    }
+    return OK;
+}
+
+/*
+ * replaceFile -- ファイルを、別のファイルで置き換える
+ *
+ * newNameのファイルをfilenameに改名して、filenameのファイルを置き換える。
+ * newNameを開いたままにしていれば、変更されたバッファを書き戻してから閉じ、
+ * filenameを開いたままにしていれば、バッファ上のページを書き戻さずに閉じる
+ * (置き換えた後で前の内容を読まないように)。新しいファイルは圧縮しない
+ * 形式とするので、filenameのページ対応表は改名より先に消す。最後に
+ * ディレクトリをfsync()して、置き換えを確定させる。
+ * newNameは、syncFile()でディスクに書き込んでから閉じておくこと。
+ *
+ * 引数:
+ *	filename: 置き換えられるファイルのファイル名
+ *	newName: 置き換える内容のファイルのファイル名
+ *
+ * 返り値:
+ *	成功の場合OK、失敗(どちらかがopenFile()されている最中の場合を含む)の場合NG
+ *
+ * ***注意***
+ *	ページ対応表を消した後、改名する前に止まると、filenameの内容は読めなくなる。
+ *	newNameが残っていることから、呼び出し側が置き換えをやり直すこと。
+ */
+Result replaceFile(char *filename, char *newName){
+    char mapName[MAX_FILENAME + sizeof(PAGE_MAP_EXT)];
+    File *file;
+
+    pthread_mutex_lock(&openFileMutex);
+    if ((file = findOpenFile(newName)) != NULL
+        && (file->refCount > 0 || dropFile(file, 1) != OK)) {
+        pthread_mutex_unlock(&openFileMutex);
+        return NG;
+    }
+    pthread_mutex_unlock(&openFileMutex);
+
+    if (discardFile(filename) != OK) {
+        return NG;
+    }
+    getPageMapName(filename, mapName);
+    if ((unlink(mapName) == -1 && errno != ENOENT) || removeConversion(filename, mapName) != OK
+        || rename(newName, filename) == -1) {
+        return NG;
+    }
+
+    return syncDirectory(filename);
+}
+
+/*
+ * openFile -- ファイルのオープン
+ *
+ * 同じファイル名で開いたままのファイルがあれば、そのFile構造体を返す
+ * (前の文で読んだページがバッファに残っていれば、そのまま使える)。
+ * なければファイルを開く(ダイレクトI/Oを使うときは、ページキャッシュを通さない
+ * ように開く)。ページ対応表があれば圧縮したファイルとして開き、ページ対応表を
+ * 読み込む(圧縮したページは位置がそろっていないので、ダイレクトI/Oは使わない)。
+ * 開いているファイルがMAX_OPEN_FILESを超えるときや、
+ * ディスクリプタが足りないときは、使われていないファイルを閉じてから開く。
+ *
+ * 引数:
+ *	filename: オープンしたいファイルのファイル名
+ *
+ * 返り値:
+ *	オープンしたファイルのFile構造体
+ *	オープンに失敗した場合にはNULLを返す
+ */
+File *openFile(char *filename){
+    File *file, *unused;
+    struct stat statBuf;
+    char mapName[MAX_FILENAME + sizeof(PAGE_MAP_EXT)];
+    int desc, compressed;
+
+    pthread_mutex_lock(&openFileMutex);
+
+    /* 開いたままのファイルを探す */
+    if ((file = findOpenFile(filename)) != NULL) {
+        file->refCount++;
+        removeOpenFile(file);
+        pushOpenFile(file);
+        numFileReused++;
+        pthread_mutex_unlock(&openFileMutex);
+        return file;
+    }
+
+    /* 開いているファイルが多すぎれば、使われていないものを閉じる */
+    if (numOpenFile >= MAX_OPEN_FILES && (unused = findUnusedFile()) != NULL) {
+        dropFile(unused, 1);
+    }
+
+    /* 形式の書き直しが途中で止まっていれば、どちらかにそろえてから開く */
+    getPageMapName(filename, mapName);
+    if (recoverConversion(filename, mapName) != OK) {
+        pthread_mutex_unlock(&openFileMutex);
+        return NULL;
+    }
+    compressed = (access(mapName, F_OK) == 0);
+
+    /* ディスクリプタが足りなければ、使われていないファイルを閉じて開き直す */
+    while ((desc = openDesc(filename, directIO && !compressed)) == -1) {
+        if ((errno != EMFILE && errno != ENFILE) || (unused = findUnusedFile()) == NULL) {
+            pthread_mutex_unlock(&openFileMutex);
+            return NULL;
+        }
+        dropFile(unused, 1);
+    }
+
+    if ((file = malloc(sizeof(File))) == NULL || fstat(desc, &statBuf) == -1) {
+        free(file);
+        close(desc);
+        pthread_mutex_unlock(&openFileMutex);
+        return NULL;
+    }
+    file->pageMap = NULL;
+    if (compressed && (file->pageMap = openPageMap(mapName, 0, statBuf.st_size)) == NULL) {
+        free(file);
+        close(desc);
+        pthread_mutex_unlock(&openFileMutex);
+        return NULL;
+    }
+
+    strcpy(file->name, filename);
+    file->desc = desc;
+    file->hint = ACCESS_NORMAL;
+    file->lastPageNum = -1;
+    file->numSequential = 0;
+    file->ring = NULL;
+    file->map = NULL;
+    file->nextAheadPage = 0;
+    if (file->pageMap != NULL) {
+        file->numPages = file->pageMap->numExtent;
+    } else {
+        file->numPages = (int) ((statBuf.st_size + PAGE_SIZE - 1) / PAGE_SIZE);
+    }
+    file->refCount = 1;
+    memset(&file->stats, 0, sizeof(BufferStats));
+    pthread_mutex_init(&file->mutex, NULL);
+    pthread_mutex_init(&file->appendMutex, NULL);
+    pushOpenFile(file);
+    numFileOpened++;
+
+    pthread_mutex_unlock(&openFileMutex);
+
+    return file;
+}
+
+/*
+ * adviseFile -- ファイルのアクセスパターンの指定
+ *
+ * ACCESS_SEQUENTIALを指定すると、アクセスのパターンから判定するのを待たずに、
+ * 最初のページから先読みする。テーブルの全ページを順に読むときに使う。
+ * さらにファイルがバッファの大きさの1/4より大きければ、バッファの輪を使って
+ * 読むので、ほかのページをバッファから追い出さない。輪はシャードごとに
+ * 1シャードのバッファ数の1/8ずつ用意する。
+ * ACCESS_NORMALに戻すと、輪に入っていたバッファは置換方式に引き渡す。
+ *
+ * 引数:
+ *	file: 指定するファイルのFile構造体
+ *	hint: アクセスパターン(ACCESS_NORMALまたはACCESS_SEQUENTIAL)
+ *
+ * 返り値:
+ *	なし
+ */
+void adviseFile(File *file, accessHint hint){
+    struct stat statBuf;
+    BufferRing *ring;
+    Buffer *buf;
+    int i, size;
+    
+    pthread_mutex_lock(&openFileMutex);
+    
+    pthread_mutex_lock(&file->mutex);
+    file->hint = hint;
+    pthread_mutex_unlock(&file->mutex);
+    
+    if (hint == ACCESS_SEQUENTIAL && file->ring == NULL
+        && fstat(file->desc, &statBuf) == 0 && statBuf.st_size / PAGE_SIZE > numBuffer / 4) {
+        /* 大きなファイルなので、バッファの輪を用意する */
+        size = numBuffer / numShard / 8;
+        if (size > RING_PAGES) {
+            size = RING_PAGES;
+        }
+        if (size < 1) {
+            size = 1;
+        }
+        
+        /* 確保できなければ、輪を使わずに読む */
+        if ((ring = (BufferRing *) malloc(sizeof(BufferRing))) != NULL) {
+            ring->size = size;
+            ring->current = (int *) calloc((size_t) numShard, sizeof(int));
+            ring->slot = (Buffer **) calloc((size_t) size * numShard, sizeof(Buffer *));
+            if (ring->current == NULL || ring->slot == NULL) {
+                free(ring->current);
+                free(ring->slot);
+                free(ring);
+            } else {
+                lockAllShards();
+                file->ring = ring;
+                unlockAllShards();
+            }
+        }
+    } else if (hint == ACCESS_NORMAL && file->ring != NULL) {
+        /* 輪に入っていたバッファを置換方式に引き渡す */
+        ring = file->ring;
+        lockAllShards();
+        for (i = 0; i < ring->size * numShard; i++) {
+            buf = ring->slot[i];
+            if (buf != NULL && buf->ring == ring) {
+                buf->ring = NULL;
+                policy->insert(buf->shard, buf);
+            }
+        }
+        file->ring = NULL;
+        unlockAllShards();
+        free(ring->current);
+        free(ring->slot);
+        free(ring);
+    }
+    
+    /* マップしていれば、マップした領域にも伝える */
+    if (file->map != NULL) {
+        pthread_mutex_lock(&file->map->mutex);
+        file->map->sequential = (hint == ACCESS_SEQUENTIAL);
+        adviseMap(file->map);
+        pthread_mutex_unlock(&file->map->mutex);
+    }
+    
+    pthread_mutex_unlock(&openFileMutex);
+    
+#if defined(__linux__) && defined(POSIX_FADV_SEQUENTIAL)
+    /* カーネルにも先読みを増やすよう伝える */
+    posix_fadvise(file->desc, 0, 0,
+                  (hint == ACCESS_SEQUENTIAL) ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_NORMAL);
+#endif
+}
+
+/*
+ * mapFile -- ファイルをメモリにマップして読むようにする
+ *
+ * これを呼び出したファイルでは、pinPage()やreadPage()で読むページが
+ * バッファになければ、バッファに読み込まずにマップした領域から直接読む。
+ * readシステムコールもバッファへのコピーも行わないので、変更しない
+ * ページを順に読む場合に速い。バッファにあるページ(変更したページなど)は
+ * これまでどおりバッファから読む。
+ * マップした領域は読み出し専用なので、pinPage()で得た領域を変更しては
+ * ならない(unpinPage()にMODIFIEDを渡してはならない)。変更するページは
+ * writePage()で書くこと。
+ * ダイレクトI/Oを使っているときや、圧縮したファイルはマップしない
+ * (NGを返し、バッファで読む)。
+ *
+ * 引数:
+ *	file: マップするファイルのFile構造体
+ *
+ * 返り値:
+ *	成功の場合OK、失敗の場合NG
+ */
+Result mapFile(File *file){
+    struct stat statBuf;
+    FileMap *map;
+    size_t size;
+    char *addr;
+    Result result = OK;
+    
+    /* ダイレクトI/Oではページキャッシュを使わず、圧縮したページはそのまま読めないので、マップしない */
+    if (directIO || file->pageMap != NULL) {
+        return NG;
+    }
+    
+    pthread_mutex_lock(&openFileMutex);
+    
+    if (file->map != NULL) {
+        pthread_mutex_unlock(&openFileMutex);
+        return OK;
+    }
+    
+    if (fstat(file->desc, &statBuf) == -1) {
+        pthread_mutex_unlock(&openFileMutex);
+        return NG;
+    }
+    
+    /* ファイルが伸びてもしばらくマップし直さずに済むよう、2倍の大きさでマップする */
+    size = MIN_MAP_SIZE;
+    while (size < (size_t) statBuf.st_size * 2) {
+        size *= 2;
+    }
+    
+    addr = mmap(NULL, size, PROT_READ, MAP_SHARED, file->desc, 0);
+    if (addr == MAP_FAILED) {
+        result = NG;
+    } else if ((map = (FileMap *) malloc(sizeof(FileMap))) == NULL) {
+        munmap(addr, size);
+        result = NG;
+    } else {
+        map->addr = addr;
+        map->size = size;
+        map->fileSize = statBuf.st_size;
+        map->retired = NULL;
+        pthread_mutex_lock(&file->mutex);
+        map->sequential = (file->hint == ACCESS_SEQUENTIAL);
+        pthread_mutex_unlock(&file->mutex);
+        pthread_mutex_init(&map->mutex, NULL);
+        adviseMap(map);
+        
+        lockAllShards();
+        file->map = map;
+        unlockAllShards();
+    }
+    
+    pthread_mutex_unlock(&openFileMutex);
+    
+    return result;
+}
+
+/*
+ * prefetchPages -- ページの先読みの発行
+ *
+ * pageNumから続くnumPageページの読み込みを、バッファにないものについて
+ * まとめて発行し、終わるのを待たずに戻る。各ページは読み込みが終わった順に
+ * 使えるようになり、それより前にreadPage()などで読もうとすると、そのページの
+ * 読み込みが終わるまで待つ。一度に先読みするのはバッファの大きさの1/2までとする。
+ * 非同期I/Oを使っていなければ、カーネルに先読みを頼むだけにする。
+ *
+ * 引数:
+ *	file: アクセスするファイルのFile構造体
+ *	pageNum: 先読みする最初のページ番号
+ *	numPage: 先読みするページ数
+ *
+ * 返り値:
+ *	成功の場合OK、失敗の場合NG
+ */
+Result prefetchPages(File *file, int pageNum, int numPage){
+    Shard *shard;
+    int n, end;
+    
+    if (pageNum < 0 || numPage < 0) {
+        return NG;
+    }
+    
+    if (asyncIO == NULL) {
+#if defined(__linux__) && defined(POSIX_FADV_WILLNEED)
+        posix_fadvise(file->desc, (off_t) pageNum * PAGE_SIZE, (off_t) numPage * PAGE_SIZE,
+                      POSIX_FADV_WILLNEED);
+#endif
+        return OK;
+    }
+    
+    if (numPage > numBuffer / 2) {
+        numPage = numBuffer / 2;
+    }
+    end = pageNum + numPage;
+    
+    /*
+     * READAHEAD_PAGESずつ発行する(すでにバッファにあるページは飛ばす)
+     * 1回に発行するのは同じシャードに入るページまでなので、シャードが変われば次の回に回る
+     */
+    while (pageNum < end) {
+        n = end - pageNum;
+        if (n > READAHEAD_PAGES) {
+            n = READAHEAD_PAGES;
+        }
+        shard = getShard(file, pageNum);
+        pthread_mutex_lock(&shard->mutex);
+        if (lookupBuffer(shard, file, pageNum) != NULL) {
+            pthread_mutex_unlock(&shard->mutex);
+            pageNum++;
+            continue;
+        }
+        n = submitReadAhead(shard, file, pageNum, n, 0);
+        pthread_mutex_unlock(&shard->mutex);
+        if (n == 0) {
+            break;
+        }
+        pageNum += n;
+    }
+    
+    return OK;
+}
+
+/*
+ * setFileCompression -- ファイルのページを圧縮して格納するかどうかの設定
+ *
+ * 圧縮するように指定すると、ファイルの全ページを圧縮した形式に書き直し、
+ * ページ対応表(ファイル名にPAGE_MAP_EXTを付けたファイル)を作る。以後このファイルは、
+ * バッファから書き戻すときにページを圧縮し、読み込むときに展開する。
+ * 圧縮しないように指定すると、圧縮しない形式に書き直してページ対応表を消す。
+ * すでに指定どおりの形式なら何もしない。
+ * ファイルを開いたままにしていれば、書き戻してから閉じて書き直す。
+ *
+ * 引数:
+ *	filename: ファイル名
+ *	on: 0でなければ圧縮する、0なら圧縮しない
+ *
+ * 返り値:
+ *	成功の場合OK、失敗(openFile()されている最中の場合を含む)の場合NG
+ */
+Result setFileCompression(char *filename, int on){
+    char mapName[MAX_FILENAME + sizeof(PAGE_MAP_EXT)];
+    File *file;
+    Result result = OK;
+    
+    getPageMapName(filename, mapName);
+    
+    pthread_mutex_lock(&openFileMutex);
+    
+    if ((file = findOpenFile(filename)) != NULL) {
+        if (file->refCount > 0 || dropFile(file, 1) != OK) {
+            pthread_mutex_unlock(&openFileMutex);
+            return NG;
+        }
+    }
+    
+    if (recoverConversion(filename, mapName) != OK) {
+        result = NG;
+    } else if ((access(mapName, F_OK) == 0) != (on != 0)) {
+        result = convertFile(filename, mapName, on);
+    }
+    
+    pthread_mutex_unlock(&openFileMutex);
+    
+    return result;
+}
+
+/*
+ * isFileCompressed -- ファイルのページを圧縮して格納しているかどうか
+ *
+ * 引数:
+ *	filename: ファイル名
+ *
+ * 返り値:
+ *	圧縮していれば1、していなければ0
+ */
+int isFileCompressed(char *filename){
+    char mapName[MAX_FILENAME + sizeof(PAGE_MAP_EXT)];
+    
+    int compressed;
+    
+    getPageMapName(filename, mapName);
+    
+    /* 形式の書き直しが途中で止まっていれば、どちらかにそろえてから調べる */
+    pthread_mutex_lock(&openFileMutex);
+    recoverConversion(filename, mapName);
+    compressed = (access(mapName, F_OK) == 0);
+    pthread_mutex_unlock(&openFileMutex);
+    
+    return compressed;
+}
+
+/*
+ * setDefaultBackend -- テーブルごとに指定がないときのページを読む方法の設定
+ *
+ * 引数:
+ *	backend: BACKEND_BUFFERまたはBACKEND_MMAP
+ *
+ * 返り値:
+ *	なし
+ */
+void setDefaultBackend(fileBackend backend){
+    defaultBackend = backend;
+    defaultBackendDecided = 1;
+}
+
+/*
+ * getDefaultBackend -- テーブルごとに指定がないときのページを読む方法の取得
+ *
+ * setDefaultBackend()で設定されていなければ、環境変数ENV_BACKENDから決める。
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	BACKEND_BUFFERまたはBACKEND_MMAP
+ */
+fileBackend getDefaultBackend(){
+    char *env;
+    
+    if (!defaultBackendDecided) {
+        if ((env = getenv(ENV_BACKEND)) != NULL && strcmp(env, "mmap") == 0) {
+            defaultBackend = BACKEND_MMAP;
+        }
+        defaultBackendDecided = 1;
+    }
+    
+    return defaultBackend;
+}
+
+/*
+ * closeFile -- ファイルのクローズ
+ *
+ * ファイルは閉じずに、バッファ上のページとともに残しておく(次のopenFile()で
+ * 使う)。最後のcloseFile()では、adviseFile()とmapFile()の指定を取り消す。
+ * 変更したページは書き戻しスレッドが書き戻す。
+ *
+ * 引数:
+ *	クローズするファイルのFile構造体
+ *
+ * 返り値:
+ *	成功の場合OK、失敗の場合NG
  */
-static Buffer *bufferListHead = NULL;
+Result closeFile(File *file){
+    
+    File *unused;
+    
+    pthread_mutex_lock(&openFileMutex);
+    
+    assert(file->refCount > 0);
+    if (--file->refCount > 0) {
+        pthread_mutex_unlock(&openFileMutex);
+        return OK;
+    }
+    
+    /* 順に読むための設定を元に戻す */
+    pthread_mutex_lock(&file->mutex);
+    file->hint = ACCESS_NORMAL;
+    file->lastPageNum = -1;
+    file->numSequential = 0;
+    pthread_mutex_unlock(&file->mutex);
+    releaseRing(file);
+    
+    /* マップしたままだと、次に変更のために読むページまでマップした領域から返すので解放する */
+    unmapFile(file);
+    
+    /* 開いているファイルが多すぎれば、使われていないものを閉じる */
+    if (numOpenFile > MAX_OPEN_FILES && (unused = findUnusedFile()) != NULL) {
+        if (dropFile(unused, 1) != OK) {
+            pthread_mutex_unlock(&openFileMutex);
+            return NG;
+        }
+    }
+    
+    pthread_mutex_unlock(&openFileMutex);
+    
+    return OK;
+}
 
 /*
- * bufferListTail -- LRUリストの最後へのポインタ
+ * syncFile -- ファイルの変更されたページを書き戻し、ディスクに書き込まれるまで待つ
+ *
+ * 書き戻しスレッドを待たずに、そのファイルの更新済みのバッファをすべて
+ * 書き戻してからfsync()する。書き込んだ内容を確定させたいときに使う。
+ * そのファイルのページを固定したままで呼び出さないこと(固定されている
+ * 更新済みのバッファがあれば、書き戻さずにNGを返す)。
+ *
+ * 引数:
+ *	file: 書き戻すファイルのFile構造体
+ *
+ * 返り値:
+ *	成功の場合OK、失敗の場合NG
  */
-static Buffer *bufferListTail = NULL;
+Result syncFile(File *file){
+    Result result = OK;
+    Shard *shard;
+    Buffer *buf;
+    int s, i, n;
+    
+    pthread_mutex_lock(&openFileMutex);
+    
+    for (s = 0; s < numShard; s++) {
+        shard = &shards[s];
+        pthread_mutex_lock(&shard->mutex);
+    
+        /* 書き戻しスレッドなどが書き込んでいる最中なら、終わるまで待つ */
+        while (hasPendingIO(shard, file)) {
+            pthread_cond_wait(&shard->ioDoneCond, &shard->mutex);
+        }
+    
+        /* 固定されていないバッファはラッチを取っている者がいないので、mutexを取ったまま書き込む */
+        n = 0;
+        for (i = 0; i < shard->numFrame; i++) {
+            buf = &shard->frames[i];
+            if (buf->file != file || buf->modified != MODIFIED) {
+                continue;
+            }
+            if (buf->pinCount > 0) {
+                result = NG;
+            } else {
+                writeBackList[n++] = buf;
+            }
+        }
+        if (writeBackBuffers(writeBackList, n, NULL) != OK) {
+            result = NG;
+        } else {
+            for (i = 0; i < n; i++) {
+                writeBackList[i]->modified = UNMODIFIED;
+                shard->numDirty--;
+            }
+        }
+    
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    
+    pthread_mutex_unlock(&openFileMutex);
+    
+    if (result == OK && fsync(file->desc) == -1) {
+        result = NG;
+    }
+    
+    return result;
+}
 
 /*
- * initializeBufferList -- バッファリストの初期化
- *
- * **注意**
- *	この関数は、ファイルアクセスモジュールを使用する前に必ず一度だけ呼び出すこと。
- *	(initializeFileModule()から呼び出すこと。)
+ * readPage -- 1ページ分のデータのファイルからの読み出し
  *
  * 引数:
- *	なし
+ *	file: アクセスするファイルのFile構造体
+ *	pageNum: 読み出すページの番号
+ *	page: 読み出した内容を格納するPAGE_SIZEバイトの領域
  *
  * 返り値:
- *	初期化に成功すればOK、失敗すればNGを返す。
+ *	成功の場合OK、失敗の場合NG
  */
-static Result initializeBufferList()
-{
-    Buffer *oldBuf = NULL;
+Result readPage(File *file, int pageNum, char *page){
+    
     Buffer *buf;
-    int i;
+    char *mapped = NULL;
     
     /*
-     * NUM_BUFFER個分のバッファを用意し、
-     * ポインタをつないで両方向リストにする
+     * ページを保持するバッファを取得する(なければファイルから読み込む)
+     * たいていはシャードのmutexを取ったまま、引数のpageにコピーして返ってくる
      */
-    for (i = 0; i < NUM_BUFFER; i++) {
-        /* 1個分のバッファ(Buffer構造体)のメモリ領域の確保 */
-        if ((buf = (Buffer *) malloc(sizeof(Buffer))) == NULL) {
-            /* メモリ不足なのでエラーを返す */
+    if ((buf = fetchBuffer(file, pageNum, 1, &mapped, page)) == NULL) {
+        if (mapped == NULL) {
             return NG;
         }
-        
-        /* Buffer構造体の初期化 */
-        buf->file = NULL;
-        buf->pageNum = -1;
-        buf->modified = UNMODIFIED;
-        memset(buf->page, 0, PAGE_SIZE);
-        buf->prev = NULL;
-        buf->next = NULL;
-        
-        /* ポインタをつないで両方向リストにする */
-        if (oldBuf != NULL) {
-            oldBuf->next = buf;
-        }
-        buf->prev = oldBuf;
-        
-        /* リストの一番最初の要素へのポインタを保存 */
-        if (buf->prev == NULL) {
-            bufferListHead = buf;
-        }
-        
-        /* リストの一番最後の要素へのポインタを保存 */
-        if (i == NUM_BUFFER - 1) {
-            bufferListTail = buf;
+        /* マップしていて、バッファにないページなら、マップした領域からコピーする */
+        if (mapped != page) {
+            memcpy(page, mapped, PAGE_SIZE);
         }
-        
-        /* 次のループのために保存 */
-        oldBuf = buf;
+        return OK;
     }
     
+    /* 変更しているスレッドがいたので、終わるのを待ってからコピーする */
+    pthread_rwlock_rdlock(buf->latch);
+    memcpy(page, buf->page, PAGE_SIZE);
+    pthread_rwlock_unlock(buf->latch);
+    
+    releasePin(buf, UNMODIFIED);
+    
     return OK;
 }
 
 /*
- * finalizeBufferList -- バッファリストの終了処理
- *
- * **注意**
- *	この関数は、ファイルアクセスモジュールの使用後に必ず一度だけ呼び出すこと。
- *	(finalizeFileModule()から呼び出すこと。)
+ * writePage -- 1ページ分のデータのファイルへの書き出し
  *
  * 引数:
- *	なし
+ *	file: アクセスするファイルのFile構造体
+ *	pageNum: 書き出すページの番号
+ *	page: 書き出す内容を格納するPAGE_SIZEバイトの領域
  *
  * 返り値:
- *	終了処理に成功すればOK、失敗すればNGを返す。
+ *	成功の場合OK、失敗の場合NG
  */
-static Result finalizeBufferList()
-{
-    /* ?????? */
+Result writePage(File *file, int pageNum, char *page){
+    
+    Buffer *buf;
+    Shard *shard;
+    
+    /* ページ全体を上書きするので、バッファになくてもファイルからは読み込まない */
+    if ((buf = fetchBuffer(file, pageNum, 0, NULL, NULL)) == NULL) {
+        return NG;
+    }
+    
+    /* 引数のpageの内容をバッファにコピーする(読んでいるスレッドがいれば待つ) */
+    pthread_rwlock_wrlock(buf->latch);
+    memcpy(buf->page, page, PAGE_SIZE);
+    pthread_rwlock_unlock(buf->latch);
+    
+    /* 読み込み中の印を外し、編集済みフラグを立てる */
+    shard = buf->shard;
+    pthread_mutex_lock(&shard->mutex);
+    completeFill(buf);
+    markBufferModified(buf);
+    buf->pinCount--;
+    pthread_mutex_unlock(&shard->mutex);
+    
+    /* ファイルの後ろに書き足したページも、書き戻す前からページ数に数える */
+    pthread_mutex_lock(&file->mutex);
+    if (pageNum >= file->numPages) {
+        file->numPages = pageNum + 1;
+    }
+    pthread_mutex_unlock(&file->mutex);
+    
     return OK;
 }
 
 /*
- * moveBufferToListHead -- バッファをリストの先頭へ移動
+ * pinPage -- ページをバッファに固定し、バッファ内の領域を直接返す
+ *
+ * readPage()と違い、ページの内容をコピーしない。返された領域は、
+ * unpinPage()を呼ぶまで追い出されず、直接読み書きしてよい。
+ * ラッチは取らないので、ほかのスレッドが同じページを読み書きする
+ * 場合はlatchPage()を使うこと。
  *
  * 引数:
- *	buf: リストの先頭に移動させるバッファへのポインタ
+ *	file: アクセスするファイルのFile構造体
+ *	pageNum: 固定するページの番号
  *
  * 返り値:
- *	なし
+ *	ページの内容を保持するPAGE_SIZEバイトの領域へのポインタ
+ *	失敗した場合(すべてのバッファが固定されている場合を含む)にはNULLを返す
+ *
+ * ***注意***
+ *	この関数が返す領域は、使い終わったら必ずunpinPageで固定を解除すること。
+ *	固定したままcloseFileを呼び出してはならない。
+ *	mapFile()したファイルでは、マップした領域を返すことがある。
+ *	その領域は変更してはならない。
  */
-static void moveBufferToListHead(Buffer *buf)
-{
-    /* 自分の前後と先頭を保存 */
-    Buffer  *oldPrev = buf->prev,
-            *oldNext = buf->next,
-            *oldHead = bufferListHead;
+char *pinPage(File *file, int pageNum){
     
-    /* 今先頭にないなら移動させる */
-    if(bufferListHead != buf){
-        /* 自分が末端なら変更しておく */
-        if (bufferListTail == buf) {
-            bufferListTail = oldPrev;
-        }else{
-            /* 末端でないときのみoldNextがNULLでないので設定 */
-            oldNext->prev = oldPrev;
-        }
-        /* oldPrevのnextを設定 */
-        oldPrev->next = oldNext;
-        
-        /* 先頭に移動 */
-        bufferListHead = buf;
-        buf->next = oldHead;
-        buf->prev = NULL;
-        oldHead->prev = buf;
-        
+    Buffer *buf;
+    char *mapped = NULL;
+    
+    /* マップしていて、バッファにないページなら、マップした領域を直接返す */
+    if ((buf = fetchBuffer(file, pageNum, 1, &mapped, NULL)) == NULL) {
+        return mapped;
     }
+    
+    return buf->page;
 }
 
-/*-------ファイルモジュール本体--------*/
-
-
 /*
- * initializeFileModule -- ファイルアクセスモジュールの初期化処理
+ * unpinPage -- pinPageで固定したページの固定を解除する
  *
  * 引数:
+ *	page: pinPageが返した領域
+ *	modified: 領域の内容を変更した場合はMODIFIED、していない場合はUNMODIFIED
+ *
+ * 返り値:
  *	なし
+ */
+void unpinPage(char *page, modifyFlag modified){
+    
+    /* マップした領域なら、固定していないので何もしない */
+    if (!isBufferPage(page)) {
+        assert(modified == UNMODIFIED);
+        return;
+    }
+    
+    /* 領域の番地から、そのページを持つBuffer構造体を求める */
+    releasePin(&bufferArena[(page - pageArena) / PAGE_SIZE], modified);
+}
+
+/*
+ * latchPage -- ページをバッファに固定し、ラッチを取って領域を直接返す
+ *
+ * pinPage()と同じくページを固定し、さらにバッファのラッチを取る。
+ * LATCH_SHAREDなら読み込み用のラッチで、ほかのスレッドも同時に読めるが、
+ * 変更はできない。LATCH_EXCLUSIVEなら書き込み用のラッチで、ほかのスレッドは
+ * 読むことも変更することもできない。ほかのスレッドがラッチを持っていれば、
+ * 放すまで待つ。
+ * ラッチはページごとにあるので、違うページを読み書きするスレッドは互いに
+ * 待たない(バッファ全体のロックは、バッファを探す間しか取らない)。
+ *
+ * 引数:
+ *	file: アクセスするファイルのFile構造体
+ *	pageNum: 固定するページの番号
+ *	mode: LATCH_SHAREDまたはLATCH_EXCLUSIVE
  *
  * 返り値:
- *	成功の場合OK、失敗の場合NG
+ *	ページの内容を保持するPAGE_SIZEバイトの領域へのポインタ
+ *	失敗した場合にはNULLを返す
+ *
+ * ***注意***
+ *	この関数が返す領域は、使い終わったら必ずunlatchPageでラッチと固定を解除すること。
+ *	ラッチを取ったまま、同じページのラッチを取ってはならない。
+ *	LATCH_SHAREDでは、mapFile()したファイルのマップした領域を返すことがある。
  */
-Result initializeFileModule(){
-    initializeBufferList();
-    return OK;
+char *latchPage(File *file, int pageNum, latchMode mode){
+    
+    Buffer *buf;
+    char *mapped = NULL;
+    
+    if (mode == LATCH_SHARED) {
+        /* マップしていて、バッファにないページなら、マップした領域を直接返す */
+        if ((buf = fetchBuffer(file, pageNum, 1, &mapped, NULL)) == NULL) {
+            return mapped;
+        }
+        pthread_rwlock_rdlock(buf->latch);
+    } else {
+        /* 変更するので、マップした領域は返さない */
+        if ((buf = fetchBuffer(file, pageNum, 1, NULL, NULL)) == NULL) {
+            return NULL;
+        }
+        pthread_rwlock_wrlock(buf->latch);
+    }
+    
+    return buf->page;
 }
 
 /*
- * finalizeFileModule -- ファイルアクセスモジュールの終了処理
+ * unlatchPage -- latchPageで取ったラッチと固定を解除する
  *
  * 引数:
+ *	page: latchPageが返した領域
+ *	modified: 領域の内容を変更した場合はMODIFIED、していない場合はUNMODIFIED
+ *	          (MODIFIEDはLATCH_EXCLUSIVEで取った場合だけ)
+ *
+ * 返り値:
  *	なし
+ */
+void unlatchPage(char *page, modifyFlag modified){
+    
+    Buffer *buf;
+    
+    /* マップした領域なら、ラッチも固定も取っていないので何もしない */
+    if (!isBufferPage(page)) {
+        assert(modified == UNMODIFIED);
+        return;
+    }
+    
+    buf = &bufferArena[(page - pageArena) / PAGE_SIZE];
+    pthread_rwlock_unlock(buf->latch);
+    releasePin(buf, modified);
+}
+
+/*
+ * getBlockLatch -- ブロックを読み書きするときに取るラッチ
+ */
+static pthread_rwlock_t *getBlockLatch(File *file, int pageNum)
+{
+    return &blockLatch[hashPage(file, pageNum) % NUM_BLOCK_LATCH];
+}
+
+/*
+ * isBlockFrameFree -- ブロックを集めるために空けてよいバッファかどうかの判定
+ *
+ * 固定されておらず、読み書きの最中でもなく、輪にも属しておらず、
+ * 更新されていなければ、書き戻さずに空けてよい(空きバッファも含む)。
+ */
+static int isBlockFrameFree(Buffer *buf)
+{
+    return buf->pinCount == 0 && buf->ioState == IO_NONE && buf->ring == NULL
+        && buf->modified == UNMODIFIED;
+}
+
+/*
+ * isMovableBuffer -- ページの内容をほかのバッファに移してよいかどうかの判定
+ *
+ * 固定されておらず、読み書きの最中でもなく、輪にも属していなければ移してよい
+ * (更新済みでも、更新済みの印ごと移す)。
+ */
+static int isMovableBuffer(Buffer *buf)
+{
+    return buf->pinCount == 0 && buf->ioState == IO_NONE && buf->ring == NULL;
+}
+
+/*
+ * findBlockWindow -- ブロックのページを集める連続したバッファを探す
+ *
+ * シャードのバッファをブロックのページ数ずつに区切り、blockCursorの位置から
+ * 順に調べる。区切りのi番目のバッファには、ブロックのi番目のページがすでに
+ * 入っているか、空けてよいこと(ブロックのほかのページが入っていてはならない)。
+ * 区切りの外にあるブロックのページは、区切りに移せること。
+ * シャードのmutexを取ってから呼び出すこと。
+ *
+ * 引数:
+ *	shard: ブロックのページが入るシャード
+ *	file: アクセスするファイルのFile構造体
+ *	pageNum: ブロックの最初のページ番号
+ *	numPage: ブロックのページ数
+ *	old: ブロックの各ページが入っているバッファ(なければNULL)
  *
  * 返り値:
- *	成功の場合OK、失敗の場合NG
+ *	見つかった区切りの最初のバッファ。なければNULLを返す。
  */
-Result finalizeFileModule(){
-    finalizeBufferList();
-    return OK;
+static Buffer *findBlockWindow(Shard *shard, File *file, int pageNum, int numPage, Buffer **old)
+{
+    Buffer *frame, *buf;
+    int numWindow, window, w, i;
+    
+    numWindow = shard->numFrame / numPage;
+    for (w = 0; w < numWindow; w++) {
+        window = (shard->blockCursor + w) % numWindow;
+        frame = &shard->frames[window * numPage];
+        for (i = 0; i < numPage; i++) {
+            buf = &frame[i];
+            if (buf == old[i]) {
+                if (buf->ring != NULL) {
+                    break;
+                }
+                continue;
+            }
+            if (!isBlockFrameFree(buf)
+                || (buf->file == file && buf->pageNum >= pageNum && buf->pageNum < pageNum + numPage)
+                || (old[i] != NULL && !isMovableBuffer(old[i]))) {
+                break;
+            }
+        }
+        if (i == numPage) {
+            shard->blockCursor = (window + 1) % numWindow;
+            return frame;
+        }
+    }
+    
+    return NULL;
 }
 
 /*
- * createFile -- ファイルの作成
+ * gatherBlock -- ブロックのページを連続したバッファに集める
+ *
+ * findBlockWindow()で見つけた区切りのバッファを空け、ほかのバッファにある
+ * ブロックのページは内容を(更新済みの印ごと)移し、バッファになかったページは
+ * ファイルから読み込む。読み込みは連続したページごとに1回のpreadで行い
+ * (圧縮したファイルは1ページずつ読み込んで展開する)、その間はシャードのmutexを
+ * 放すが、読み込むバッファには読み込み中の印を付けて固定しておく。
+ * シャードのmutexを取ってから呼び出すこと。
  *
  * 引数:
- *	filename: 作成するファイルのファイル名
+ *	shard: ブロックのページが入るシャード
+ *	file: アクセスするファイルのFile構造体
+ *	pageNum: ブロックの最初のページ番号
+ *	numPage: ブロックのページ数
  *
  * 返り値:
- *	成功の場合OK、失敗の場合NG
+ *	ブロックの最初のページのバッファ(続くページは続くバッファにあり、すべて固定されている)。
+ *	集められなかった場合や読み込めなかった場合はNULLを返す。
  */
-Result createFile(char *filename){
-    int fd;
-    if((fd = creat(filename, S_IRUSR|S_IWUSR)) == -1){
-        return NG;
+static Buffer *gatherBlock(Shard *shard, File *file, int pageNum, int numPage)
+{
+    Buffer *old[MAX_PAGE_SIZE / PAGE_SIZE], *frame, *buf, **link;
+    int missing[MAX_PAGE_SIZE / PAGE_SIZE], valid[MAX_PAGE_SIZE / PAGE_SIZE];
+    long long start;
+    ssize_t n;
+    int numMissing = 0, failed = 0, dirty, i, j;
+    
+    for (i = 0; i < numPage; i++) {
+        old[i] = lookupBuffer(shard, file, pageNum + i);
     }
-    close(fd);
-    return OK;
+    if ((frame = findBlockWindow(shard, file, pageNum, numPage, old)) == NULL) {
+        return NULL;
+    }
+    
+    /* 区切りの空きバッファを空きリストから外す */
+    for (link = &shard->freeBufferList; *link != NULL; ) {
+        if (*link >= frame && *link < frame + numPage) {
+            *link = (*link)->next;
+        } else {
+            link = &(*link)->next;
+        }
+    }
+    
+    for (i = 0; i < numPage; i++) {
+        buf = &frame[i];
+        
+        /* すでに入っているページは、そのまま固定する */
+        if (buf == old[i]) {
+            buf->pinCount++;
+            policy->access(shard, buf);
+            continue;
+        }
+        
+        /* 区切りに残っているほかのページは追い出す */
+        if (buf->file != NULL) {
+            policy->remove(shard, buf, 1);
+            removeBufferFromHash(buf);
+            shard->numEvict++;
+            pthread_mutex_lock(&buf->file->mutex);
+            buf->file->stats.numEvict++;
+            pthread_mutex_unlock(&buf->file->mutex);
+            clearBuffer(buf);
+        }
+        buf->next = NULL;
+        
+        /* ほかのバッファにあるページは、内容と更新済みの印を移す */
+        if (old[i] != NULL) {
+            memcpy(buf->page, old[i]->page, PAGE_SIZE);
+            dirty = (old[i]->modified == MODIFIED);
+            policy->remove(shard, old[i], 0);
+            removeBufferFromHash(old[i]);
+            releaseBuffer(old[i]);
+            buf->file = file;
+            buf->pageNum = pageNum + i;
+            buf->pinCount++;
+            insertBufferToHash(buf);
+            policy->insert(shard, buf);
+            if (dirty) {
+                markBufferModified(buf);
+            }
+            continue;
+        }
+        
+        /* バッファになかったページは、読み込み中の印を付けて後で読み込む */
+        prepareReadBuffer(buf, file, pageNum + i);
+        missing[numMissing++] = i;
+    }
+    if (numMissing == 0) {
+        return frame;
+    }
+    shard->numPendingIO += numMissing;
+    shard->numInFlight += numMissing;
+    
+    /* 連続したページごとにまとめて読み込む(固定しているので、シャードのmutexを放してよい) */
+    pthread_mutex_unlock(&shard->mutex);
+    for (i = 0; i < numMissing; i = j) {
+        for (j = i + 1; j < numMissing && missing[j] == missing[j - 1] + 1; j++) {
+        }
+        if (file->pageMap != NULL) {
+            n = 0;
+            while (n < (ssize_t) (j - i) * PAGE_SIZE
+                   && readCompressedPage(file, pageNum + missing[i] + (int) (n / PAGE_SIZE),
+                                         frame[missing[i]].page + n) == PAGE_SIZE) {
+                n += PAGE_SIZE;
+            }
+        } else {
+            start = getNanosec();
+            n = pread(file->desc, frame[missing[i]].page, (size_t) (j - i) * PAGE_SIZE,
+                      (off_t) (pageNum + missing[i]) * PAGE_SIZE);
+            countIO(file, 0, n, getNanosec() - start);
+        }
+        while (i < j) {
+            valid[missing[i]] = (n >= PAGE_SIZE);
+            n -= PAGE_SIZE;
+            i++;
+        }
+    }
+    pthread_mutex_lock(&shard->mutex);
+    
+    /* 読み込めなかったバッファは空きリストに戻す */
+    shard->numPendingIO -= numMissing;
+    shard->numInFlight -= numMissing;
+    for (i = 0; i < numMissing; i++) {
+        buf = &frame[missing[i]];
+        buf->ioState = IO_NONE;
+        if (valid[missing[i]]) {
+            policy->insert(shard, buf);
+        } else {
+            removeBufferFromHash(buf);
+            releaseBuffer(buf);
+            failed = 1;
+        }
+    }
+    pthread_cond_broadcast(&shard->ioDoneCond);
+    
+    /* ブロックの全体がそろわなければ、固定を外して失敗とする */
+    if (failed) {
+        for (i = 0; i < numPage; i++) {
+            if (frame[i].file == file && frame[i].pageNum == pageNum + i) {
+                frame[i].pinCount--;
+            }
+        }
+        return NULL;
+    }
+    
+    return frame;
 }
 
 /*
- * deleteFile -- ファイルの削除
+ * pinBlock -- ブロックのページを、連続したバッファに置いたまま固定する
+ *
+ * ブロックのページがすでに連続したバッファに順に並んでいれば、そのまま固定する。
+ * そうでなければgatherBlock()で連続したバッファに集める。
+ * バッファの輪を使っているファイルや、ブロックのページが同じシャードに
+ * 入らない場合、シャードが小さい場合(BLOCK_PIN_RATIO)は固定しない。
+ * ロックを取らずに呼び出すこと。
  *
  * 引数:
- *	filename: 削除するファイルのファイル名
+ *	file: アクセスするファイルのFile構造体
+ *	pageNum: ブロックの最初のページ番号
+ *	numPage: ブロックのページ数
  *
  * 返り値:
- *	成功の場合OK、失敗の場合NG
+ *	ブロックの最初のページのバッファ(続くページは続くバッファにあり、すべて固定されている)。
+ *	固定できなければNULLを返す。
  */
-Result deleteFile(char *filename){
-    if(unlink(filename)  == -1){
-        return NG;
+static Buffer *pinBlock(File *file, int pageNum, int numPage)
+{
+    Shard *shard = getShard(file, pageNum);
+    Buffer *first, *buf;
+    int hit, i;
+    
+    if (file->ring != NULL || getShard(file, pageNum + numPage - 1) != shard
+        || shard->numFrame < numPage * BLOCK_PIN_RATIO) {
+        return NULL;
+    }
+    
+    pthread_mutex_lock(&shard->mutex);
+    
+retry:
+    /*
+     * ブロックのページを読み込み中なら、終わるのを待つ(ほかのスレッドの先読みで
+     * 読み込み中のページもあるので、並び方を調べる前にすべてのページを調べる)
+     */
+    for (i = 0; i < numPage; i++) {
+        buf = lookupBuffer(shard, file, pageNum + i);
+        if (buf != NULL && buf->ioState == IO_READ) {
+            pthread_cond_wait(&shard->ioDoneCond, &shard->mutex);
+            goto retry;
+        }
+    }
+    
+    /* 連続したバッファに順に並んでいるかどうか調べる */
+    first = lookupBuffer(shard, file, pageNum);
+    for (i = 0; i < numPage; i++) {
+        buf = lookupBuffer(shard, file, pageNum + i);
+        if (buf == NULL || buf != first + i || buf->ring != NULL) {
+            break;
+        }
+    }
+    
+    hit = (i == numPage);
+    if (hit) {
+        for (i = 0; i < numPage; i++) {
+            first[i].pinCount++;
+            policy->access(shard, &first[i]);
+        }
+    } else {
+        first = gatherBlock(shard, file, pageNum, numPage);
     }
-    return OK;
+    
+    /* ふつうのページと同じく、ページごとに統計に数える */
+    if (first != NULL) {
+        for (i = 0; i < numPage; i++) {
+            recordAccess(shard, file, pageNum + i, hit);
+        }
+    }
+    
+    pthread_mutex_unlock(&shard->mutex);
+    
+    return first;
 }
 
 /*
- * openFile -- ファイルのオープン
+ * latchBlock -- 連続したページをまとめたブロックを、ラッチを取って読み込む
+ *
+ * テーブルのページをPAGE_SIZEより大きくするときに使う。ブロックblockNumは、
+ * ページ番号blockNum * (blockSize / PAGE_SIZE)から続くページをまとめたもので、
+ * バッファにはPAGE_SIZEのページとして載る(先読みや書き戻しは、
+ * ふつうのページと同じく連続したページをまとめて行う)。
+ * ブロックのラッチを取ってから、ブロックのページを連続したバッファに集めて
+ * 固定し(pinBlock())、各ページのラッチも取ってバッファの領域をそのまま返す。
+ * 固定できなければ(バッファが少ない場合など)、各ページの内容を確保した領域に
+ * コピーして返す(バッファを固定したままにはしないので、大きなブロックも読める)。
+ * blockSizeがPAGE_SIZEなら、latchPage()と同じ(コピーせずにバッファの領域を返す)。
  *
  * 引数:
- *	filename: オープンしたいファイルのファイル名
+ *	file: アクセスするファイルのFile構造体
+ *	blockNum: ブロック番号
+ *	blockSize: ブロックの大きさ(PAGE_SIZEの倍数でMAX_PAGE_SIZE以下)
+ *	mode: LATCH_SHAREDまたはLATCH_EXCLUSIVE
  *
  * 返り値:
- *	オープンしたファイルのFile構造体
- *	オープンに失敗した場合にはNULLを返す
+ *	ブロックの内容を保持するblockSizeバイトの領域へのポインタ
+ *	失敗した場合(ブロックがファイルにない場合を含む)にはNULLを返す
+ *
+ * ***注意***
+ *	この関数が返す領域は、使い終わったら必ずunlatchBlockで解除すること。
+ *	ラッチを取ったまま、ほかのブロックのラッチを取ってはならない。
  */
-File *openFile(char *filename){
-    File *file;
-    file = malloc(sizeof(File));
-
-    strcpy(file->name, filename);
-
-    if((file->desc = open(filename, O_RDWR)) == -1){
+char *latchBlock(File *file, int blockNum, int blockSize, latchMode mode){
+    
+    pthread_rwlock_t *latch;
+    Buffer *buf;
+    Block *block;
+    int numPage, i;
+    
+    if (blockSize == PAGE_SIZE) {
+        return latchPage(file, blockNum, mode);
+    }
+    if (blockSize < PAGE_SIZE || blockSize % PAGE_SIZE != 0 || blockSize > MAX_PAGE_SIZE) {
         return NULL;
     }
-
-    return file;
+    numPage = blockSize / PAGE_SIZE;
+    latch = getBlockLatch(file, blockNum * numPage);
+    
+    if (mode == LATCH_SHARED) {
+        pthread_rwlock_rdlock(latch);
+    } else {
+        pthread_rwlock_wrlock(latch);
+    }
+    
+    /* 連続したバッファに固定できれば、各ページのラッチを取ってそのまま返す */
+    if ((buf = pinBlock(file, blockNum * numPage, numPage)) != NULL) {
+        for (i = 0; i < numPage; i++) {
+            if (mode == LATCH_SHARED) {
+                pthread_rwlock_rdlock(buf[i].latch);
+            } else {
+                pthread_rwlock_wrlock(buf[i].latch);
+            }
+        }
+        return buf->page;
+    }
+    
+    /* 固定できなければ、各ページを確保した領域にコピーする */
+    if ((block = malloc(offsetof(Block, data) + (size_t) blockSize)) == NULL) {
+        pthread_rwlock_unlock(latch);
+        return NULL;
+    }
+    block->file = file;
+    block->numPage = numPage;
+    block->pageNum = blockNum * numPage;
+    block->latch = latch;
+    for (i = 0; i < block->numPage; i++) {
+        if (readPage(file, block->pageNum + i, block->data + (size_t) i * PAGE_SIZE) != OK) {
+            pthread_rwlock_unlock(block->latch);
+            free(block);
+            return NULL;
+        }
+    }
+    
+    return block->data;
 }
 
 /*
- * closeFile -- ファイルのクローズ
+ * unlatchBlock -- latchBlockで取ったラッチを解除する
+ *
+ * バッファの領域を返していれば、各ページのラッチと固定を解除する。
+ * コピーした領域を返していてMODIFIEDなら、ブロックの各ページをバッファに
+ * 書き戻してからラッチを解除する。
  *
  * 引数:
- *	クローズするファイルのFile構造体
+ *	data: latchBlockが返した領域
+ *	blockSize: latchBlockに指定したブロックの大きさ
+ *	modified: 領域の内容を変更した場合はMODIFIED、していない場合はUNMODIFIED
+ *	          (MODIFIEDはLATCH_EXCLUSIVEで取った場合だけ)
  *
  * 返り値:
- *	成功の場合OK、失敗の場合NG
+ *	成功の場合OK、ページをバッファに書き戻せなかった場合NG
+ *	(NGでもラッチは解除する。UNMODIFIEDならNGは返さない)
  */
-Result closeFile(File *file){
+Result unlatchBlock(char *data, int blockSize, modifyFlag modified){
     
+    pthread_rwlock_t *latch;
     Buffer *buf;
+    Block *block;
+    Result result = OK;
+    int i;
     
-    for (buf = bufferListHead; buf != NULL; buf = buf->next) {
-        /*クローズするファイルのバッファであるとき*/
-        if(file == buf->file){
-            if(buf->modified == MODIFIED){
-                /* 変更フラグが立っていたらバッファをファイルに書き戻す */
-                if(lseek(buf->file->desc, buf->pageNum*PAGE_SIZE, SEEK_SET)  == -1){
-                    return NG;
-                }
-                if (write(buf->file->desc, buf->page, PAGE_SIZE) == -1) {
-                    return NG;
-                }
-            }
-            /*バッファを空にする*/
-            buf->file = NULL;
-            buf->pageNum = 0;
-            buf->modified = UNMODIFIED;
-            memset(buf->page, 0, PAGE_SIZE);
-        }
+    if (blockSize == PAGE_SIZE) {
+        unlatchPage(data, modified);
+        return OK;
     }
     
+    /* 連続したバッファに固定していれば、各ページのラッチと固定を解除する */
+    if (isBufferPage(data)) {
+        buf = &bufferArena[(data - pageArena) / PAGE_SIZE];
+        latch = getBlockLatch(buf->file, buf->pageNum);
+        for (i = 0; i < blockSize / PAGE_SIZE; i++) {
+            pthread_rwlock_unlock(buf[i].latch);
+            releasePin(&buf[i], modified);
+        }
+        pthread_rwlock_unlock(latch);
+        return OK;
+    }
     
-    /* ファイルのクローズ */
-    if(close(file->desc) == -1){
-        return NG;
+    block = (Block *) (data - offsetof(Block, data));
+    if (modified == MODIFIED) {
+        for (i = 0; i < block->numPage && result == OK; i++) {
+            result = writePage(block->file, block->pageNum + i, block->data + (size_t) i * PAGE_SIZE);
+        }
     }
-    free(file);
-    return OK;
+    pthread_rwlock_unlock(block->latch);
+    free(block);
+    
+    return result;
 }
 
 /*
- * readPage -- 1ページ分のデータのファイルからの読み出し
+ * writeBlock -- 連続したページをまとめたブロックの書き出し
+ *
+ * ブロックのラッチを取ってから、各ページをwritePage()で書く。
+ * ファイルの後ろにブロックを書き足すときに使う。
  *
  * 引数:
  *	file: アクセスするファイルのFile構造体
- *	pageNum: 読み出すページの番号
- *	page: 読み出した内容を格納するPAGE_SIZEバイトの領域
+ *	blockNum: ブロック番号
+ *	blockSize: ブロックの大きさ(PAGE_SIZEの倍数でMAX_PAGE_SIZE以下)
+ *	data: 書き出す内容を格納するblockSizeバイトの領域
  *
  * 返り値:
  *	成功の場合OK、失敗の場合NG
  */
-Result readPage(File *file, int pageNum, char *page){
+Result writeBlock(File *file, int blockNum, int blockSize, char *data){
     
-    Buffer *buf, *emptyBuf = NULL;
+    pthread_rwlock_t *latch;
+    Result result = OK;
+    int numPage, i;
     
-    /*
-     * 読み出しを要求されたページがバッファに保存されているかどうか、
-     * リストの先頭から順に探す
-     */
-    for (buf = bufferListHead; buf != NULL; buf = buf->next) {
-        /* 要求されたページがリストの中にあるかどうかチェックする */
-        if (buf->file == file && buf->pageNum == pageNum) {
-            /* 要求されたページがバッファにあったので、その内容を引数のpageにコピーする */
-            memcpy(page, buf->page, PAGE_SIZE);
-            
-            /* アクセスされたバッファを、リストの先頭に移動させる */
-            moveBufferToListHead(buf);
-            
-            return OK;
-        }
-    }
-
-    /* バッファの空きを探す */
-    for (buf = bufferListHead; buf != NULL; buf = buf->next) {
-        /* 途中で空きバッファが見つかったらそれをemptyBufに */
-        if(buf->file == NULL){
-            emptyBuf = buf;
-            break;
-        }
-        
-        /* 最後まで空きバッファが見つからなかったら */
-        if(buf->next == NULL && buf->file != NULL){
-            /* 末端バッファをファイルに書き戻す */
-            if(lseek(buf->file->desc, buf->pageNum*PAGE_SIZE, SEEK_SET)  == -1){
-                return NG;
-            }
-            if (write(buf->file->desc, buf->page, PAGE_SIZE) == -1) {
-                return NG;
-            }
-            
-            /* 末端バッファを初期化してemptyBufに */
-            buf->file = NULL;
-            buf->pageNum = -1;
-            memset(buf->page, 0, PAGE_SIZE);
-            
-            emptyBuf = buf;
-            
-        }
+    if (blockSize == PAGE_SIZE) {
+        return writePage(file, blockNum, data);
     }
-    
-    /*
-     * lseekとreadシステムコールで空きバッファにファイルの内容を読み込み、
-     * Buffer構造体に保存する
-     */
-    
-    /* 読み出し位置の設定 */
-    if (lseek(file->desc, pageNum * PAGE_SIZE, SEEK_SET) == -1) {
+    if (blockSize < PAGE_SIZE || blockSize % PAGE_SIZE != 0 || blockSize > MAX_PAGE_SIZE) {
         return NG;
     }
+    numPage = blockSize / PAGE_SIZE;
+    latch = getBlockLatch(file, blockNum * numPage);
     
-    /* 1ページ分のデータの読み出し */
-    if (read(file->desc, emptyBuf->page, PAGE_SIZE) < PAGE_SIZE) {
-        return NG;
+    pthread_rwlock_wrlock(latch);
+    for (i = 0; i < numPage && result == OK; i++) {
+        result = writePage(file, blockNum * numPage + i, data + (size_t) i * PAGE_SIZE);
     }
+    pthread_rwlock_unlock(latch);
     
-    /* バッファの内容を引数のpageにコピー */
-    memcpy(page, emptyBuf->page, PAGE_SIZE);
+    return result;
+}
+
+/*
+ * appendBlock -- ファイルの末尾にブロックを書き足す
+ *
+ * ファイルのページ数から書き足すブロックの番号を決め、writeBlock()で書く。
+ * ページ数を調べてから書き終わるまでファイルのappendMutexを取っておくので、
+ * ほかのスレッドが同時に書き足しても、同じブロック番号に書くことはない。
+ * 末尾のブロックが途中までしかなければ、そのブロックに書く。
+ *
+ * 引数:
+ *	file: アクセスするファイルのFile構造体
+ *	blockSize: ブロックの大きさ(PAGE_SIZEの倍数でMAX_PAGE_SIZE以下)
+ *	data: 書き出す内容を格納するblockSizeバイトの領域
+ *
+ * 返り値:
+ *	書き足したブロックの番号。失敗した場合は-1を返す。
+ */
+int appendBlock(File *file, int blockSize, char *data){
     
-    /* Buffer構造体(emptyBuf)への各種情報の設定 */
-    emptyBuf->file = file;
-    emptyBuf->modified = UNMODIFIED;
-    emptyBuf->pageNum = pageNum;
+    int blockNum;
     
-    /* アクセスされたバッファ(emptyBuf)を、リストの先頭に移動させる */
-    moveBufferToListHead(emptyBuf);
+    if (blockSize < PAGE_SIZE || blockSize % PAGE_SIZE != 0 || blockSize > MAX_PAGE_SIZE) {
+        return -1;
+    }
     
+    pthread_mutex_lock(&file->appendMutex);
+    pthread_mutex_lock(&file->mutex);
+    blockNum = file->numPages / (blockSize / PAGE_SIZE);
+    pthread_mutex_unlock(&file->mutex);
+    if (writeBlock(file, blockNum, blockSize, data) != OK) {
+        blockNum = -1;
+    }
+    pthread_mutex_unlock(&file->appendMutex);
     
-    return OK;
+    return blockNum;
 }
 
 /*
- * writePage -- 1ページ分のデータのファイルへの書き出し
+ * appendPages -- ファイルの末尾に連続したページをまとめて書き足す
+ *
+ * バッファを通さずに、1回のpwriteで書き込む(圧縮したファイルは、writePage()で
+ * 1ページずつ書く)。大量のページを順に書き足すときに、バッファにあるほかの
+ * ページを追い出さずに済む。appendBlock()と同じく、ページ数を調べてから
+ * 書き終わるまでファイルのappendMutexを取っておくので、その間にほかのスレッドが
+ * 書き足すことはない。
  *
  * 引数:
  *	file: アクセスするファイルのFile構造体
- *	pageNum: 書き出すページの番号
- *	page: 書き出す内容を格納するPAGE_SIZEバイトの領域
+ *	numPage: 書き足すページ数
+ *	align: 書き足す最初のページの番号がこの倍数でなければ、書き足さずに失敗とする
+ *	       (ブロックの途中から書き足さないように、ブロックのページ数を指定する)
+ *	data: 書き足す内容を格納するnumPage * PAGE_SIZEバイトの領域
+ *	      (ダイレクトI/Oで開いていることがあるので、PAGE_SIZEの境界にそろえること)
  *
  * 返り値:
- *	成功の場合OK、失敗の場合NG
+ *	書き足した最初のページの番号。失敗した場合は-1を返す。
  */
-Result writePage(File *file, int pageNum, char *page){
+int appendPages(File *file, int numPage, int align, char *data){
     
-    Buffer *buf, *emptyBuf = NULL;
+    size_t size = (size_t) numPage * PAGE_SIZE;
+    ssize_t written;
+    long long start, nsec;
+    int pageNum, i;
     
-    /*
-     * 書き込みを要求されたページがバッファに保存されているかどうか、
-     * リストの先頭から順に探す
-     */
-    for (buf = bufferListHead; buf != NULL; buf = buf->next) {
-        /* 要求されたページがリストの中にあるかどうかチェックする */
-        if (buf->file == file && buf->pageNum == pageNum) {
-            /* 要求されたページがバッファにあったので、そこにpageの内容をコピーする */
-            memcpy(buf->page, page, PAGE_SIZE);
-            
-            /* 編集済みフラグを立てる */
-            buf->modified = MODIFIED;
+    if (numPage <= 0 || align <= 0) {
+        return -1;
+    }
     
-            /* アクセスされたバッファを、リストの先頭に移動させる */
-            moveBufferToListHead(buf);
-            
-            return OK;
-        }
+    pthread_mutex_lock(&file->appendMutex);
+    pthread_mutex_lock(&file->mutex);
+    pageNum = file->numPages;
+    pthread_mutex_unlock(&file->mutex);
+    if (pageNum % align != 0) {
+        pthread_mutex_unlock(&file->appendMutex);
+        return -1;
     }
     
-    /* バッファの空きを探す */
-    for (buf = bufferListHead; buf != NULL; buf = buf->next) {
-        /* 途中で空きバッファが見つかったらそれをemptyBufに */
-        if(buf->file == NULL){
-            emptyBuf = buf;
-            break;
-        }
-        
-        /* 最後まで空きバッファが見つからなかったら */
-        if(buf->next == NULL && buf->file != NULL){
-            /* 末端バッファをファイルに書き戻す */
-            if(lseek(buf->file->desc, buf->pageNum*PAGE_SIZE, SEEK_SET)  == -1){
-                return NG;
-            }
-            if (write(buf->file->desc, buf->page, PAGE_SIZE) == -1) {
-                return NG;
+    if (file->pageMap != NULL) {
+        /* 圧縮したファイルは、書き戻すときにページごとに圧縮する */
+        for (i = 0; i < numPage; i++) {
+            if (writePage(file, pageNum + i, data + (size_t) i * PAGE_SIZE) != OK) {
+                pthread_mutex_unlock(&file->appendMutex);
+                return -1;
             }
-            
-            /* 末端バッファを初期化してemptyBufに */
-            buf->file = NULL;
-            buf->pageNum = 0;
-            memset(buf->page, 0, PAGE_SIZE);
-            
-            emptyBuf = buf;
-            
         }
+    } else {
+        start = getNanosec();
+        written = pwrite(file->desc, data, size, (off_t) pageNum * PAGE_SIZE);
+        nsec = getNanosec() - start;
+        countIO(file, 1, written, nsec);
+        if (written != (ssize_t) size) {
+            pthread_mutex_unlock(&file->appendMutex);
+            return -1;
+        }
+        pthread_mutex_lock(&file->mutex);
+        file->numPages = pageNum + numPage;
+        pthread_mutex_unlock(&file->mutex);
     }
+    pthread_mutex_unlock(&file->appendMutex);
     
-    /*
-     * lseekとwriteシステムコールで空きバッファにファイルの内容を読み込み、
-     * Buffer構造体に保存する
-     */
-    
-    /* 引数のpageをバッファにコピー */
-    memcpy(emptyBuf->page, page, PAGE_SIZE);
-    
-    /* Buffer構造体(emptyBuf)への各種情報の設定 */
-    emptyBuf->file = file;
-    emptyBuf->modified = MODIFIED;
-    emptyBuf->pageNum = pageNum;
-    
-    /* アクセスされたバッファ(emptyBuf)を、リストの先頭に移動させる */
-    moveBufferToListHead(emptyBuf);
-    return OK;
-
+    return pageNum;
 }
 
 /*
  * getNumPages -- ファイルのページ数の取得
  *
+ * ファイルを開いたままにしていれば、バッファ上で書き足してまだ書き戻して
+ * いないページも数える(statシステムコールは呼ばない)。
+ *
  * 引数:
  *	filename: ファイル名
  *
@@ -471,7 +6828,31 @@ Result writePage(File *file, int pageNum, char *page){
 int getNumPages(char *filename){
     int pageCount;
     struct stat statBuf;
+    char mapName[MAX_FILENAME + sizeof(PAGE_MAP_EXT)];
     int fileSize;
+    File *file;
+
+    pthread_mutex_lock(&openFileMutex);
+    if ((file = findOpenFile(filename)) != NULL) {
+        pthread_mutex_lock(&file->mutex);
+        pageCount = file->numPages;
+        pthread_mutex_unlock(&file->mutex);
+        pthread_mutex_unlock(&openFileMutex);
+        return pageCount;
+    }
+
+    /* 形式の書き直しが途中で止まっていれば、どちらかにそろえてから調べる */
+    getPageMapName(filename, mapName);
+    if (recoverConversion(filename, mapName) != OK) {
+        pthread_mutex_unlock(&openFileMutex);
+        return -1;
+    }
+    pthread_mutex_unlock(&openFileMutex);
+
+    /* 圧縮したファイルは、ページ対応表の項目の数を返す */
+    if (stat(mapName, &statBuf) == 0) {
+        return (int) (statBuf.st_size / sizeof(Extent));
+    }
 
     if (stat(filename, &statBuf) == -1) {
         return -1;
@@ -487,25 +6868,270 @@ int getNumPages(char *filename){
 }
 
 
+/*
+ * collectTotalStats -- 全体の統計を集める
+ *
+ * 読み書きの統計にシャードごとのヒット、ミス、追い出しの数を足したものを返す。
+ * すべてのシャードのmutexを取ってから呼び出すこと。
+ *
+ * 引数:
+ *	stats: 統計を格納する領域
+ *
+ * 返り値:
+ *	なし
+ */
+static void collectTotalStats(BufferStats *stats)
+{
+    int i;
+    
+    pthread_mutex_lock(&statsMutex);
+    *stats = totalStats;
+    pthread_mutex_unlock(&statsMutex);
+    
+    for (i = 0; i < numShard; i++) {
+        stats->numHit += shards[i].numHit;
+        stats->numMiss += shards[i].numMiss;
+        stats->numEvict += shards[i].numEvict;
+    }
+}
+
 /*
  * printBufferList -- バッファのリストの内容の出力(テスト用)
+ *
+ * 使用中のバッファを置換方式ごとの順序と状態で出力し、続けて空きバッファと
+ * ヒット率を出力する。シャードに分けていれば、シャードごとに出力する。
+ *	lru: LRUリストの先頭(最も最近アクセスされたもの)から順に出力
+ *	clock: バッファの番号順に出力。">"は時計の針の位置、"*"は参照ビット
+ *	2q: A1in, Amのリストの先頭から順に出力し、A1outの記録数を出力
+ *	lru-k: バッファの番号順に出力。[]内は最後とK回前のアクセス時刻
+ * バッファの輪に入っているバッファは"ring:"を付けて出力する。
  */
 void printBufferList()
 {
+    BufferStats stats;
+    Shard *shard;
     Buffer *buf;
+    int s, i, numDirty = 0;
+    long numAccess;
+    
+    pthread_mutex_lock(&openFileMutex);
+    lockAllShards();
     
     printf("Buffer List:");
     
-    /* それぞれのバッファの最初の3バイトだけ出力する */
-    for (buf = bufferListHead; buf != NULL; buf = buf->next) {
-        if (buf->file == NULL) {
+    for (s = 0; s < numShard; s++) {
+        shard = &shards[s];
+        if (numShard > 1) {
+            printf(" [shard %d]", s);
+        }
+        
+        /* 使用中のバッファを置換方式ごとに出力する */
+        policy->print(shard);
+        
+        /* バッファの輪に入っているバッファを出力する */
+        for (i = 0; i < shard->numFrame; i++) {
+            buf = &shard->frames[i];
+            if (buf->ring != NULL) {
+                printf("ring:%s(%d) ", buf->file->name, buf->pageNum);
+            }
+        }
+        
+        /* 空きバッファを出力する */
+        for (buf = shard->freeBufferList; buf != NULL; buf = buf->next) {
             printf("(empty) ");
-        } else {
-//            printf("    %c%c%c ", buf->page[0], buf->page[1], buf->page[2]);
-            printf(" %s(%d) ", buf->file->name, buf->pageNum);
         }
+        
+        numDirty += shard->numDirty;
     }
     
     printf("\n");
+    
+    collectTotalStats(&stats);
+    numAccess = stats.numHit + stats.numMiss;
+    
+    printf("  policy %s: hit %ld, miss %ld, evict %ld, hit ratio %.1f%%\n",
+           policy->name, stats.numHit, stats.numMiss, stats.numEvict,
+           (numAccess > 0) ? 100.0 * stats.numHit / numAccess : 0.0);
+    printf("  dirty %d, written back on eviction %ld, by flusher %ld, in %ld writes\n",
+           numDirty, stats.numEvictWriteBack, getCount(&numFlush), stats.numWriteCall);
+    printf("  readahead %ld times, %ld pages, mapped read %ld pages\n",
+           getCount(&numReadAhead), getCount(&numReadAheadPage), getCount(&numMappedRead));
+    printf("  async io %s: read %ld, write %ld\n",
+           getAsyncIO(), getCount(&numAsyncRead), getCount(&numAsyncWrite));
+    printf("  open files %d: opened %ld (direct io %ld), reused %ld\n",
+           numOpenFile, numFileOpened, numDirectOpened, numFileReused);
+    
+    unlockAllShards();
+    pthread_mutex_unlock(&openFileMutex);
+}
+
+/*
+ * getBufferStats -- ファイル全体のバッファの統計の取得
+ *
+ * 引数:
+ *	stats: 統計を格納する領域
+ *
+ * 返り値:
+ *	なし
+ */
+void getBufferStats(BufferStats *stats)
+{
+    lockAllShards();
+    collectTotalStats(stats);
+    unlockAllShards();
+}
+
+/*
+ * getFileStats -- ファイルごとのバッファの統計の取得
+ *
+ * ファイルを最初に開いたとき(またはresetBufferStats()のとき)からの統計を返す。
+ * ファイルが実際に閉じられると(closeFile()ではなく、deleteFile()や
+ * finalizeFileModule()などで)、そのファイルの統計は失われる。
+ *
+ * 引数:
+ *	file: ファイルのFile構造体
+ *	stats: 統計を格納する領域
+ *
+ * 返り値:
+ *	なし
+ */
+void getFileStats(File *file, BufferStats *stats)
+{
+    pthread_mutex_lock(&file->mutex);
+    *stats = file->stats;
+    pthread_mutex_unlock(&file->mutex);
+}
+
+/*
+ * resetBufferStats -- バッファの統計を0に戻す
+ *
+ * 全体と開いているファイルごとの統計、およびprintBufferList()が出力する
+ * 回数をすべて0に戻す。
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	なし
+ */
+void resetBufferStats()
+{
+    File *file;
+    int i;
+    
+    pthread_mutex_lock(&openFileMutex);
+    lockAllShards();
+    
+    for (i = 0; i < numShard; i++) {
+        shards[i].numHit = shards[i].numMiss = shards[i].numEvict = 0;
+    }
+    for (file = openFileHead; file != NULL; file = file->cacheNext) {
+        pthread_mutex_lock(&file->mutex);
+        memset(&file->stats, 0, sizeof(BufferStats));
+        pthread_mutex_unlock(&file->mutex);
+    }
+    
+    pthread_mutex_lock(&statsMutex);
+    memset(&totalStats, 0, sizeof(BufferStats));
+    numFlush = 0;
+    numReadAhead = numReadAheadPage = 0;
+    numMappedRead = 0;
+    numAsyncRead = numAsyncWrite = numWriteError = 0;
+    pthread_mutex_unlock(&statsMutex);
+    numFileOpened = numFileReused = 0;
+    numDirectOpened = 0;
+    
+    unlockAllShards();
+    pthread_mutex_unlock(&openFileMutex);
+}
+
+/*
+ * printStatsLine -- バッファの統計を1行出力する
+ *
+ * 引数:
+ *	name: 行の名前
+ *	stats: 出力する統計
+ *
+ * 返り値:
+ *	なし
+ */
+static void printStatsLine(char *name, BufferStats *stats)
+{
+    long numAccess = stats->numHit + stats->numMiss;
+    
+    printf("%9ld %9ld %6.1f%% %8ld %9ld %8ld %10lld %8ld %10lld %9.3f  %s\n",
+           stats->numHit, stats->numMiss,
+           (numAccess > 0) ? 100.0 * stats->numHit / numAccess : 0.0,
+           stats->numEvict, stats->numWriteBack,
+           stats->numReadCall, stats->readBytes / 1024,
+           stats->numWriteCall, stats->writeBytes / 1024,
+           stats->ioTime / 1000000.0, name);
+}
+
+/*
+ * printCompressionLine -- ページの圧縮の統計を1行出力する
+ *
+ * 引数:
+ *	name: 行の名前
+ *	stats: 出力する統計
+ *
+ * 返り値:
+ *	なし
+ */
+static void printCompressionLine(char *name, BufferStats *stats)
+{
+    printf("%10lld %10lld %7.2f %9.3f  %s\n",
+           stats->rawBytes / 1024, stats->packedBytes / 1024,
+           (stats->packedBytes > 0) ? (double) stats->rawBytes / stats->packedBytes : 0.0,
+           stats->codecTime / 1000000.0, name);
 }
 
+/*
+ * printBufferStats -- バッファの統計の出力
+ *
+ * 全体の統計と、開いているファイルごとの統計を1行ずつ出力する。
+ * 非同期I/O(io_uring)の読み書きは、システムコールの時間には数えない。
+ * 圧縮したファイルを読み書きしていれば、続けて全体と圧縮したファイルごとに、
+ * 圧縮・展開したページの元の大きさとファイル上の大きさ、その比(圧縮率)、
+ * 圧縮と展開にかかったCPU時間を出力する。
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	なし
+ */
+void printBufferStats()
+{
+    BufferStats stats, fileStats;
+    File *file;
+    
+    pthread_mutex_lock(&openFileMutex);
+    
+    getBufferStats(&stats);
+    
+    printf("buffer: %d pages in %d shard%s, policy %s, async io %s, direct io %s, huge pages %s\n",
+           numBuffer, numShard, (numShard > 1) ? "s" : "", policy->name, getAsyncIO(),
+           directIO ? "on" : "off", getHugePages());
+    printf("%9s %9s %7s %8s %9s %8s %10s %8s %10s %9s  %s\n",
+           "hit", "miss", "ratio", "evict", "writeback",
+           "reads", "read KB", "writes", "write KB", "io ms", "file");
+    printStatsLine("(total)", &stats);
+    for (file = openFileHead; file != NULL; file = file->cacheNext) {
+        getFileStats(file, &fileStats);
+        printStatsLine(file->name, &fileStats);
+    }
+    
+    if (stats.rawBytes > 0) {
+        printf("%10s %10s %7s %9s  %s\n", "raw KB", "packed KB", "ratio", "codec ms", "compressed file");
+        printCompressionLine("(total)", &stats);
+        for (file = openFileHead; file != NULL; file = file->cacheNext) {
+            if (file->pageMap != NULL) {
+                getFileStats(file, &fileStats);
+                printCompressionLine(file->name, &fileStats);
+            }
+        }
+    }
+    
+    pthread_mutex_unlock(&openFileMutex);
+}
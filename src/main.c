@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include "../include/microdb.h"
@@ -157,8 +158,8 @@ static char *getNextToken(){
      * 次回のgetNextToken()の呼び出しのために
      * nextPositionをその次の文字に移動する
      */
+    token[length] = '\0';
     if (*end != '\0') {
-        token[length] = '\0';
         nextPosition = end;
     } else {
         /*
@@ -183,7 +184,9 @@ static char *getNextToken(){
  *	なし
  *
  * create tableの書式:
- *	create table テーブル名 ( フィールド名 データ型, ... )
+ *	create table テーブル名 ( フィールド名 データ型, ... ) [ page size バイト数 ]
+ *
+ * page sizeを省略した場合、データファイルのページの大きさはPAGE_SIZEになる。
  */
 void callCreateTable(){
     char *token;
@@ -275,6 +278,27 @@ void callCreateTable(){
     }
 
     tableInfo.numField = numField;
+    tableInfo.pageSize = 0;
+
+    /* ")"の後に"page size"があれば、データファイルのページの大きさを読み込む */
+    if ((token = getNextToken()) != NULL) {
+        char *endp;
+        long inputPageSize;
+
+        if (strcmp(token, "page") != 0
+            || (token = getNextToken()) == NULL || strcmp(token, "size") != 0
+            || (token = getNextToken()) == NULL) {
+            /* 文法エラー */
+            printf("%s\n", systemMessage[SYS_MSG_INVALID_INPUT]);
+            return;
+        }
+        inputPageSize = strtol(token, &endp, 10);
+        if (inputPageSize <= 0 || inputPageSize > MAX_PAGE_SIZE || strcmp(endp, "") != 0) {
+            printf("%s\n", systemMessage[SYS_MSG_INVALID_ARG]);
+            return;
+        }
+        tableInfo.pageSize = (int)inputPageSize;
+    }
 
     /* createTableを呼び出し、テーブルを作成 */
     if (createTable(tableName, &tableInfo) == OK) {
@@ -370,6 +394,7 @@ void callInsertRecord(){
     if (token == NULL || strcmp(token, "(") != 0) {
         /* 文法エラー */
         printf("%s\n", systemMessage[SYS_MSG_INVALID_INPUT]);
+        freeTableInfo(tableInfo);
         return;
     }
 
@@ -385,6 +410,7 @@ void callInsertRecord(){
         if (token == NULL || strcmp(token, ")") == 0) {
             /* 文法エラー */
             printf("%s\n", systemMessage[SYS_MSG_INVALID_INPUT]);
+            freeTableInfo(tableInfo);
             return;
         }
 
@@ -396,6 +422,7 @@ void callInsertRecord(){
             inputIntNum = strtol(token, &endp, 10);
             if(inputIntNum < INT_MIN || inputIntNum > INT_MAX || strcmp(endp, "") != 0){
                 printf("%s\n", systemMessage[SYS_MSG_INVALID_ARG]);
+                freeTableInfo(tableInfo);
                 return;
             }else{
                 recordData.fieldData[i].val.intVal = (int)inputIntNum;
@@ -405,6 +432,7 @@ void callInsertRecord(){
             inputDoubleNum = strtod(token, &endp);
             if(inputDoubleNum == -HUGE_VAL || inputDoubleNum == HUGE_VAL || strcmp(endp, "") != 0){
                 printf("%s\n", systemMessage[SYS_MSG_INVALID_ARG]);
+                freeTableInfo(tableInfo);
                 return;
             }else{
                 recordData.fieldData[i].val.doubleVal = inputDoubleNum;
@@ -415,6 +443,7 @@ void callInsertRecord(){
             if(token == NULL || token[0] != '\''){
                 /* 文法エラー */
                 printf("%s\n", systemMessage[SYS_MSG_INVALID_COND]);
+                freeTableInfo(tableInfo);
                 return;
             }
 
@@ -429,6 +458,7 @@ void callInsertRecord(){
                 strcpy(recordData.fieldData[i].val.stringVal, stringVal);
             }else{
                 printf("%s\n", systemMessage[SYS_MSG_INVALID_ARG]);
+                freeTableInfo(tableInfo);
                 return;
             }
 
@@ -449,12 +479,15 @@ void callInsertRecord(){
     if (token == NULL || strcmp(token, ")") != 0) {
         /* 文法エラー */
         printf("%s\n", systemMessage[SYS_MSG_INVALID_INPUT]);
+        freeTableInfo(tableInfo);
         return;
     }
 
+    freeTableInfo(tableInfo);
+
     recordData.next = NULL;
 
-    if(insertRecord(tableName, &recordData) ==  OK){
+    if(insertRecord(tableName, &recordData, NULL) ==  OK){
         printf("%s\n", systemMessage[SYS_MSG_SUCCESS_INSERT]);
         printRecord(tableName, &recordData);
         return;
@@ -571,6 +604,9 @@ void callSelectRecord(){
     token = getNextToken();
     /* "select * from TABLENAME" のように条件句がない時 */
     if(token == NULL){
+        /* 不要になったメモリ領域を解放する */
+        freeTableInfo(tableInfo);
+
         /*selectRecoredの呼び出し*/
         if ((recordSet = selectRecord(tableName, &fieldList, &cond)) == NULL) {
             fprintf(stderr, "%s\n", errorMessage[ERR_MSG_SELECT]);
@@ -582,6 +618,7 @@ void callSelectRecord(){
         if (strcmp(token, "where") != 0) {
             /* 文法エラー */
             printf("%s\n", systemMessage[SYS_MSG_INVALID_INPUT]);
+            freeTableInfo(tableInfo);
             return;
         }
 
@@ -754,6 +791,9 @@ void callDeleteRecord(){
     token = getNextToken();
     /* "delete from TABLENAME" のように条件句がない時 */
     if(token == NULL){
+        /* 不要になったメモリ領域を解放する */
+        freeTableInfo(tableInfo);
+
         if(deleteRecord(tableName, &cond)){
             fprintf(stderr, "%s\n", errorMessage[ERR_MSG_DELETE]);
             return;
@@ -765,6 +805,7 @@ void callDeleteRecord(){
     if (strcmp(token, "where") != 0) {
         /* 文法エラー */
         printf("%s\n", systemMessage[SYS_MSG_INVALID_INPUT]);
+        freeTableInfo(tableInfo);
         return;
     }
 
@@ -877,6 +918,164 @@ void callDeleteRecord(){
     }
 }
 
+/*
+ * callCopy -- copy文の構文解析とcopyRecordsの呼び出し
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	なし
+ *
+ * copyの書式:
+ *	copy テーブル名 from 'ファイル名'
+ *
+ * ファイルはCSVまたはTSV(1行目にタブがあればTSV)。読み込んだ件数と、
+ * かかった時間から求めた1秒あたりのレコード数とバイト数(MB/s)を出力する。
+ */
+void callCopy(){
+    char *token;
+    char *tableName;
+    char filename[MAX_QUERY];
+    TableInfo *tableInfo;
+    CopyStats stats;
+    struct timespec start, end;
+    double seconds;
+    size_t length;
+
+    /* テーブル名を読み込む */
+    if ((tableName = getNextToken()) == NULL) {
+        /* 文法エラー */
+        printf("%s\n", systemMessage[SYS_MSG_INVALID_INPUT]);
+        return;
+    }
+
+    /* 次のトークンを読み込み、それが"from"かどうかをチェック */
+    token = getNextToken();
+    if (token == NULL || strcmp(token, "from") != 0) {
+        /* 文法エラー */
+        printf("%s\n", systemMessage[SYS_MSG_INVALID_INPUT]);
+        return;
+    }
+
+    /* 'で囲んだファイル名を読み込む */
+    token = getNextToken();
+    if (token == NULL || token[0] != '\'' || (length = strlen(token)) < 3 || token[length - 1] != '\'') {
+        /* 文法エラー */
+        printf("%s\n", systemMessage[SYS_MSG_INVALID_INPUT]);
+        return;
+    }
+    strncpy(filename, token + 1, length - 2);
+    filename[length - 2] = '\0';
+
+    /* 余分なトークンがあれば文法エラー */
+    if (getNextToken() != NULL) {
+        printf("%s\n", systemMessage[SYS_MSG_INVALID_INPUT]);
+        return;
+    }
+
+    /* テーブルがあるかどうかをチェック */
+    if ((tableInfo = getTableInfo(tableName)) == NULL) {
+        printf("%s\n", systemMessage[SYS_MSG_TABLE_NOT_EXIST]);
+        return;
+    }
+    freeTableInfo(tableInfo);
+
+    /* copyRecordsを呼び出し、かかった時間を測る */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (copyRecords(tableName, filename, &stats) == OK) {
+        printf("%ld%s\n", stats.numRecord, systemMessage[SYS_MSG_SUCCESS_COPY]);
+    } else {
+        fprintf(stderr, "%s (line %ld)\n", errorMessage[ERR_MSG_COPY], stats.lineNum);
+        printf("%ld%s\n", stats.numRecord, systemMessage[SYS_MSG_SUCCESS_COPY]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    /* 1秒あたりのレコード数とバイト数を出力する */
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
+    printf("%.3f sec, %.0f rows/s, %.2f MB/s (%d pages)\n", seconds,
+           stats.numRecord / seconds, stats.numByte / seconds / (1024 * 1024), stats.numPage);
+}
+
+/*
+ * getStatsTarget -- show文、reset文の対象("buffer stats")の構文解析
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	対象が"buffer stats"ならOK、そうでなければNG
+ */
+static Result getStatsTarget(){
+    char *token;
+
+    /* "buffer"の次に"stats"が続くかどうかをチェック */
+    token = getNextToken();
+    if (token == NULL || strcmp(token, "buffer") != 0) {
+        return NG;
+    }
+    token = getNextToken();
+    if (token == NULL || strcmp(token, "stats") != 0) {
+        return NG;
+    }
+
+    /* 余分なトークンがあれば文法エラー */
+    if (getNextToken() != NULL) {
+        return NG;
+    }
+
+    return OK;
+}
+
+/*
+ * callShow -- show文の構文解析とprintBufferStatsの呼び出し
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	なし
+ *
+ * showの書式:
+ *	show buffer stats
+ */
+void callShow(){
+    if (getStatsTarget() != OK) {
+        /* 文法エラー */
+        printf("%s\n", systemMessage[SYS_MSG_INVALID_INPUT]);
+        return;
+    }
+
+    /* バッファの統計を全体とファイルごとに出力する */
+    printBufferStats();
+}
+
+/*
+ * callReset -- reset文の構文解析とresetBufferStatsの呼び出し
+ *
+ * 引数:
+ *	なし
+ *
+ * 返り値:
+ *	なし
+ *
+ * resetの書式:
+ *	reset buffer stats
+ */
+void callReset(){
+    if (getStatsTarget() != OK) {
+        /* 文法エラー */
+        printf("%s\n", systemMessage[SYS_MSG_INVALID_INPUT]);
+        return;
+    }
+
+    resetBufferStats();
+    printf("%s\n", systemMessage[SYS_MSG_RESET_STATS]);
+}
+
 /*
  * main -- マイクロDBシステムのエントリポイント
  */
@@ -954,6 +1153,12 @@ int main(){
             callSelectRecord();
         } else if (strcmp(token, "delete") == 0) {
             callDeleteRecord();
+        } else if (strcmp(token, "copy") == 0) {
+            callCopy();
+        } else if (strcmp(token, "show") == 0) {
+            callShow();
+        } else if (strcmp(token, "reset") == 0) {
+            callReset();
         } else {
             /* 入力に間違いがあった */
             printf("%s\n", systemMessage[SYS_MSG_INVALID_INPUT]);
@@ -87,56 +87,76 @@ void printTableData(char *tableName){
     RecordSet *recordSet;
     char filename[MAX_FILENAME];
     File *file;
-    int numPage, numRecord = 0;
+    int numPage, pageSize, numRecord = 0;
     TableInfo *tableInfo;
     int i, j, k;
-    char page[PAGE_SIZE];
+    char *page; //バッファ上のページのポインタ
     int numSlot;
-    char *p, *q;
-    Slot slot;
+    char *q;
+    Slot *slot;
     FieldList fieldList;
 
     fieldList.numField = 0;
 
     recordSet = (RecordSet*)malloc(sizeof(RecordSet));
 
-    sprintf(filename, "%s/%s%s", DB_PATH, tableName, DATA_FILE_EXT);
-    file = openFile(filename);
-
-    numPage = getNumPages(filename);
-
     /*テーブル情報の取得*/
     if((tableInfo = getTableInfo(tableName)) == NULL){
         return; //エラー処理
     }
 
+    /* 古い形式のデータファイルなら、今の形式に書き直す */
+    if(upgradeDataFile(tableName, tableInfo) != OK){
+        freeTableInfo(tableInfo);
+        return; //エラー処理
+    }
+
+    sprintf(filename, "%s/%s%s", DB_PATH, tableName, DATA_FILE_EXT);
+    if((file = openFile(filename)) == NULL){
+        freeTableInfo(tableInfo);
+        return; //エラー処理
+    }
+
+    /* 全ページを順に読むので、先読みするよう指定する */
+    adviseFile(file, ACCESS_SEQUENTIAL);
+
+    /* 指定されていれば、メモリにマップして読む(失敗したらバッファで読む) */
+    if(getTableBackend(tableName) == BACKEND_MMAP){
+        mapFile(file);
+    }
+
+    numPage = getNumPages(filename);
+
+    /* テーブルのページの大きさを単位としたページ数にする */
+    pageSize = tableInfo->pageSize;
+    numPage /= pageSize / PAGE_SIZE;
+
     /*表ヘッダの出力*/
     printTableHeader(tableInfo, &fieldList);
 
     /* ページ数分だけ繰り返す */
     for (i=0; i<numPage; ++i) {
-        readPage(file, i, page);
+        /* 読み込み用のラッチを取ってページを読む(PAGE_SIZEならバッファ上のページをコピーせずに直接読む) */
+        if((page = latchBlock(file, i, pageSize, LATCH_SHARED)) == NULL){
+            break; //エラー処理
+        }
 
         /*スロットの数*/
-        memcpy(&numSlot, page, sizeof(int));
-
-        p = page + sizeof(int);
+        numSlot = PAGE_HEADER(page)->numSlot;
 
-        /* スロットを見ていく */
+        /* スロットを見ていく(スロットはページ上で直接読む) */
         for (j=0; j<numSlot; ++j) {
             int intValue;
             double doubleValue;
             char stringVal[MAX_STRING];
             int stringLen;
 
-            memcpy(&slot.flag, p, sizeof(char));
-            memcpy(&slot.offset, p+sizeof(char), sizeof(int));
-            memcpy(&slot.size,p+sizeof(char)+sizeof(int), sizeof(int));
+            slot = PAGE_SLOT(page, j);
 
-            q = page + slot.offset;
+            q = page + slot->offset;
 
             /* レコードがあったら表示 */
-            if(slot.flag == 1){
+            if(slot->flag == SLOT_USED){
                 numRecord++;
 
                 printf("|");
@@ -165,6 +185,8 @@ void printTableData(char *tableName){
                             break;
                         default:
                             /* ここにくることはないはず */
+                            unlatchBlock(page, pageSize, UNMODIFIED);
+                            closeFile(file);
                             freeTableInfo(tableInfo);
                             return ;
                     }
@@ -174,18 +196,21 @@ void printTableData(char *tableName){
                 printf("\n");
             }
 
-
-            /* 次のスロットを見る */
-            p += sizeof(char) + sizeof(int) * 2;
         }/* スロット繰り返し */
 
+        unlatchBlock(page, pageSize, UNMODIFIED);
+
     }/*ページ繰り返し*/
 
+    closeFile(file);
+
     if(numRecord > 0){
         insertLine(tableInfo->numField, COLUMN_WIDTH);
     }
     printf("%d rows in set\n", numRecord);
 
+    freeTableInfo(tableInfo);
+
     return;
 
 }
@@ -251,6 +276,7 @@ void printRecordSet(char *tableName, RecordSet *recordSet, FieldList *fieldList)
         }
     }
 
+    freeTableInfo(tableInfo);
     return;
 }
 
@@ -346,6 +372,7 @@ void printRecord(char *tableName, RecordData *record){
                 break;
             default:
                 /* ここにくることはないはず */
+                freeTableInfo(tableInfo);
                 return ;
         }
 
@@ -3,6 +3,7 @@
  */
 
 #include <time.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,6 +30,27 @@
  */
 #define TEST_SIZE 20
 
+/*
+ * ベンチマーク用ファイルのファイル名
+ */
+#define BENCH_FILE "benchfile"
+
+/*
+ * ベンチマークでのページアクセス回数
+ */
+#define BENCH_SIZE 1000000
+
+/*
+ * ベンチマークで試すバッファの大きさ(ページ数)
+ */
+static int benchNumBuffer[] = { 4, 64, 1024, 4096 };
+#define NUM_BENCH (sizeof(benchNumBuffer) / sizeof(benchNumBuffer[0]))
+
+/*
+ * ヒットを測るときに繰り返し固定するページ数(バッファ数によらず同じにする)
+ */
+#define BENCH_HOT_PAGE 4
+
 /*
  * initializeRandomGenerator -- 乱数発生器の初期化
  *
@@ -278,6 +300,1759 @@ void test2()
     printf("---------- test2 end ----------\n\n");
 }
 
+/*
+ * test4 -- ページの固定(pin)のテスト
+ *
+ * 固定したページは、他のページをいくら読み出しても追い出されず、
+ * すべてのバッファが固定されていればそれ以上固定できないことを確かめる。
+ */
+void test4()
+{
+    File *file[2];
+    char page[PAGE_SIZE], saved[PAGE_SIZE];
+    char *pinned[FILE_SIZE];
+    int i, numPinned;
+    
+    printf("---------- test4 start ----------\n");
+    
+    if ((file[0] = openFile(TEST_FILE1)) == NULL || (file[1] = openFile(TEST_FILE2)) == NULL) {
+        fprintf(stderr, "Cannot open file.\n");
+        exit(1);
+    }
+    
+    /* file1の0ページ目を固定する */
+    if ((pinned[0] = pinPage(file[0], 0)) == NULL) {
+        fprintf(stderr, "Cannot pin page.\n");
+        exit(1);
+    }
+    memcpy(saved, pinned[0], PAGE_SIZE);
+    printBufferList();
+    
+    /* file2の全ページを読み出して、バッファを一巡させる */
+    for (i = 0; i < FILE_SIZE; i++) {
+        if (readPage(file[1], i, page) != OK) {
+            fprintf(stderr, "Cannot read page.\n");
+            exit(1);
+        }
+    }
+    printBufferList();
+    
+    /* 固定したページが同じ場所に同じ内容で残っているか確認する */
+    if (pinPage(file[0], 0) != pinned[0] || memcmp(pinned[0], saved, PAGE_SIZE) != 0) {
+        fprintf(stderr, "Pinned page was evicted.\n");
+        exit(1);
+    }
+    unpinPage(pinned[0], UNMODIFIED);
+    unpinPage(pinned[0], UNMODIFIED);
+    
+    /* バッファが尽きるまで固定し、尽きたらNULLが返ることを確認する */
+    for (numPinned = 0; numPinned < FILE_SIZE; numPinned++) {
+        if ((pinned[numPinned] = pinPage(file[1], numPinned)) == NULL) {
+            break;
+        }
+    }
+    printf("pinned %d pages of %d buffers\n", numPinned, getNumBuffer());
+    if (numPinned != getNumBuffer() || readPage(file[0], 1, page) != NG) {
+        fprintf(stderr, "Pinned pages were evicted.\n");
+        exit(1);
+    }
+    for (i = 0; i < numPinned; i++) {
+        unpinPage(pinned[i], UNMODIFIED);
+    }
+    
+    /* 固定を解除すれば再び読み出せる */
+    if (readPage(file[0], 1, page) != OK) {
+        fprintf(stderr, "Cannot read page.\n");
+        exit(1);
+    }
+    printBufferList();
+    
+    if (closeFile(file[0]) != OK || closeFile(file[1]) != OK) {
+        fprintf(stderr, "Cannot close file.\n");
+        exit(1);
+    }
+    
+    printf("---------- test4 end ----------\n\n");
+}
+
+/*
+ * getElapsedNanoSec -- 2つの時刻の差をナノ秒で求める
+ */
+double getElapsedNanoSec(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+/*
+ * benchLookup -- バッファに載っているページを固定しては解除し、1回あたりの時間を測る
+ *
+ * numPageページを一巡してバッファを埋めてから、その中に散らばった
+ * BENCH_HOT_PAGEページだけを繰り返しpinPage()、unpinPage()する。
+ * ページの内容をコピーせず、触るページの数もバッファ数によらないので、
+ * バッファを探す時間だけを測れる。
+ *
+ * 引数:
+ *	file: 読み出すファイル
+ *	numPage: バッファに載せるページ数
+ *	count: 固定する回数
+ *
+ * 返り値:
+ *	1回の固定と解除にかかった平均時間(ナノ秒)
+ */
+double benchLookup(File *file, int numPage, int count)
+{
+    char page[PAGE_SIZE];
+    char *p;
+    struct timespec start, end;
+    int hot[BENCH_HOT_PAGE];
+    int i;
+    
+    /* 最初に一巡してバッファに載せておく */
+    for (i = 0; i < numPage; i++) {
+        if (readPage(file, i, page) != OK) {
+            fprintf(stderr, "Cannot read page.\n");
+            exit(1);
+        }
+    }
+    
+    /* 繰り返し固定するページは、バッファに載せたページ全体から均等に選ぶ */
+    for (i = 0; i < BENCH_HOT_PAGE; i++) {
+        hot[i] = i * numPage / BENCH_HOT_PAGE;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++) {
+        if ((p = pinPage(file, hot[i % BENCH_HOT_PAGE])) == NULL) {
+            fprintf(stderr, "Cannot pin page.\n");
+            exit(1);
+        }
+        unpinPage(p, UNMODIFIED);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    return getElapsedNanoSec(&start, &end) / count;
+}
+
+/*
+ * benchAccess -- numPageページを順番に繰り返し読み出し、1回あたりの時間を測る
+ *
+ * 引数:
+ *	file: 読み出すファイル
+ *	numPage: 繰り返し読み出すページ数
+ *	count: 読み出し回数
+ *
+ * 返り値:
+ *	1回の読み出しにかかった平均時間(ナノ秒)
+ */
+double benchAccess(File *file, int numPage, int count)
+{
+    char page[PAGE_SIZE];
+    struct timespec start, end;
+    int i;
+    
+    /* 最初に一巡してバッファに載せておく */
+    for (i = 0; i < numPage; i++) {
+        if (readPage(file, i, page) != OK) {
+            fprintf(stderr, "Cannot read page.\n");
+            exit(1);
+        }
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++) {
+        if (readPage(file, i % numPage, page) != OK) {
+            fprintf(stderr, "Cannot read page.\n");
+            exit(1);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    return getElapsedNanoSec(&start, &end) / count;
+}
+
+/*
+ * test3 -- ページ検索のベンチマーク
+ *
+ * バッファの大きさを変えながら、以下の2つを測る。
+ * バッファをすべて埋めてから、その中の決まった数のページを固定しては解除すると、
+ * すべてヒットする(benchLookup())。バッファを探す時間だけを測るので、
+ * リストをたどって探す実装では、1回あたりの時間がバッファ数とともに伸びる。
+ * ハッシュ表で探す実装では、バッファ数によらずほぼ一定になる。
+ * バッファ数の2倍のページ数を順番に読み出すと、すべてミスになる(benchAccess())。
+ */
+void test3()
+{
+    File *file;
+    char page[PAGE_SIZE];
+    int i, n;
+    unsigned int k;
+    
+    printf("---------- test3 start ----------\n");
+    
+    for (k = 0; k < NUM_BENCH; k++) {
+        n = benchNumBuffer[k];
+        
+        /* バッファの大きさを変えてファイルアクセスモジュールを初期化し直す */
+        if (finalizeFileModule() != OK || setNumBuffer(n) != OK || initializeFileModule() != OK) {
+            fprintf(stderr, "Cannot reinitialize file module.\n");
+            exit(1);
+        }
+        
+        /* ベンチマーク用のファイルを作る */
+        deleteFile(BENCH_FILE);
+        if (createFile(BENCH_FILE) != OK) {
+            fprintf(stderr, "Cannot create file.\n");
+            exit(1);
+        }
+        
+        if ((file = openFile(BENCH_FILE)) == NULL) {
+            fprintf(stderr, "Cannot open file.\n");
+            exit(1);
+        }
+        
+        memset(page, 0, PAGE_SIZE);
+        for (i = 0; i < n * 2; i++) {
+            if (writePage(file, i, page) != OK) {
+                fprintf(stderr, "Cannot write page.\n");
+                exit(1);
+            }
+        }
+        
+        if (closeFile(file) != OK) {
+            fprintf(stderr, "Cannot close file.\n");
+            exit(1);
+        }
+        
+        if ((file = openFile(BENCH_FILE)) == NULL) {
+            fprintf(stderr, "Cannot open file.\n");
+            exit(1);
+        }
+        
+        printf("buffers %6d: hit %8.1f ns/access, miss %8.1f ns/access\n",
+               getNumBuffer(),
+               benchLookup(file, n, BENCH_SIZE),
+               benchAccess(file, n * 2, BENCH_SIZE / 10));
+        
+        if (closeFile(file) != OK) {
+            fprintf(stderr, "Cannot close file.\n");
+            exit(1);
+        }
+        
+        deleteFile(BENCH_FILE);
+    }
+    
+    /* バッファの大きさを元に戻す */
+    if (finalizeFileModule() != OK || setNumBuffer(0) != OK || initializeFileModule() != OK) {
+        fprintf(stderr, "Cannot reinitialize file module.\n");
+        exit(1);
+    }
+    
+    printf("---------- test3 end ----------\n\n");
+}
+
+/*
+ * 置換方式の比較で使うバッファの大きさ(ページ数)
+ */
+#define POLICY_NUM_BUFFER 16
+
+/*
+ * 置換方式の比較で繰り返しアクセスするページ数
+ */
+#define POLICY_HOT_SIZE 10
+
+/*
+ * 置換方式の比較で順番に読み出すページ数
+ */
+#define POLICY_SCAN_SIZE 64
+
+/*
+ * 置換方式の比較で試す置換方式
+ */
+static char *testPolicy[] = { "lru", "clock", "2q", "lru-k" };
+#define NUM_POLICY (sizeof(testPolicy) / sizeof(testPolicy[0]))
+
+/*
+ * test5 -- 置換方式の比較
+ *
+ * バッファより大きい範囲を順番に読み出しながら、その合間に少数のページを
+ * 繰り返し読み出す。LRUやCLOCKでは順番に読み出したページが繰り返し読む
+ * ページを追い出してしまうが、2QやLRU-Kでは繰り返し読むページがバッファに
+ * 残りやすいので、ヒット率が高くなる。
+ */
+void test5()
+{
+    File *file;
+    char page[PAGE_SIZE];
+    int i, round;
+    unsigned int k;
+    
+    printf("---------- test5 start ----------\n");
+    
+    for (k = 0; k < NUM_POLICY; k++) {
+        /* 置換方式を変えてファイルアクセスモジュールを初期化し直す */
+        if (finalizeFileModule() != OK || setNumBuffer(POLICY_NUM_BUFFER) != OK ||
+            setReplacementPolicy(testPolicy[k]) != OK || initializeFileModule() != OK) {
+            fprintf(stderr, "Cannot reinitialize file module.\n");
+            exit(1);
+        }
+        
+        /* テスト用のファイルを作る */
+        deleteFile(BENCH_FILE);
+        if (createFile(BENCH_FILE) != OK) {
+            fprintf(stderr, "Cannot create file.\n");
+            exit(1);
+        }
+        
+        if ((file = openFile(BENCH_FILE)) == NULL) {
+            fprintf(stderr, "Cannot open file.\n");
+            exit(1);
+        }
+        
+        memset(page, 0, PAGE_SIZE);
+        for (i = 0; i < POLICY_HOT_SIZE + POLICY_SCAN_SIZE; i++) {
+            if (writePage(file, i, page) != OK) {
+                fprintf(stderr, "Cannot write page.\n");
+                exit(1);
+            }
+        }
+        
+        if (closeFile(file) != OK) {
+            fprintf(stderr, "Cannot close file.\n");
+            exit(1);
+        }
+        
+        /* 作成時のアクセスを数えないように、初期化し直す */
+        if (finalizeFileModule() != OK || initializeFileModule() != OK) {
+            fprintf(stderr, "Cannot reinitialize file module.\n");
+            exit(1);
+        }
+        
+        if ((file = openFile(BENCH_FILE)) == NULL) {
+            fprintf(stderr, "Cannot open file.\n");
+            exit(1);
+        }
+        
+        /*
+         * 残りのページを順番に読み出しながら、1ページ読むごとに
+         * 繰り返し読むページ(0〜POLICY_HOT_SIZE-1)を1つ読み出す
+         */
+        for (round = 0; round < 10; round++) {
+            for (i = 0; i < POLICY_SCAN_SIZE; i++) {
+                if (readPage(file, POLICY_HOT_SIZE + i, page) != OK) {
+                    fprintf(stderr, "Cannot read page.\n");
+                    exit(1);
+                }
+                if (readPage(file, i % POLICY_HOT_SIZE, page) != OK) {
+                    fprintf(stderr, "Cannot read page.\n");
+                    exit(1);
+                }
+            }
+        }
+        
+        printBufferList();
+        printf("\n");
+        
+        if (closeFile(file) != OK) {
+            fprintf(stderr, "Cannot close file.\n");
+            exit(1);
+        }
+        
+        deleteFile(BENCH_FILE);
+    }
+    
+    /* バッファの大きさと置換方式を元に戻す */
+    if (finalizeFileModule() != OK || setNumBuffer(0) != OK ||
+        setReplacementPolicy(NULL) != OK || initializeFileModule() != OK) {
+        fprintf(stderr, "Cannot reinitialize file module.\n");
+        exit(1);
+    }
+    
+    printf("---------- test5 end ----------\n\n");
+}
+
+/*
+ * 先読みのテストで使うバッファの大きさ(ページ数)とファイルのページ数
+ */
+#define READAHEAD_NUM_BUFFER 32
+#define READAHEAD_FILE_SIZE 64
+
+/*
+ * test6 -- 先読みのテスト
+ *
+ * ファイルを先頭から順番に読み出すと、3ページ目からは続くページが
+ * まとめて先読みされ、ミスの数がページ数よりずっと少なくなる。
+ * adviseFile()でACCESS_SEQUENTIALを指定すると、先頭のページから先読みされる。
+ * どちらの場合も、読み出した内容が書き込んだものと同じかどうかを確かめる。
+ */
+void test6()
+{
+    File *file;
+    char page[PAGE_SIZE], expected[PAGE_SIZE];
+    int i, pass;
+    
+    printf("---------- test6 start ----------\n");
+    
+    /* テスト用のファイルを作り、各ページの先頭にページ番号を書く */
+    deleteFile(BENCH_FILE);
+    if (createFile(BENCH_FILE) != OK) {
+        fprintf(stderr, "Cannot create file.\n");
+        exit(1);
+    }
+    
+    if ((file = openFile(BENCH_FILE)) == NULL) {
+        fprintf(stderr, "Cannot open file.\n");
+        exit(1);
+    }
+    
+    for (i = 0; i < READAHEAD_FILE_SIZE; i++) {
+        memset(page, 0, PAGE_SIZE);
+        sprintf(page, "page %d", i);
+        if (writePage(file, i, page) != OK) {
+            fprintf(stderr, "Cannot write page.\n");
+            exit(1);
+        }
+    }
+    
+    if (closeFile(file) != OK) {
+        fprintf(stderr, "Cannot close file.\n");
+        exit(1);
+    }
+    
+    for (pass = 0; pass < 2; pass++) {
+        /* バッファを空にして数え直すため、初期化し直す */
+        if (finalizeFileModule() != OK || setNumBuffer(READAHEAD_NUM_BUFFER) != OK ||
+            initializeFileModule() != OK) {
+            fprintf(stderr, "Cannot reinitialize file module.\n");
+            exit(1);
+        }
+        
+        if ((file = openFile(BENCH_FILE)) == NULL) {
+            fprintf(stderr, "Cannot open file.\n");
+            exit(1);
+        }
+        
+        if (pass == 0) {
+            printf("sequential read without hint\n");
+        } else {
+            printf("sequential read with ACCESS_SEQUENTIAL\n");
+            adviseFile(file, ACCESS_SEQUENTIAL);
+        }
+        
+        for (i = 0; i < READAHEAD_FILE_SIZE; i++) {
+            if (readPage(file, i, page) != OK) {
+                fprintf(stderr, "Cannot read page.\n");
+                exit(1);
+            }
+            
+            memset(expected, 0, PAGE_SIZE);
+            sprintf(expected, "page %d", i);
+            if (memcmp(page, expected, PAGE_SIZE) != 0) {
+                printf("page %d: NG\n", i);
+            }
+        }
+        
+        printBufferList();
+        printf("\n");
+        
+        if (closeFile(file) != OK) {
+            fprintf(stderr, "Cannot close file.\n");
+            exit(1);
+        }
+    }
+    
+    deleteFile(BENCH_FILE);
+    
+    /* バッファの大きさを元に戻す */
+    if (finalizeFileModule() != OK || setNumBuffer(0) != OK || initializeFileModule() != OK) {
+        fprintf(stderr, "Cannot reinitialize file module.\n");
+        exit(1);
+    }
+    
+    printf("---------- test6 end ----------\n\n");
+}
+
+/*
+ * バッファの輪のテストで使うバッファの大きさ(ページ数)とファイルのページ数
+ */
+#define RING_NUM_BUFFER 32
+#define RING_FILE_SIZE 128
+
+/*
+ * test7 -- バッファの輪のテスト
+ *
+ * TEST_FILE1の全ページ(よく使うページ)を読み出してから、バッファより大きい
+ * ファイルを順番に読み出し、バッファのリストを出力する。
+ * ACCESS_SEQUENTIALを指定しないと、順番に読んだページがよく使うページを
+ * 追い出してしまうので、リストにTEST_FILE1のページは残らない。
+ * ACCESS_SEQUENTIALを指定するとバッファの輪だけを使って読むので、
+ * TEST_FILE1のページはすべてリストに残る。
+ */
+void test7()
+{
+    File *file, *hotFile;
+    char page[PAGE_SIZE];
+    int i, pass;
+    
+    printf("---------- test7 start ----------\n");
+    
+    /* テスト用の大きなファイルを作る */
+    deleteFile(BENCH_FILE);
+    if (createFile(BENCH_FILE) != OK) {
+        fprintf(stderr, "Cannot create file.\n");
+        exit(1);
+    }
+    
+    if ((file = openFile(BENCH_FILE)) == NULL) {
+        fprintf(stderr, "Cannot open file.\n");
+        exit(1);
+    }
+    
+    memset(page, 0, PAGE_SIZE);
+    for (i = 0; i < RING_FILE_SIZE; i++) {
+        if (writePage(file, i, page) != OK) {
+            fprintf(stderr, "Cannot write page.\n");
+            exit(1);
+        }
+    }
+    
+    if (closeFile(file) != OK) {
+        fprintf(stderr, "Cannot close file.\n");
+        exit(1);
+    }
+    
+    for (pass = 0; pass < 2; pass++) {
+        /* バッファを空にして数え直すため、初期化し直す */
+        if (finalizeFileModule() != OK || setNumBuffer(RING_NUM_BUFFER) != OK ||
+            initializeFileModule() != OK) {
+            fprintf(stderr, "Cannot reinitialize file module.\n");
+            exit(1);
+        }
+        
+        if ((hotFile = openFile(TEST_FILE1)) == NULL || (file = openFile(BENCH_FILE)) == NULL) {
+            fprintf(stderr, "Cannot open file.\n");
+            exit(1);
+        }
+        
+        /* よく使うページを読み出しておく */
+        for (i = 0; i < FILE_SIZE; i++) {
+            if (readPage(hotFile, i, page) != OK) {
+                fprintf(stderr, "Cannot read page.\n");
+                exit(1);
+            }
+        }
+        
+        if (pass == 0) {
+            printf("scan without hint\n");
+        } else {
+            printf("scan with ACCESS_SEQUENTIAL\n");
+            adviseFile(file, ACCESS_SEQUENTIAL);
+        }
+        
+        /* 大きなファイルを順番に読み出す */
+        for (i = 0; i < RING_FILE_SIZE; i++) {
+            if (readPage(file, i, page) != OK) {
+                fprintf(stderr, "Cannot read page.\n");
+                exit(1);
+            }
+        }
+        
+        /* よく使うページがバッファに残っているかどうかを見る */
+        printBufferList();
+        printf("\n");
+        
+        if (closeFile(file) != OK || closeFile(hotFile) != OK) {
+            fprintf(stderr, "Cannot close file.\n");
+            exit(1);
+        }
+    }
+    
+    deleteFile(BENCH_FILE);
+    
+    /* バッファの大きさを元に戻す */
+    if (finalizeFileModule() != OK || setNumBuffer(0) != OK || initializeFileModule() != OK) {
+        fprintf(stderr, "Cannot reinitialize file module.\n");
+        exit(1);
+    }
+    
+    printf("---------- test7 end ----------\n\n");
+}
+
+/*
+ * マップのテストで最初に書くページ数と、後から追加するページ数
+ * (追加した後はマップした領域の最小の大きさを超えるようにする)
+ */
+#define MAP_FILE_SIZE 8
+#define MAP_APPEND_SIZE 200
+
+/*
+ * test8 -- メモリにマップして読むテスト
+ *
+ * ファイルをmapFile()してからpinPage()とreadPage()で読み、書き込んだ内容が
+ * 読めるかを確かめる。続いてもう一度openFile()してページを追加し、マップした
+ * 範囲を超えたページも読めること(マップし直されること)と、マップし直す
+ * 前にpinPage()で得た領域がそのまま読めることを確かめる。
+ */
+void test8()
+{
+    File *file, *mapped;
+    char page[PAGE_SIZE], expected[PAGE_SIZE];
+    char *p, *first;
+    int i;
+    
+    printf("---------- test8 start ----------\n");
+    
+    deleteFile(BENCH_FILE);
+    if (createFile(BENCH_FILE) != OK) {
+        fprintf(stderr, "Cannot create file.\n");
+        exit(1);
+    }
+    
+    /* 各ページの先頭にページ番号を書く */
+    if ((file = openFile(BENCH_FILE)) == NULL) {
+        fprintf(stderr, "Cannot open file.\n");
+        exit(1);
+    }
+    for (i = 0; i < MAP_FILE_SIZE; i++) {
+        memset(page, 0, PAGE_SIZE);
+        sprintf(page, "page %d", i);
+        if (writePage(file, i, page) != OK) {
+            fprintf(stderr, "Cannot write page.\n");
+            exit(1);
+        }
+    }
+    if (closeFile(file) != OK) {
+        fprintf(stderr, "Cannot close file.\n");
+        exit(1);
+    }
+    
+    /* マップして読む */
+    if ((mapped = openFile(BENCH_FILE)) == NULL) {
+        fprintf(stderr, "Cannot open file.\n");
+        exit(1);
+    }
+    if (mapFile(mapped) != OK) {
+        fprintf(stderr, "Cannot map file.\n");
+        exit(1);
+    }
+    
+    /* 0ページ目は固定したまま、マップし直した後にも読めるか確かめる */
+    if ((first = pinPage(mapped, 0)) == NULL) {
+        fprintf(stderr, "Cannot pin page.\n");
+        exit(1);
+    }
+    
+    for (i = 0; i < MAP_FILE_SIZE; i++) {
+        memset(expected, 0, PAGE_SIZE);
+        sprintf(expected, "page %d", i);
+        if ((p = pinPage(mapped, i)) == NULL || memcmp(p, expected, PAGE_SIZE) != 0) {
+            printf("pinPage %d: NG\n", i);
+        }
+        if (p != NULL) {
+            unpinPage(p, UNMODIFIED);
+        }
+    }
+    printf("read %d pages through the mapping\n", MAP_FILE_SIZE);
+    
+    /* もう一度オープンしてページを追加する */
+    if ((file = openFile(BENCH_FILE)) == NULL) {
+        fprintf(stderr, "Cannot open file.\n");
+        exit(1);
+    }
+    for (i = MAP_FILE_SIZE; i < MAP_FILE_SIZE + MAP_APPEND_SIZE; i++) {
+        memset(page, 0, PAGE_SIZE);
+        sprintf(page, "page %d", i);
+        if (writePage(file, i, page) != OK) {
+            fprintf(stderr, "Cannot write page.\n");
+            exit(1);
+        }
+    }
+    if (closeFile(file) != OK) {
+        fprintf(stderr, "Cannot close file.\n");
+        exit(1);
+    }
+    
+    /* 追加したページも読めるか確かめる */
+    for (i = MAP_FILE_SIZE; i < MAP_FILE_SIZE + MAP_APPEND_SIZE; i++) {
+        memset(expected, 0, PAGE_SIZE);
+        sprintf(expected, "page %d", i);
+        if (readPage(mapped, i, page) != OK || memcmp(page, expected, PAGE_SIZE) != 0) {
+            printf("readPage %d: NG\n", i);
+        }
+    }
+    printf("read %d appended pages through the grown mapping\n", MAP_APPEND_SIZE);
+    
+    memset(expected, 0, PAGE_SIZE);
+    sprintf(expected, "page %d", 0);
+    printf("page pinned before growing: %s\n", (memcmp(first, expected, PAGE_SIZE) == 0) ? "OK" : "NG");
+    unpinPage(first, UNMODIFIED);
+    
+    printBufferList();
+    
+    if (closeFile(mapped) != OK) {
+        fprintf(stderr, "Cannot close file.\n");
+        exit(1);
+    }
+    
+    deleteFile(BENCH_FILE);
+    
+    printf("---------- test8 end ----------\n\n");
+}
+
+/*
+ * 非同期I/Oのテストで使うバッファの大きさ(ページ数)とファイルのページ数
+ */
+#define AIO_NUM_BUFFER 64
+#define AIO_FILE_SIZE 256
+
+/*
+ * 非同期I/Oのテストで試す方式
+ */
+static char *testAsyncIO[] = { "threads", "io_uring" };
+#define NUM_ASYNC_IO (sizeof(testAsyncIO) / sizeof(testAsyncIO[0]))
+
+/*
+ * test9 -- 非同期I/Oのテスト
+ *
+ * 方式ごとに以下を行い、読み出した内容が書き込んだものと同じかを確かめる。
+ * 1. ページを書き込み、途中で書き戻しスレッドにまとめて書き戻させる
+ * 2. prefetchPages()で先読みを発行してから、逆順に読み出す
+ *    (先読みの完了を待つページと、すでに読み込まれたページが混ざる)
+ * 3. ACCESS_SEQUENTIALを指定して順番に読み出す(非同期の先読みが続く)
+ */
+void test9()
+{
+    File *file;
+    char page[PAGE_SIZE], expected[PAGE_SIZE];
+    int i, numError;
+    unsigned int k;
+    
+    printf("---------- test9 start ----------\n");
+    
+    for (k = 0; k < NUM_ASYNC_IO; k++) {
+        if (finalizeFileModule() != OK || setNumBuffer(AIO_NUM_BUFFER) != OK ||
+            setAsyncIO(testAsyncIO[k]) != OK || initializeFileModule() != OK) {
+            fprintf(stderr, "Cannot reinitialize file module.\n");
+            exit(1);
+        }
+        printf("async io %s (requested %s)\n", getAsyncIO(), testAsyncIO[k]);
+        numError = 0;
+        
+        /* 1. 書き込んで、書き戻しスレッドに書き戻させる */
+        deleteFile(BENCH_FILE);
+        if (createFile(BENCH_FILE) != OK) {
+            fprintf(stderr, "Cannot create file.\n");
+            exit(1);
+        }
+        if ((file = openFile(BENCH_FILE)) == NULL) {
+            fprintf(stderr, "Cannot open file.\n");
+            exit(1);
+        }
+        for (i = 0; i < AIO_FILE_SIZE; i++) {
+            memset(page, 0, PAGE_SIZE);
+            sprintf(page, "page %d", i);
+            if (writePage(file, i, page) != OK) {
+                fprintf(stderr, "Cannot write page.\n");
+                exit(1);
+            }
+            
+            /* バッファの3/4が更新済みになったら、書き戻しスレッドが書き戻すのを待つ */
+            if (i == AIO_NUM_BUFFER * 3 / 4) {
+                usleep(300 * 1000);
+            }
+        }
+        if (closeFile(file) != OK) {
+            fprintf(stderr, "Cannot close file.\n");
+            exit(1);
+        }
+        
+        if ((file = openFile(BENCH_FILE)) == NULL) {
+            fprintf(stderr, "Cannot open file.\n");
+            exit(1);
+        }
+        
+        /* 2. 先読みを発行してから逆順に読み出す */
+        if (prefetchPages(file, 0, AIO_NUM_BUFFER / 2) != OK) {
+            fprintf(stderr, "Cannot prefetch pages.\n");
+            exit(1);
+        }
+        for (i = AIO_NUM_BUFFER / 2 - 1; i >= 0; i--) {
+            memset(expected, 0, PAGE_SIZE);
+            sprintf(expected, "page %d", i);
+            if (readPage(file, i, page) != OK || memcmp(page, expected, PAGE_SIZE) != 0) {
+                numError++;
+            }
+        }
+        
+        /* 3. 順番に読み出す */
+        adviseFile(file, ACCESS_SEQUENTIAL);
+        for (i = 0; i < AIO_FILE_SIZE; i++) {
+            memset(expected, 0, PAGE_SIZE);
+            sprintf(expected, "page %d", i);
+            if (readPage(file, i, page) != OK || memcmp(page, expected, PAGE_SIZE) != 0) {
+                numError++;
+            }
+        }
+        
+        printf("wrong pages: %d\n", numError);
+        printBufferList();
+        printf("\n");
+        
+        if (closeFile(file) != OK) {
+            fprintf(stderr, "Cannot close file.\n");
+            exit(1);
+        }
+        deleteFile(BENCH_FILE);
+    }
+    
+    /* バッファの大きさと非同期I/Oの方式を元に戻す */
+    if (finalizeFileModule() != OK || setNumBuffer(0) != OK ||
+        setAsyncIO(NULL) != OK || initializeFileModule() != OK) {
+        fprintf(stderr, "Cannot reinitialize file module.\n");
+        exit(1);
+    }
+    
+    printf("---------- test9 end ----------\n\n");
+}
+
+/*
+ * 開いたままにするファイルのテストで作るファイルの数
+ * (閉じずに残しておくファイルの上限の64より多くする)
+ */
+#define CACHE_NUM_FILE 70
+
+/*
+ * test10 -- 開いたままにするファイルのテスト
+ *
+ * 1. ページを書き足してcloseFile()し、書き戻す前でもgetNumPages()に
+ *    数えられることと、もう一度openFile()すると同じFile構造体が返り、
+ *    書いたページがバッファから読めることを確かめる
+ * 2. 上限より多いファイルを順にオープン・クローズし、使われていない
+ *    ファイルが閉じられて、開いているファイルが上限を超えないことを確かめる
+ */
+void test10()
+{
+    File *file, *again;
+    char page[PAGE_SIZE], expected[PAGE_SIZE], filename[MAX_FILENAME];
+    int i;
+    
+    printf("---------- test10 start ----------\n");
+    
+    /* 1. 書き足したページを次のopenFile()で使う */
+    deleteFile(BENCH_FILE);
+    if (createFile(BENCH_FILE) != OK || (file = openFile(BENCH_FILE)) == NULL) {
+        fprintf(stderr, "Cannot open file.\n");
+        exit(1);
+    }
+    for (i = 0; i < 2; i++) {
+        memset(page, 0, PAGE_SIZE);
+        sprintf(page, "page %d", i);
+        if (writePage(file, i, page) != OK) {
+            fprintf(stderr, "Cannot write page.\n");
+            exit(1);
+        }
+    }
+    if (closeFile(file) != OK) {
+        fprintf(stderr, "Cannot close file.\n");
+        exit(1);
+    }
+    printf("pages after close: %d\n", getNumPages(BENCH_FILE));
+    
+    if ((again = openFile(BENCH_FILE)) == NULL) {
+        fprintf(stderr, "Cannot open file.\n");
+        exit(1);
+    }
+    printf("same File after reopen: %s\n", (again == file) ? "OK" : "NG");
+    
+    memset(expected, 0, PAGE_SIZE);
+    sprintf(expected, "page %d", 1);
+    if (readPage(again, 1, page) != OK || memcmp(page, expected, PAGE_SIZE) != 0) {
+        printf("readPage 1: NG\n");
+    }
+    printBufferList();
+    
+    if (closeFile(again) != OK) {
+        fprintf(stderr, "Cannot close file.\n");
+        exit(1);
+    }
+    deleteFile(BENCH_FILE);
+    
+    /* 2. 上限より多いファイルをオープン・クローズする */
+    for (i = 0; i < CACHE_NUM_FILE; i++) {
+        sprintf(filename, "cachefile%d", i);
+        if (createFile(filename) != OK || (file = openFile(filename)) == NULL) {
+            fprintf(stderr, "Cannot open file.\n");
+            exit(1);
+        }
+        memset(page, 0, PAGE_SIZE);
+        sprintf(page, "file %d", i);
+        if (writePage(file, 0, page) != OK || closeFile(file) != OK) {
+            fprintf(stderr, "Cannot write page.\n");
+            exit(1);
+        }
+    }
+    printBufferList();
+    
+    /* 閉じられたファイルにも、書いたページが書き戻されているか確かめる */
+    for (i = 0; i < CACHE_NUM_FILE; i++) {
+        sprintf(filename, "cachefile%d", i);
+        memset(expected, 0, PAGE_SIZE);
+        sprintf(expected, "file %d", i);
+        if ((file = openFile(filename)) == NULL) {
+            fprintf(stderr, "Cannot open file.\n");
+            exit(1);
+        }
+        if (readPage(file, 0, page) != OK || memcmp(page, expected, PAGE_SIZE) != 0) {
+            printf("%s: NG\n", filename);
+        }
+        if (closeFile(file) != OK) {
+            fprintf(stderr, "Cannot close file.\n");
+            exit(1);
+        }
+    }
+    printf("read %d files\n", CACHE_NUM_FILE);
+    
+    for (i = 0; i < CACHE_NUM_FILE; i++) {
+        sprintf(filename, "cachefile%d", i);
+        deleteFile(filename);
+    }
+    
+    printf("---------- test10 end ----------\n\n");
+}
+
+/*
+ * 書き戻しのテストで使うバッファの大きさ(ページ数)とファイルのページ数
+ */
+#define WRITEBACK_NUM_BUFFER 1024
+#define WRITEBACK_FILE_SIZE 1000
+
+/*
+ * test11 -- 書き戻しをまとめるテスト
+ *
+ * 連続したページを後ろから順に書き込み、書き戻しスレッドに書き戻させる。
+ * 書き戻しはページの順に並べ替えて連続したページをまとめて書くので、
+ * 書き込みの回数はページ数よりずっと少なくなる。初期化し直してから読み出し、
+ * 書き込んだ内容と同じかどうかを確かめる。
+ */
+void test11()
+{
+    File *file;
+    char page[PAGE_SIZE], expected[PAGE_SIZE];
+    int i, numError = 0;
+    
+    printf("---------- test11 start ----------\n");
+    
+    if (finalizeFileModule() != OK || setNumBuffer(WRITEBACK_NUM_BUFFER) != OK ||
+        initializeFileModule() != OK) {
+        fprintf(stderr, "Cannot reinitialize file module.\n");
+        exit(1);
+    }
+    
+    deleteFile(BENCH_FILE);
+    if (createFile(BENCH_FILE) != OK || (file = openFile(BENCH_FILE)) == NULL) {
+        fprintf(stderr, "Cannot open file.\n");
+        exit(1);
+    }
+    for (i = WRITEBACK_FILE_SIZE - 1; i >= 0; i--) {
+        memset(page, 0, PAGE_SIZE);
+        sprintf(page, "page %d", i);
+        if (writePage(file, i, page) != OK) {
+            fprintf(stderr, "Cannot write page.\n");
+            exit(1);
+        }
+    }
+    if (closeFile(file) != OK) {
+        fprintf(stderr, "Cannot close file.\n");
+        exit(1);
+    }
+    
+    /* 書き戻しスレッドが書き戻すのを待つ */
+    usleep(300 * 1000);
+    printBufferList();
+    
+    /* バッファを空にしてから読み出す */
+    if (finalizeFileModule() != OK || setNumBuffer(0) != OK || initializeFileModule() != OK) {
+        fprintf(stderr, "Cannot reinitialize file module.\n");
+        exit(1);
+    }
+    if ((file = openFile(BENCH_FILE)) == NULL) {
+        fprintf(stderr, "Cannot open file.\n");
+        exit(1);
+    }
+    for (i = 0; i < WRITEBACK_FILE_SIZE; i++) {
+        memset(expected, 0, PAGE_SIZE);
+        sprintf(expected, "page %d", i);
+        if (readPage(file, i, page) != OK || memcmp(page, expected, PAGE_SIZE) != 0) {
+            numError++;
+        }
+    }
+    printf("wrong pages: %d\n", numError);
+    if (closeFile(file) != OK) {
+        fprintf(stderr, "Cannot close file.\n");
+        exit(1);
+    }
+    deleteFile(BENCH_FILE);
+    
+    printf("---------- test11 end ----------\n\n");
+}
+
+/*
+ * ダイレクトI/Oのテストで使うバッファの大きさ(ページ数)とファイルのページ数
+ */
+#define DIRECT_NUM_BUFFER 64
+#define DIRECT_FILE_SIZE 64
+
+/*
+ * test12 -- ダイレクトI/Oのテスト
+ *
+ * ダイレクトI/Oを使うように初期化し直し、ページを書き込んでから
+ * バッファを空にして読み出し、書き込んだ内容と同じかどうかを確かめる。
+ * 順番に読むので先読み(preadv)も通る。ファイルシステムがO_DIRECTに
+ * 対応していなければ、ふつうのI/Oで同じことを確かめる。
+ */
+void test12()
+{
+    File *file;
+    char page[PAGE_SIZE], expected[PAGE_SIZE];
+    int i, pass, numError = 0;
+    
+    printf("---------- test12 start ----------\n");
+    
+    if (finalizeFileModule() != OK || setNumBuffer(DIRECT_NUM_BUFFER) != OK ||
+        setDirectIO(1) != OK || initializeFileModule() != OK) {
+        fprintf(stderr, "Cannot reinitialize file module.\n");
+        exit(1);
+    }
+    printf("direct io %d\n", getDirectIO());
+    
+    deleteFile(BENCH_FILE);
+    if (createFile(BENCH_FILE) != OK) {
+        fprintf(stderr, "Cannot create file.\n");
+        exit(1);
+    }
+    
+    for (pass = 0; pass < 2; pass++) {
+        if ((file = openFile(BENCH_FILE)) == NULL) {
+            fprintf(stderr, "Cannot open file.\n");
+            exit(1);
+        }
+        for (i = 0; i < DIRECT_FILE_SIZE; i++) {
+            memset(expected, 0, PAGE_SIZE);
+            sprintf(expected, "page %d", i);
+            if (pass == 0) {
+                if (writePage(file, i, expected) != OK) {
+                    fprintf(stderr, "Cannot write page.\n");
+                    exit(1);
+                }
+            } else if (readPage(file, i, page) != OK || memcmp(page, expected, PAGE_SIZE) != 0) {
+                numError++;
+            }
+        }
+        if (pass == 1) {
+            printBufferList();
+        }
+        if (closeFile(file) != OK) {
+            fprintf(stderr, "Cannot close file.\n");
+            exit(1);
+        }
+        
+        /* 書き戻してバッファを空にする */
+        if (finalizeFileModule() != OK || initializeFileModule() != OK) {
+            fprintf(stderr, "Cannot reinitialize file module.\n");
+            exit(1);
+        }
+    }
+    printf("wrong pages: %d\n", numError);
+    
+    deleteFile(BENCH_FILE);
+    
+    if (finalizeFileModule() != OK || setNumBuffer(0) != OK ||
+        setDirectIO(-1) != OK || initializeFileModule() != OK) {
+        fprintf(stderr, "Cannot reinitialize file module.\n");
+        exit(1);
+    }
+    
+    printf("---------- test12 end ----------\n\n");
+}
+
+/*
+ * test13 -- バッファの統計のテスト
+ *
+ * 統計を0に戻してから2つのファイルのページを読み出し、ファイルごとの
+ * ヒット数とミス数の和が全体の値と一致することと、読み込んだバイト数が
+ * ミスしたページ数以上であることを確かめる。最後にもう一度0に戻す。
+ */
+void test13()
+{
+    File *file[2];
+    BufferStats total, stats[2];
+    char page[PAGE_SIZE];
+    int i;
+    
+    printf("---------- test13 start ----------\n");
+    
+    if ((file[0] = openFile(TEST_FILE1)) == NULL || (file[1] = openFile(TEST_FILE2)) == NULL) {
+        fprintf(stderr, "Cannot open file.\n");
+        exit(1);
+    }
+    
+    resetBufferStats();
+    for (i = 0; i < TEST_SIZE; i++) {
+        if (readPage(file[i % 2], i % FILE_SIZE, page) != OK) {
+            fprintf(stderr, "Cannot read page.\n");
+            exit(1);
+        }
+    }
+    
+    getBufferStats(&total);
+    getFileStats(file[0], &stats[0]);
+    getFileStats(file[1], &stats[1]);
+    printBufferStats();
+    
+    printf("per-file sum: %s\n",
+           (stats[0].numHit + stats[1].numHit == total.numHit
+            && stats[0].numMiss + stats[1].numMiss == total.numMiss
+            && total.numHit + total.numMiss == TEST_SIZE) ? "OK" : "NG");
+    printf("bytes read: %s\n", (total.readBytes >= (long long) total.numMiss * PAGE_SIZE) ? "OK" : "NG");
+    
+    resetBufferStats();
+    getBufferStats(&total);
+    printf("after reset: %s\n", (total.numHit == 0 && total.numMiss == 0 && total.readBytes == 0) ? "OK" : "NG");
+    
+    if (closeFile(file[0]) != OK || closeFile(file[1]) != OK) {
+        fprintf(stderr, "Cannot close file.\n");
+        exit(1);
+    }
+    
+    printf("---------- test13 end ----------\n\n");
+}
+
+/*
+ * シャードのテストで使うバッファの大きさ(ページ数)、シャードの数、
+ * ファイルのページ数、スレッドの数、各スレッドがページを更新する回数
+ */
+#define SHARD_NUM_BUFFER 64
+#define SHARD_NUM_SHARD 4
+#define SHARD_FILE_SIZE 256
+#define SHARD_NUM_THREAD 4
+#define SHARD_NUM_ROUND 20
+
+/*
+ * SHARD_COUNTER_OFFSET -- ページの中で更新回数を数える位置
+ */
+#define SHARD_COUNTER_OFFSET 64
+
+/*
+ * ShardWorker -- シャードのテストのスレッドに渡す引数
+ */
+typedef struct ShardWorker ShardWorker;
+struct ShardWorker {
+    File *file;				/* 読み書きするファイル */
+    int index;				/* スレッドの番号 */
+    int numError;			/* 見つけた誤りの数 */
+};
+
+/*
+ * shardWorkerMain -- シャードのテストのスレッドの本体
+ *
+ * 自分の番号で割り切れるページを書き込み用のラッチを取って更新し、
+ * その間にほかのページを読み込み用のラッチを取って読み、ページの見出しが
+ * 正しいかどうかを確かめる。
+ */
+static void *shardWorkerMain(void *arg)
+{
+    ShardWorker *worker = (ShardWorker *) arg;
+    char expected[PAGE_SIZE];
+    char *p;
+    int round, i, other, counter;
+    
+    for (round = 0; round < SHARD_NUM_ROUND; round++) {
+        for (i = worker->index; i < SHARD_FILE_SIZE; i += SHARD_NUM_THREAD) {
+            if ((p = latchPage(worker->file, i, LATCH_EXCLUSIVE)) == NULL) {
+                worker->numError++;
+                continue;
+            }
+            memcpy(&counter, p + SHARD_COUNTER_OFFSET, sizeof(int));
+            counter++;
+            memcpy(p + SHARD_COUNTER_OFFSET, &counter, sizeof(int));
+            unlatchPage(p, MODIFIED);
+            
+            other = (i * 7 + round) % SHARD_FILE_SIZE;
+            memset(expected, 0, SHARD_COUNTER_OFFSET);
+            sprintf(expected, "page %d", other);
+            if ((p = latchPage(worker->file, other, LATCH_SHARED)) == NULL) {
+                worker->numError++;
+                continue;
+            }
+            if (memcmp(p, expected, SHARD_COUNTER_OFFSET) != 0) {
+                worker->numError++;
+            }
+            unlatchPage(p, UNMODIFIED);
+        }
+    }
+    
+    return NULL;
+}
+
+/*
+ * test14 -- バッファをシャードに分けたときの並行アクセスのテスト
+ *
+ * バッファをSHARD_NUM_SHARD個のシャードに分けて初期化し直し、
+ * バッファより大きなファイルを複数のスレッドで同時に読み書きする。
+ * 各スレッドは別々のページを更新し、ほかのスレッドのページも読むので、
+ * 追い出しや書き戻しとラッチが並行して動く。最後にバッファを空にしてから
+ * 読み出し、すべての更新が残っていることを確かめる。
+ */
+void test14()
+{
+    File *file;
+    ShardWorker worker[SHARD_NUM_THREAD];
+    pthread_t thread[SHARD_NUM_THREAD];
+    char page[PAGE_SIZE], expected[PAGE_SIZE];
+    int i, counter, numError = 0;
+    
+    printf("---------- test14 start ----------\n");
+    
+    if (finalizeFileModule() != OK || setNumBuffer(SHARD_NUM_BUFFER) != OK ||
+        setNumShard(SHARD_NUM_SHARD) != OK || initializeFileModule() != OK) {
+        fprintf(stderr, "Cannot reinitialize file module.\n");
+        exit(1);
+    }
+    printf("%d pages in %d shards\n", getNumBuffer(), getNumShard());
+    
+    deleteFile(BENCH_FILE);
+    if (createFile(BENCH_FILE) != OK || (file = openFile(BENCH_FILE)) == NULL) {
+        fprintf(stderr, "Cannot create file.\n");
+        exit(1);
+    }
+    for (i = 0; i < SHARD_FILE_SIZE; i++) {
+        memset(page, 0, PAGE_SIZE);
+        sprintf(page, "page %d", i);
+        if (writePage(file, i, page) != OK) {
+            fprintf(stderr, "Cannot write page.\n");
+            exit(1);
+        }
+    }
+    
+    /* 複数のスレッドで同時に読み書きする */
+    for (i = 0; i < SHARD_NUM_THREAD; i++) {
+        worker[i].file = file;
+        worker[i].index = i;
+        worker[i].numError = 0;
+        if (pthread_create(&thread[i], NULL, shardWorkerMain, &worker[i]) != 0) {
+            fprintf(stderr, "Cannot create thread.\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < SHARD_NUM_THREAD; i++) {
+        pthread_join(thread[i], NULL);
+        numError += worker[i].numError;
+    }
+    printf("errors in threads: %d\n", numError);
+    
+    if (closeFile(file) != OK) {
+        fprintf(stderr, "Cannot close file.\n");
+        exit(1);
+    }
+    
+    /* バッファを空にしてから、すべての更新が書き戻されたか確かめる */
+    if (finalizeFileModule() != OK || initializeFileModule() != OK
+        || (file = openFile(BENCH_FILE)) == NULL) {
+        fprintf(stderr, "Cannot reinitialize file module.\n");
+        exit(1);
+    }
+    numError = 0;
+    for (i = 0; i < SHARD_FILE_SIZE; i++) {
+        memset(expected, 0, SHARD_COUNTER_OFFSET);
+        sprintf(expected, "page %d", i);
+        if (readPage(file, i, page) != OK) {
+            numError++;
+            continue;
+        }
+        memcpy(&counter, page + SHARD_COUNTER_OFFSET, sizeof(int));
+        if (memcmp(page, expected, SHARD_COUNTER_OFFSET) != 0 || counter != SHARD_NUM_ROUND) {
+            numError++;
+        }
+    }
+    printf("wrong pages: %d\n", numError);
+    if (closeFile(file) != OK) {
+        fprintf(stderr, "Cannot close file.\n");
+        exit(1);
+    }
+    deleteFile(BENCH_FILE);
+    
+    if (finalizeFileModule() != OK || setNumBuffer(0) != OK ||
+        setNumShard(0) != OK || initializeFileModule() != OK) {
+        fprintf(stderr, "Cannot reinitialize file module.\n");
+        exit(1);
+    }
+    
+    printf("---------- test14 end ----------\n\n");
+}
+
+/*
+ * ヒュージページのテストで使うバッファの大きさ(ページ数)とファイルのページ数
+ */
+#define HUGE_NUM_BUFFER 1024
+#define HUGE_FILE_SIZE 1024
+
+/*
+ * test15 -- ヒュージページで確保したバッファのテスト
+ *
+ * バッファの領域をTransparent Huge Pagesで確保するように初期化し直し、
+ * ページを書き込んでからバッファを空にして読み出し、書き込んだ内容と
+ * 同じかどうかを確かめる。ヒュージページが使えなければ、ふつうのページで
+ * 確保したバッファで同じことを確かめる。
+ */
+void test15()
+{
+    File *file;
+    char page[PAGE_SIZE], expected[PAGE_SIZE];
+    int i, pass, numError = 0;
+    
+    printf("---------- test15 start ----------\n");
+    
+    if (setHugePages("2mb") != NG) {
+        fprintf(stderr, "Unknown name was accepted.\n");
+        exit(1);
+    }
+    if (finalizeFileModule() != OK || setNumBuffer(HUGE_NUM_BUFFER) != OK ||
+        setHugePages("thp") != OK || initializeFileModule() != OK) {
+        fprintf(stderr, "Cannot reinitialize file module.\n");
+        exit(1);
+    }
+    printf("huge pages %s\n", getHugePages());
+    
+    deleteFile(BENCH_FILE);
+    if (createFile(BENCH_FILE) != OK) {
+        fprintf(stderr, "Cannot create file.\n");
+        exit(1);
+    }
+    
+    for (pass = 0; pass < 2; pass++) {
+        if ((file = openFile(BENCH_FILE)) == NULL) {
+            fprintf(stderr, "Cannot open file.\n");
+            exit(1);
+        }
+        for (i = 0; i < HUGE_FILE_SIZE; i++) {
+            memset(expected, 0, PAGE_SIZE);
+            sprintf(expected, "page %d", i);
+            if (pass == 0) {
+                if (writePage(file, i, expected) != OK) {
+                    fprintf(stderr, "Cannot write page.\n");
+                    exit(1);
+                }
+            } else if (readPage(file, i, page) != OK || memcmp(page, expected, PAGE_SIZE) != 0) {
+                numError++;
+            }
+        }
+        if (closeFile(file) != OK) {
+            fprintf(stderr, "Cannot close file.\n");
+            exit(1);
+        }
+        
+        /* 書き戻してバッファを空にする */
+        if (finalizeFileModule() != OK || initializeFileModule() != OK) {
+            fprintf(stderr, "Cannot reinitialize file module.\n");
+            exit(1);
+        }
+    }
+    printf("wrong pages: %d\n", numError);
+    
+    deleteFile(BENCH_FILE);
+    
+    if (finalizeFileModule() != OK || setNumBuffer(0) != OK ||
+        setHugePages(NULL) != OK || initializeFileModule() != OK) {
+        fprintf(stderr, "Cannot reinitialize file module.\n");
+        exit(1);
+    }
+    
+    printf("---------- test15 end ----------\n\n");
+}
+
+/*
+ * 圧縮のテストで使うファイルのページ数
+ */
+#define COMPRESS_FILE_SIZE 256
+
+/*
+ * fillCompressPage -- 圧縮のテストで書き込むページの内容を作る
+ *
+ * 偶数回目はテーブルのデータファイルのように同じ文字列の並びが続くページ、
+ * 奇数回目は7ページごとに乱数で埋めた(圧縮できない)ページにする。
+ */
+static void fillCompressPage(char *page, int pageNum, int round)
+{
+    int i, offset;
+    
+    memset(page, 0, PAGE_SIZE);
+    if (round % 2 == 1 && pageNum % 7 == 0) {
+        srand((unsigned int) pageNum);
+        for (i = 0; i < PAGE_SIZE; i++) {
+            page[i] = (char) (rand() & 0xff);
+        }
+        return;
+    }
+    offset = sprintf(page, "page %d round %d", pageNum, round) + 1;
+    for (i = 0; offset + 40 < PAGE_SIZE / 2; i++) {
+        offset += sprintf(page + offset, "name%04d|tokyo|%d|", i % 10, pageNum + round) + 1;
+    }
+}
+
+/*
+ * checkCompressFile -- 圧縮のテストのファイルを読み、書き込んだ内容と同じか確かめる
+ *
+ * 返り値:
+ *	内容が違ったページ数
+ */
+static int checkCompressFile(int round)
+{
+    File *file;
+    char page[PAGE_SIZE], expected[PAGE_SIZE];
+    int i, numError = 0;
+    
+    /* 書き戻してバッファを空にしてから読む */
+    if (finalizeFileModule() != OK || initializeFileModule() != OK) {
+        fprintf(stderr, "Cannot reinitialize file module.\n");
+        exit(1);
+    }
+    if ((file = openFile(BENCH_FILE)) == NULL) {
+        fprintf(stderr, "Cannot open file.\n");
+        exit(1);
+    }
+    for (i = 0; i < COMPRESS_FILE_SIZE; i++) {
+        fillCompressPage(expected, i, round);
+        if (readPage(file, i, page) != OK || memcmp(page, expected, PAGE_SIZE) != 0) {
+            numError++;
+        }
+    }
+    if (closeFile(file) != OK) {
+        fprintf(stderr, "Cannot close file.\n");
+        exit(1);
+    }
+    
+    return numError;
+}
+
+/*
+ * test16 -- ページを圧縮したファイルのテスト
+ *
+ * ページを書き込んだファイルを圧縮した形式に書き直し、バッファを空にしてから
+ * 読み出して内容を確かめる。続けて圧縮できないページを混ぜて書き直し、
+ * 圧縮の統計を確かめてから、圧縮しない形式に戻して内容を確かめる。
+ * 形式の書き直しが途中で止まった状態も作り、開くときに確定していたものは
+ * 終わらせ、確定していなかったものは取り消すことを確かめる。
+ */
+void test16()
+{
+    File *file;
+    char page[PAGE_SIZE];
+    BufferStats stats;
+    FILE *fp;
+    int i, round;
+    
+    printf("---------- test16 start ----------\n");
+    
+    deleteFile(BENCH_FILE);
+    if (createFile(BENCH_FILE) != OK) {
+        fprintf(stderr, "Cannot create file.\n");
+        exit(1);
+    }
+    
+    for (round = 0; round < 2; round++) {
+        if ((file = openFile(BENCH_FILE)) == NULL) {
+            fprintf(stderr, "Cannot open file.\n");
+            exit(1);
+        }
+        for (i = 0; i < COMPRESS_FILE_SIZE; i++) {
+            fillCompressPage(page, i, round);
+            if (writePage(file, i, page) != OK) {
+                fprintf(stderr, "Cannot write page.\n");
+                exit(1);
+            }
+        }
+        if (closeFile(file) != OK) {
+            fprintf(stderr, "Cannot close file.\n");
+            exit(1);
+        }
+        
+        /* 1回目は書き込んだファイルを圧縮した形式に書き直す */
+        if (round == 0) {
+            if (setFileCompression(BENCH_FILE, 1) != OK) {
+                fprintf(stderr, "Cannot compress file.\n");
+                exit(1);
+            }
+            printf("compressed: %d, pages: %d\n", isFileCompressed(BENCH_FILE), getNumPages(BENCH_FILE));
+        }
+        
+        resetBufferStats();
+        printf("round %d wrong pages: %d\n", round, checkCompressFile(round));
+        
+        /* 読み込んだときに展開したので、圧縮の統計が数えられている */
+        if ((file = openFile(BENCH_FILE)) == NULL) {
+            fprintf(stderr, "Cannot open file.\n");
+            exit(1);
+        }
+        getFileStats(file, &stats);
+        printf("round %d packed smaller: %s\n", round,
+               (stats.packedBytes > 0 && stats.packedBytes < stats.rawBytes) ? "yes" : "no");
+        closeFile(file);
+    }
+    printBufferStats();
+    
+    /* 圧縮しない形式に戻す */
+    if (setFileCompression(BENCH_FILE, 0) != OK) {
+        fprintf(stderr, "Cannot decompress file.\n");
+        exit(1);
+    }
+    printf("compressed: %d, pages: %d\n", isFileCompressed(BENCH_FILE), getNumPages(BENCH_FILE));
+    printf("wrong pages: %d\n", checkCompressFile(1));
+    
+    /*
+     * 圧縮する書き直しで、ページ対応表を置いた後、データファイルを置き換える前に
+     * 止まった状態を作る(データファイルは古い内容の代わりに空にしておく)
+     */
+    if (setFileCompression(BENCH_FILE, 1) != OK || rename(BENCH_FILE, BENCH_FILE ".pack") != 0
+        || (fp = fopen(BENCH_FILE, "w")) == NULL) {
+        fprintf(stderr, "Cannot make interrupted conversion.\n");
+        exit(1);
+    }
+    fclose(fp);
+    printf("committed conversion: compressed: %d, wrong pages: %d\n",
+           isFileCompressed(BENCH_FILE), checkCompressFile(1));
+    
+    /* 圧縮しない書き直しで、ページ対応表を消す前に止まった状態を作る */
+    if ((fp = fopen(BENCH_FILE ".unpack", "w")) == NULL) {
+        fprintf(stderr, "Cannot make interrupted conversion.\n");
+        exit(1);
+    }
+    fputs("partial", fp);
+    fclose(fp);
+    printf("uncommitted conversion: compressed: %d, ", isFileCompressed(BENCH_FILE));
+    printf("wrong pages: %d, ", checkCompressFile(1));
+    if ((fp = fopen(BENCH_FILE ".unpack", "r")) != NULL) {
+        fclose(fp);
+    }
+    printf("left: %d\n", fp != NULL);
+    
+    deleteFile(BENCH_FILE);
+    
+    printf("---------- test16 end ----------\n\n");
+}
+
+/*
+ * 追い出しのテストで使うバッファの大きさ(ページ数)、ファイルのページ数、更新するページ数
+ */
+#define EVICT_NUM_BUFFER 64
+#define EVICT_FILE_SIZE 256
+#define EVICT_NUM_DIRTY 8
+
+/*
+ * test17 -- 追い出しが書き込みを待たないことを確かめるテスト
+ *
+ * 1つのシャードにしたバッファでいくつかのページを更新してから、残りのページを
+ * 読んでバッファを追い出させる。追い出しは更新されていないバッファを選ぶので、
+ * 追い出すときの書き戻しは起きない。更新済みのバッファは書き戻しスレッドが
+ * 書き戻すことも確かめる。
+ */
+void test17()
+{
+    File *file;
+    char page[PAGE_SIZE];
+    BufferStats stats;
+    int i, round, wait;
+    
+    printf("---------- test17 start ----------\n");
+    
+    if (finalizeFileModule() != OK || setNumBuffer(EVICT_NUM_BUFFER) != OK ||
+        setNumShard(1) != OK || initializeFileModule() != OK) {
+        fprintf(stderr, "Cannot reinitialize file module.\n");
+        exit(1);
+    }
+    
+    deleteFile(BENCH_FILE);
+    if (createFile(BENCH_FILE) != OK || (file = openFile(BENCH_FILE)) == NULL) {
+        fprintf(stderr, "Cannot open file.\n");
+        exit(1);
+    }
+    memset(page, 0, PAGE_SIZE);
+    for (i = 0; i < EVICT_FILE_SIZE; i++) {
+        sprintf(page, "page %d", i);
+        if (writePage(file, i, page) != OK) {
+            fprintf(stderr, "Cannot write page.\n");
+            exit(1);
+        }
+    }
+    if (syncFile(file) != OK) {
+        fprintf(stderr, "Cannot sync file.\n");
+        exit(1);
+    }
+    resetBufferStats();
+    
+    /* 先頭のページを更新し、残りのページを読んでバッファを追い出させる */
+    for (i = 0; i < EVICT_NUM_DIRTY; i++) {
+        sprintf(page, "dirty %d", i);
+        if (writePage(file, i, page) != OK) {
+            fprintf(stderr, "Cannot write page.\n");
+            exit(1);
+        }
+    }
+    for (round = 0; round < 2; round++) {
+        for (i = EVICT_NUM_DIRTY; i < EVICT_FILE_SIZE; i++) {
+            if (readPage(file, i, page) != OK) {
+                fprintf(stderr, "Cannot read page.\n");
+                exit(1);
+            }
+        }
+    }
+    getBufferStats(&stats);
+    printf("evicted: %s\n", stats.numEvict > 0 ? "yes" : "no");
+    if (stats.numEvictWriteBack != 0) {
+        printf("evict without write: NG (%ld)\n", stats.numEvictWriteBack);
+    } else {
+        printf("evict without write: OK\n");
+    }
+    
+    /* 更新したページは書き戻しスレッドが書き戻す */
+    for (wait = 0; wait < 50; wait++) {
+        getFileStats(file, &stats);
+        if (stats.numWriteBack >= EVICT_NUM_DIRTY) {
+            break;
+        }
+        usleep(100 * 1000);
+    }
+    if (stats.numWriteBack < EVICT_NUM_DIRTY || stats.numEvictWriteBack != 0) {
+        printf("flusher drained: NG (%ld, %ld)\n", stats.numWriteBack, stats.numEvictWriteBack);
+    } else {
+        printf("flusher drained: OK\n");
+    }
+    
+    if (closeFile(file) != OK) {
+        fprintf(stderr, "Cannot close file.\n");
+        exit(1);
+    }
+    deleteFile(BENCH_FILE);
+    
+    if (finalizeFileModule() != OK || setNumBuffer(0) != OK ||
+        setNumShard(0) != OK || initializeFileModule() != OK) {
+        fprintf(stderr, "Cannot reinitialize file module.\n");
+        exit(1);
+    }
+    
+    printf("---------- test17 end ----------\n\n");
+}
+
+/*
+ * ブロックのテストで使うバッファの大きさ(ページ数)、ファイルのページ数、ブロックの大きさ
+ */
+#define BLOCK_NUM_BUFFER 256
+#define BLOCK_FILE_SIZE 64
+#define BLOCK_SIZE (4 * PAGE_SIZE)
+
+/*
+ * test18 -- ブロックをバッファに置いたまま読み書きするテスト
+ *
+ * ページを後ろから書き込んでバッファの並びを逆にしてから、ブロックのラッチを取る。
+ * ブロックのページは連続したバッファに集められるので、同じブロックのラッチを
+ * もう一度取ると同じ領域が返る。バッファを空にしてから、ファイルから読み込む
+ * 場合も同じことを確かめる。書き込み用のラッチで変更した内容が、
+ * ページとして読めることも確かめる。
+ */
+void test18()
+{
+    File *file;
+    char page[PAGE_SIZE], expected[PAGE_SIZE];
+    char *block, *again;
+    int blockNum, numPage = BLOCK_SIZE / PAGE_SIZE, round, numError, i;
+    
+    printf("---------- test18 start ----------\n");
+    
+    if (finalizeFileModule() != OK || setNumBuffer(BLOCK_NUM_BUFFER) != OK ||
+        setNumShard(1) != OK || initializeFileModule() != OK) {
+        fprintf(stderr, "Cannot reinitialize file module.\n");
+        exit(1);
+    }
+    
+    deleteFile(BENCH_FILE);
+    if (createFile(BENCH_FILE) != OK || (file = openFile(BENCH_FILE)) == NULL) {
+        fprintf(stderr, "Cannot open file.\n");
+        exit(1);
+    }
+    memset(page, 0, PAGE_SIZE);
+    for (i = BLOCK_FILE_SIZE - 1; i >= 0; i--) {
+        sprintf(page, "page %d", i);
+        if (writePage(file, i, page) != OK) {
+            fprintf(stderr, "Cannot write page.\n");
+            exit(1);
+        }
+    }
+    
+    for (round = 0; round < 2; round++) {
+        /* 2回目は、バッファを空にしてから別のブロックを読む */
+        blockNum = 3 + round;
+        if (round == 1) {
+            if (closeFile(file) != OK || finalizeFileModule() != OK || initializeFileModule() != OK
+                || (file = openFile(BENCH_FILE)) == NULL) {
+                fprintf(stderr, "Cannot reopen file.\n");
+                exit(1);
+            }
+        }
+    
+        /* 同じブロックのラッチをもう一度取ると、1回目に集めたバッファの領域がそのまま返る */
+        if ((block = latchBlock(file, blockNum, BLOCK_SIZE, LATCH_SHARED)) == NULL
+            || (again = latchBlock(file, blockNum, BLOCK_SIZE, LATCH_SHARED)) == NULL) {
+            fprintf(stderr, "Cannot latch block.\n");
+            exit(1);
+        }
+        printf("round %d block in place: %s\n", round, (block == again) ? "OK" : "NG");
+        numError = 0;
+        for (i = 0; i < numPage; i++) {
+            memset(expected, 0, PAGE_SIZE);
+            sprintf(expected, "page %d", blockNum * numPage + i);
+            if (memcmp(block + (size_t) i * PAGE_SIZE, expected, PAGE_SIZE) != 0) {
+                numError++;
+            }
+        }
+        printf("round %d block contents: %s\n", round, (numError == 0) ? "OK" : "NG");
+        if (unlatchBlock(again, BLOCK_SIZE, UNMODIFIED) != OK
+            || unlatchBlock(block, BLOCK_SIZE, UNMODIFIED) != OK) {
+            fprintf(stderr, "Cannot unlatch block.\n");
+            exit(1);
+        }
+    }
+    
+    /* 書き込み用のラッチで変更した内容は、ページとして読める */
+    if ((block = latchBlock(file, blockNum, BLOCK_SIZE, LATCH_EXCLUSIVE)) == NULL) {
+        fprintf(stderr, "Cannot latch block.\n");
+        exit(1);
+    }
+    sprintf(block + PAGE_SIZE, "modified");
+    if (unlatchBlock(block, BLOCK_SIZE, MODIFIED) != OK) {
+        fprintf(stderr, "Cannot unlatch block.\n");
+        exit(1);
+    }
+    memset(expected, 0, PAGE_SIZE);
+    sprintf(expected, "modified");
+    if (readPage(file, blockNum * numPage + 1, page) != OK || memcmp(page, expected, PAGE_SIZE) != 0) {
+        printf("block write: NG\n");
+    } else {
+        printf("block write: OK\n");
+    }
+    
+    if (closeFile(file) != OK) {
+        fprintf(stderr, "Cannot close file.\n");
+        exit(1);
+    }
+    deleteFile(BENCH_FILE);
+    
+    if (finalizeFileModule() != OK || setNumBuffer(0) != OK ||
+        setNumShard(0) != OK || initializeFileModule() != OK) {
+        fprintf(stderr, "Cannot reinitialize file module.\n");
+        exit(1);
+    }
+    
+    printf("---------- test18 end ----------\n\n");
+}
+
 /*
  * main -- バッファ管理モジュールのテスト
  */
@@ -368,6 +2143,22 @@ int main(int argc, char **argv)
      */
     test1();
     test2();
+    test4();
+    test5();
+    test6();
+    test7();
+    test8();
+    test9();
+    test10();
+    test11();
+    test12();
+    test13();
+    test14();
+    test15();
+    test16();
+    test17();
+    test18();
+    test3();
     
     /*
      * ファイルアクセスモジュールの終了処理
@@ -12,7 +12,8 @@
 int main(int argc, char **argv)
 {
     char tableName[20];
-    TableInfo tableInfo;
+    char filename[MAX_FILENAME];
+    TableInfo tableInfo, *info;
     int i;
 
     /* ファイルモジュールを初期化する */
@@ -63,6 +64,7 @@ int main(int argc, char **argv)
     i++;
 
     tableInfo.numField = i;
+    tableInfo.pageSize = 0;
 
     /* テーブルの作成 */
     if (createTable(tableName, &tableInfo) != OK) {
@@ -113,6 +115,7 @@ int main(int argc, char **argv)
     i++;
 
     tableInfo.numField = i;
+    tableInfo.pageSize = 0;
 
     /* テーブルの作成 */
     if (createTable(tableName, &tableInfo) != OK) {
@@ -124,6 +127,56 @@ int main(int argc, char **argv)
     /* 作成したテーブルの情報を出力 */
     printTableInfo(tableName);
 
+    /* 2回目からは、キャッシュしたデータ定義情報を返す */
+    if ((info = getTableInfo(tableName)) == NULL || getTableInfo(tableName) != info) {
+	fprintf(stderr, "Table info is not cached.\n");
+	exit(1);
+    }
+    freeTableInfo(info);
+
+    /* 作り直したら、新しいデータ定義情報を返す(使っている間は、古いものも解放しない) */
+    dropTable(tableName);
+    if (getTableInfo(tableName) != NULL) {
+	fprintf(stderr, "Dropped table info is still cached.\n");
+	exit(1);
+    }
+    if (info->numField != tableInfo.numField) {
+	fprintf(stderr, "Dropped table info is freed while in use.\n");
+	exit(1);
+    }
+    freeTableInfo(info);
+    tableInfo.numField = 2;
+    if (createTable(tableName, &tableInfo) != OK) {
+	fprintf(stderr, "Cannot create table.\n");
+	exit(1);
+    }
+    if ((info = getTableInfo(tableName)) == NULL || info->numField != 2) {
+	fprintf(stderr, "Recreated table info is not reloaded.\n");
+	exit(1);
+    }
+    freeTableInfo(info);
+
+    /* データ定義ファイルは作らず、システムカタログから読み直せる */
+    sprintf(filename, "%s/%s.def", DB_PATH, tableName);
+    if (access(filename, F_OK) == 0) {
+	fprintf(stderr, "Table definition file is created.\n");
+	exit(1);
+    }
+    if (finalizeDataDefModule() != OK || initializeDataDefModule() != OK) {
+	fprintf(stderr, "Cannot reload system catalog.\n");
+	exit(1);
+    }
+    if ((info = getTableInfo(tableName)) == NULL || info->numField != 2) {
+	fprintf(stderr, "Table info is not reloaded from system catalog.\n");
+	exit(1);
+    }
+    freeTableInfo(info);
+    if ((info = getTableInfo("student")) == NULL || info->numField != 4) {
+	fprintf(stderr, "Table info is not reloaded from system catalog.\n");
+	exit(1);
+    }
+    freeTableInfo(info);
+
     /* 後始末 */
     dropTable("student");
     dropTable("teacher");
@@ -6,6 +6,85 @@
 
 #define TABLE_NAME "student"
 
+/*
+ * WIDE_TABLE_NAME, WIDE_PAGE_SIZE, WIDE_NUM_RECORD -- ページの大きさを指定したテーブルのテスト用
+ */
+#define WIDE_TABLE_NAME "wide"
+#define WIDE_PAGE_SIZE (4 * PAGE_SIZE)
+#define WIDE_NUM_RECORD 1000
+
+/*
+ * FSM_TABLE_NAME, FSM_NUM_RECORD -- 空き領域マップのテスト用
+ */
+#define FSM_TABLE_NAME "fsmtest"
+#define FSM_NUM_RECORD 2000
+
+/*
+ * COMPACT_TABLE_NAME, COMPACT_NUM_RECORD, COMPACT_NUM_LONG -- ページの詰め直しのテスト用
+ */
+#define COMPACT_TABLE_NAME "compact"
+#define COMPACT_NUM_RECORD 600
+#define COMPACT_NUM_LONG 80
+
+/*
+ * UPGRADE_TABLE_NAME, UPGRADE_NUM_PAGE, UPGRADE_NUM_SLOT -- 古い形式のデータファイルの書き直しのテスト用
+ *
+ * 古い形式のページをUPGRADE_NUM_PAGEページ作り、1ページにUPGRADE_NUM_SLOT個の
+ * スロットを置く(3つに1つは削除済みのスロットにする)。
+ */
+#define UPGRADE_TABLE_NAME "upgrade"
+#define UPGRADE_NUM_PAGE 4
+#define UPGRADE_NUM_SLOT 150
+
+/*
+ * BULK_TABLE_NAME, BULK_NUM_RECORD -- まとめて挿入するテスト用
+ */
+#define BULK_TABLE_NAME "bulk"
+#define BULK_NUM_RECORD 1000
+
+/*
+ * COPY_TABLE_NAME, COPY_NUM_RECORD -- ファイルから読み込むテスト用
+ */
+#define COPY_TABLE_NAME "copy"
+#define COPY_NUM_RECORD 3000
+
+/*
+ * RID_TABLE_NAME, RID_NUM_RECORD -- 番地を指定して読み書きするテスト用
+ */
+#define RID_TABLE_NAME "rid"
+#define RID_NUM_RECORD 500
+
+/*
+ * APPEND_TABLE_NAME, APPEND_NUM_THREAD, APPEND_NUM_RECORD -- 同時に書き足すテスト用
+ *
+ * APPEND_NUM_THREAD個のスレッドが、それぞれAPPEND_NUM_RECORD個のレコードを
+ * 同じテーブルに挿入する(スレッド0はinsertRecord()、ほかはまとめて挿入するセッション)。
+ */
+#define APPEND_TABLE_NAME "append"
+#define APPEND_NUM_THREAD 4
+#define APPEND_NUM_RECORD 400
+
+/*
+ * UPGRADE_NUM_THREAD, UPGRADE_NUM_ROUND, UPGRADE_NUM_READ, UPGRADE_MAX_DELAY -- 書き直しと同時に読むテスト用
+ *
+ * 古い形式のデータファイルを作り直すことをUPGRADE_NUM_ROUND回くり返し、そのたびに
+ * UPGRADE_NUM_THREAD個のスレッドが同時にUPGRADE_NUM_READ回ずつレコードを数える。
+ * 書き直しの途中で数え始めるスレッドもあるよう、数える前に
+ * UPGRADE_MAX_DELAYマイクロ秒未満のばらばらの時間だけ待つ。
+ */
+#define UPGRADE_NUM_THREAD 8
+#define UPGRADE_NUM_ROUND 50
+#define UPGRADE_NUM_READ 5
+#define UPGRADE_MAX_DELAY 2000
+
+/*
+ * THREAD_NUM_BUFFER -- 複数のスレッドで同時に読み書きするテストのバッファの大きさ(ページ数)
+ *
+ * 既定の大きさ(シャードに分けるとさらに小さい)では、スレッドがそれぞれページを
+ * 固定すると空きバッファがなくなり、読み書きが失敗することがある。
+ */
+#define THREAD_NUM_BUFFER 256
+
 /*
  * test1 -- レコードの挿入
  */
@@ -46,7 +125,7 @@ Result test1()
 
     record.numField = i;
 
-    if (insertRecord(TABLE_NAME, &record) != OK) {
+    if (insertRecord(TABLE_NAME, &record, NULL) != OK) {
         fprintf(stderr, "Cannot insert record.\n");
         return NG;
     }
@@ -83,7 +162,7 @@ Result test1()
 
     record.numField = i;
 
-    if (insertRecord(TABLE_NAME, &record) != OK) {
+    if (insertRecord(TABLE_NAME, &record, NULL) != OK) {
         fprintf(stderr, "Cannot insert record.\n");
         return NG;
     }
@@ -120,7 +199,7 @@ Result test1()
 
     record.numField = i;
 
-    if (insertRecord(TABLE_NAME, &record) != OK) {
+    if (insertRecord(TABLE_NAME, &record, NULL) != OK) {
         fprintf(stderr, "Cannot insert record.\n");
         return NG;
     }
@@ -157,7 +236,7 @@ Result test1()
 
     record.numField = i;
 
-    if (insertRecord(TABLE_NAME, &record) != OK) {
+    if (insertRecord(TABLE_NAME, &record, NULL) != OK) {
         fprintf(stderr, "Cannot insert record.\n");
         return NG;
     }
@@ -194,7 +273,7 @@ Result test1()
 
     record.numField = i;
 
-    if (insertRecord(TABLE_NAME, &record) != OK) {
+    if (insertRecord(TABLE_NAME, &record, NULL) != OK) {
         fprintf(stderr, "Cannot insert record.\n");
         return NG;
     }
@@ -231,7 +310,7 @@ Result test1()
 
     record.numField = i;
 
-    if (insertRecord(TABLE_NAME, &record) != OK) {
+    if (insertRecord(TABLE_NAME, &record, NULL) != OK) {
         fprintf(stderr, "Cannot insert record.\n");
         return NG;
     }
@@ -430,101 +509,1333 @@ Result test3()
 }
 
 /*
- * main -- データ操作モジュールのテスト
+ * countRecord -- 条件に合うレコードの数を数える(test4用)
  */
-int main(int argc, char **argv)
+static int countRecord(char *tableName, Condition *condition)
+{
+    RecordSet *recordSet;
+    FieldList fieldList;
+    int numRecord;
+
+    fieldList.numField = 0;
+    if ((recordSet = selectRecord(tableName, &fieldList, condition)) == NULL) {
+        return -1;
+    }
+    numRecord = recordSet->numRecord;
+    freeRecordSet(recordSet);
+
+    return numRecord;
+}
+
+/*
+ * test4 -- ページの大きさを指定したテーブルの挿入、検索、削除
+ */
+Result test4()
 {
-    char tableName[20];
     TableInfo tableInfo;
+    RecordData record;
+    Condition condition;
+    char filename[MAX_FILENAME];
+    int i, numPage, numRecord;
+
+    dropTable(WIDE_TABLE_NAME);
+
+    /*
+     * 以下のテーブルを作成
+     * create table wide ( id int, name varchar ) page size WIDE_PAGE_SIZE
+     */
+    strcpy(tableInfo.fieldInfo[0].name, "id");
+    tableInfo.fieldInfo[0].dataType = TYPE_INT;
+    strcpy(tableInfo.fieldInfo[1].name, "name");
+    tableInfo.fieldInfo[1].dataType = TYPE_VARCHAR;
+    tableInfo.numField = 2;
+
+    /* PAGE_SIZEの2のべき乗倍でない大きさは指定できない */
+    tableInfo.pageSize = PAGE_SIZE + 1;
+    if (createTable(WIDE_TABLE_NAME, &tableInfo) == OK) {
+        fprintf(stderr, "Created table with invalid page size.\n");
+        return NG;
+    }
+
+    tableInfo.pageSize = WIDE_PAGE_SIZE;
+    if (createTable(WIDE_TABLE_NAME, &tableInfo) != OK) {
+        fprintf(stderr, "Cannot create table.\n");
+        return NG;
+    }
+
+    /* 保存したページの大きさを読み出せるか確認する */
+    {
+        TableInfo *savedInfo;
+
+        if ((savedInfo = getTableInfo(WIDE_TABLE_NAME)) == NULL
+            || savedInfo->pageSize != WIDE_PAGE_SIZE) {
+            fprintf(stderr, "Page size is not saved.\n");
+            return NG;
+        }
+        freeTableInfo(savedInfo);
+    }
+
+    /* 複数のページにまたがる数のレコードを挿入する */
+    strcpy(record.fieldData[0].name, "id");
+    record.fieldData[0].dataType = TYPE_INT;
+    strcpy(record.fieldData[1].name, "name");
+    record.fieldData[1].dataType = TYPE_VARCHAR;
+    record.numField = 2;
+    for (i = 0; i < WIDE_NUM_RECORD; i++) {
+        record.fieldData[0].val.intVal = i;
+        sprintf(record.fieldData[1].val.stringVal, "name%05d", i);
+        if (insertRecord(WIDE_TABLE_NAME, &record, NULL) != OK) {
+            fprintf(stderr, "Cannot insert record.\n");
+            return NG;
+        }
+    }
+
+    /* データファイルはWIDE_PAGE_SIZEを単位として大きくなる */
+    sprintf(filename, "%s/%s.dat", DB_PATH, WIDE_TABLE_NAME);
+    numPage = getNumPages(filename);
+    if (numPage < WIDE_PAGE_SIZE / PAGE_SIZE || numPage % (WIDE_PAGE_SIZE / PAGE_SIZE) != 0) {
+        fprintf(stderr, "Invalid number of pages: %d\n", numPage);
+        return NG;
+    }
+
+    /* 全件と条件付きで検索する */
+    strcpy(condition.name, "");
+    condition.dataType = TYPE_UNKNOWN;
+    condition.operator = OPR_UNKNOWN;
+    condition.distinct = NOT_DISTINCT;
+    if ((numRecord = countRecord(WIDE_TABLE_NAME, &condition)) != WIDE_NUM_RECORD) {
+        fprintf(stderr, "Invalid number of records: %d\n", numRecord);
+        return NG;
+    }
+
+    strcpy(condition.name, "id");
+    condition.dataType = TYPE_INT;
+    condition.operator = OPR_LESS_THAN;
+    condition.val.intVal = WIDE_NUM_RECORD / 4;
+    if ((numRecord = countRecord(WIDE_TABLE_NAME, &condition)) != WIDE_NUM_RECORD / 4) {
+        fprintf(stderr, "Invalid number of records: %d\n", numRecord);
+        return NG;
+    }
+
+    /* delete from wide where id < WIDE_NUM_RECORD / 4 */
+    if (deleteRecord(WIDE_TABLE_NAME, &condition) != OK) {
+        fprintf(stderr, "Cannot delete records.\n");
+        return NG;
+    }
+
+    strcpy(condition.name, "");
+    condition.dataType = TYPE_UNKNOWN;
+    condition.operator = OPR_UNKNOWN;
+    if ((numRecord = countRecord(WIDE_TABLE_NAME, &condition)) != WIDE_NUM_RECORD - WIDE_NUM_RECORD / 4) {
+        fprintf(stderr, "Invalid number of records: %d\n", numRecord);
+        return NG;
+    }
+
+    printf("page size %d: %d records in %d pages\n", WIDE_PAGE_SIZE, numRecord, numPage);
+
+    dropTable(WIDE_TABLE_NAME);
+
+    return OK;
+}
+
+/*
+ * insertFsmRecords -- test5用のレコードをまとめて挿入する
+ */
+static Result insertFsmRecords(int start, int n)
+{
+    RecordData record;
     int i;
 
-    /* ファイルモジュールを初期化する */
-    if (initializeFileModule() != OK) {
-        fprintf(stderr, "Cannot initialize file module.\n");
-        exit(1);
+    strcpy(record.fieldData[0].name, "id");
+    record.fieldData[0].dataType = TYPE_INT;
+    strcpy(record.fieldData[1].name, "name");
+    record.fieldData[1].dataType = TYPE_VARCHAR;
+    record.numField = 2;
+    for (i = start; i < start + n; i++) {
+        record.fieldData[0].val.intVal = i;
+        sprintf(record.fieldData[1].val.stringVal, "name%05d", i);
+        if (insertRecord(FSM_TABLE_NAME, &record, NULL) != OK) {
+            return NG;
+        }
     }
 
-    /* データ定義ジュールを初期化する */
-    if (initializeDataDefModule() != OK) {
-        fprintf(stderr, "Cannot initialize data definition module.\n");
-        exit(1);
+    return OK;
+}
+
+/*
+ * test5 -- 空き領域マップを使った挿入
+ */
+Result test5()
+{
+    TableInfo tableInfo;
+    Condition condition;
+    char filename[MAX_FILENAME], fsmName[MAX_FILENAME];
+    int numPage, numRecord;
+
+    dropTable(FSM_TABLE_NAME);
+
+    strcpy(tableInfo.fieldInfo[0].name, "id");
+    tableInfo.fieldInfo[0].dataType = TYPE_INT;
+    strcpy(tableInfo.fieldInfo[1].name, "name");
+    tableInfo.fieldInfo[1].dataType = TYPE_VARCHAR;
+    tableInfo.numField = 2;
+    tableInfo.pageSize = 0;
+    if (createTable(FSM_TABLE_NAME, &tableInfo) != OK) {
+        fprintf(stderr, "Cannot create table.\n");
+        return NG;
     }
 
-    /* データ操作ジュールを初期化する */
-    if (initializeDataManipModule() != OK) {
-        fprintf(stderr, "Cannot initialize data manipulation module.\n");
-        exit(1);
+    /* 空き領域マップのファイルもできる */
+    sprintf(filename, "%s/%s.dat", DB_PATH, FSM_TABLE_NAME);
+    sprintf(fsmName, "%s/%s.fsm", DB_PATH, FSM_TABLE_NAME);
+    if (access(fsmName, F_OK) != 0) {
+        fprintf(stderr, "Free space map is not created.\n");
+        return NG;
     }
 
-    /*
-     * このプログラムの前回の実行の時のデータ定義残っている可能性があるので、
-     * とりあえず削除する
-     */
-    dropTable(TABLE_NAME);
+    if (insertFsmRecords(0, FSM_NUM_RECORD) != OK) {
+        fprintf(stderr, "Cannot insert record.\n");
+        return NG;
+    }
+    numPage = getNumPages(filename);
 
-    /*
-     * 以下のテーブルを作成
-     * create table student (
-     *   id string,
-     *   name string,
-     *   age int,
-     *   address string
-     * )
-     */
-    strcpy(tableName, TABLE_NAME);
-    i = 0;
+    /* 前半を削除してから同じ数だけ挿入しても、データファイルは大きくならない */
+    strcpy(condition.name, "id");
+    condition.dataType = TYPE_INT;
+    condition.operator = OPR_LESS_THAN;
+    condition.val.intVal = FSM_NUM_RECORD / 2;
+    condition.distinct = NOT_DISTINCT;
+    if (deleteRecord(FSM_TABLE_NAME, &condition) != OK) {
+        fprintf(stderr, "Cannot delete records.\n");
+        return NG;
+    }
+    if (insertFsmRecords(FSM_NUM_RECORD, FSM_NUM_RECORD / 2) != OK) {
+        fprintf(stderr, "Cannot insert record.\n");
+        return NG;
+    }
+    if (getNumPages(filename) != numPage) {
+        fprintf(stderr, "Free space is not reused: %d -> %d pages\n", numPage, getNumPages(filename));
+        return NG;
+    }
 
-    strcpy(tableInfo.fieldInfo[i].name, "id");
-    tableInfo.fieldInfo[i].dataType = TYPE_VARCHAR;
-    i++;
+    /* 空き領域マップがないテーブルでは、使うときに作り直す */
+    if (deleteFile(fsmName) != OK) {
+        fprintf(stderr, "Cannot delete free space map.\n");
+        return NG;
+    }
+    condition.operator = OPR_OR_GREATER_THAN;
+    condition.val.intVal = FSM_NUM_RECORD;
+    if (deleteRecord(FSM_TABLE_NAME, &condition) != OK
+        || insertFsmRecords(0, FSM_NUM_RECORD / 2) != OK) {
+        fprintf(stderr, "Cannot rebuild free space map.\n");
+        return NG;
+    }
+    if (access(fsmName, F_OK) != 0 || getNumPages(filename) != numPage) {
+        fprintf(stderr, "Free space map is not rebuilt.\n");
+        return NG;
+    }
 
-    strcpy(tableInfo.fieldInfo[i].name, "name");
-    tableInfo.fieldInfo[i].dataType = TYPE_VARCHAR;
-    i++;
+    strcpy(condition.name, "");
+    condition.dataType = TYPE_UNKNOWN;
+    condition.operator = OPR_UNKNOWN;
+    if ((numRecord = countRecord(FSM_TABLE_NAME, &condition)) != FSM_NUM_RECORD) {
+        fprintf(stderr, "Invalid number of records: %d\n", numRecord);
+        return NG;
+    }
 
-    strcpy(tableInfo.fieldInfo[i].name, "age");
-    tableInfo.fieldInfo[i].dataType = TYPE_INT;
-    i++;
+    printf("free space map: %d records in %d pages\n", numRecord, numPage);
 
-    strcpy(tableInfo.fieldInfo[i].name, "weight");
-    tableInfo.fieldInfo[i].dataType = TYPE_DOUBLE;
-    i++;
+    dropTable(FSM_TABLE_NAME);
 
-    strcpy(tableInfo.fieldInfo[i].name, "address");
-    tableInfo.fieldInfo[i].dataType = TYPE_VARCHAR;
-    i++;
+    return OK;
+}
 
-    tableInfo.numField = i;
+/*
+ * insertCompactRecords -- test6用のレコードをまとめて挿入する
+ *
+ * grpにはidを2で割った余りを入れる。longNameが0でなければ、長い名前にする。
+ */
+static Result insertCompactRecords(int start, int n, int longName)
+{
+    RecordData record;
+    int i;
 
-    /* テーブルの作成 */
-    if (createTable(tableName, &tableInfo) != OK) {
-        /* テーブルの作成に失敗 */
+    strcpy(record.fieldData[0].name, "id");
+    record.fieldData[0].dataType = TYPE_INT;
+    strcpy(record.fieldData[1].name, "grp");
+    record.fieldData[1].dataType = TYPE_INT;
+    strcpy(record.fieldData[2].name, "name");
+    record.fieldData[2].dataType = TYPE_VARCHAR;
+    record.numField = 3;
+    for (i = start; i < start + n; i++) {
+        record.fieldData[0].val.intVal = i;
+        record.fieldData[1].val.intVal = i % 2;
+        if (longName) {
+            sprintf(record.fieldData[2].val.stringVal, "long-name-of-record-%020d", i);
+        } else {
+            sprintf(record.fieldData[2].val.stringVal, "s%07d", i);
+        }
+        if (insertRecord(COMPACT_TABLE_NAME, &record, NULL) != OK) {
+            return NG;
+        }
+    }
+
+    return OK;
+}
+
+/*
+ * test6 -- 削除したときの空きの統合とページの詰め直し
+ */
+Result test6()
+{
+    TableInfo tableInfo;
+    Condition condition;
+    char filename[MAX_FILENAME];
+    int numPage, numRecord;
+
+    dropTable(COMPACT_TABLE_NAME);
+
+    strcpy(tableInfo.fieldInfo[0].name, "id");
+    tableInfo.fieldInfo[0].dataType = TYPE_INT;
+    strcpy(tableInfo.fieldInfo[1].name, "grp");
+    tableInfo.fieldInfo[1].dataType = TYPE_INT;
+    strcpy(tableInfo.fieldInfo[2].name, "name");
+    tableInfo.fieldInfo[2].dataType = TYPE_VARCHAR;
+    tableInfo.numField = 3;
+    tableInfo.pageSize = 0;
+    if (createTable(COMPACT_TABLE_NAME, &tableInfo) != OK) {
         fprintf(stderr, "Cannot create table.\n");
-        exit(1);
+        return NG;
     }
 
-    /* 挿入テスト */
-    fprintf(stderr, "test1: Start\n\n");
-    if (test1() == OK) {
-        fprintf(stderr, "test1: OK\n\n");
-    } else {
-        fprintf(stderr, "test1: NG\n\n");
+    if (insertCompactRecords(0, COMPACT_NUM_RECORD, 0) != OK) {
+        fprintf(stderr, "Cannot insert record.\n");
+        return NG;
     }
+    sprintf(filename, "%s/%s.dat", DB_PATH, COMPACT_TABLE_NAME);
+    numPage = getNumPages(filename);
 
-    /* 検索テスト */
-    fprintf(stderr, "test2: Start\n\n");
-    if (test2() == OK) {
-        fprintf(stderr, "test2: OK\n\n");
-    } else {
-        fprintf(stderr, "test2: NG\n\n");
+    /*
+     * 1つおきに削除すると小さな空きが散らばるが、ページを詰め直すので
+     * それより大きなレコードも同じページに入る
+     */
+    strcpy(condition.name, "grp");
+    condition.dataType = TYPE_INT;
+    condition.operator = OPR_EQUAL;
+    condition.val.intVal = 1;
+    condition.distinct = NOT_DISTINCT;
+    if (deleteRecord(COMPACT_TABLE_NAME, &condition) != OK) {
+        fprintf(stderr, "Cannot delete records.\n");
+        return NG;
+    }
+    if (insertCompactRecords(COMPACT_NUM_RECORD, COMPACT_NUM_LONG, 1) != OK) {
+        fprintf(stderr, "Cannot insert record.\n");
+        return NG;
+    }
+    if (getNumPages(filename) != numPage) {
+        fprintf(stderr, "Fragmented space is not reused: %d -> %d pages\n", numPage, getNumPages(filename));
+        return NG;
     }
 
-    /* 削除テスト */
-    fprintf(stderr, "test3: Start\n\n");
-    if (test3() == OK) {
-        fprintf(stderr, "test3: OK\n\n");
-    } else {
-        fprintf(stderr, "test3: NG\n\n");
+    /* 全部削除して空になったページは、ファイルを伸ばす前に使われる */
+    strcpy(condition.name, "");
+    condition.dataType = TYPE_UNKNOWN;
+    condition.operator = OPR_UNKNOWN;
+    if (deleteRecord(COMPACT_TABLE_NAME, &condition) != OK) {
+        fprintf(stderr, "Cannot delete records.\n");
+        return NG;
+    }
+    if (insertCompactRecords(0, COMPACT_NUM_RECORD, 0) != OK) {
+        fprintf(stderr, "Cannot insert record.\n");
+        return NG;
+    }
+    if (getNumPages(filename) != numPage) {
+        fprintf(stderr, "Empty pages are not reused: %d -> %d pages\n", numPage, getNumPages(filename));
+        return NG;
+    }
+
+    if ((numRecord = countRecord(COMPACT_TABLE_NAME, &condition)) != COMPACT_NUM_RECORD) {
+        fprintf(stderr, "Invalid number of records: %d\n", numRecord);
+        return NG;
+    }
+
+    printf("compaction: %d records in %d pages\n", numRecord, numPage);
+
+    dropTable(COMPACT_TABLE_NAME);
+
+    return OK;
+}
+
+/*
+ * writeOldPages -- test7用に、古い形式(ページの形式0)のデータファイルを作る
+ *
+ * idとnameの2つのフィールドのレコードを、古い形式のスロット(char + int×2)で
+ * ページの末尾から詰めて書き込む。
+ *
+ * 返り値:
+ *	削除済みでないレコードの数。失敗したら-1
+ */
+static int writeOldPages(char *filename)
+{
+    File *file;
+    char page[PAGE_SIZE];
+    char flag, *p;
+    int numSlot = UPGRADE_NUM_SLOT, offset, size, stringLen, id, numRecord = 0, i, j;
+    char name[MAX_STRING];
+
+    if ((file = openFile(filename)) == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < UPGRADE_NUM_PAGE; i++) {
+        memset(page, 0, PAGE_SIZE);
+        memcpy(page, &numSlot, sizeof(int));
+        offset = PAGE_SIZE;
+        for (j = 0; j < numSlot; j++) {
+            id = i * numSlot + j;
+            sprintf(name, "old%05d", id);
+            stringLen = (int) strlen(name);
+            size = sizeof(int) * 2 + stringLen + 1;
+            offset -= size;
+
+            /* レコード */
+            memcpy(page + offset, &id, sizeof(int));
+            memcpy(page + offset + sizeof(int), &stringLen, sizeof(int));
+            strcpy(page + offset + sizeof(int) * 2, name);
+
+            /* スロット */
+            flag = (j % 3 == 2) ? 0 : 1;
+            numRecord += flag;
+            p = page + sizeof(int) + (sizeof(char) + sizeof(int) * 2) * j;
+            memcpy(p, &flag, sizeof(char));
+            memcpy(p + sizeof(char), &offset, sizeof(int));
+            memcpy(p + sizeof(char) + sizeof(int), &size, sizeof(int));
+        }
+        if (writePage(file, i, page) != OK) {
+            closeFile(file);
+            return -1;
+        }
+    }
+
+    if (closeFile(file) != OK) {
+        return -1;
+    }
+
+    return numRecord;
+}
+
+/*
+ * copyDataFile -- ファイルの全ページを、別のファイルに写してディスクに書き込む
+ *
+ * 返り値:
+ *	成功ならOK、失敗ならNG
+ */
+static Result copyDataFile(char *srcName, char *dstName)
+{
+    File *src, *dst;
+    char page[PAGE_SIZE];
+    int numPage, i;
+
+    if ((numPage = getNumPages(srcName)) < 0 || createFile(dstName) != OK) {
+        return NG;
+    }
+    if ((src = openFile(srcName)) == NULL) {
+        return NG;
+    }
+    if ((dst = openFile(dstName)) == NULL) {
+        closeFile(src);
+        return NG;
+    }
+    for (i = 0; i < numPage; i++) {
+        if (readPage(src, i, page) != OK || writePage(dst, i, page) != OK) {
+            closeFile(src);
+            closeFile(dst);
+            return NG;
+        }
+    }
+    if (syncFile(dst) != OK) {
+        closeFile(src);
+        closeFile(dst);
+        return NG;
+    }
+    if (closeFile(src) != OK || closeFile(dst) != OK) {
+        return NG;
+    }
+
+    return OK;
+}
+
+/*
+ * test7 -- 古い形式のデータファイルの書き直し
+ */
+Result test7()
+{
+    TableInfo tableInfo, *info;
+    Condition condition;
+    RecordData record;
+    char filename[MAX_FILENAME], tmpName[MAX_FILENAME];
+    int numRecord, expected;
+
+    dropTable(UPGRADE_TABLE_NAME);
+
+    strcpy(tableInfo.fieldInfo[0].name, "id");
+    tableInfo.fieldInfo[0].dataType = TYPE_INT;
+    strcpy(tableInfo.fieldInfo[1].name, "name");
+    tableInfo.fieldInfo[1].dataType = TYPE_VARCHAR;
+    tableInfo.numField = 2;
+    tableInfo.pageSize = 0;
+    if (createTable(UPGRADE_TABLE_NAME, &tableInfo) != OK) {
+        fprintf(stderr, "Cannot create table.\n");
+        return NG;
+    }
+
+    /* 古い形式のデータファイルを作り、データ定義ファイルにもそう記録する */
+    sprintf(filename, "%s/%s.dat", DB_PATH, UPGRADE_TABLE_NAME);
+    if ((expected = writeOldPages(filename)) < 0
+        || setTablePageFormat(UPGRADE_TABLE_NAME, 0) != OK) {
+        fprintf(stderr, "Cannot write old data file.\n");
+        return NG;
+    }
+
+    /* 検索すると今の形式に書き直され、削除済みでないレコードがすべて読める */
+    strcpy(condition.name, "");
+    condition.dataType = TYPE_UNKNOWN;
+    condition.operator = OPR_UNKNOWN;
+    condition.distinct = NOT_DISTINCT;
+    if ((numRecord = countRecord(UPGRADE_TABLE_NAME, &condition)) != expected) {
+        fprintf(stderr, "Invalid number of records: %d (expected %d)\n", numRecord, expected);
+        return NG;
+    }
+    if ((info = getTableInfo(UPGRADE_TABLE_NAME)) == NULL || info->pageFormat != PAGE_FORMAT) {
+        fprintf(stderr, "Data file is not upgraded.\n");
+        return NG;
+    }
+    freeTableInfo(info);
+    sprintf(tmpName, "%s/%s.upg", DB_PATH, UPGRADE_TABLE_NAME);
+    if (access(tmpName, F_OK) == 0) {
+        fprintf(stderr, "Temporary file is left.\n");
+        return NG;
+    }
+
+    /*
+     * 今の形式を記録した後、データファイルを置き換える前に止まった場合:
+     * 書き直した一時ファイルと古い形式のデータファイルが残っていても、
+     * 初期化のときに置き換えを終わらせる
+     */
+    if (copyDataFile(filename, tmpName) != OK || createFile(filename) != OK
+        || writeOldPages(filename) != expected) {
+        fprintf(stderr, "Cannot make interrupted upgrade.\n");
+        return NG;
+    }
+    if (finalizeDataManipModule() != OK || initializeDataManipModule() != OK) {
+        fprintf(stderr, "Cannot recover upgrade.\n");
+        return NG;
+    }
+    if ((numRecord = countRecord(UPGRADE_TABLE_NAME, &condition)) != expected
+        || access(tmpName, F_OK) == 0) {
+        fprintf(stderr, "Committed upgrade is not finished: %d records (expected %d)\n",
+                numRecord, expected);
+        return NG;
+    }
+
+    /*
+     * 今の形式を記録する前に止まった場合:
+     * 書きかけの一時ファイルは消し、古い形式のデータファイルをもう一度書き直す
+     */
+    if (createFile(filename) != OK || writeOldPages(filename) != expected
+        || setTablePageFormat(UPGRADE_TABLE_NAME, 0) != OK
+        || createFile(tmpName) != OK) {
+        fprintf(stderr, "Cannot make interrupted upgrade.\n");
+        return NG;
+    }
+    if (finalizeDataManipModule() != OK || initializeDataManipModule() != OK
+        || access(tmpName, F_OK) == 0) {
+        fprintf(stderr, "Uncommitted upgrade is not rolled back.\n");
+        return NG;
+    }
+    if ((numRecord = countRecord(UPGRADE_TABLE_NAME, &condition)) != expected) {
+        fprintf(stderr, "Invalid number of records: %d (expected %d)\n", numRecord, expected);
+        return NG;
+    }
+
+    /* 書き直したデータファイルに、挿入と削除ができる */
+    strcpy(record.fieldData[0].name, "id");
+    record.fieldData[0].dataType = TYPE_INT;
+    record.fieldData[0].val.intVal = -1;
+    strcpy(record.fieldData[1].name, "name");
+    record.fieldData[1].dataType = TYPE_VARCHAR;
+    strcpy(record.fieldData[1].val.stringVal, "new");
+    record.numField = 2;
+    if (insertRecord(UPGRADE_TABLE_NAME, &record, NULL) != OK) {
+        fprintf(stderr, "Cannot insert record.\n");
+        return NG;
+    }
+    strcpy(condition.name, "id");
+    condition.dataType = TYPE_INT;
+    condition.operator = OPR_LESS_THAN;
+    condition.val.intVal = UPGRADE_NUM_SLOT;
+    if (deleteRecord(UPGRADE_TABLE_NAME, &condition) != OK) {
+        fprintf(stderr, "Cannot delete records.\n");
+        return NG;
+    }
+    expected -= UPGRADE_NUM_SLOT - UPGRADE_NUM_SLOT / 3;
+    strcpy(condition.name, "");
+    condition.dataType = TYPE_UNKNOWN;
+    condition.operator = OPR_UNKNOWN;
+    if ((numRecord = countRecord(UPGRADE_TABLE_NAME, &condition)) != expected) {
+        fprintf(stderr, "Invalid number of records: %d (expected %d)\n", numRecord, expected);
+        return NG;
+    }
+
+    sprintf(filename, "%s/%s.dat", DB_PATH, UPGRADE_TABLE_NAME);
+    printf("upgrade: %d records in %d pages\n", numRecord, getNumPages(filename));
+
+    dropTable(UPGRADE_TABLE_NAME);
+
+    return OK;
+}
+
+/*
+ * test8 -- レコードをまとめて挿入する
+ */
+Result test8()
+{
+    TableInfo tableInfo;
+    Condition condition;
+    RecordData *records;
+    BulkInsert *bulk;
+    char filename[MAX_FILENAME];
+    int numPage, numRecord, i;
+
+    dropTable(BULK_TABLE_NAME);
+
+    strcpy(tableInfo.fieldInfo[0].name, "id");
+    tableInfo.fieldInfo[0].dataType = TYPE_INT;
+    strcpy(tableInfo.fieldInfo[1].name, "name");
+    tableInfo.fieldInfo[1].dataType = TYPE_VARCHAR;
+    tableInfo.numField = 2;
+    tableInfo.pageSize = 0;
+    if (createTable(BULK_TABLE_NAME, &tableInfo) != OK) {
+        fprintf(stderr, "Cannot create table.\n");
+        return NG;
+    }
+    sprintf(filename, "%s/%s.dat", DB_PATH, BULK_TABLE_NAME);
+
+    /* nextでつないだリストを作る */
+    if ((records = (RecordData *) malloc(sizeof(RecordData) * BULK_NUM_RECORD)) == NULL) {
+        fprintf(stderr, "Cannot allocate records.\n");
+        return NG;
+    }
+    for (i = 0; i < BULK_NUM_RECORD; i++) {
+        strcpy(records[i].fieldData[0].name, "id");
+        records[i].fieldData[0].dataType = TYPE_INT;
+        records[i].fieldData[0].val.intVal = i;
+        strcpy(records[i].fieldData[1].name, "name");
+        records[i].fieldData[1].dataType = TYPE_VARCHAR;
+        sprintf(records[i].fieldData[1].val.stringVal, "name%05d", i);
+        records[i].numField = 2;
+        records[i].next = (i + 1 < BULK_NUM_RECORD) ? &records[i + 1] : NULL;
+    }
+
+    /* リストをまとめて挿入する */
+    if (insertRecords(BULK_TABLE_NAME, records, BULK_NUM_RECORD) != OK) {
+        fprintf(stderr, "Cannot insert records.\n");
+        free(records);
+        return NG;
+    }
+    numPage = getNumPages(filename);
+
+    /* 前半を削除してから、セッションで同じ数だけ挿入すると、削除した分の空きを使う */
+    strcpy(condition.name, "id");
+    condition.dataType = TYPE_INT;
+    condition.operator = OPR_LESS_THAN;
+    condition.val.intVal = BULK_NUM_RECORD / 2;
+    condition.distinct = NOT_DISTINCT;
+    if (deleteRecord(BULK_TABLE_NAME, &condition) != OK) {
+        fprintf(stderr, "Cannot delete records.\n");
+        free(records);
+        return NG;
+    }
+    if ((bulk = beginBulkInsert(BULK_TABLE_NAME)) == NULL) {
+        fprintf(stderr, "Cannot begin bulk insert.\n");
+        free(records);
+        return NG;
+    }
+    for (i = 0; i < BULK_NUM_RECORD; i++) {
+        records[i].fieldData[0].val.intVal = BULK_NUM_RECORD + i;
+        if (bulkInsertRecord(bulk, &records[i]) != OK) {
+            fprintf(stderr, "Cannot insert record.\n");
+            endBulkInsert(bulk);
+            free(records);
+            return NG;
+        }
+    }
+    free(records);
+    if (endBulkInsert(bulk) != OK) {
+        fprintf(stderr, "Cannot end bulk insert.\n");
+        return NG;
+    }
+    if (getNumPages(filename) > numPage * 3 / 2 + 1) {
+        fprintf(stderr, "Free space is not reused: %d -> %d pages\n", numPage, getNumPages(filename));
+        return NG;
+    }
+
+    strcpy(condition.name, "");
+    condition.dataType = TYPE_UNKNOWN;
+    condition.operator = OPR_UNKNOWN;
+    if ((numRecord = countRecord(BULK_TABLE_NAME, &condition)) != BULK_NUM_RECORD * 3 / 2) {
+        fprintf(stderr, "Invalid number of records: %d\n", numRecord);
+        return NG;
+    }
+
+    printf("bulk insert: %d records in %d pages\n", numRecord, getNumPages(filename));
+
+    dropTable(BULK_TABLE_NAME);
+
+    return OK;
+}
+
+/*
+ * test9 -- CSV、TSVのファイルからレコードを読み込む
+ */
+Result test9()
+{
+    TableInfo tableInfo;
+    Condition condition;
+    RecordData record;
+    CopyStats stats;
+    FILE *fp;
+    char filename[MAX_FILENAME];
+    int numRecord, i;
+
+    dropTable(COPY_TABLE_NAME);
+
+    strcpy(tableInfo.fieldInfo[0].name, "id");
+    tableInfo.fieldInfo[0].dataType = TYPE_INT;
+    strcpy(tableInfo.fieldInfo[1].name, "name");
+    tableInfo.fieldInfo[1].dataType = TYPE_VARCHAR;
+    strcpy(tableInfo.fieldInfo[2].name, "score");
+    tableInfo.fieldInfo[2].dataType = TYPE_DOUBLE;
+    tableInfo.numField = 3;
+    tableInfo.pageSize = 0;
+    if (createTable(COPY_TABLE_NAME, &tableInfo) != OK) {
+        fprintf(stderr, "Cannot create table.\n");
+        return NG;
+    }
+
+    /* 見出しと、"で囲んだフィールドがあるCSV */
+    sprintf(filename, "%s/%s.csv", DB_PATH, COPY_TABLE_NAME);
+    if ((fp = fopen(filename, "w")) == NULL) {
+        fprintf(stderr, "Cannot create %s.\n", filename);
+        return NG;
+    }
+    fprintf(fp, "id,name,score\r\n");
+    fprintf(fp, "1,\"a,b\",1.5\r\n");
+    fprintf(fp, "2,\"say \"\"hi\"\"\",2\r\n");
+    fprintf(fp, "3,\"two\nlines\",-3.25\r\n\r\n");
+    for (i = 4; i <= COPY_NUM_RECORD; i++) {
+        fprintf(fp, "%d,name%05d,%d.5\n", i, i, i);
+    }
+    fclose(fp);
+    if (copyRecords(COPY_TABLE_NAME, filename, &stats) != OK || stats.numRecord != COPY_NUM_RECORD) {
+        fprintf(stderr, "Cannot copy CSV file: line %ld\n", stats.lineNum);
+        return NG;
+    }
+
+    /* 見出しのないTSV(最後の行は改行で終わらない) */
+    sprintf(filename, "%s/%s.tsv", DB_PATH, COPY_TABLE_NAME);
+    if ((fp = fopen(filename, "w")) == NULL) {
+        fprintf(stderr, "Cannot create %s.\n", filename);
+        return NG;
+    }
+    fprintf(fp, "%d\tc,d\t0.5\n", COPY_NUM_RECORD + 1);
+    fprintf(fp, "%d\t\"e\"\t1e4", COPY_NUM_RECORD + 2);
+    fclose(fp);
+    if (copyRecords(COPY_TABLE_NAME, filename, &stats) != OK || stats.numRecord != 2) {
+        fprintf(stderr, "Cannot copy TSV file: line %ld\n", stats.lineNum);
+        return NG;
+    }
+
+    /* フィールドの数が違う行で止まり、その前の行は挿入したままになる */
+    sprintf(filename, "%s/%s.csv", DB_PATH, COPY_TABLE_NAME);
+    if ((fp = fopen(filename, "w")) == NULL) {
+        fprintf(stderr, "Cannot create %s.\n", filename);
+        return NG;
+    }
+    fprintf(fp, "%d,x,0\n%d,y\n%d,z,0\n", COPY_NUM_RECORD + 3, COPY_NUM_RECORD + 4, COPY_NUM_RECORD + 5);
+    fclose(fp);
+    if (copyRecords(COPY_TABLE_NAME, filename, &stats) != NG || stats.numRecord != 1 || stats.lineNum != 2) {
+        fprintf(stderr, "Invalid line is not detected: line %ld\n", stats.lineNum);
+        return NG;
+    }
+    unlink(filename);
+    sprintf(filename, "%s/%s.tsv", DB_PATH, COPY_TABLE_NAME);
+    unlink(filename);
+
+    /* 読み込んだ値を確かめる */
+    strcpy(condition.name, "");
+    condition.dataType = TYPE_UNKNOWN;
+    condition.operator = OPR_UNKNOWN;
+    if ((numRecord = countRecord(COPY_TABLE_NAME, &condition)) != COPY_NUM_RECORD + 3) {
+        fprintf(stderr, "Invalid number of records: %d\n", numRecord);
+        return NG;
+    }
+    strcpy(condition.name, "name");
+    condition.dataType = TYPE_VARCHAR;
+    condition.operator = OPR_EQUAL;
+    condition.distinct = NOT_DISTINCT;
+    strcpy(condition.val.stringVal, "say \"hi\"");
+    if (countRecord(COPY_TABLE_NAME, &condition) != 1) {
+        fprintf(stderr, "Quoted field is not copied.\n");
+        return NG;
+    }
+    strcpy(condition.val.stringVal, "two\nlines");
+    if (countRecord(COPY_TABLE_NAME, &condition) != 1) {
+        fprintf(stderr, "Multi-line field is not copied.\n");
+        return NG;
+    }
+    strcpy(condition.name, "score");
+    condition.dataType = TYPE_DOUBLE;
+    condition.val.doubleVal = 10000;
+    if (countRecord(COPY_TABLE_NAME, &condition) != 1) {
+        fprintf(stderr, "Double field is not copied.\n");
+        return NG;
+    }
+
+    /* 読み込んだ後も、ふつうに挿入できる */
+    strcpy(record.fieldData[0].name, "id");
+    record.fieldData[0].dataType = TYPE_INT;
+    record.fieldData[0].val.intVal = 0;
+    strcpy(record.fieldData[1].name, "name");
+    record.fieldData[1].dataType = TYPE_VARCHAR;
+    strcpy(record.fieldData[1].val.stringVal, "inserted");
+    strcpy(record.fieldData[2].name, "score");
+    record.fieldData[2].dataType = TYPE_DOUBLE;
+    record.fieldData[2].val.doubleVal = 0;
+    record.numField = 3;
+    record.next = NULL;
+    if (insertRecord(COPY_TABLE_NAME, &record, NULL) != OK) {
+        fprintf(stderr, "Cannot insert record.\n");
+        return NG;
+    }
+    strcpy(condition.name, "");
+    condition.dataType = TYPE_UNKNOWN;
+    condition.operator = OPR_UNKNOWN;
+    if ((numRecord = countRecord(COPY_TABLE_NAME, &condition)) != COPY_NUM_RECORD + 4) {
+        fprintf(stderr, "Invalid number of records: %d\n", numRecord);
+        return NG;
+    }
+
+    printf("copy: %d records\n", numRecord);
+
+    dropTable(COPY_TABLE_NAME);
+
+    return OK;
+}
+
+/*
+ * test10 -- 番地を指定してレコードを読み、削除する
+ */
+Result test10()
+{
+    TableInfo tableInfo;
+    Condition condition;
+    RecordData record, *fetched;
+    RecordId recordId[RID_NUM_RECORD], badId;
+    int numRecord, i;
+
+    dropTable(RID_TABLE_NAME);
+
+    strcpy(tableInfo.fieldInfo[0].name, "id");
+    tableInfo.fieldInfo[0].dataType = TYPE_INT;
+    strcpy(tableInfo.fieldInfo[1].name, "name");
+    tableInfo.fieldInfo[1].dataType = TYPE_VARCHAR;
+    tableInfo.numField = 2;
+    tableInfo.pageSize = 0;
+    if (createTable(RID_TABLE_NAME, &tableInfo) != OK) {
+        fprintf(stderr, "Cannot create table.\n");
+        return NG;
+    }
+
+    /* 挿入したレコードの番地を覚えておく */
+    strcpy(record.fieldData[0].name, "id");
+    record.fieldData[0].dataType = TYPE_INT;
+    strcpy(record.fieldData[1].name, "name");
+    record.fieldData[1].dataType = TYPE_VARCHAR;
+    record.numField = 2;
+    record.next = NULL;
+    for (i = 0; i < RID_NUM_RECORD; i++) {
+        record.fieldData[0].val.intVal = i;
+        sprintf(record.fieldData[1].val.stringVal, "name%05d", i);
+        if (insertRecord(RID_TABLE_NAME, &record, &recordId[i]) != OK) {
+            fprintf(stderr, "Cannot insert record.\n");
+            return NG;
+        }
+    }
+
+    /* 番地を指定して読むと、挿入したレコードが返る */
+    for (i = 0; i < RID_NUM_RECORD; i++) {
+        if ((fetched = fetchRecord(RID_TABLE_NAME, &recordId[i])) == NULL
+            || fetched->fieldData[0].val.intVal != i) {
+            fprintf(stderr, "Cannot fetch record %d at (%d, %d).\n", i, recordId[i].pageNum, recordId[i].slotNum);
+            free(fetched);
+            return NG;
+        }
+        free(fetched);
+    }
+
+    /* 偶数番目を番地を指定して削除する(同じ番地は2回は削除できない) */
+    for (i = 0; i < RID_NUM_RECORD; i += 2) {
+        if (deleteRecordByRid(RID_TABLE_NAME, &recordId[i]) != OK) {
+            fprintf(stderr, "Cannot delete record %d.\n", i);
+            return NG;
+        }
+    }
+    if (deleteRecordByRid(RID_TABLE_NAME, &recordId[0]) == OK) {
+        fprintf(stderr, "Deleted record is deleted again.\n");
+        return NG;
+    }
+
+    /* 削除したレコードは読めず、残ったレコードは(ページを詰め直しても)同じ番地で読める */
+    for (i = 0; i < RID_NUM_RECORD; i++) {
+        fetched = fetchRecord(RID_TABLE_NAME, &recordId[i]);
+        if ((i % 2 == 0 && fetched != NULL)
+            || (i % 2 == 1 && (fetched == NULL || fetched->fieldData[0].val.intVal != i
+                               || strcmp(fetched->fieldData[1].val.stringVal, "") == 0))) {
+            fprintf(stderr, "Invalid record at (%d, %d).\n", recordId[i].pageNum, recordId[i].slotNum);
+            free(fetched);
+            return NG;
+        }
+        free(fetched);
+    }
+
+    /* データファイルにない番地 */
+    badId.pageNum = recordId[RID_NUM_RECORD - 1].pageNum + 1;
+    badId.slotNum = 0;
+    if (fetchRecord(RID_TABLE_NAME, &badId) != NULL || deleteRecordByRid(RID_TABLE_NAME, &badId) == OK) {
+        fprintf(stderr, "Record is found out of data file.\n");
+        return NG;
+    }
+    badId.pageNum = 0;
+    badId.slotNum = -1;
+    if (fetchRecord(RID_TABLE_NAME, &badId) != NULL || deleteRecordByRid(RID_TABLE_NAME, &badId) == OK) {
+        fprintf(stderr, "Record is found at invalid slot.\n");
+        return NG;
+    }
+
+    /* 削除した分の空きに挿入した番地も読める */
+    record.fieldData[0].val.intVal = RID_NUM_RECORD;
+    if (insertRecord(RID_TABLE_NAME, &record, &badId) != OK
+        || (fetched = fetchRecord(RID_TABLE_NAME, &badId)) == NULL
+        || fetched->fieldData[0].val.intVal != RID_NUM_RECORD) {
+        fprintf(stderr, "Cannot fetch reinserted record.\n");
+        return NG;
+    }
+    free(fetched);
+
+    strcpy(condition.name, "");
+    condition.dataType = TYPE_UNKNOWN;
+    condition.operator = OPR_UNKNOWN;
+    if ((numRecord = countRecord(RID_TABLE_NAME, &condition)) != RID_NUM_RECORD / 2 + 1) {
+        fprintf(stderr, "Invalid number of records: %d\n", numRecord);
+        return NG;
+    }
+
+    printf("rid: %d records, last at (%d, %d)\n", numRecord, recordId[RID_NUM_RECORD - 1].pageNum,
+           recordId[RID_NUM_RECORD - 1].slotNum);
+
+    dropTable(RID_TABLE_NAME);
+
+    return OK;
+}
+
+/*
+ * resizeBuffer -- ファイルモジュールを初期化し直して、バッファの大きさを変える
+ *
+ * 引数:
+ *	n: バッファの大きさ(ページ数)。0なら環境変数か既定値に戻す
+ *
+ * 返り値:
+ *	成功ならOK、失敗ならNG
+ */
+static Result resizeBuffer(int n)
+{
+    if (finalizeFileModule() != OK || setNumBuffer(n) != OK || initializeFileModule() != OK) {
+        fprintf(stderr, "Cannot resize buffer.\n");
+        return NG;
+    }
+    return OK;
+}
+
+/*
+ * appendWorkerMain -- test11で、レコードを挿入し続けるスレッド
+ *
+ * 引数:
+ *	arg: スレッドの番号(intへのポインタ)
+ *
+ * 返り値:
+ *	成功ならNULL、失敗ならargを返す
+ */
+static void *appendWorkerMain(void *arg)
+{
+    int id = *(int *) arg, i;
+    RecordData record;
+    BulkInsert *bulk = NULL;
+
+    strcpy(record.fieldData[0].name, "id");
+    record.fieldData[0].dataType = TYPE_INT;
+    strcpy(record.fieldData[1].name, "name");
+    record.fieldData[1].dataType = TYPE_VARCHAR;
+    record.numField = 2;
+    record.next = NULL;
+
+    if (id != 0 && (bulk = beginBulkInsert(APPEND_TABLE_NAME)) == NULL) {
+        return arg;
+    }
+    for (i = 0; i < APPEND_NUM_RECORD; i++) {
+        record.fieldData[0].val.intVal = id * APPEND_NUM_RECORD + i;
+        sprintf(record.fieldData[1].val.stringVal, "%0*d", MAX_STRING / 2, id * APPEND_NUM_RECORD + i);
+        if ((bulk == NULL ? insertRecord(APPEND_TABLE_NAME, &record, NULL)
+                          : bulkInsertRecord(bulk, &record)) != OK) {
+            if (bulk != NULL) {
+                endBulkInsert(bulk);
+            }
+            return arg;
+        }
+    }
+    if (bulk != NULL && endBulkInsert(bulk) != OK) {
+        return arg;
+    }
+
+    return NULL;
+}
+
+/*
+ * test11 -- 複数のスレッドが同時にページを書き足す
+ */
+Result test11()
+{
+    TableInfo tableInfo;
+    Condition condition;
+    pthread_t thread[APPEND_NUM_THREAD];
+    int id[APPEND_NUM_THREAD];
+    int numRecord, numError = 0, i;
+    void *ret;
+
+    dropTable(APPEND_TABLE_NAME);
+
+    strcpy(tableInfo.fieldInfo[0].name, "id");
+    tableInfo.fieldInfo[0].dataType = TYPE_INT;
+    strcpy(tableInfo.fieldInfo[1].name, "name");
+    tableInfo.fieldInfo[1].dataType = TYPE_VARCHAR;
+    tableInfo.numField = 2;
+    tableInfo.pageSize = 0;
+    if (createTable(APPEND_TABLE_NAME, &tableInfo) != OK) {
+        fprintf(stderr, "Cannot create table.\n");
+        return NG;
+    }
+    if (resizeBuffer(THREAD_NUM_BUFFER) != OK) {
+        return NG;
+    }
+
+    for (i = 0; i < APPEND_NUM_THREAD; i++) {
+        id[i] = i;
+        if (pthread_create(&thread[i], NULL, appendWorkerMain, &id[i]) != 0) {
+            fprintf(stderr, "Cannot create thread.\n");
+            return NG;
+        }
+    }
+    for (i = 0; i < APPEND_NUM_THREAD; i++) {
+        if (pthread_join(thread[i], &ret) != 0 || ret != NULL) {
+            numError++;
+        }
+    }
+    if (resizeBuffer(0) != OK) {
+        return NG;
+    }
+    if (numError > 0) {
+        fprintf(stderr, "Cannot insert records in %d threads.\n", numError);
+        return NG;
+    }
+
+    /* 同じページ番号に書き足したスレッドがあれば、上書きされたレコードが足りなくなる */
+    strcpy(condition.name, "");
+    condition.dataType = TYPE_UNKNOWN;
+    condition.operator = OPR_UNKNOWN;
+    condition.distinct = NOT_DISTINCT;
+    if ((numRecord = countRecord(APPEND_TABLE_NAME, &condition)) != APPEND_NUM_THREAD * APPEND_NUM_RECORD) {
+        fprintf(stderr, "Invalid number of records: %d (expected %d)\n",
+                numRecord, APPEND_NUM_THREAD * APPEND_NUM_RECORD);
+        return NG;
+    }
+
+    printf("concurrent append: %d records\n", numRecord);
+
+    dropTable(APPEND_TABLE_NAME);
+
+    return OK;
+}
+
+/*
+ * upgradeReaderMain -- test12で、書き直しと同時にレコードを数えるスレッド
+ *
+ * 引数:
+ *	arg: 数えるはずのレコードの数(intへのポインタ)
+ *
+ * 返り値:
+ *	すべて正しく数えられたらNULL、そうでなければargを返す
+ */
+static void *upgradeReaderMain(void *arg)
+{
+    Condition condition;
+    unsigned int seed = (unsigned int) (size_t) &condition;
+    int i;
+
+    strcpy(condition.name, "");
+    condition.dataType = TYPE_UNKNOWN;
+    condition.operator = OPR_UNKNOWN;
+    condition.distinct = NOT_DISTINCT;
+    for (i = 0; i < UPGRADE_NUM_READ; i++) {
+        usleep((useconds_t) (rand_r(&seed) % UPGRADE_MAX_DELAY));
+        if (countRecord(UPGRADE_TABLE_NAME, &condition) != *(int *) arg) {
+            return arg;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * test12 -- 古い形式のデータファイルの書き直しと同時に読む
+ *
+ * 最初に数えるスレッドが書き直し、ほかのスレッドは書き直しを待ってから読む
+ * (書き直しの途中のデータファイルを読むと、数が合わなくなる)。
+ */
+Result test12()
+{
+    TableInfo tableInfo;
+    pthread_t thread[UPGRADE_NUM_THREAD];
+    char filename[MAX_FILENAME];
+    int expected, numError = 0, round, i;
+    void *ret;
+
+    dropTable(UPGRADE_TABLE_NAME);
+
+    strcpy(tableInfo.fieldInfo[0].name, "id");
+    tableInfo.fieldInfo[0].dataType = TYPE_INT;
+    strcpy(tableInfo.fieldInfo[1].name, "name");
+    tableInfo.fieldInfo[1].dataType = TYPE_VARCHAR;
+    tableInfo.numField = 2;
+    tableInfo.pageSize = 0;
+    if (createTable(UPGRADE_TABLE_NAME, &tableInfo) != OK) {
+        fprintf(stderr, "Cannot create table.\n");
+        return NG;
+    }
+    sprintf(filename, "%s/%s.dat", DB_PATH, UPGRADE_TABLE_NAME);
+    if (resizeBuffer(THREAD_NUM_BUFFER) != OK) {
+        return NG;
+    }
+
+    for (round = 0; round < UPGRADE_NUM_ROUND && numError == 0; round++) {
+        /* 古い形式のデータファイルを作り直す */
+        if (createFile(filename) != OK || (expected = writeOldPages(filename)) < 0
+            || setTablePageFormat(UPGRADE_TABLE_NAME, 0) != OK) {
+            fprintf(stderr, "Cannot write old data file.\n");
+            return NG;
+        }
+
+        for (i = 0; i < UPGRADE_NUM_THREAD; i++) {
+            if (pthread_create(&thread[i], NULL, upgradeReaderMain, &expected) != 0) {
+                fprintf(stderr, "Cannot create thread.\n");
+                return NG;
+            }
+        }
+        for (i = 0; i < UPGRADE_NUM_THREAD; i++) {
+            if (pthread_join(thread[i], &ret) != 0 || ret != NULL) {
+                numError++;
+            }
+        }
+    }
+    if (resizeBuffer(0) != OK) {
+        return NG;
+    }
+    if (numError > 0) {
+        fprintf(stderr, "Invalid number of records in round %d (%d threads).\n", round - 1, numError);
+        return NG;
+    }
+
+    printf("upgrade while reading: %d rounds\n", round);
+
+    dropTable(UPGRADE_TABLE_NAME);
+
+    return OK;
+}
+
+/*
+ * main -- データ操作モジュールのテスト
+ */
+int main(int argc, char **argv)
+{
+    char tableName[20];
+    TableInfo tableInfo;
+    int i;
+
+    /* ファイルモジュールを初期化する */
+    if (initializeFileModule() != OK) {
+        fprintf(stderr, "Cannot initialize file module.\n");
+        exit(1);
+    }
+
+    /* データ定義ジュールを初期化する */
+    if (initializeDataDefModule() != OK) {
+        fprintf(stderr, "Cannot initialize data definition module.\n");
+        exit(1);
+    }
+
+    /* データ操作ジュールを初期化する */
+    if (initializeDataManipModule() != OK) {
+        fprintf(stderr, "Cannot initialize data manipulation module.\n");
+        exit(1);
+    }
+
+    /*
+     * このプログラムの前回の実行の時のデータ定義残っている可能性があるので、
+     * とりあえず削除する
+     */
+    dropTable(TABLE_NAME);
+
+    /*
+     * 以下のテーブルを作成
+     * create table student (
+     *   id string,
+     *   name string,
+     *   age int,
+     *   address string
+     * )
+     */
+    strcpy(tableName, TABLE_NAME);
+    i = 0;
+
+    strcpy(tableInfo.fieldInfo[i].name, "id");
+    tableInfo.fieldInfo[i].dataType = TYPE_VARCHAR;
+    i++;
+
+    strcpy(tableInfo.fieldInfo[i].name, "name");
+    tableInfo.fieldInfo[i].dataType = TYPE_VARCHAR;
+    i++;
+
+    strcpy(tableInfo.fieldInfo[i].name, "age");
+    tableInfo.fieldInfo[i].dataType = TYPE_INT;
+    i++;
+
+    strcpy(tableInfo.fieldInfo[i].name, "weight");
+    tableInfo.fieldInfo[i].dataType = TYPE_DOUBLE;
+    i++;
+
+    strcpy(tableInfo.fieldInfo[i].name, "address");
+    tableInfo.fieldInfo[i].dataType = TYPE_VARCHAR;
+    i++;
+
+    tableInfo.numField = i;
+    tableInfo.pageSize = 0;
+
+    /* テーブルの作成 */
+    if (createTable(tableName, &tableInfo) != OK) {
+        /* テーブルの作成に失敗 */
+        fprintf(stderr, "Cannot create table.\n");
+        exit(1);
+    }
+
+    /* 挿入テスト */
+    fprintf(stderr, "test1: Start\n\n");
+    if (test1() == OK) {
+        fprintf(stderr, "test1: OK\n\n");
+    } else {
+        fprintf(stderr, "test1: NG\n\n");
+    }
+
+    /* 検索テスト */
+    fprintf(stderr, "test2: Start\n\n");
+    if (test2() == OK) {
+        fprintf(stderr, "test2: OK\n\n");
+    } else {
+        fprintf(stderr, "test2: NG\n\n");
+    }
+
+    /* 削除テスト */
+    fprintf(stderr, "test3: Start\n\n");
+    if (test3() == OK) {
+        fprintf(stderr, "test3: OK\n\n");
+    } else {
+        fprintf(stderr, "test3: NG\n\n");
+    }
+
+    /* ページの大きさを指定したテーブルのテスト */
+    fprintf(stderr, "test4: Start\n\n");
+    if (test4() == OK) {
+        fprintf(stderr, "test4: OK\n\n");
+    } else {
+        fprintf(stderr, "test4: NG\n\n");
+    }
+
+    /* 空き領域マップのテスト */
+    fprintf(stderr, "test5: Start\n\n");
+    if (test5() == OK) {
+        fprintf(stderr, "test5: OK\n\n");
+    } else {
+        fprintf(stderr, "test5: NG\n\n");
+    }
+
+    /* 空きの統合とページの詰め直しのテスト */
+    fprintf(stderr, "test6: Start\n\n");
+    if (test6() == OK) {
+        fprintf(stderr, "test6: OK\n\n");
+    } else {
+        fprintf(stderr, "test6: NG\n\n");
+    }
+
+    /* 古い形式のデータファイルの書き直しのテスト */
+    fprintf(stderr, "test7: Start\n\n");
+    if (test7() == OK) {
+        fprintf(stderr, "test7: OK\n\n");
+    } else {
+        fprintf(stderr, "test7: NG\n\n");
+    }
+
+    /* まとめて挿入するテスト */
+    fprintf(stderr, "test8: Start\n\n");
+    if (test8() == OK) {
+        fprintf(stderr, "test8: OK\n\n");
+    } else {
+        fprintf(stderr, "test8: NG\n\n");
+    }
+
+    fprintf(stderr, "test9: Start\n\n");
+    if (test9() == OK) {
+        fprintf(stderr, "test9: OK\n\n");
+    } else {
+        fprintf(stderr, "test9: NG\n\n");
+    }
+
+    fprintf(stderr, "test10: Start\n\n");
+    if (test10() == OK) {
+        fprintf(stderr, "test10: OK\n\n");
+    } else {
+        fprintf(stderr, "test10: NG\n\n");
+    }
+
+    fprintf(stderr, "test11: Start\n\n");
+    if (test11() == OK) {
+        fprintf(stderr, "test11: OK\n\n");
+    } else {
+        fprintf(stderr, "test11: NG\n\n");
+    }
+
+    fprintf(stderr, "test12: Start\n\n");
+    if (test12() == OK) {
+        fprintf(stderr, "test12: OK\n\n");
+    } else {
+        fprintf(stderr, "test12: NG\n\n");
     }
 
     /* 後始末 */